@@ -5,11 +5,19 @@ LIB_VNC_ROOT := LibVNCServer-0.9.7
 LIB_VNC_SVR_PATH := $(LIB_VNC_ROOT)/libvncserver
 LIB_VNC_SVR_SRC := \
 	main.c \
+	log.c \
 	rfbserver.c \
 	rfbregion.c \
+	rfbbandregion.c \
 	auth.c \
 	sockets.c \
+	outqueue.c \
+	workers.c \
+	adaptive.c \
+	rectmerge.c \
+	damage.c \
 	stats.c \
+	trace.c \
 	corre.c \
 	hextile.c \
 	rre.c \
@@ -47,6 +55,11 @@ LOCAL_C_INCLUDES := \
 
 LOCAL_LDLIBS += -lz
 
+# TRACE=1 records trace points, see libvncserver/trace.c
+ifdef TRACE
+LOCAL_CFLAGS += -DLIBVNCSERVER_WITH_TRACE
+endif
+
 #LOCAL_SHARED_LIBRARIES := libz
 LOCAL_STATIC_LIBRARIES := libjpeg
 
@@ -837,6 +837,12 @@ SetFormatAndEncodings(rfbClient* client)
   if (se->nEncodings < MAX_ENCODINGS)
     encs[se->nEncodings++] = rfbClientSwap32IfLE(rfbEncodingServerIdentity);
 
+  /* Continuous Updates and Fence */
+  if (se->nEncodings < MAX_ENCODINGS && client->canUseContinuousUpdates)
+    encs[se->nEncodings++] = rfbClientSwap32IfLE(rfbEncodingContinuousUpdates);
+  if (se->nEncodings < MAX_ENCODINGS)
+    encs[se->nEncodings++] = rfbClientSwap32IfLE(rfbEncodingFence);
+
 
   /* client extensions */
   for(e = rfbClientExtensions; e; e = e->next)
@@ -1059,6 +1065,59 @@ SendClientCutText(rfbClient* client, char *str, int len)
 }
 
 
+/*
+ * SendEnableContinuousUpdates.  While continuous updates are on, the server
+ * sends updates of the area on its own, and HandleRFBServerMessage() does
+ * not ask for the next one after each.
+ */
+
+rfbBool
+SendEnableContinuousUpdates(rfbClient* client, rfbBool enable,
+			    int x, int y, int w, int h)
+{
+  rfbEnableContinuousUpdatesMsg ecu;
+
+  if (!client->supportsContinuousUpdates) return TRUE;
+
+  ecu.type = rfbEnableContinuousUpdates;
+  ecu.enable = enable ? 1 : 0;
+  ecu.x = rfbClientSwap16IfLE(x);
+  ecu.y = rfbClientSwap16IfLE(y);
+  ecu.w = rfbClientSwap16IfLE(w);
+  ecu.h = rfbClientSwap16IfLE(h);
+
+  if (!WriteToRFBServer(client, (char *)&ecu, sz_rfbEnableContinuousUpdatesMsg))
+    return FALSE;
+
+  client->continuousUpdates = enable;
+  return TRUE;
+}
+
+
+/*
+ * SendFence.
+ */
+
+rfbBool
+SendFence(rfbClient* client, uint32_t flags, int length, const char *data)
+{
+  rfbFenceMsg f;
+
+  if (!client->supportsFence) return TRUE;
+
+  if (length > rfbFenceMaxDataSize)
+    length = rfbFenceMaxDataSize;
+
+  memset((char *)&f, 0, sizeof(f));
+  f.type = rfbFence;
+  f.flags = rfbClientSwap32IfLE(flags);
+  f.length = length;
+
+  return  (WriteToRFBServer(client, (char *)&f, sz_rfbFenceMsg) &&
+	   (length == 0 || WriteToRFBServer(client, (char *)data, length)));
+}
+
+
 
 /*
  * HandleRFBServerMessage.
@@ -1165,6 +1224,8 @@ HandleRFBServerMessage(rfbClient* client)
 	client->height = rect.r.h;
 	client->MallocFrameBuffer(client);
 	SendFramebufferUpdateRequest(client, 0, 0, rect.r.w, rect.r.h, FALSE);
+	if (client->continuousUpdates)
+	  SendEnableContinuousUpdates(client, TRUE, 0, 0, rect.r.w, rect.r.h);
 	rfbClientLog("Got new framebuffer size: %dx%d\n", rect.r.w, rect.r.h);
 	continue;
       }
@@ -1506,7 +1567,58 @@ HandleRFBServerMessage(rfbClient* client)
       client->GotFrameBufferUpdate(client, rect.r.x, rect.r.y, rect.r.w, rect.r.h);
     }
 
-    if (!SendIncrementalFramebufferUpdateRequest(client))
+    if (!client->continuousUpdates &&
+	!SendIncrementalFramebufferUpdateRequest(client))
+      return FALSE;
+
+    break;
+  }
+
+  case rfbEndOfContinuousUpdates:
+  {
+    if (!client->supportsContinuousUpdates) {
+      /* the first one tells us that the server can send them */
+      client->supportsContinuousUpdates = TRUE;
+      if (client->canUseContinuousUpdates) {
+	rfbClientLog("Enabling continuous updates\n");
+	if (!SendEnableContinuousUpdates(client, TRUE,
+			client->updateRect.x, client->updateRect.y,
+			client->updateRect.w, client->updateRect.h))
+	  return FALSE;
+      }
+    } else if (!client->continuousUpdates) {
+      /* they have stopped: ask for updates again */
+      if (!SendIncrementalFramebufferUpdateRequest(client))
+	return FALSE;
+    }
+
+    break;
+  }
+
+  case rfbFence:
+  {
+    char data[rfbFenceMaxDataSize];
+    uint32_t flags;
+
+    if (!ReadFromRFBServer(client, ((char *)&msg) + 1,
+			   sz_rfbFenceMsg - 1))
+      return FALSE;
+
+    if (msg.f.length > rfbFenceMaxDataSize) {
+      rfbClientLog("Fence with %d bytes of data\n", msg.f.length);
+      return FALSE;
+    }
+    if (msg.f.length > 0 && !ReadFromRFBServer(client, data, msg.f.length))
+      return FALSE;
+
+    client->supportsFence = TRUE;
+
+    /* everything before it has been dealt with, and nothing after it
+       will be before the answer has gone out */
+    flags = rfbClientSwap32IfLE(msg.f.flags);
+    if ((flags & rfbFenceFlagRequest) &&
+	!SendFence(client, flags & rfbFenceFlagsSupported & ~rfbFenceFlagRequest,
+		   msg.f.length, data))
       return FALSE;
 
     break;
@@ -1594,6 +1706,8 @@ HandleRFBServerMessage(rfbClient* client)
     client->height = rfbClientSwap16IfLE(msg.rsfb.framebufferHeigth);
     client->MallocFrameBuffer(client);
     SendFramebufferUpdateRequest(client, 0, 0, client->width, client->height, FALSE);
+    if (client->continuousUpdates)
+      SendEnableContinuousUpdates(client, TRUE, 0, 0, client->width, client->height);
     rfbClientLog("Got new framebuffer size: %dx%d\n", client->width, client->height);
     break;
   }
@@ -1607,6 +1721,8 @@ HandleRFBServerMessage(rfbClient* client)
     client->height = rfbClientSwap16IfLE(msg.prsfb.buffer_h);
     client->MallocFrameBuffer(client);
     SendFramebufferUpdateRequest(client, 0, 0, client->width, client->height, FALSE);
+    if (client->continuousUpdates)
+      SendEnableContinuousUpdates(client, TRUE, 0, 0, client->width, client->height);
     rfbClientLog("Got new framebuffer size: %dx%d\n", client->width, client->height);
     break;
   }
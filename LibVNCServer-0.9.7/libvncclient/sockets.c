@@ -523,6 +523,10 @@ int WaitForMessage(rfbClient* client,unsigned int usecs)
   if (client->serverPort==-1)
     /* playing back vncrec file */
     return 1;
+
+  if (client->buffered > 0)
+    /* the next message has arrived already, e.g. behind an update */
+    return 1;
   
   timeout.tv_sec=(usecs/1000000);
   timeout.tv_usec=(usecs%1000000);
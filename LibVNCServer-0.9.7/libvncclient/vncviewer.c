@@ -123,6 +123,9 @@ rfbClient* rfbGetClient(int bitsPerSample,int samplesPerPixel,
   /* default: use complete frame buffer */ 
   client->updateRect.x = -1;
  
+  /* updates come without asking, if the server can do that */
+  client->canUseContinuousUpdates = TRUE;
+ 
   client->format.bitsPerPixel = bytesPerPixel*8;
   client->format.depth = bitsPerSample*samplesPerPixel;
   client->appData.requestedDepth=client->format.depth;
@@ -0,0 +1,544 @@
+/*
+ * adaptive.c - fit the quality of updates to what the link to each client
+ * can take.
+ */
+
+/*
+ *  This is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This software is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this software; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307,
+ *  USA.
+ */
+
+/*
+ * With screen->targetLatency set, every client gets a controller which
+ * times its updates: from the moment we start encoding one until the
+ * client has dealt with it, which the answer to the fence sent after it
+ * tells us (or, for clients without fences, their next
+ * FramebufferUpdateRequest).  From these delivery times it keeps a
+ * smoothed latency, the shortest delivery seen (about the round trip) and
+ * the throughput of the link.
+ *
+ * When the latency is above the target, the client is moved one level
+ * down, at most every LEVEL_DOWN_TIME ms; each level lowers the Tight JPEG
+ * quality (and with it the ZYWRLE level, which zrle.c derives from it),
+ * raises the compression level and, further down, leaves more time
+ * between updates.  Once the latency has been well below the target for
+ * LEVEL_UP_TIME ms, and the bigger updates of the level above would still
+ * get through in time at the measured throughput, it goes back up.
+ * Level 0 is what the client asked for.
+ *
+ * Only what the client allows is touched: JPEG quality is only lowered if
+ * it sent a quality level (or uses ZYWRLE, which is lossy anyway).
+ *
+ * With screen->cpuBudget set, a governor shared by all clients of the
+ * screen also adds up the time spent encoding rectangles.  Whenever a
+ * CPU_WINDOW ms window has used more than its share of the budget, it
+ * goes one level down: first it caps the compression level, then it
+ * moves clients from Tight and ZRLE to the cheapest encoding they listed
+ * (Ultra, Hextile or Zlib), and last it leaves more time between updates.
+ * When a window used less than half its share, it goes one level back up.
+ *
+ * Last, clients can be capped at cl->maxBytesPerSecond and
+ * cl->maxUpdatesPerSecond (view-only ones at the screen's defaults for
+ * them).  Each cap is a token bucket: an update may start once its bucket
+ * is not in debt, and then takes its bytes (and one update) from it, so a
+ * big update is paid for by waiting longer before the next one.  The
+ * bytes bucket holds at most BURST_TIME ms worth of tokens, the updates
+ * bucket at most one.  Changes made meanwhile are merged into the next
+ * update, as for clients which do not keep up.
+ */
+
+#include <rfb/rfb.h>
+#include "private.h"
+
+#ifdef LIBVNCSERVER_HAVE_SYS_TIME_H
+#include <sys/time.h>
+#endif
+
+#define MAX_LEVEL 5
+
+/* JPEG quality and compression level steps per level */
+#define QUALITY_STEP 2
+#define COMPRESS_STEP 1
+
+/* least ms between the starts of two updates, per level */
+static const int minUpdateInterval[MAX_LEVEL + 1] = { 0, 0, 0, 40, 80, 160 };
+
+/* ms to wait after a change before going down or up again */
+#define LEVEL_DOWN_TIME 250
+#define LEVEL_UP_TIME 1000
+
+/* smaller updates say little about the throughput */
+#define MIN_BANDWIDTH_SAMPLE 4096
+
+/* ms of bytes a client under a cap may save up */
+#define BURST_TIME 250
+
+#define MAX_CPU_LEVEL 4
+
+/* ms over which the governor compares encoding time with the budget */
+#define CPU_WINDOW 1000
+
+/* highest compression level and least ms between updates, per CPU level */
+static const int cpuCompressCap[MAX_CPU_LEVEL + 1] = { 9, 6, 3, 1, 1 };
+static const int cpuUpdateInterval[MAX_CPU_LEVEL + 1] = { 0, 0, 0, 50, 100 };
+
+/* from this CPU level on, expensive encodings are replaced */
+#define CPU_CHEAP_LEVEL 2
+
+/* what replaces them, the cheapest first */
+static const int cheapEncodings[] = {
+	rfbEncodingUltra,
+	rfbEncodingHextile,
+#ifdef LIBVNCSERVER_HAVE_LIBZ
+	rfbEncodingZlib,
+#endif
+	0
+};
+
+typedef struct rfbGovernor {
+	MUTEX(mutex);
+	int level;
+	struct timeval windowStart;
+	int used;			/* us spent encoding in this window */
+} rfbGovernor;
+
+typedef struct rfbAdaptState {
+	int level;
+	int cpuLevel;			/* of the governor, when last applied */
+
+	/* what the client asked for, and what we made of it */
+	int baseEncoding, baseQuality, baseTightCompress, baseZlibCompress;
+	int encoding, quality, tightCompress, zlibCompress;
+
+	/* the update being timed */
+	rfbBool timing;
+	struct timeval updateStart, timedStart;
+	int startBytes, timedBytes;
+
+	int latency;			/* smoothed delivery time, us */
+	int minDelivery;		/* shortest delivery time, us */
+	double bandwidth;		/* smoothed, bytes per second */
+	int updateBytes;		/* smoothed update size */
+	struct timeval lastUpdate;	/* start of the last update */
+	struct timeval lastChange;	/* of the level */
+
+	/* token buckets for the caps */
+	double byteTokens, updateTokens;
+	struct timeval lastRefill;
+} rfbAdaptState;
+
+/* us from from to to, at most 1000 s */
+static int
+ElapsedUs(struct timeval* from, struct timeval* to)
+{
+	if (to->tv_sec - from->tv_sec > 1000)
+		return 1000 * 1000000;
+	return (to->tv_sec - from->tv_sec) * 1000000
+		+ (to->tv_usec - from->tv_usec);
+}
+
+static rfbBool
+LossyAllowed(rfbAdaptState* s)
+{
+	return s->baseQuality >= 0 || s->baseEncoding == rfbEncodingZYWRLE;
+}
+
+static rfbBool
+ExpensiveEncoding(int encoding)
+{
+	return encoding == rfbEncodingTight || encoding == rfbEncodingZRLE
+		|| encoding == rfbEncodingZYWRLE;
+}
+
+/* set the client's encoding and levels for s->level and s->cpuLevel */
+static void
+ApplyLevel(rfbClientPtr cl, rfbAdaptState* s)
+{
+	int i;
+
+	s->encoding = s->baseEncoding;
+	if (s->cpuLevel >= CPU_CHEAP_LEVEL && ExpensiveEncoding(s->baseEncoding))
+		for (i = 0; cheapEncodings[i]; i++)
+			if (cl->encodingsAdvertised & (1 << cheapEncodings[i])) {
+				s->encoding = cheapEncodings[i];
+				break;
+			}
+
+	s->quality = s->baseQuality;
+	if (s->level > 0 && LossyAllowed(s)) {
+		s->quality = (s->baseQuality >= 0 ? s->baseQuality : 9)
+			- s->level * QUALITY_STEP;
+		if (s->quality < 0)
+			s->quality = 0;
+	}
+	s->tightCompress = s->baseTightCompress + s->level * COMPRESS_STEP;
+	if (s->tightCompress > cpuCompressCap[s->cpuLevel])
+		s->tightCompress = cpuCompressCap[s->cpuLevel];
+	s->zlibCompress = s->baseZlibCompress + s->level * COMPRESS_STEP;
+	if (s->zlibCompress > cpuCompressCap[s->cpuLevel])
+		s->zlibCompress = cpuCompressCap[s->cpuLevel];
+
+	if (cl->preferredEncoding != s->encoding) {
+		char encBuf[64];
+		rfbLog("Using %s encoding for client %s at CPU level %d\n",
+				encodingName(s->encoding, encBuf, sizeof(encBuf)),
+				cl->host, s->cpuLevel);
+	}
+	cl->preferredEncoding = s->encoding;
+	cl->tightQualityLevel = s->quality;
+	cl->tightCompressLevel = s->tightCompress;
+	cl->zlibCompressLevel = s->zlibCompress;
+}
+
+/* the caps of the client, 0 for none */
+static void
+GetCaps(rfbClientPtr cl, int* bytesPerSecond, int* updatesPerSecond)
+{
+	*bytesPerSecond = cl->maxBytesPerSecond;
+	*updatesPerSecond = cl->maxUpdatesPerSecond;
+	if (cl->viewOnly) {
+		if (*bytesPerSecond == 0)
+			*bytesPerSecond = cl->screen->viewOnlyMaxBytesPerSecond;
+		if (*updatesPerSecond == 0)
+			*updatesPerSecond = cl->screen->viewOnlyMaxUpdatesPerSecond;
+	}
+}
+
+static rfbAdaptState*
+GetState(rfbClientPtr cl)
+{
+	rfbAdaptState* s = (rfbAdaptState*)cl->adaptData;
+	int bytesPerSecond, updatesPerSecond;
+
+	if (s)
+		return s;
+	GetCaps(cl, &bytesPerSecond, &updatesPerSecond);
+	if (cl->screen->targetLatency <= 0 && cl->screen->cpuBudget <= 0
+			&& bytesPerSecond <= 0 && updatesPerSecond <= 0)
+		return NULL;
+	s = (rfbAdaptState*)calloc(1, sizeof(rfbAdaptState));
+	if (!s)
+		return NULL;
+	s->baseEncoding = s->encoding = cl->preferredEncoding;
+	s->baseQuality = s->quality = cl->tightQualityLevel;
+	s->baseTightCompress = s->tightCompress = cl->tightCompressLevel;
+	s->baseZlibCompress = s->zlibCompress = cl->zlibCompressLevel;
+	s->updateTokens = 1;
+	gettimeofday(&s->lastRefill, NULL);
+	cl->adaptData = s;
+	return s;
+}
+
+/*
+ * Fill the buckets for the time since the last refill, and return how many
+ * ms the client has to wait until neither is in debt.
+ */
+
+static int
+RefillBuckets(rfbClientPtr cl, rfbAdaptState* s, struct timeval* now)
+{
+	int bytesPerSecond, updatesPerSecond, wait = 0, w;
+	double seconds = ElapsedUs(&s->lastRefill, now) / 1e6;
+
+	s->lastRefill = *now;
+	GetCaps(cl, &bytesPerSecond, &updatesPerSecond);
+	if (bytesPerSecond > 0) {
+		s->byteTokens += bytesPerSecond * seconds;
+		if (s->byteTokens > bytesPerSecond * (BURST_TIME / 1000.0))
+			s->byteTokens = bytesPerSecond * (BURST_TIME / 1000.0);
+		if (s->byteTokens < 0)
+			wait = (int)(-s->byteTokens * 1000 / bytesPerSecond) + 1;
+	} else
+		s->byteTokens = 0;
+	if (updatesPerSecond > 0) {
+		s->updateTokens += updatesPerSecond * seconds;
+		if (s->updateTokens > 1)
+			s->updateTokens = 1;
+		if (s->updateTokens < 1) {
+			w = (int)((1 - s->updateTokens) * 1000 / updatesPerSecond) + 1;
+			if (w > wait)
+				wait = w;
+		}
+	} else
+		s->updateTokens = 1;
+	return wait;
+}
+
+static void
+SetLevel(rfbClientPtr cl, rfbAdaptState* s, int level, struct timeval* now)
+{
+	s->level = level;
+	s->lastChange = *now;
+	ApplyLevel(cl, s);
+	rfbLog("Adapting to level %d for client %s: latency %d ms, "
+			"%d kB/s, quality %d, compression %d\n",
+			level, cl->host, s->latency / 1000, (int)(s->bandwidth / 1000),
+			s->quality, s->tightCompress);
+}
+
+/*
+ * The governor's level, after closing its window if that is over.
+ */
+
+static int
+GovernorLevel(rfbScreenInfoPtr screen)
+{
+	rfbGovernor* g = (rfbGovernor*)screen->governor;
+	struct timeval now;
+	double share;
+	int elapsed, level;
+
+	if (!g || screen->cpuBudget <= 0)
+		return 0;
+	gettimeofday(&now, NULL);
+	LOCK(g->mutex);
+	elapsed = ElapsedUs(&g->windowStart, &now);
+	if (elapsed >= CPU_WINDOW * 1000) {
+		/* us of encoding the window was allowed */
+		share = screen->cpuBudget * (elapsed / 1000.0);
+		if (g->used > share && g->level < MAX_CPU_LEVEL) {
+			g->level++;
+			rfbLog("Encoding took %d ms in %d ms, over the budget: "
+					"CPU level %d\n", g->used / 1000, elapsed / 1000,
+					g->level);
+		} else if (g->used < share / 2 && g->level > 0) {
+			g->level--;
+			rfbLog("Encoding took %d ms in %d ms: CPU level %d\n",
+					g->used / 1000, elapsed / 1000, g->level);
+		}
+		g->used = 0;
+		g->windowStart = now;
+	}
+	level = g->level;
+	UNLOCK(g->mutex);
+	return level;
+}
+
+void
+rfbAdaptInitScreen(rfbScreenInfoPtr screen)
+{
+	rfbGovernor* g = (rfbGovernor*)calloc(1, sizeof(rfbGovernor));
+
+	if (g) {
+		INIT_MUTEX(g->mutex);
+		gettimeofday(&g->windowStart, NULL);
+	}
+	screen->governor = g;
+}
+
+void
+rfbAdaptCleanupScreen(rfbScreenInfoPtr screen)
+{
+	rfbGovernor* g = (rfbGovernor*)screen->governor;
+
+	if (!g)
+		return;
+	TINI_MUTEX(g->mutex);
+	free(g);
+	screen->governor = NULL;
+}
+
+/*
+ * A rectangle was encoded, starting at start: account for the time it
+ * took, in the statistics of its encoding and against the CPU budget.
+ */
+
+void
+rfbAdaptRectEncoded(rfbClientPtr cl, struct timeval* start)
+{
+	rfbGovernor* g = (rfbGovernor*)cl->screen->governor;
+	struct timeval now;
+	int us;
+
+	gettimeofday(&now, NULL);
+	us = ElapsedUs(start, &now);
+	/* -1 until the client sends SetEncodings, and then Raw is used */
+	rfbStatRecordEncodingTime(cl,
+			cl->preferredEncoding == -1 ? rfbEncodingRaw : cl->preferredEncoding, us);
+	if (g && cl->screen->cpuBudget > 0) {
+		LOCK(g->mutex);
+		g->used += us;
+		UNLOCK(g->mutex);
+	}
+}
+
+/*
+ * The client sent SetEncodings: whatever it set anew becomes the base of
+ * our levels, whatever it left alone stays as it was.
+ */
+
+void
+rfbAdaptSetEncodings(rfbClientPtr cl)
+{
+	rfbAdaptState* s = (rfbAdaptState*)cl->adaptData;
+
+	if (!s)
+		return;
+	if (cl->preferredEncoding != s->encoding)
+		s->baseEncoding = cl->preferredEncoding;
+	if (cl->tightQualityLevel != s->quality)
+		s->baseQuality = cl->tightQualityLevel;
+	if (cl->tightCompressLevel != s->tightCompress)
+		s->baseTightCompress = cl->tightCompressLevel;
+	if (cl->zlibCompressLevel != s->zlibCompress)
+		s->baseZlibCompress = cl->zlibCompressLevel;
+	ApplyLevel(cl, s);
+}
+
+/*
+ * Returns how many ms the next update has to wait to keep to the update
+ * rate of the client's level, of the governor's and of its caps.
+ */
+
+int
+rfbAdaptUpdateDelay(rfbClientPtr cl)
+{
+	rfbAdaptState* s = GetState(cl);
+	struct timeval now;
+	int interval, wait, capWait;
+
+	if (!s)
+		return 0;
+	gettimeofday(&now, NULL);
+	capWait = RefillBuckets(cl, s, &now);
+	interval = minUpdateInterval[s->level];
+	wait = cpuUpdateInterval[GovernorLevel(cl->screen)];
+	if (wait > interval)
+		interval = wait;
+	wait = interval - ElapsedUs(&s->lastUpdate, &now) / 1000;
+	if (capWait > wait)
+		wait = capWait;
+	return wait > 0 ? wait : 0;
+}
+
+/*
+ * An update is about to be encoded: this is when the client follows the
+ * governor to another level.
+ */
+
+void
+rfbAdaptUpdateStart(rfbClientPtr cl)
+{
+	rfbAdaptState* s = GetState(cl);
+	int cpuLevel;
+
+	if (!s)
+		return;
+	cpuLevel = GovernorLevel(cl->screen);
+	if (cpuLevel != s->cpuLevel) {
+		s->cpuLevel = cpuLevel;
+		ApplyLevel(cl, s);
+	}
+	gettimeofday(&s->updateStart, NULL);
+	s->startBytes = rfbStatGetSentBytes(cl);
+}
+
+/*
+ * The update is queued.  Time it, unless one is timed already, or a fence
+ * is still on its way: its answer would not say when this update arrived.
+ */
+
+void
+rfbAdaptUpdateSent(rfbClientPtr cl)
+{
+	rfbAdaptState* s = (rfbAdaptState*)cl->adaptData;
+	int bytes;
+
+	if (!s)
+		return;
+	bytes = rfbStatGetSentBytes(cl) - s->startBytes;
+	if (s->updateBytes == 0)
+		s->updateBytes = bytes;
+	else
+		s->updateBytes += (bytes - s->updateBytes) / 8;
+	s->lastUpdate = s->updateStart;
+	s->byteTokens -= bytes;
+	s->updateTokens -= 1;
+	if (s->timing || (cl->enableFence && cl->fencePending))
+		return;
+	s->timing = TRUE;
+	s->timedStart = s->updateStart;
+	s->timedBytes = bytes;
+}
+
+/* the client has dealt with the timed update: adjust the level */
+void
+rfbAdaptUpdateDelivered(rfbClientPtr cl)
+{
+	rfbAdaptState* s = (rfbAdaptState*)cl->adaptData;
+	struct timeval now;
+	int delivery, target, sinceChange;
+
+	if (!s || !s->timing)
+		return;
+	s->timing = FALSE;
+	gettimeofday(&now, NULL);
+	delivery = ElapsedUs(&s->timedStart, &now);
+	if (delivery < 1)
+		delivery = 1;
+
+	if (s->latency == 0)
+		s->latency = delivery;
+	else
+		s->latency += (delivery - s->latency) / 4;
+	if (s->minDelivery == 0 || delivery < s->minDelivery)
+		s->minDelivery = delivery;
+	if (s->timedBytes >= MIN_BANDWIDTH_SAMPLE && delivery > s->minDelivery) {
+		double sample = s->timedBytes * 1e6 / (delivery - s->minDelivery);
+		if (s->bandwidth == 0)
+			s->bandwidth = sample;
+		else
+			s->bandwidth += (sample - s->bandwidth) / 8;
+	}
+
+	target = cl->screen->targetLatency * 1000;
+	if (target <= 0)
+		return;
+	sinceChange = ElapsedUs(&s->lastChange, &now) / 1000;
+
+	if (s->latency > target) {
+		if (s->level < MAX_LEVEL && sinceChange >= LEVEL_DOWN_TIME)
+			SetLevel(cl, s, s->level + 1, &now);
+	} else if (s->latency < target / 2 && s->level > 0
+			&& sinceChange >= LEVEL_UP_TIME) {
+		/* updates grow by about half with each level up */
+		double predicted = s->bandwidth > 0
+			? s->minDelivery + s->updateBytes * 1.5e6 / s->bandwidth
+			: s->latency * 1.5;
+		if (predicted < target * 0.8)
+			SetLevel(cl, s, s->level - 1, &now);
+	}
+}
+
+int
+rfbAdaptGetLevel(rfbClientPtr cl)
+{
+	rfbAdaptState* s = (rfbAdaptState*)cl->adaptData;
+
+	return s ? s->level : 0;
+}
+
+int
+rfbAdaptGetCpuLevel(rfbScreenInfoPtr screen)
+{
+	return GovernorLevel(screen);
+}
+
+void
+rfbAdaptCleanup(rfbClientPtr cl)
+{
+	free(cl->adaptData);
+	cl->adaptData = NULL;
+}
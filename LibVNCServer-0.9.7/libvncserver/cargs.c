@@ -33,6 +33,12 @@ rfbUsage(void)
                                                              "(default 40)\n");
     fprintf(stderr, "-deferptrupdate time   time in ms to defer pointer updates"
                                                            " (default none)\n");
+    fprintf(stderr, "-targetlatency time    lower the quality of updates for clients which\n"
+                    "                       take longer than time ms to get them (default off)\n");
+    fprintf(stderr, "-cpubudget time        use cheaper encodings once encoding takes more than\n"
+                    "                       time ms per second (default off)\n");
+    fprintf(stderr, "-viewonlyrate bytes    send view-only clients at most bytes per second\n");
+    fprintf(stderr, "-viewonlyfps n         send view-only clients at most n updates per second\n");
     fprintf(stderr, "-desktop name          VNC desktop name (default \"LibVNCServer\")\n");
     fprintf(stderr, "-alwaysshared          always treat new clients as shared\n");
     fprintf(stderr, "-nevershared           never treat new clients as shared\n");
@@ -43,7 +49,19 @@ rfbUsage(void)
     fprintf(stderr, "-httpdir dir-path      enable http server using dir-path home\n");
     fprintf(stderr, "-httpport portnum      use portnum for http connection\n");
     fprintf(stderr, "-enablehttpproxy       enable http proxy support\n");
+    fprintf(stderr, "-httpmetrics           serve statistics at /metrics and /status over http\n");
+#ifdef LIBVNCSERVER_WITH_TRACE
+    fprintf(stderr, "-tracefile file        write the trace to file on SIGUSR2\n");
+#endif
     fprintf(stderr, "-progressive height    enable progressive updating for slow links\n");
+    fprintf(stderr, "-nomergerects          send every changed rectangle on its own\n");
+#ifdef LIBVNCSERVER_HAVE_LIBPTHREAD
+    fprintf(stderr, "-workers n             threads serving the clients in the background\n"
+                    "                       (default one per processor)\n");
+    fprintf(stderr, "-asynclog              write the log from a thread of its own\n");
+#endif
+    fprintf(stderr, "-lograte n             log at most n messages a second from one place\n"
+                    "                       (default 20, 0 for no limit)\n");
     fprintf(stderr, "-listen ipaddr         listen for connections only on network interface with\n");
     fprintf(stderr, "                       addr ipaddr. '-listen localhost' and hostname work too.\n");
 
@@ -123,6 +141,30 @@ rfbProcessArguments(rfbScreenInfoPtr rfbScreen,int* argc, char *argv[])
 		return FALSE;
 	    }
             rfbScreen->deferPtrUpdateTime = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-targetlatency") == 0) {  /* -targetlatency milliseconds */
+            if (i + 1 >= *argc) {
+		rfbUsage();
+		return FALSE;
+	    }
+            rfbScreen->targetLatency = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-cpubudget") == 0) {  /* -cpubudget milliseconds */
+            if (i + 1 >= *argc) {
+		rfbUsage();
+		return FALSE;
+	    }
+            rfbScreen->cpuBudget = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-viewonlyrate") == 0) {  /* -viewonlyrate bytes */
+            if (i + 1 >= *argc) {
+		rfbUsage();
+		return FALSE;
+	    }
+            rfbScreen->viewOnlyMaxBytesPerSecond = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-viewonlyfps") == 0) {  /* -viewonlyfps n */
+            if (i + 1 >= *argc) {
+		rfbUsage();
+		return FALSE;
+	    }
+            rfbScreen->viewOnlyMaxUpdatesPerSecond = atoi(argv[++i]);
         } else if (strcmp(argv[i], "-desktop") == 0) {  /* -desktop desktop-name */
             if (i + 1 >= *argc) {
 		rfbUsage();
@@ -149,12 +191,40 @@ rfbProcessArguments(rfbScreenInfoPtr rfbScreen,int* argc, char *argv[])
             rfbScreen->httpPort = atoi(argv[++i]);
         } else if (strcmp(argv[i], "-enablehttpproxy") == 0) {
             rfbScreen->httpEnableProxyConnect = TRUE;
+        } else if (strcmp(argv[i], "-httpmetrics") == 0) {
+            rfbScreen->httpMetrics = TRUE;
+#ifdef LIBVNCSERVER_WITH_TRACE
+        } else if (strcmp(argv[i], "-tracefile") == 0) {  /* -tracefile file */
+            if (i + 1 >= *argc) {
+		rfbUsage();
+		return FALSE;
+	    }
+            rfbScreen->traceFile = argv[++i];
+#endif
         } else if (strcmp(argv[i], "-progressive") == 0) {  /* -httpport portnum */
             if (i + 1 >= *argc) {
 		rfbUsage();
 		return FALSE;
 	    }
             rfbScreen->progressiveSliceHeight = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-nomergerects") == 0) {
+            rfbScreen->mergeRects = FALSE;
+#ifdef LIBVNCSERVER_HAVE_LIBPTHREAD
+        } else if (strcmp(argv[i], "-workers") == 0) {  /* -workers n */
+            if (i + 1 >= *argc) {
+		rfbUsage();
+		return FALSE;
+	    }
+            rfbScreen->workerThreads = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-asynclog") == 0) {
+            rfbLogStartAsync();
+#endif
+        } else if (strcmp(argv[i], "-lograte") == 0) {  /* -lograte n */
+            if (i + 1 >= *argc) {
+		rfbUsage();
+		return FALSE;
+	    }
+            rfbLogSetRateLimit(atoi(argv[++i]));
         } else if (strcmp(argv[i], "-listen") == 0) {  /* -listen ipaddr */
             if (i + 1 >= *argc) {
 		rfbUsage();
@@ -0,0 +1,367 @@
+/*
+ * damage.c - one record of what has changed on the screen, for all
+ * clients.
+ */
+
+/*
+ *  This is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This software is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this software; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307,
+ *  USA.
+ */
+
+/*
+ * rfbMarkRegionAsModified() does not add the damage to the modifiedRegion
+ * of every client, but records it once, in the screen's journal: a short
+ * list of bitmaps of DAMAGE_TILE sized tiles, each covering a run of
+ * changes numbered consecutively.  A client only remembers the number of
+ * the last change it has taken, and rfbDamageCollect() adds what came
+ * after it to its modifiedRegion when an update is about to be sent.  So
+ * marking costs the same however many clients are connected.
+ *
+ * An entry takes changes until some client collects it; later changes
+ * go into a new one, so that clients can tell them apart.  When all
+ * DAMAGE_ENTRIES are in use the two oldest are merged, which only makes
+ * the clients that far behind send a few more tiles than they need to.
+ *
+ * The journal's mutex is held only to set or gather bits: a client ORs
+ * the entries it needs into a bitmap of its own and turns that into a
+ * region afterwards.  Whether there is anything new for a client is
+ * asked far more often than anything is marked, so the number of the
+ * last change is stored with release and read with acquire ordering,
+ * without the mutex: an idle poll is a plain load, and writes nothing.
+ */
+
+#include <rfb/rfb.h>
+#include <rfb/rfbregion.h>
+#include "private.h"
+
+#define DAMAGE_TILE 16
+#define DAMAGE_ENTRIES 32
+
+#if defined(__ATOMIC_ACQUIRE) && defined(LIBVNCSERVER_HAVE_LIBPTHREAD)
+#define LOCK_FREE_SEQ
+#endif
+#define PUBLISH_SEQ(j, s) DAMAGE_SEQ_STORE(&(j)->seq, (s))
+#define READ_SEQ(j) DAMAGE_SEQ_LOAD(&(j)->seq)
+
+typedef struct {
+	int width, height;
+	int tilesX, tilesY;
+	int rowWords, words;		/* per row of tiles, per bitmap */
+} DamageGeometry;
+
+typedef struct {
+	unsigned long first, last;	/* the changes recorded here */
+	struct timeval time;		/* when the first of them was made */
+	uint32_t* tiles;
+} DamageEntry;
+
+typedef struct {
+	MUTEX(mutex);
+	DamageGeometry g;
+	uint32_t* tiles;		/* the bitmaps of all entries */
+	volatile unsigned long seq;	/* number of the last change */
+	unsigned long base;		/* changes before this one are lost */
+	int oldest, count;
+	rfbBool open;			/* whether the newest entry takes changes */
+	DamageEntry entries[DAMAGE_ENTRIES];
+} DamageJournal;
+
+static void
+AllocTiles(DamageJournal* j, int width, int height)
+{
+	int i;
+
+	DamageGeometry* g = &j->g;
+
+	free(j->tiles);
+	g->width = width;
+	g->height = height;
+	g->tilesX = (width + DAMAGE_TILE - 1) / DAMAGE_TILE;
+	g->tilesY = (height + DAMAGE_TILE - 1) / DAMAGE_TILE;
+	g->rowWords = (g->tilesX + 31) / 32;
+	g->words = g->rowWords * g->tilesY;
+	j->tiles = (uint32_t*)malloc(DAMAGE_ENTRIES * g->words * sizeof(uint32_t));
+	if (!j->tiles && g->words > 0)
+		rfbErr("damage journal: out of memory, clients get whole screens\n");
+	for (i = 0; i < DAMAGE_ENTRIES; i++)
+		j->entries[i].tiles = j->tiles ? j->tiles + i * g->words : NULL;
+	j->oldest = j->count = 0;
+	j->open = FALSE;
+	j->base = j->seq;
+}
+
+void
+rfbDamageInitScreen(rfbScreenInfoPtr screen)
+{
+	DamageJournal* j = (DamageJournal*)calloc(1, sizeof(DamageJournal));
+
+	if (j) {
+		INIT_MUTEX(j->mutex);
+		AllocTiles(j, screen->width, screen->height);
+	}
+	screen->damageJournal = j;
+}
+
+void
+rfbDamageCleanupScreen(rfbScreenInfoPtr screen)
+{
+	DamageJournal* j = (DamageJournal*)screen->damageJournal;
+
+	if (!j)
+		return;
+	TINI_MUTEX(j->mutex);
+	free(j->tiles);
+	free(j);
+	screen->damageJournal = NULL;
+}
+
+/*
+ * The framebuffer has a new size: forget what was recorded, every client
+ * has been given the whole screen anyway.
+ */
+
+void
+rfbDamageResizeScreen(rfbScreenInfoPtr screen)
+{
+	DamageJournal* j = (DamageJournal*)screen->damageJournal;
+
+	if (!j)
+		return;
+	LOCK(j->mutex);
+	AllocTiles(j, screen->width, screen->height);
+	UNLOCK(j->mutex);
+}
+
+/* A new client has been given the whole screen. */
+
+void
+rfbDamageInitClient(rfbClientPtr cl)
+{
+	DamageJournal* j = (DamageJournal*)cl->screen->damageJournal;
+
+	cl->damageTiles = NULL;
+	cl->damageWords = 0;
+	if (!j)
+		return;
+	LOCK(j->mutex);
+	DAMAGE_SEQ_STORE(&cl->damageSeq, j->seq);
+	UNLOCK(j->mutex);
+}
+
+void
+rfbDamageCleanupClient(rfbClientPtr cl)
+{
+	free(cl->damageTiles);
+	cl->damageTiles = NULL;
+	cl->damageWords = 0;
+}
+
+static DamageEntry*
+OpenEntry(DamageJournal* j)
+{
+	DamageEntry *e, *next;
+	int i;
+
+	if (j->open)
+		return &j->entries[(j->oldest + j->count - 1) % DAMAGE_ENTRIES];
+
+	if (j->count == DAMAGE_ENTRIES) {
+		e = &j->entries[j->oldest];
+		j->oldest = (j->oldest + 1) % DAMAGE_ENTRIES;
+		j->count--;
+		next = &j->entries[j->oldest];
+		for (i = 0; i < j->g.words; i++)
+			next->tiles[i] |= e->tiles[i];
+		next->first = e->first;
+		next->time = e->time;
+	}
+
+	e = &j->entries[(j->oldest + j->count) % DAMAGE_ENTRIES];
+	j->count++;
+	j->open = TRUE;
+	memset(e->tiles, 0, j->g.words * sizeof(uint32_t));
+	e->first = j->seq + 1;
+	gettimeofday(&e->time, NULL);
+	return e;
+}
+
+static void
+SetTiles(const DamageGeometry* g, uint32_t* tiles, const sraRect* r)
+{
+	int tx1 = r->x1 / DAMAGE_TILE, tx2 = (r->x2 + DAMAGE_TILE - 1) / DAMAGE_TILE;
+	int ty1 = r->y1 / DAMAGE_TILE, ty2 = (r->y2 + DAMAGE_TILE - 1) / DAMAGE_TILE;
+	int tx, ty;
+
+	if (tx2 > g->tilesX)
+		tx2 = g->tilesX;
+	if (ty2 > g->tilesY)
+		ty2 = g->tilesY;
+	for (ty = ty1; ty < ty2; ty++) {
+		uint32_t* row = tiles + ty * g->rowWords;
+		for (tx = tx1; tx < tx2; ) {
+			if ((tx & 31) == 0 && tx + 32 <= tx2) {
+				row[tx >> 5] = 0xffffffff;
+				tx += 32;
+			} else {
+				row[tx >> 5] |= 1u << (tx & 31);
+				tx++;
+			}
+		}
+	}
+}
+
+/*
+ * Records damage to the screen.  Returns the number of the change before
+ * it: clients which had taken that one need to be told about this one.
+ */
+
+unsigned long
+rfbDamageMark(rfbScreenInfoPtr screen, sraRegionPtr region)
+{
+	DamageJournal* j = (DamageJournal*)screen->damageJournal;
+	sraRectangleIterator* i;
+	DamageEntry* e;
+	unsigned long seq;
+	sraRect rect;
+
+	LOCK(j->mutex);
+	seq = j->seq;
+	if (j->tiles) {
+		e = OpenEntry(j);
+		i = sraRgnGetIterator(region);
+		while (sraRgnIteratorNext(i, &rect))
+			SetTiles(&j->g, e->tiles, &rect);
+		sraRgnReleaseIterator(i);
+		e->last = seq + 1;
+	}
+	PUBLISH_SEQ(j, seq + 1);
+	UNLOCK(j->mutex);
+	return seq;
+}
+
+/* whether the journal has changes cl has not taken yet */
+
+rfbBool
+rfbDamagePending(rfbClientPtr cl)
+{
+	DamageJournal* j = (DamageJournal*)cl->screen->damageJournal;
+	rfbBool result;
+
+	if (!j)
+		return FALSE;
+#ifdef LOCK_FREE_SEQ
+	result = DAMAGE_SEQ_LOAD(&cl->damageSeq) != READ_SEQ(j);
+#else
+	LOCK(j->mutex);
+	result = cl->damageSeq != j->seq;
+	UNLOCK(j->mutex);
+#endif
+	return result;
+}
+
+/* the tiles set in bitmap, as a region; rows that are alike are merged */
+static sraRegionPtr
+TilesToRegion(const DamageGeometry* g, const uint32_t* tiles)
+{
+	sraRegionPtr region = sraRgnCreate(), rect;
+	int ty, y1 = 0, tx, x1;
+	const uint32_t* band = NULL;
+
+	for (ty = 0; ty <= g->tilesY; ty++) {
+		const uint32_t* row = tiles + ty * g->rowWords;
+		if (band && ty < g->tilesY
+				&& memcmp(band, row, g->rowWords * sizeof(uint32_t)) == 0)
+			continue;
+		if (band) {
+			int y2 = ty * DAMAGE_TILE;
+			if (y2 > g->height)
+				y2 = g->height;
+			for (tx = 0; tx < g->tilesX; ) {
+				if (!(band[tx >> 5] & (1u << (tx & 31)))) {
+					tx++;
+					continue;
+				}
+				for (x1 = tx; tx < g->tilesX && (band[tx >> 5] & (1u << (tx & 31))); tx++)
+					;
+				rect = sraRgnCreateRect(x1 * DAMAGE_TILE, y1 * DAMAGE_TILE,
+						tx * DAMAGE_TILE < g->width ? tx * DAMAGE_TILE : g->width, y2);
+				sraRgnOr(region, rect);
+				sraRgnDestroy(rect);
+			}
+		}
+		band = row;
+		y1 = ty;
+	}
+	return region;
+}
+
+/*
+ * Adds the changes cl has not taken yet to its modifiedRegion.  The
+ * caller holds cl->updateMutex.
+ */
+
+void
+rfbDamageCollect(rfbClientPtr cl)
+{
+	DamageJournal* j = (DamageJournal*)cl->screen->damageJournal;
+	DamageGeometry g;
+	struct timeval time;
+	sraRegionPtr damage;
+	unsigned long changes;
+	rfbBool whole;
+	int n, i;
+
+	if (!j || !rfbDamagePending(cl))
+		return;
+	LOCK(j->mutex);
+	g = j->g;
+	changes = j->seq - cl->damageSeq;
+	whole = cl->damageSeq < j->base || !j->tiles;
+	if (!whole && cl->damageWords != g.words) {
+		free(cl->damageTiles);
+		cl->damageTiles = (uint32_t*)malloc(g.words * sizeof(uint32_t));
+		cl->damageWords = cl->damageTiles ? g.words : 0;
+		whole = !cl->damageTiles;
+	}
+	time.tv_sec = time.tv_usec = 0;
+	if (!whole) {
+		memset(cl->damageTiles, 0, g.words * sizeof(uint32_t));
+		for (n = 0; n < j->count; n++) {
+			DamageEntry* e = &j->entries[(j->oldest + n) % DAMAGE_ENTRIES];
+			if (e->last <= cl->damageSeq)
+				continue;
+			if (time.tv_sec == 0)
+				time = e->time;
+			for (i = 0; i < g.words; i++)
+				cl->damageTiles[i] |= e->tiles[i];
+		}
+	}
+	DAMAGE_SEQ_STORE(&cl->damageSeq, j->seq);
+	/* what changes from now on is new to this client */
+	j->open = FALSE;
+	UNLOCK(j->mutex);
+
+	if (whole) {
+		damage = sraRgnCreateRect(0, 0, g.width, g.height);
+		gettimeofday(&time, NULL);
+	} else
+		damage = TilesToRegion(&g, cl->damageTiles);
+	sraRgnOr(cl->modifiedRegion, damage);
+	sraRgnDestroy(damage);
+	if (cl->damageTime.tv_sec == 0)
+		cl->damageTime = time;
+	if (cl->updateDeferred)
+		cl->framesSkipped += changes;
+}
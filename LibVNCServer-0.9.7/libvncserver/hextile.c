@@ -26,6 +26,7 @@
  */
 
 #include <rfb/rfb.h>
+#include "pixelscan.h"
 
 static rfbBool sendHextiles8(rfbClientPtr cl, int x, int y, int w, int h);
 static rfbBool sendHextiles16(rfbClientPtr cl, int x, int y, int w, int h);
@@ -91,6 +92,7 @@ rfbSendRectEncodingHextile(rfbClientPtr cl,
 
 #define DEFINE_SEND_HEXTILES(bpp)                                               \
                                                                                 \
+DEFINE_PIXEL_SCAN_FUNCTIONS(bpp)                                                \
                                                                                 \
 static rfbBool subrectEncode##bpp(rfbClientPtr cli, uint##bpp##_t *data,        \
 		int w, int h, uint##bpp##_t bg, uint##bpp##_t fg, rfbBool mono);\
@@ -216,15 +218,15 @@ subrectEncode##bpp(rfbClientPtr cl, uint##bpp##_t *data, int w, int h,
     for (y=0; y<h; y++) {                                                       \
         line = data+(y*w);                                                      \
         for (x=0; x<w; x++) {                                                   \
-            if (line[x] != bg) {                                                \
+            x += PixelRunLength##bpp(line+x, w-x, bg);                          \
+            if (x < w) {                                                        \
                 cl2 = line[x];                                                  \
                 hy = y-1;                                                       \
                 hyflag = 1;                                                     \
                 for (j=y; j<h; j++) {                                           \
                     seg = data+(j*w);                                           \
                     if (seg[x] != cl2) {break;}                                 \
-                    i = x;                                                      \
-                    while ((seg[i] == cl2) && (i < w)) i += 1;                  \
+                    i = x + PixelRunLength##bpp(seg+x, w-x, cl2);               \
                     i -= 1;                                                     \
                     if (j == y) vx = hx = i;                                    \
                     if (i < vx) vx = i;                                         \
@@ -299,33 +301,23 @@ subrectEncode##bpp(rfbClientPtr cl, uint##bpp##_t *data, int w, int h,
 static void                                                                     \
 testColours##bpp(uint##bpp##_t *data, int size, rfbBool *mono, rfbBool *solid,  \
                  uint##bpp##_t *bg, uint##bpp##_t *fg) {                        \
-    uint##bpp##_t colour1 = 0, colour2 = 0;                                     \
-    int n1 = 0, n2 = 0;                                                         \
+    uint##bpp##_t colour1, colour2 = 0;                                         \
+    int n1, n2 = 0, i;                                                          \
     *mono = TRUE;                                                               \
     *solid = TRUE;                                                              \
                                                                                 \
-    for (; size > 0; size--, data++) {                                          \
-                                                                                \
-        if (n1 == 0)                                                            \
-            colour1 = *data;                                                    \
-                                                                                \
-        if (*data == colour1) {                                                 \
-            n1++;                                                               \
-            continue;                                                           \
-        }                                                                       \
-                                                                                \
-        if (n2 == 0) {                                                          \
-            *solid = FALSE;                                                     \
-            colour2 = *data;                                                    \
-        }                                                                       \
-                                                                                \
-        if (*data == colour2) {                                                 \
-            n2++;                                                               \
-            continue;                                                           \
-        }                                                                       \
-                                                                                \
-        *mono = FALSE;                                                          \
-        break;                                                                  \
+    colour1 = *data;                                                            \
+    n1 = PixelRunLength##bpp(data, size, colour1);                              \
+                                                                                \
+    if (n1 < size) {                                                            \
+        *solid = FALSE;                                                         \
+        colour2 = data[n1];                                                     \
+        i = n1;                                                                 \
+        i += PixelTwoColourRun##bpp(data + i, size - i,                         \
+                                    colour1, colour2, &n1);                     \
+        n2 = i - n1;                                                            \
+        if (i < size)                                                           \
+            *mono = FALSE;                                                      \
     }                                                                           \
                                                                                 \
     if (n1 > n2) {                                                              \
@@ -23,8 +23,10 @@
  */
 
 #include <rfb/rfb.h>
+#include "private.h"
 
 #include <ctype.h>
+#include <stdarg.h>
 #ifdef LIBVNCSERVER_HAVE_UNISTD_H
 #include <unistd.h>
 #endif
@@ -87,6 +89,9 @@
 #endif
 
 static void httpProcessInput(rfbScreenInfoPtr screen);
+static void httpCloseSock(rfbScreenInfoPtr rfbScreen);
+static rfbBool httpServeStats(rfbScreenInfoPtr rfbScreen, const char *path);
+static void httpSendResponse(rfbScreenInfoPtr rfbScreen);
 static rfbBool compareAndSkip(char **ptr, const char *str);
 static rfbBool parseParams(const char *request, char *result, int max_bytes);
 static rfbBool validateString(char *str);
@@ -96,6 +101,10 @@ static rfbBool validateString(char *str);
 static char buf[BUF_SIZE];
 static size_t buf_filled=0;
 
+/* an answer made up in memory, and how much of it has been sent */
+static char *response=NULL;
+static size_t responseLen=0, responseSize=0, responseSent=0;
+
 /*
  * httpInitSockets sets up the TCP socket to listen for HTTP connections.
  */
@@ -108,7 +117,7 @@ rfbHttpInitSockets(rfbScreenInfoPtr rfbScreen)
 
     rfbScreen->httpInitDone = TRUE;
 
-    if (!rfbScreen->httpDir)
+    if (!rfbScreen->httpDir && !rfbScreen->httpMetrics)
 	return;
 
     if (rfbScreen->httpPort == 0) {
@@ -126,6 +135,7 @@ rfbHttpInitSockets(rfbScreenInfoPtr rfbScreen)
     }
 
    /*AddEnabledDevice(httpListenSock);*/
+    rfbEpollAdd(rfbScreen, rfbScreen->httpListenSock, &rfbScreen->httpListenSock, FALSE);
 }
 
 void rfbHttpShutdownSockets(rfbScreenInfoPtr rfbScreen) {
@@ -145,25 +155,29 @@ void
 rfbHttpCheckFds(rfbScreenInfoPtr rfbScreen)
 {
     int nfds;
-    fd_set fds;
+    fd_set fds, wfds;
     struct timeval tv;
     struct sockaddr_in addr;
     socklen_t addrlen = sizeof(addr);
 
-    if (!rfbScreen->httpDir)
+    if (!rfbScreen->httpDir && !rfbScreen->httpMetrics)
 	return;
 
     if (rfbScreen->httpListenSock < 0)
 	return;
 
     FD_ZERO(&fds);
+    FD_ZERO(&wfds);
     FD_SET(rfbScreen->httpListenSock, &fds);
     if (rfbScreen->httpSock >= 0) {
 	FD_SET(rfbScreen->httpSock, &fds);
+	/* the rest of an answer is waiting to be sent */
+	if (responseSent < responseLen)
+	    FD_SET(rfbScreen->httpSock, &wfds);
     }
     tv.tv_sec = 0;
     tv.tv_usec = 0;
-    nfds = select(max(rfbScreen->httpSock,rfbScreen->httpListenSock) + 1, &fds, NULL, NULL, &tv);
+    nfds = select(max(rfbScreen->httpSock,rfbScreen->httpListenSock) + 1, &fds, &wfds, NULL, &tv);
     if (nfds == 0) {
 	return;
     }
@@ -176,13 +190,16 @@ rfbHttpCheckFds(rfbScreenInfoPtr rfbScreen)
 	return;
     }
 
-    if ((rfbScreen->httpSock >= 0) && FD_ISSET(rfbScreen->httpSock, &fds)) {
+    if (rfbScreen->httpSock >= 0 && responseSent < responseLen) {
+	if (FD_ISSET(rfbScreen->httpSock, &wfds))
+	    httpSendResponse(rfbScreen);
+    } else if ((rfbScreen->httpSock >= 0) && FD_ISSET(rfbScreen->httpSock, &fds)) {
 	httpProcessInput(rfbScreen);
     }
 
     if (FD_ISSET(rfbScreen->httpListenSock, &fds)) {
         int flags;
-	if (rfbScreen->httpSock >= 0) close(rfbScreen->httpSock);
+	if (rfbScreen->httpSock >= 0) httpCloseSock(rfbScreen);
 
 	if ((rfbScreen->httpSock = accept(rfbScreen->httpListenSock,
 			       (struct sockaddr *)&addr, &addrlen)) < 0) {
@@ -219,6 +236,7 @@ rfbHttpCheckFds(rfbScreenInfoPtr rfbScreen)
 #endif
 
 	/*AddEnabledDevice(httpSock);*/
+	rfbEpollAdd(rfbScreen, rfbScreen->httpSock, &rfbScreen->httpSock, FALSE);
     }
 }
 
@@ -229,6 +247,7 @@ httpCloseSock(rfbScreenInfoPtr rfbScreen)
     close(rfbScreen->httpSock);
     rfbScreen->httpSock = -1;
     buf_filled = 0;
+    responseLen = responseSent = 0;
 }
 
 static rfbClientRec cl;
@@ -256,12 +275,12 @@ httpProcessInput(rfbScreenInfoPtr rfbScreen)
    
     cl.sock=rfbScreen->httpSock;
 
-    if (strlen(rfbScreen->httpDir) > 255) {
+    if (rfbScreen->httpDir && strlen(rfbScreen->httpDir) > 255) {
 	rfbErr("-httpd directory too long\n");
 	httpCloseSock(rfbScreen);
 	return;
     }
-    strcpy(fullFname, rfbScreen->httpDir);
+    strcpy(fullFname, rfbScreen->httpDir ? rfbScreen->httpDir : "");
     fname = &fullFname[strlen(fullFname)];
     maxFnameLen = 511 - strlen(fullFname);
 
@@ -358,6 +377,17 @@ httpProcessInput(rfbScreenInfoPtr rfbScreen)
 	return;
     }
 
+    /* the statistics are asked for often, and not logged */
+    if (rfbScreen->httpMetrics && httpServeStats(rfbScreen, fname))
+	return;
+
+    /* there are only the statistics to serve */
+    if (!rfbScreen->httpDir) {
+	rfbWriteExact(&cl, NOT_FOUND_STR, strlen(NOT_FOUND_STR));
+	httpCloseSock(rfbScreen);
+	return;
+    }
+
     if (strchr(fname+1, '/') != NULL) {
 	rfbErr("httpd: asking for file in other directory\n");
 	rfbWriteExact(&cl, NOT_FOUND_STR, strlen(NOT_FOUND_STR));
@@ -507,6 +537,327 @@ httpProcessInput(rfbScreenInfoPtr rfbScreen)
 }
 
 
+/*
+ * /metrics and /status tell what the statistics say about the screen and
+ * its clients, the first for Prometheus and the second as JSON.  The
+ * answer is made up in memory from snapshots, which do not wait on the
+ * capture or on the clients, and is written without blocking; what the
+ * socket does not take at once is sent from rfbHttpCheckFds() as it
+ * drains.
+ */
+
+#define METRICS_OK_STR "HTTP/1.0 200 OK\r\nConnection: close\r\n" \
+    "Content-Type: text/plain; version=0.0.4\r\n\r\n"
+#define STATUS_OK_STR "HTTP/1.0 200 OK\r\nConnection: close\r\n" \
+    "Content-Type: application/json\r\nPragma: no-cache\r\n\r\n"
+
+typedef struct {
+    char labels[128];
+    char host[64];
+    char encoding[32];
+    rfbBool viewOnly;
+    rfbStatSnapshot stats;
+} httpClientStats;
+
+static void
+httpPrintf(const char *format, ...)
+{
+    va_list args;
+    char *grown;
+    size_t left;
+    int n;
+
+    while (1) {
+	left = responseSize - responseLen;
+	va_start(args, format);
+	n = vsnprintf(response ? response + responseLen : NULL, left, format, args);
+	va_end(args);
+	if (n < 0)
+	    return;
+	if ((size_t)n < left) {
+	    responseLen += n;
+	    return;
+	}
+	if ((grown = (char *)realloc(response, responseSize + n + 4096)) == NULL)
+	    return;
+	response = grown;
+	responseSize += n + 4096;
+    }
+}
+
+/* snapshots of all the clients' statistics */
+static int
+httpCollectClients(rfbScreenInfoPtr rfbScreen, httpClientStats **clients)
+{
+    rfbClientIteratorPtr i;
+    rfbClientPtr c;
+    httpClientStats *s, *grown;
+    int n = 0, size = 0;
+
+    *clients = NULL;
+    i = rfbGetClientIterator(rfbScreen);
+    while ((c = rfbClientIteratorNext(i)) != NULL) {
+	if (c->state != RFB_NORMAL)
+	    continue;
+	if (n == size) {
+	    grown = (httpClientStats *)realloc(*clients, (size + 8) * sizeof(httpClientStats));
+	    if (!grown)
+		break;
+	    *clients = grown;
+	    size += 8;
+	}
+	s = &(*clients)[n++];
+	snprintf(s->host, sizeof(s->host), "%s", c->host ? c->host : "");
+	snprintf(s->labels, sizeof(s->labels), "client=\"%s\",sock=\"%d\"", s->host, c->sock);
+	encodingName(c->preferredEncoding == -1 ? rfbEncodingRaw : c->preferredEncoding,
+		s->encoding, sizeof(s->encoding));
+	s->viewOnly = c->viewOnly;
+	rfbStatGetSnapshot(c, &s->stats);
+    }
+    rfbReleaseClientIterator(i);
+    return n;
+}
+
+/* what the process uses, where there is a /proc to tell */
+static rfbBool
+httpMemoryUsage(double *virtualBytes, double *residentBytes)
+{
+#ifdef WIN32
+    return FALSE;
+#else
+    FILE *f;
+    unsigned long pages, resident;
+    int n;
+
+    if ((f = fopen("/proc/self/statm", "r")) == NULL)
+	return FALSE;
+    n = fscanf(f, "%lu %lu", &pages, &resident);
+    fclose(f);
+    if (n != 2)
+	return FALSE;
+    *virtualBytes = (double)pages * sysconf(_SC_PAGESIZE);
+    *residentBytes = (double)resident * sysconf(_SC_PAGESIZE);
+    return TRUE;
+#endif
+}
+
+static void
+httpMetricsHeader(const char *name, const char *type, const char *help)
+{
+    httpPrintf("# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+/* a histogram, its values multiplied by scale, up to its last used bucket */
+static void
+httpMetricsHistogram(const char *name, const char *labels, const rfbStatHistogram *h, double scale)
+{
+    uint32_t seen = 0;
+    int i, last;
+
+    for (last = RFB_STAT_BUCKETS - 1; last > 0 && h->buckets[last] == 0; last--)
+	;
+    for (i = 0; i <= last; i++) {
+	seen += h->buckets[i];
+	httpPrintf("%s_bucket{%s%sle=\"%.15g\"} %u\n", name, labels, *labels ? "," : "",
+		((double)((uint32_t)1 << i) - 1) * scale, seen);
+    }
+    httpPrintf("%s_bucket{%s%sle=\"+Inf\"} %u\n", name, labels, *labels ? "," : "", h->count);
+    httpPrintf("%s_sum%s%s%s %.15g\n", name, *labels ? "{" : "", labels, *labels ? "}" : "",
+	    h->sum * scale);
+    httpPrintf("%s_count%s%s%s %u\n", name, *labels ? "{" : "", labels, *labels ? "}" : "",
+	    h->count);
+}
+
+#define CLIENT_METRIC(name, type, help, value) do { \
+	httpMetricsHeader(name, type, help); \
+	for (c = 0; c < n; c++) \
+	    httpPrintf("%s{%s} %.15g\n", name, clients[c].labels, (double)(value)); \
+    } while (0)
+
+#define CLIENT_HISTOGRAM(name, help, field, scale) do { \
+	httpMetricsHeader(name, "histogram", help); \
+	for (c = 0; c < n; c++) \
+	    httpMetricsHistogram(name, clients[c].labels, &clients[c].stats.field, scale); \
+    } while (0)
+
+static void
+httpWriteMetrics(rfbScreenInfoPtr rfbScreen)
+{
+    httpClientStats *clients;
+    rfbCaptureStats capture;
+    double virtualBytes, residentBytes;
+    int c, n;
+
+    rfbStatGetCaptureSnapshot(rfbScreen, &capture);
+    httpMetricsHeader("rfb_capture_scans_total", "counter", "Screen scans for changes.");
+    httpPrintf("rfb_capture_scans_total %u\n", capture.scans);
+    httpMetricsHeader("rfb_capture_frames_total", "counter", "Screen scans which found changes.");
+    httpPrintf("rfb_capture_frames_total %u\n", capture.frames);
+    httpMetricsHeader("rfb_capture_fps", "gauge", "Changed frames found in the last second.");
+    httpPrintf("rfb_capture_fps %u\n", capture.framesLastSecond);
+    httpMetricsHeader("rfb_capture_scan_seconds", "histogram", "Time taken by a screen scan.");
+    httpMetricsHistogram("rfb_capture_scan_seconds", "", &capture.scanTime, 1e-6);
+    httpMetricsHeader("rfb_capture_frames_per_second", "histogram",
+	    "Changed frames found in each second with any.");
+    httpMetricsHistogram("rfb_capture_frames_per_second", "", &capture.fps, 1);
+
+    n = httpCollectClients(rfbScreen, &clients);
+    httpMetricsHeader("rfb_clients", "gauge", "Connected clients.");
+    httpPrintf("rfb_clients %d\n", n);
+
+    httpMetricsHeader("rfb_client_info", "gauge", "The encoding a client gets, and whether it is view-only.");
+    for (c = 0; c < n; c++)
+	httpPrintf("rfb_client_info{%s,encoding=\"%s\",view_only=\"%d\"} 1\n",
+		clients[c].labels, clients[c].encoding, clients[c].viewOnly ? 1 : 0);
+    CLIENT_METRIC("rfb_client_sent_bytes_total", "counter", "Bytes sent to a client.",
+	    clients[c].stats.bytesSent);
+    CLIENT_METRIC("rfb_client_sent_raw_bytes_total", "counter",
+	    "Bytes the data sent to a client would have taken unencoded.",
+	    clients[c].stats.bytesSentIfRaw);
+    CLIENT_METRIC("rfb_client_received_bytes_total", "counter", "Bytes received from a client.",
+	    clients[c].stats.bytesRcvd);
+    CLIENT_METRIC("rfb_client_sent_bytes_per_second", "gauge", "Bytes sent to a client in the last second.",
+	    clients[c].stats.bytesLastSecond);
+    CLIENT_METRIC("rfb_client_updates_total", "counter", "Framebuffer updates sent to a client.",
+	    clients[c].stats.updatesSent);
+    CLIENT_METRIC("rfb_client_fps", "gauge", "Framebuffer updates sent to a client in the last second.",
+	    clients[c].stats.updatesLastSecond);
+    CLIENT_METRIC("rfb_client_frames_skipped_total", "counter",
+	    "Changes merged into an update held back for a client.",
+	    clients[c].stats.framesSkipped);
+    CLIENT_METRIC("rfb_client_queue_bytes", "gauge", "Bytes waiting to be sent to a client.",
+	    clients[c].stats.queueDepth);
+    CLIENT_METRIC("rfb_client_queue_max_bytes", "gauge", "Most bytes seen waiting to be sent to a client.",
+	    clients[c].stats.maxQueueDepth);
+    CLIENT_METRIC("rfb_client_round_trip_seconds", "gauge", "Round trip time to a client.",
+	    clients[c].stats.roundTripTime * 1e-6);
+    CLIENT_METRIC("rfb_client_adapt_level", "gauge", "Levels below what it asked for a client's updates are.",
+	    clients[c].stats.adaptLevel);
+    CLIENT_METRIC("rfb_client_key_events_total", "counter", "Key events from a client.",
+	    clients[c].stats.keyEvents);
+    CLIENT_METRIC("rfb_client_pointer_events_total", "counter", "Pointer events from a client.",
+	    clients[c].stats.pointerEvents);
+    CLIENT_HISTOGRAM("rfb_client_update_latency_seconds",
+	    "Time from the first change in an update until it was sent.", updateLatency, 1e-6);
+    CLIENT_HISTOGRAM("rfb_client_encode_seconds", "Time taken to encode a rectangle.", encodeTime, 1e-6);
+    CLIENT_HISTOGRAM("rfb_client_update_bytes", "Bytes in a framebuffer update.", updateBytes, 1);
+    CLIENT_HISTOGRAM("rfb_client_updates_per_second", "Updates sent in each second with any.", fps, 1);
+    free(clients);
+
+    if (httpMemoryUsage(&virtualBytes, &residentBytes)) {
+	httpMetricsHeader("process_virtual_memory_bytes", "gauge", "Virtual memory size in bytes.");
+	httpPrintf("process_virtual_memory_bytes %.15g\n", virtualBytes);
+	httpMetricsHeader("process_resident_memory_bytes", "gauge", "Resident memory size in bytes.");
+	httpPrintf("process_resident_memory_bytes %.15g\n", residentBytes);
+    }
+}
+
+static void
+httpJsonHistogram(const char *name, const rfbStatHistogram *h)
+{
+    httpPrintf("\"%s\":{\"count\":%u,\"p50\":%d,\"p90\":%d,\"p99\":%d,\"max\":%u}",
+	    name, h->count, rfbStatHistogramPercentile(h, 50), rfbStatHistogramPercentile(h, 90),
+	    rfbStatHistogramPercentile(h, 99), h->max);
+}
+
+static void
+httpWriteStatus(rfbScreenInfoPtr rfbScreen)
+{
+    httpClientStats *clients;
+    rfbCaptureStats capture;
+    double virtualBytes, residentBytes;
+    time_t now = time(NULL);
+    int c, n;
+
+    rfbStatGetCaptureSnapshot(rfbScreen, &capture);
+    httpPrintf("{\"width\":%d,\"height\":%d,\"capture\":{\"scans\":%u,\"frames\":%u,\"fps\":%u,",
+	    rfbScreen->width, rfbScreen->height, capture.scans, capture.frames,
+	    capture.framesLastSecond);
+    httpJsonHistogram("scanTimeUs", &capture.scanTime);
+    httpPrintf("},");
+    if (httpMemoryUsage(&virtualBytes, &residentBytes))
+	httpPrintf("\"memory\":{\"virtualBytes\":%.0f,\"residentBytes\":%.0f},",
+		virtualBytes, residentBytes);
+
+    n = httpCollectClients(rfbScreen, &clients);
+    httpPrintf("\"clients\":[");
+    for (c = 0; c < n; c++) {
+	rfbStatSnapshot *s = &clients[c].stats;
+	double seconds = now > s->startTime ? (double)(now - s->startTime) : 1;
+
+	httpPrintf("%s{\"host\":\"%s\",\"encoding\":\"%s\",\"viewOnly\":%s,\"seconds\":%.0f,"
+		"\"bytesSent\":%u,\"bytesPerSecond\":%u,\"updates\":%u,\"fps\":%u,"
+		"\"framesSkipped\":%d,\"queueDepth\":%d,\"maxQueueDepth\":%d,"
+		"\"roundTripUs\":%d,\"adaptLevel\":%d,"
+		"\"keyEventsPerSecond\":%.2f,\"pointerEventsPerSecond\":%.2f,",
+		c ? "," : "", clients[c].host, clients[c].encoding,
+		clients[c].viewOnly ? "true" : "false", seconds,
+		s->bytesSent, s->bytesLastSecond, s->updatesSent, s->updatesLastSecond,
+		s->framesSkipped, s->queueDepth, s->maxQueueDepth,
+		s->roundTripTime, s->adaptLevel,
+		s->keyEvents / seconds, s->pointerEvents / seconds);
+	httpJsonHistogram("latencyUs", &s->updateLatency);
+	httpPrintf(",");
+	httpJsonHistogram("encodeUs", &s->encodeTime);
+	httpPrintf(",");
+	httpJsonHistogram("updateBytes", &s->updateBytes);
+	httpPrintf("}");
+    }
+    httpPrintf("]}\n");
+    free(clients);
+}
+
+#ifdef LIBVNCSERVER_WITH_TRACE
+static void
+httpTraceWriter(void *data, const char *text, size_t len)
+{
+    httpPrintf("%.*s", (int)len, text);
+}
+#endif
+
+/* answers a request for the statistics, if that is what path is */
+static rfbBool
+httpServeStats(rfbScreenInfoPtr rfbScreen, const char *path)
+{
+    size_t len = strcspn(path, "?");
+
+    responseLen = responseSent = 0;
+    if (len == 8 && strncmp(path, "/metrics", 8) == 0) {
+	httpPrintf("%s", METRICS_OK_STR);
+	httpWriteMetrics(rfbScreen);
+    } else if (len == 7 && strncmp(path, "/status", 7) == 0) {
+	httpPrintf("%s", STATUS_OK_STR);
+	httpWriteStatus(rfbScreen);
+#ifdef LIBVNCSERVER_WITH_TRACE
+    } else if (len == 6 && strncmp(path, "/trace", 6) == 0) {
+	httpPrintf("%s", STATUS_OK_STR);
+	rfbTraceWrite(httpTraceWriter, NULL);
+#endif
+    } else
+	return FALSE;
+    httpSendResponse(rfbScreen);
+    return TRUE;
+}
+
+/* sends what the socket takes of the answer, and closes it when done */
+static void
+httpSendResponse(rfbScreenInfoPtr rfbScreen)
+{
+    while (responseSent < responseLen) {
+	ssize_t n = write(rfbScreen->httpSock, response + responseSent,
+		responseLen - responseSent);
+	if (n < 0 && (errno == EAGAIN || errno == EINTR))
+	    return;
+	if (n <= 0) {
+	    rfbLogPerror("httpSendResponse: write");
+	    break;
+	}
+	responseSent += n;
+    }
+    httpCloseSock(rfbScreen);
+}
+
+
 static rfbBool
 compareAndSkip(char **ptr, const char *str)
 {
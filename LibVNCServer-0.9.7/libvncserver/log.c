@@ -0,0 +1,396 @@
+/*
+ * log.c - rfbLog() and rfbErr(), written by a thread of their own if
+ * asked to.
+ */
+
+/*
+ *  This is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This software is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this software; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307,
+ *  USA.
+ */
+
+/*
+ * By default a message is written to stderr before rfbLog() returns, so a
+ * slow console stalls whichever thread logs, and with it the updates.
+ * After rfbLogStartAsync() a message is only formatted and put into a
+ * ring of LOG_RECORDS records, which a flusher thread writes out in
+ * batches.  Any thread may log: a record is claimed by advancing the
+ * ring's tail with compare-and-swap, and handed to the flusher by setting
+ * its sequence number.  When the ring is full the message is dropped and
+ * counted, rather than waiting; the flusher reports how many were lost.
+ * Nothing on the way takes a mutex, which also keeps the debugging LOCK()
+ * macros, which log themselves, from recursing.
+ *
+ * A format string which is logged more than logRateLimit times in a
+ * second is quiet for the rest of that second, and then says how many of
+ * its messages were left out.  The formats are told apart by address, in
+ * a small table: two sharing a slot only makes both count from zero more
+ * often.
+ *
+ * rfbLogClient() puts the client's host, socket and encoding in front of
+ * the message, in the same form as the labels of /metrics.
+ */
+
+#include <rfb/rfb.h>
+#include "private.h"
+#include <time.h>
+#include <errno.h>
+#ifndef WIN32
+#include <unistd.h>
+#endif
+
+#define LOG_LINE 512		/* longer messages are cut */
+#define LOG_RECORDS 256
+#define LOG_SITES 64
+#define LOG_FLUSH_INTERVAL 20	/* ms the flusher sleeps when idle */
+
+#if defined(__GNUC__) && defined(LIBVNCSERVER_HAVE_LIBPTHREAD)
+#define LOG_ASYNC
+#endif
+
+static int rfbEnableLogging=1;
+static int logRateLimit=20;
+
+static int logMutex_initialized = 0;
+#ifdef LIBVNCSERVER_HAVE_LIBPTHREAD
+static MUTEX(logMutex);
+#endif
+
+typedef struct {
+	const char* format;
+	time_t second;
+	int count;
+	int suppressed;
+} LogSite;
+
+static LogSite logSites[LOG_SITES];
+
+#ifdef LOG_ASYNC
+typedef struct {
+	volatile unsigned long seq;	/* position+1 when it can be written out */
+	time_t time;
+	char text[LOG_LINE];
+} LogRecord;
+
+static LogRecord* logRing = NULL;
+static volatile unsigned long logTail = 0;	/* next record to claim */
+static volatile unsigned long logHead = 0;	/* next to write out */
+static volatile unsigned long logDropped = 0;
+static volatile int logAsync = 0, logStopping = 0, logSitesBusy = 0;
+static int logAtExitSet = 0;
+static pthread_t logThread;
+
+#define LOG_SITES_LOCK() while (__sync_lock_test_and_set(&logSitesBusy, 1)) ;
+#define LOG_SITES_UNLOCK() __sync_lock_release(&logSitesBusy)
+#else
+#define LOG_SITES_LOCK()
+#define LOG_SITES_UNLOCK()
+#endif
+
+void rfbLogEnable(int enabled) {
+	rfbEnableLogging=enabled;
+}
+
+void rfbLogSetRateLimit(int perSecond) {
+	logRateLimit=perSecond;
+}
+
+static size_t
+LogTimeStamp(char* buf, size_t size, time_t t)
+{
+	return strftime(buf, size, "%d/%m/%Y %X ", localtime(&t));
+}
+
+/* before any threads are started, rfbGetScreen() makes sure of the mutex */
+void
+rfbLogInit(void)
+{
+	if (! logMutex_initialized) {
+		INIT_MUTEX(logMutex);
+		logMutex_initialized = 1;
+	}
+}
+
+static void
+LogWriteNow(time_t t, const char* text)
+{
+	char stamp[64];
+
+	rfbLogInit();
+	LOCK(logMutex);
+	LogTimeStamp(stamp, sizeof(stamp), t);
+	fputs(stamp, stderr);
+	fputs(text, stderr);
+	fflush(stderr);
+	UNLOCK(logMutex);
+}
+
+#ifdef LOG_ASYNC
+/* drops the message, and counts it, if the ring is full */
+static void
+LogEnqueue(time_t t, const char* text)
+{
+	unsigned long pos = logTail;
+	LogRecord* r;
+
+	while (1) {
+		r = &logRing[pos % LOG_RECORDS];
+		if (r->seq == pos) {
+			if (__sync_bool_compare_and_swap(&logTail, pos, pos + 1))
+				break;
+		} else if ((long)(r->seq - pos) < 0) {
+			__sync_fetch_and_add(&logDropped, 1);
+			return;
+		}
+		pos = logTail;
+	}
+	r->time = t;
+	strncpy(r->text, text, LOG_LINE - 1);
+	r->text[LOG_LINE - 1] = '\0';
+	__sync_synchronize();
+	r->seq = pos + 1;
+}
+#endif
+
+static void
+LogText(time_t t, const char* text)
+{
+#ifdef LOG_ASYNC
+	if (logAsync) {
+		LogEnqueue(t, text);
+		return;
+	}
+#endif
+	LogWriteNow(t, text);
+}
+
+/* whether a message in this format may be logged now; says so if some
+   were left out before */
+static rfbBool
+LogAllowed(const char* format, time_t now)
+{
+	LogSite* site = &logSites[((unsigned long)format >> 3) % LOG_SITES];
+	int suppressed = 0;
+	rfbBool allowed;
+
+	if (logRateLimit <= 0)
+		return TRUE;
+
+	LOG_SITES_LOCK();
+	if (site->format != format || site->second != now) {
+		if (site->format == format)
+			suppressed = site->suppressed;
+		site->format = format;
+		site->second = now;
+		site->count = 0;
+		site->suppressed = 0;
+	}
+	allowed = ++site->count <= logRateLimit;
+	if (!allowed)
+		site->suppressed++;
+	LOG_SITES_UNLOCK();
+
+	if (suppressed > 0) {
+		char text[LOG_LINE];
+		int len = strcspn(format, "\n");
+		snprintf(text, sizeof(text), "(%d more messages like \"%.*s\" left out)\n",
+				suppressed, len > 60 ? 60 : len, format);
+		LogText(now, text);
+	}
+	return allowed;
+}
+
+static void
+LogV(rfbClientPtr cl, const char* format, va_list args)
+{
+	char text[LOG_LINE], enc[32];
+	time_t now;
+	int len = 0;
+
+	if(!rfbEnableLogging)
+		return;
+
+	time(&now);
+	if (!LogAllowed(format, now))
+		return;
+
+	if (cl) {
+		encodingName(cl->preferredEncoding == -1 ? rfbEncodingRaw : cl->preferredEncoding,
+				enc, sizeof(enc));
+		len = snprintf(text, sizeof(text), "client=%s sock=%d encoding=%s: ",
+				cl->host ? cl->host : "", cl->sock, enc);
+		if (len < 0 || len >= (int)sizeof(text))
+			len = 0;
+	}
+	vsnprintf(text + len, sizeof(text) - len, format, args);
+	LogText(now, text);
+}
+
+/*
+ * rfbLog prints a time-stamped message to the log file (stderr).
+ */
+
+static void
+rfbDefaultLog(const char *format, ...)
+{
+	va_list args;
+
+	va_start(args, format);
+	LogV(NULL, format, args);
+	va_end(args);
+}
+
+rfbLogProc rfbLog=rfbDefaultLog;
+rfbLogProc rfbErr=rfbDefaultLog;
+
+void rfbLogPerror(const char *str)
+{
+	rfbErr("%s: %s\n", str, strerror(errno));
+}
+
+void
+rfbLogClient(rfbClientPtr cl, const char *format, ...)
+{
+	va_list args;
+
+	va_start(args, format);
+	if (rfbLog == rfbDefaultLog || !cl)
+		LogV(cl, format, args);
+	else {
+		/* the application logs; give it the message in one piece */
+		char text[LOG_LINE];
+		vsnprintf(text, sizeof(text), format, args);
+		rfbLog("client=%s sock=%d: %s", cl->host ? cl->host : "", cl->sock, text);
+	}
+	va_end(args);
+}
+
+#ifdef LOG_ASYNC
+/* writes out what is in the ring; returns how many records there were */
+static int
+LogDrain(void)
+{
+	char batch[8192];
+	size_t used = 0, len;
+	unsigned long dropped;
+	int n = 0;
+
+	while (1) {
+		LogRecord* r = &logRing[logHead % LOG_RECORDS];
+		if (r->seq != logHead + 1)
+			break;
+		__sync_synchronize();
+		len = strlen(r->text) + 64;
+		if (used + len > sizeof(batch)) {
+			fwrite(batch, 1, used, stderr);
+			used = 0;
+		}
+		used += LogTimeStamp(batch + used, sizeof(batch) - used, r->time);
+		len = strlen(r->text);
+		memcpy(batch + used, r->text, len);
+		used += len;
+		__sync_synchronize();
+		r->seq = logHead + LOG_RECORDS;
+		logHead++;
+		n++;
+	}
+	if ((dropped = __sync_fetch_and_and(&logDropped, 0)) > 0) {
+		if (used + 128 > sizeof(batch)) {
+			fwrite(batch, 1, used, stderr);
+			used = 0;
+		}
+		used += LogTimeStamp(batch + used, sizeof(batch) - used, time(NULL));
+		used += snprintf(batch + used, sizeof(batch) - used,
+				"(%lu log messages dropped, the log could not keep up)\n", dropped);
+	}
+	if (used > 0) {
+		fwrite(batch, 1, used, stderr);
+		fflush(stderr);
+	}
+	return n;
+}
+
+static void*
+LogFlusher(void* data)
+{
+	while (1) {
+		if (LogDrain() > 0)
+			continue;
+		if (logStopping)
+			break;
+		usleep(LOG_FLUSH_INTERVAL * 1000);
+	}
+	return NULL;
+}
+
+static void
+LogAtExit(void)
+{
+	rfbLogStopAsync();
+}
+#endif
+
+rfbBool
+rfbLogStartAsync(void)
+{
+#ifdef LOG_ASYNC
+	int i;
+
+	if (logAsync)
+		return TRUE;
+	if (!logRing) {
+		logRing = (LogRecord*)calloc(LOG_RECORDS, sizeof(LogRecord));
+		if (!logRing)
+			return FALSE;
+		for (i = 0; i < LOG_RECORDS; i++)
+			logRing[i].seq = i;
+	}
+	logStopping = 0;
+	if (pthread_create(&logThread, NULL, LogFlusher, NULL) != 0)
+		return FALSE;
+	logAsync = 1;
+	if (!logAtExitSet) {
+		atexit(LogAtExit);
+		logAtExitSet = 1;
+	}
+	return TRUE;
+#else
+	return FALSE;
+#endif
+}
+
+void
+rfbLogStopAsync(void)
+{
+#ifdef LOG_ASYNC
+	if (!logAsync)
+		return;
+	logAsync = 0;
+	logStopping = 1;
+	pthread_join(logThread, NULL);
+	/* from threads which saw logAsync just before it changed */
+	LogDrain();
+#endif
+}
+
+void
+rfbLogFlush(void)
+{
+#ifdef LOG_ASYNC
+	unsigned long tail = logTail;
+
+	while (logAsync && (long)(logHead - tail) < 0)
+		usleep(1000);
+#endif
+}
@@ -39,14 +39,10 @@
 #include <time.h>
 
 static int extMutex_initialized = 0;
-static int logMutex_initialized = 0;
 #ifdef LIBVNCSERVER_HAVE_LIBPTHREAD
-static MUTEX(logMutex);
 static MUTEX(extMutex);
 #endif
 
-static int rfbEnableLogging=1;
-
 #ifdef LIBVNCSERVER_WORDS_BIGENDIAN
 char rfbEndianTest = (1==0);
 #else
@@ -210,55 +206,6 @@ void* rfbGetExtensionClientData(rfbClientPtr cl, rfbProtocolExtension* extension
 	return data->data;
 		}
 
-/*
- * Logging
- */
-
-void rfbLogEnable(int enabled) {
-	rfbEnableLogging=enabled;
-}
-
-/*
- * rfbLog prints a time-stamped message to the log file (stderr).
- */
-
-static void
-rfbDefaultLog(const char *format, ...)
-{
-	va_list args;
-	char buf[256];
-	time_t log_clock;
-
-	if(!rfbEnableLogging)
-		return;
-
-	if (! logMutex_initialized) {
-		INIT_MUTEX(logMutex);
-		logMutex_initialized = 1;
-	}
-
-	LOCK(logMutex);
-	va_start(args, format);
-
-	time(&log_clock);
-	strftime(buf, 255, "%d/%m/%Y %X ", localtime(&log_clock));
-	fprintf(stderr,buf);
-
-	vfprintf(stderr, format, args);
-	fflush(stderr);
-
-	va_end(args);
-	UNLOCK(logMutex);
-}
-
-rfbLogProc rfbLog=rfbDefaultLog;
-rfbLogProc rfbErr=rfbDefaultLog;
-
-void rfbLogPerror(const char *str)
-{
-	rfbErr("%s: %s\n", str, strerror(errno));
-}
-
 void rfbScheduleCopyRegion(rfbScreenInfoPtr rfbScreen,sraRegionPtr copyRegion,int dx,int dy)
 {  
 	rfbClientIteratorPtr iterator;
@@ -267,6 +214,8 @@ void rfbScheduleCopyRegion(rfbScreenInfoPtr rfbScreen,sraRegionPtr copyRegion,in
 	iterator=rfbGetClientIterator(rfbScreen);
 	while((cl=rfbClientIteratorNext(iterator))) {
 		LOCK(cl->updateMutex);
+		/* the damage so far lies under the copy */
+		rfbDamageCollect(cl);
 		if(cl->useCopyRect) {
 			sraRegionPtr modifiedRegionBackup;
 			if(!sraRgnEmpty(cl->copyRegion)) {
@@ -341,7 +290,7 @@ void rfbScheduleCopyRegion(rfbScreenInfoPtr rfbScreen,sraRegionPtr copyRegion,in
 		} else {
 			sraRgnOr(cl->modifiedRegion,copyRegion);
 		}
-		TSIGNAL(cl->updateCond);
+		rfbScheduleUpdate(cl);
 		UNLOCK(cl->updateMutex);
 	}
 
@@ -395,15 +344,35 @@ void rfbMarkRegionAsModified(rfbScreenInfoPtr screen,sraRegionPtr modRegion)
 {
 	rfbClientIteratorPtr iterator;
 	rfbClientPtr cl;
+	unsigned long seq;
 
-	iterator=rfbGetClientIterator(screen);
-	while((cl=rfbClientIteratorNext(iterator))) {
-		LOCK(cl->updateMutex);
-		sraRgnOr(cl->modifiedRegion,modRegion);
-		TSIGNAL(cl->updateCond);
-		UNLOCK(cl->updateMutex);
+	if(!screen->damageJournal) {
+		iterator=rfbGetClientIterator(screen);
+		while((cl=rfbClientIteratorNext(iterator))) {
+			LOCK(cl->updateMutex);
+			sraRgnOr(cl->modifiedRegion,modRegion);
+			if(cl->damageTime.tv_sec == 0)
+				gettimeofday(&cl->damageTime,NULL);
+			if(cl->updateDeferred)
+				cl->framesSkipped++;
+			rfbScheduleUpdate(cl);
+			UNLOCK(cl->updateMutex);
+		}
+		rfbReleaseClientIterator(iterator);
+		return;
 	}
 
+	/*
+	 * The damage is recorded once, in the screen's journal; clients
+	 * take it from there when they send their next update.  Only those
+	 * which had taken everything so far need waking up, the others are
+	 * due for an update anyway.
+	 */
+	seq=rfbDamageMark(screen,modRegion);
+	iterator=rfbGetClientIterator(screen);
+	while((cl=rfbClientIteratorNext(iterator)))
+		if(DAMAGE_SEQ_LOAD(&cl->damageSeq)==seq)
+			rfbScheduleUpdate(cl);
 	rfbReleaseClientIterator(iterator);
 }
 
@@ -423,173 +392,31 @@ void rfbMarkRectAsModified(rfbScreenInfoPtr screen,int x1,int y1,int x2,int y2)
 	if(y2>screen->height) y2=screen->height;
 	if(y1==y2) return;
 
+	RFB_TRACE_BEGIN("mark",(x2-x1)*(y2-y1));
 	/* update scaled copies for this rectangle */
 	rfbScaledScreenUpdate(screen,x1,y1,x2,y2);
 
 	region = sraRgnCreateRect(x1,y1,x2,y2);
 	rfbMarkRegionAsModified(screen,region);
 	sraRgnDestroy(region);
-}
-
-#ifdef LIBVNCSERVER_HAVE_LIBPTHREAD
-#include <unistd.h>
-
-static void *
-clientOutput(void *data)
-{
-	rfbClientPtr cl = (rfbClientPtr)data;
-	rfbBool haveUpdate;
-	sraRegion* updateRegion;
-
-	while (1) {
-		haveUpdate = false;
-		while (!haveUpdate) {
-			if (cl->sock == -1) {
-				/* Client has disconnected. */
-				return NULL;
-			}
-			LOCK(cl->updateMutex);
-			haveUpdate = FB_UPDATE_PENDING(cl);
-			if(!haveUpdate) {
-				updateRegion = sraRgnCreateRgn(cl->modifiedRegion);
-				haveUpdate = sraRgnAnd(updateRegion,cl->requestedRegion);
-				sraRgnDestroy(updateRegion);
-			}
-
-			if (!haveUpdate) {
-				WAIT(cl->updateCond, cl->updateMutex);
-			}
-			UNLOCK(cl->updateMutex);
-		}
-
-		/* OK, now, to save bandwidth, wait a little while for more
-           updates to come along. */
-		usleep(cl->screen->deferUpdateTime * 1000);
-
-		/* Now, get the region we're going to update, and remove
-           it from cl->modifiedRegion _before_ we send the update.
-           That way, if anything that overlaps the region we're sending
-           is updated, we'll be sure to do another update later. */
-		LOCK(cl->updateMutex);
-		updateRegion = sraRgnCreateRgn(cl->modifiedRegion);
-		UNLOCK(cl->updateMutex);
-
-		/* Now actually send the update. */
-		rfbIncrClientRef(cl);
-		rfbSendFramebufferUpdate(cl, updateRegion);
-		rfbDecrClientRef(cl);
-
-		sraRgnDestroy(updateRegion);
-	}
-
-	/* Not reached. */
-	return NULL;
-}
-
-static void *
-clientInput(void *data)
-{
-	rfbClientPtr cl = (rfbClientPtr)data;
-	pthread_t output_thread;
-	pthread_create(&output_thread, NULL, clientOutput, (void *)cl);
-
-	while (1) {
-		fd_set rfds, wfds, efds;
-		struct timeval tv;
-		int n;
-
-		FD_ZERO(&rfds);
-		FD_SET(cl->sock, &rfds);
-		FD_ZERO(&efds);
-		FD_SET(cl->sock, &efds);
-
-		/* Are we transferring a file in the background? */
-		FD_ZERO(&wfds);
-		if ((cl->fileTransfer.fd!=-1) && (cl->fileTransfer.sending==1))
-			FD_SET(cl->sock, &wfds);
-
-		tv.tv_sec = 60; /* 1 minute */
-		tv.tv_usec = 0;
-		n = select(cl->sock + 1, &rfds, &wfds, &efds, &tv);
-		if (n < 0) {
-			rfbLogPerror("ReadExact: select");
-			break;
-		}
-		if (n == 0) /* timeout */
-		{
-			rfbSendFileTransferChunk(cl);
-			continue;
-		}
-
-		/* We have some space on the transmit queue, send some data */
-		if (FD_ISSET(cl->sock, &wfds))
-			rfbSendFileTransferChunk(cl);
-
-		if (FD_ISSET(cl->sock, &rfds) || FD_ISSET(cl->sock, &efds))
-			rfbProcessClientMessage(cl);
-
-		if (cl->sock == -1) {
-			/* Client has disconnected. */
-			break;
-		}
-	}
-
-	/* Get rid of the output thread. */
-	LOCK(cl->updateMutex);
-	TSIGNAL(cl->updateCond);
-	UNLOCK(cl->updateMutex);
-	IF_PTHREADS(pthread_join(output_thread, NULL));
-
-	rfbClientConnectionGone(cl);
-
-	return NULL;
-}
-
-static void*
-listenerRun(void *data)
-{
-	rfbScreenInfoPtr screen=(rfbScreenInfoPtr)data;
-	int client_fd;
-	struct sockaddr_in peer;
-	rfbClientPtr cl;
-	socklen_t len;
-
-	len = sizeof(peer);
-
-	/* TODO: this thread wont die by restarting the server */
-	/* TODO: HTTP is not handled */
-	while ((client_fd = accept(screen->listenSock,
-			(struct sockaddr*)&peer, &len)) >= 0) {
-		cl = rfbNewClient(screen,client_fd);
-		len = sizeof(peer);
-
-		if (cl && !cl->onHold )
-			rfbStartOnHoldClient(cl);
-	}
-	return(NULL);
+	RFB_TRACE_END();
 }
 
-void 
-rfbStartOnHoldClient(rfbClientPtr cl)
-{
-	pthread_create(&cl->client_thread, NULL, clientInput, (void *)cl);
-}
-
-#else
-
 void 
 rfbStartOnHoldClient(rfbClientPtr cl)
 {
 	cl->onHold = FALSE;
+	/* pick up what it has sent meanwhile */
+	rfbScheduleClient(cl, RFB_TASK_INPUT, 0);
 }
 
-#endif
-
 void 
 rfbRefuseOnHoldClient(rfbClientPtr cl)
 {
 	rfbCloseClient(cl);
-	rfbClientConnectionGone(cl);
+	/* worker threads, if it has them, let go of it themselves */
+	if (!rfbScheduleClient(cl, 0, 0))
+		rfbClientConnectionGone(cl);
 }
 
 static void
@@ -778,11 +605,7 @@ rfbScreenInfoPtr rfbGetScreen(int* argc,char** argv,
 {
 	rfbScreenInfoPtr screen=calloc(sizeof(rfbScreenInfo),1);
 
-	if (! logMutex_initialized) {
-		INIT_MUTEX(logMutex);
-		logMutex_initialized = 1;
-	}
-
+	rfbLogInit();
 
 	if(width&3)
 		rfbErr("WARNING: Width (%d) is not a multiple of 4. VncViewer has problems with that.\n",width);
@@ -803,6 +626,11 @@ rfbScreenInfoPtr rfbGetScreen(int* argc,char** argv,
 
 	screen->maxFd=0;
 	screen->listenSock=-1;
+	screen->epollFd=-1;
+	screen->timerFd=-1;
+	screen->lastClientSweep=0;
+	screen->deferDeadline.tv_sec=0;
+	screen->deferDeadline.tv_usec=0;
 
 	screen->httpInitDone=FALSE;
 	screen->httpEnableProxyConnect=FALSE;
@@ -828,11 +656,19 @@ rfbScreenInfoPtr rfbGetScreen(int* argc,char** argv,
 
 	/* disable progressive updating per default */
 	screen->progressiveSliceHeight = 0;
+	screen->targetLatency = 0;
+	screen->cpuBudget = 0;
+	screen->viewOnlyMaxBytesPerSecond = 0;
+	screen->viewOnlyMaxUpdatesPerSecond = 0;
+	rfbAdaptInitScreen(screen);
+	rfbDamageInitScreen(screen);
 
 	screen->listenInterface = htonl(INADDR_ANY);
 
 	screen->deferUpdateTime=5;
+	IF_PTHREADS(screen->workerThreads=0);
 	screen->maxRectsPerUpdate=50;
+	screen->mergeRects=TRUE;
 
 	screen->handleEventsEagerly = FALSE;
 
@@ -868,8 +704,11 @@ screen->underCursorBuffer=NULL;
 screen->dontConvertRichCursorToXCursor = FALSE;
 screen->cursor = &myCursor;
 INIT_MUTEX(screen->cursorMutex);
+INIT_MUTEX(screen->fdsMutex);
+INIT_MUTEX(screen->classStatsMutex);
 
 IF_PTHREADS(screen->backgroundLoop = FALSE);
+IF_PTHREADS(screen->workers = NULL);
 
 /* proc's and hook's */
 
@@ -927,6 +766,7 @@ void rfbNewFramebuffer(rfbScreenInfoPtr screen, char *framebuffer,
 	}
 
 	screen->frameBuffer = framebuffer;
+	rfbDamageResizeScreen(screen);
 
 	/* Adjust pointer position if necessary */
 
@@ -957,7 +797,7 @@ void rfbNewFramebuffer(rfbScreenInfoPtr screen, char *framebuffer,
 		if (cl->useNewFBSize)
 			cl->newFBSizePending = TRUE;
 
-		TSIGNAL(cl->updateCond);
+		rfbScheduleUpdate(cl);
 		UNLOCK(cl->updateMutex);
 	}
 	rfbReleaseClientIterator(iterator);
@@ -967,8 +807,13 @@ void rfbNewFramebuffer(rfbScreenInfoPtr screen, char *framebuffer,
 
 void rfbScreenCleanup(rfbScreenInfoPtr screen)
 {
-	rfbClientIteratorPtr i=rfbGetClientIterator(screen);
-	rfbClientPtr cl,cl1=rfbClientIteratorNext(i);
+	rfbClientIteratorPtr i;
+	rfbClientPtr cl,cl1;
+
+	rfbStopWorkers(screen);
+
+	i=rfbGetClientIterator(screen);
+	cl1=rfbClientIteratorNext(i);
 	while(cl1) {
 		cl=rfbClientIteratorNext(i);
 		rfbClientConnectionGone(cl1);
@@ -980,17 +825,16 @@ void rfbScreenCleanup(rfbScreenInfoPtr screen)
 	FREE_IF(colourMap.data.bytes);
 	FREE_IF(underCursorBuffer);
 	TINI_MUTEX(screen->cursorMutex);
+	TINI_MUTEX(screen->fdsMutex);
+	rfbPrintClassStats(screen);
+	TINI_MUTEX(screen->classStatsMutex);
 	if(screen->cursor && screen->cursor->cleanup)
 		rfbFreeCursor(screen->cursor);
 
-	rfbRRECleanup(screen);
-	rfbCoRRECleanup(screen);
-	rfbUltraCleanup(screen);
 #ifdef LIBVNCSERVER_HAVE_LIBZ
-	rfbZlibCleanup(screen);
-#ifdef LIBVNCSERVER_HAVE_LIBJPEG
-	rfbTightCleanup(screen);
-#endif
+	rfbZrleCleanup(screen);
+	rfbAdaptCleanupScreen(screen);
+	rfbDamageCleanupScreen(screen);
 
 	/* free all 'scaled' versions of this screen */
 	while (screen->scaledScreenNext!=NULL)
@@ -1014,6 +858,7 @@ void rfbInitServer(rfbScreenInfoPtr screen)
 #endif
 	rfbInitSockets(screen);
 	rfbHttpInitSockets(screen);
+	rfbTraceInitServer(screen);
 #ifndef __MINGW32__
 	if(screen->ignoreSIGPIPE)
 		signal(SIGPIPE,SIG_IGN);
@@ -1031,6 +876,9 @@ void rfbShutdownServer(rfbScreenInfoPtr screen,rfbBool disconnectClients) {
 		rfbReleaseClientIterator(iter);
 	}
 
+	/* before the sockets the event thread waits on go away */
+	rfbStopWorkers(screen);
+
 	rfbShutdownSockets(screen);
 	rfbHttpShutdownSockets(screen);
 }
@@ -1049,13 +897,31 @@ void gettimeofday(struct timeval* tv,char* dummy)
 }
 #endif
 
+/* make *deadline the time ms (and a bit) after start, if that is earlier */
+static void
+rfbEarlierDeadline(struct timeval* deadline,struct timeval* start,int ms)
+{
+	struct timeval t;
+
+	t.tv_sec=start->tv_sec+(ms+1)/1000;
+	t.tv_usec=start->tv_usec+((ms+1)%1000)*1000;
+	if(t.tv_usec>=1000000) {
+		t.tv_sec++;
+		t.tv_usec-=1000000;
+	}
+	if(deadline->tv_sec==0 || t.tv_sec<deadline->tv_sec
+			|| (t.tv_sec==deadline->tv_sec && t.tv_usec<deadline->tv_usec))
+		*deadline=t;
+}
+
 rfbBool
 rfbProcessEvents(rfbScreenInfoPtr screen,long usec)
 {
 	rfbClientIteratorPtr i;
 	rfbClientPtr cl,clPrev;
-	struct timeval tv;
+	struct timeval tv,deadline;
 	rfbBool result=FALSE;
+	int clientClass;
 	extern rfbClientIteratorPtr
 	rfbGetClientIteratorWithClosed(rfbScreenInfoPtr rfbScreen);
 
@@ -1067,31 +933,45 @@ rfbProcessEvents(rfbScreenInfoPtr screen,long usec)
 #ifdef CORBA
 	corbaCheckFds(screen);
 #endif
-
-	i = rfbGetClientIteratorWithClosed(screen);
-	cl = rfbClientIteratorHead(i);
-	while(cl) {
-		if (cl->sock >= 0 && !cl->onHold && FB_UPDATE_PENDING(cl) &&
-				!sraRgnEmpty(cl->requestedRegion)) {
-			result=TRUE;
-			if(screen->deferUpdateTime == 0) {
-				rfbSendFramebufferUpdate(cl,cl->modifiedRegion);
-			} else if(cl->startDeferring.tv_usec == 0) {
-				gettimeofday(&cl->startDeferring, NULL);
-				if(cl->startDeferring.tv_usec == 0)
-					cl->startDeferring.tv_usec++;
-			} else {
-				gettimeofday(&tv,NULL);
-				if(tv.tv_sec < cl->startDeferring.tv_sec /* at midnight */
-						|| ((tv.tv_sec-cl->startDeferring.tv_sec)*1000
-								+(tv.tv_usec-cl->startDeferring.tv_usec)/1000)
-								> screen->deferUpdateTime) {
-					cl->startDeferring.tv_usec = 0;
+	rfbTraceCheckDump(screen);
+
+	deadline.tv_sec=deadline.tv_usec=0;
+
+	/* send the updates which are due, to the interactive clients first */
+	for(clientClass=0;clientClass<RFB_CLIENT_CLASSES;clientClass++) {
+		i = rfbGetClientIterator(screen);
+		while((cl=rfbClientIteratorNext(i))) {
+			if (cl->sock < 0 || cl->onHold || rfbClientClass(cl) != clientClass)
+				continue;
+			if (FB_UPDATE_PENDING(cl) && !sraRgnEmpty(cl->requestedRegion)) {
+				result=TRUE;
+				if(screen->deferUpdateTime == 0) {
 					rfbSendFramebufferUpdate(cl,cl->modifiedRegion);
+				} else if(cl->startDeferring.tv_usec == 0) {
+					gettimeofday(&cl->startDeferring, NULL);
+					if(cl->startDeferring.tv_usec == 0)
+						cl->startDeferring.tv_usec++;
+				} else {
+					gettimeofday(&tv,NULL);
+					if(tv.tv_sec < cl->startDeferring.tv_sec /* at midnight */
+							|| ((tv.tv_sec-cl->startDeferring.tv_sec)*1000
+									+(tv.tv_usec-cl->startDeferring.tv_usec)/1000)
+									> screen->deferUpdateTime) {
+						cl->startDeferring.tv_usec = 0;
+						rfbSendFramebufferUpdate(cl,cl->modifiedRegion);
+					}
 				}
 			}
+			/* have rfbCheckFds() wake up when deferring is over */
+			if(cl->startDeferring.tv_usec != 0)
+				rfbEarlierDeadline(&deadline,&cl->startDeferring,screen->deferUpdateTime);
 		}
+		rfbReleaseClientIterator(i);
+	}
 
+	i = rfbGetClientIteratorWithClosed(screen);
+	cl = rfbClientIteratorHead(i);
+	while(cl) {
 		if (!cl->viewOnly && cl->lastPtrX >= 0) {
 			if(cl->startPtrDeferring.tv_usec == 0) {
 				gettimeofday(&cl->startPtrDeferring,NULL);
@@ -1112,6 +992,10 @@ rfbProcessEvents(rfbScreenInfoPtr screen,long usec)
 				}
 			}
 		}
+
+		if(cl->startPtrDeferring.tv_usec != 0)
+			rfbEarlierDeadline(&deadline,&cl->startPtrDeferring,screen->deferPtrUpdateTime);
+
 		clPrev=cl;
 		cl=rfbClientIteratorNext(i);
 		if(clPrev->sock==-1) {
@@ -1120,6 +1004,7 @@ rfbProcessEvents(rfbScreenInfoPtr screen,long usec)
 		}
 	}
 	rfbReleaseClientIterator(i);
+	screen->deferDeadline=deadline;
 
 	return result;
 }
@@ -1132,11 +1017,12 @@ void rfbRunEventLoop(rfbScreenInfoPtr screen, long usec, rfbBool runInBackground
 {
 	if(runInBackground) {
 #ifdef LIBVNCSERVER_HAVE_LIBPTHREAD
-		pthread_t listener_thread;
-
 		screen->backgroundLoop = TRUE;
 
-		pthread_create(&listener_thread, NULL, listenerRun, screen);
+		if(!rfbStartWorkers(screen)) {
+			rfbErr("Can't start the threads to run in background!\n");
+			screen->backgroundLoop = FALSE;
+		}
 		return;
 #else
 		rfbErr("Can't run in background, because I don't have PThreads!\n");
@@ -0,0 +1,436 @@
+/*
+ * outqueue.c - per-client output queue, see outqueue.h.
+ */
+
+/*
+ *  This is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This software is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this software; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307,
+ *  USA.
+ */
+
+#include <limits.h>
+#include <errno.h>
+#ifdef LIBVNCSERVER_HAVE_SYS_TIME_H
+#include <sys/time.h>
+#endif
+#include "outqueue.h"
+
+/* While corked, flush once this much block data is waiting. */
+#define OUT_QUEUE_MAX_BYTES (256 * 1024)
+
+/* Free blocks kept per client. */
+#define OUT_QUEUE_FREE_BLOCKS 4
+
+#ifdef IOV_MAX
+#define OUT_QUEUE_MAX_IOV IOV_MAX
+#else
+#define OUT_QUEUE_MAX_IOV 16
+#endif
+
+static rfbOutBlock *
+GetBlock(rfbOutQueue *q)
+{
+  rfbOutBlock *b = q->freeBlocks;
+
+  if (b) {
+    q->freeBlocks = b->next;
+    q->numFreeBlocks--;
+  } else {
+    b = (rfbOutBlock *)malloc(sizeof(rfbOutBlock));
+    if (!b)
+      return NULL;
+  }
+  b->next = NULL;
+  b->refCount = 1;
+  return b;
+}
+
+static void
+ReleaseBlock(rfbOutQueue *q, rfbOutBlock *b)
+{
+  if (--b->refCount > 0)
+    return;
+  if (q->numFreeBlocks < OUT_QUEUE_FREE_BLOCKS) {
+    b->next = q->freeBlocks;
+    q->freeBlocks = b;
+    q->numFreeBlocks++;
+  } else {
+    free(b);
+  }
+}
+
+static rfbBool
+AddSegment(rfbOutQueue *q, const char *data, int len, rfbOutBlock *block)
+{
+  rfbOutSegment *s;
+
+  if (q->numSegments == q->maxSegments) {
+    int n = q->maxSegments ? q->maxSegments * 2 : 16;
+    s = (rfbOutSegment *)realloc(q->segments, n * sizeof(rfbOutSegment));
+    if (!s)
+      return FALSE;
+    q->segments = s;
+    q->maxSegments = n;
+  }
+  s = &q->segments[q->numSegments++];
+  s->data = data;
+  s->len = len;
+  s->block = block;
+  q->queuedBytes += len;
+  if (block) {
+    block->refCount++;
+    q->blockBytes += len;
+  }
+  return TRUE;
+}
+
+/* Drop the first n segments. */
+static void
+RemoveSegments(rfbOutQueue *q, int n)
+{
+  int i;
+
+  for (i = 0; i < n; i++) {
+    q->queuedBytes -= q->segments[i].len;
+    if (q->segments[i].block) {
+      q->blockBytes -= q->segments[i].len;
+      ReleaseBlock(q, q->segments[i].block);
+    }
+  }
+  q->numSegments -= n;
+  memmove(q->segments, q->segments + n, q->numSegments * sizeof(rfbOutSegment));
+}
+
+/* Drop the first len bytes, which have been written. */
+static void
+ConsumeBytes(rfbOutQueue *q, int len)
+{
+  int n = 0;
+  rfbOutSegment *s;
+
+  while (n < q->numSegments && len >= q->segments[n].len)
+    len -= q->segments[n++].len;
+  RemoveSegments(q, n);
+  if (len > 0) {
+    s = &q->segments[0];
+    s->data += len;
+    s->len -= len;
+    q->queuedBytes -= len;
+    if (s->block)
+      q->blockBytes -= len;
+  }
+}
+
+/*
+ * Copy the data of all borrowed segments into blocks, so that the queue
+ * can outlive the call that queued them.
+ */
+static rfbBool
+DetachSegments(rfbOutQueue *q)
+{
+  rfbOutSegment *old = q->segments;
+  int i, n, used = 0, numOld = q->numSegments;
+  rfbOutBlock *fill = NULL;
+  rfbBool result = TRUE;
+
+  for (i = 0; i < numOld && old[i].block; i++)
+    ;
+  if (i == numOld)
+    return TRUE;
+
+  q->segments = NULL;
+  q->numSegments = q->maxSegments = 0;
+  q->blockBytes = q->queuedBytes = 0;
+
+  for (i = 0; i < numOld; i++) {
+    const char *data = old[i].data;
+    int len = old[i].len;
+
+    if (!result) {
+      if (old[i].block)
+	ReleaseBlock(q, old[i].block);
+      continue;
+    }
+    if (old[i].block) {
+      /* the new segment takes over the old one's reference */
+      result = AddSegment(q, data, len, old[i].block);
+      ReleaseBlock(q, old[i].block);
+      continue;
+    }
+    while (len > 0 && result) {
+      if (!fill || used == UPDATE_BUF_SIZE) {
+	if (fill)
+	  ReleaseBlock(q, fill);
+	fill = GetBlock(q);
+	used = 0;
+	if (!fill) {
+	  result = FALSE;
+	  break;
+	}
+      }
+      n = UPDATE_BUF_SIZE - used;
+      if (n > len)
+	n = len;
+      memcpy(fill->data + used, data, n);
+      result = AddSegment(q, fill->data + used, n, fill);
+      used += n;
+      data += n;
+      len -= n;
+    }
+  }
+  if (fill)
+    ReleaseBlock(q, fill);
+  free(old);
+  return result;
+}
+
+static int
+BacklogLimit(rfbClientPtr cl)
+{
+  if (rfbMaxClientBacklog > 0)
+    return rfbMaxClientBacklog;
+  /* room for a couple of full updates in raw 32 bit pixels */
+  return 2 * 4 * cl->screen->width * cl->screen->height + OUT_QUEUE_MAX_BYTES;
+}
+
+static rfbBool
+Blocking(rfbClientPtr cl)
+{
+#ifdef LIBVNCSERVER_HAVE_LIBPTHREAD
+  /* worker threads must not wait for any one client */
+  return cl->screen->backgroundLoop && !cl->screen->workers;
+#else
+  return FALSE;
+#endif
+}
+
+rfbBool
+rfbOutQueueInit(rfbClientPtr cl)
+{
+  rfbOutQueue *q = (rfbOutQueue *)calloc(1, sizeof(rfbOutQueue));
+
+  if (!q)
+    return FALSE;
+  q->iov = (struct iovec *)malloc(OUT_QUEUE_MAX_IOV * sizeof(struct iovec));
+  q->current = GetBlock(q);
+  if (!q->iov || !q->current) {
+    free(q->iov);
+    free(q->current);
+    free(q);
+    return FALSE;
+  }
+  cl->outputQueue = q;
+  cl->updateBuf = q->current->data;
+  cl->ublen = 0;
+  return TRUE;
+}
+
+void
+rfbOutQueueFree(rfbClientPtr cl)
+{
+  rfbOutQueue *q = (rfbOutQueue *)cl->outputQueue;
+  rfbOutBlock *b;
+
+  if (!q)
+    return;
+  RemoveSegments(q, q->numSegments);
+  ReleaseBlock(q, q->current);
+  while ((b = q->freeBlocks) != NULL) {
+    q->freeBlocks = b->next;
+    free(b);
+  }
+  free(q->segments);
+  free(q->iov);
+  free(q);
+  cl->outputQueue = NULL;
+  cl->updateBuf = NULL;
+}
+
+/*
+ * Queue the contents of updateBuf and give the client an empty one.
+ */
+
+rfbBool
+rfbOutQueueUpdateBuf(rfbClientPtr cl)
+{
+  rfbOutQueue *q = (rfbOutQueue *)cl->outputQueue;
+  rfbOutBlock *b;
+
+  if (cl->ublen == 0)
+    return TRUE;
+
+  LOCK(cl->outputMutex);
+  b = GetBlock(q);
+  if (!b || !AddSegment(q, cl->updateBuf, cl->ublen, q->current)) {
+    if (b)
+      ReleaseBlock(q, b);
+    UNLOCK(cl->outputMutex);
+    rfbErr("rfbOutQueueUpdateBuf: out of memory\n");
+    return FALSE;
+  }
+  ReleaseBlock(q, q->current);
+  q->current = b;
+  cl->updateBuf = b->data;
+  cl->ublen = 0;
+  UNLOCK(cl->outputMutex);
+  return TRUE;
+}
+
+/*
+ * Queue len bytes at data without copying them.  They are read when the
+ * queue is flushed, so they must not change or go away until then.
+ */
+
+rfbBool
+rfbOutQueueData(rfbClientPtr cl, const char *data, int len)
+{
+  rfbOutQueue *q = (rfbOutQueue *)cl->outputQueue;
+  rfbBool result = TRUE;
+
+  if (len <= 0)
+    return TRUE;
+
+  LOCK(cl->outputMutex);
+  if (!AddSegment(q, data, len, NULL)) {
+    rfbErr("rfbOutQueueData: out of memory\n");
+    result = FALSE;
+  }
+  UNLOCK(cl->outputMutex);
+  return result;
+}
+
+void
+rfbOutQueueCork(rfbClientPtr cl, rfbBool corked)
+{
+  rfbOutQueue *q = (rfbOutQueue *)cl->outputQueue;
+
+  LOCK(cl->outputMutex);
+  q->corked = corked;
+  UNLOCK(cl->outputMutex);
+}
+
+/*
+ * Write out the queue, unless it is corked and not too full yet (and the
+ * flush is not forced).  Returns like rfbWriteExact().  On error the queue
+ * is emptied, as the connection is going to be closed anyway.
+ *
+ * Only what the socket takes right now is written, and the rest is left for
+ * rfbCheckFds().
+ */
+
+int
+rfbOutQueueFlush(rfbClientPtr cl, rfbBool force)
+{
+  rfbOutQueue *q = (rfbOutQueue *)cl->outputQueue;
+  rfbBool blocking = Blocking(cl);
+  int n, i, result = 1;
+
+  LOCK(cl->outputMutex);
+  if (!force && q->corked && q->blockBytes < OUT_QUEUE_MAX_BYTES
+      && q->numSegments < OUT_QUEUE_MAX_IOV) {
+    UNLOCK(cl->outputMutex);
+    return 1;
+  }
+
+  while (q->numSegments > 0) {
+    n = q->numSegments;
+    if (n > OUT_QUEUE_MAX_IOV)
+      n = OUT_QUEUE_MAX_IOV;
+    for (i = 0; i < n; i++) {
+      q->iov[i].iov_base = (char *)q->segments[i].data;
+      q->iov[i].iov_len = q->segments[i].len;
+    }
+    if (blocking) {
+      result = rfbWriteExactVLocked(cl, q->iov, n);
+      if (result > 0) {
+	RemoveSegments(q, n);
+	continue;
+      }
+    } else {
+      n = rfbWriteVNonBlocking(cl, q->iov, n);
+      if (n > 0) {
+	ConsumeBytes(q, n);
+	gettimeofday(&q->lastProgress, NULL);
+	continue;
+      }
+      if (n == 0)
+	break;
+      result = -1;
+    }
+    RemoveSegments(q, q->numSegments);
+    break;
+  }
+
+  if (q->numSegments == 0) {
+    q->waiting = FALSE;
+  } else if (!DetachSegments(q)) {
+    rfbErr("rfbOutQueueFlush: out of memory\n");
+    RemoveSegments(q, q->numSegments);
+    errno = ENOMEM;
+    result = -1;
+  } else if (q->queuedBytes > BacklogLimit(cl)) {
+    rfbErr("rfbOutQueueFlush: client backlog of %d bytes is too large\n",
+	   q->queuedBytes);
+    RemoveSegments(q, q->numSegments);
+    errno = ENOBUFS;
+    result = -1;
+  } else if (!q->waiting) {
+    q->waiting = TRUE;
+    gettimeofday(&q->lastProgress, NULL);
+  }
+  UNLOCK(cl->outputMutex);
+  return result;
+}
+
+/*
+ * Returns the number of bytes waiting to be written to the client.
+ */
+
+int
+rfbOutQueuePending(rfbClientPtr cl)
+{
+  rfbOutQueue *q = (rfbOutQueue *)cl->outputQueue;
+  int result;
+
+  if (!q)
+    return 0;
+  LOCK(cl->outputMutex);
+  result = q->queuedBytes;
+  UNLOCK(cl->outputMutex);
+  return result;
+}
+
+/*
+ * Returns TRUE if data has been waiting for the client for more than
+ * rfbMaxClientWait ms without any of it being written.
+ */
+
+rfbBool
+rfbOutQueueStalled(rfbClientPtr cl)
+{
+  rfbOutQueue *q = (rfbOutQueue *)cl->outputQueue;
+  struct timeval now;
+  rfbBool result = FALSE;
+
+  if (!q)
+    return FALSE;
+  LOCK(cl->outputMutex);
+  if (q->waiting) {
+    gettimeofday(&now, NULL);
+    result = (now.tv_sec - q->lastProgress.tv_sec) * 1000
+      + (now.tv_usec - q->lastProgress.tv_usec) / 1000 >= rfbMaxClientWait;
+  }
+  UNLOCK(cl->outputMutex);
+  return result;
+}
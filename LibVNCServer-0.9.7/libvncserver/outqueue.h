@@ -0,0 +1,110 @@
+/*
+ * outqueue.h - per-client output queue.
+ */
+
+/*
+ *  This is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This software is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this software; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307,
+ *  USA.
+ */
+
+#ifndef RFB_OUTQUEUE_H
+#define RFB_OUTQUEUE_H
+
+#include <rfb/rfb.h>
+
+#ifdef WIN32
+struct iovec {
+  void *iov_base;
+  size_t iov_len;
+};
+#else
+#include <sys/uio.h>
+#endif
+
+/*
+ * Everything sent to a client goes through a queue of segments which is
+ * written out with writev().  A segment refers either to part of a block,
+ * the memory cl->updateBuf points into, or to memory owned by someone else
+ * (frame buffer rows, an encoder's output buffer), which must then stay
+ * valid until the queue has been flushed.
+ *
+ * Blocks are reference counted: the client holds a reference on the block
+ * it is encoding into, and each segment holds one on its block.
+ * rfbOutQueueUpdateBuf() hands the contents of updateBuf over to the queue
+ * and moves updateBuf on to a free block, so nothing is copied.
+ *
+ * While the queue is corked (during a framebuffer update) flushing is put
+ * off until a fair amount of data is waiting, so that an update normally
+ * leaves in one or a few system calls.  The queue is protected by
+ * cl->outputMutex.
+ *
+ * A flush never blocks: what the socket does not take stays queued
+ * (borrowed data is copied into blocks first) and is written by
+ * rfbCheckFds(), or a worker thread, once the socket becomes writable.  No
+ * new framebuffer update is started while anything is queued, so damage
+ * keeps accumulating in modifiedRegion and a slow client gets one merged
+ * update later instead of a backlog of stale ones.  The same goes while
+ * the kernel holds more than rfbMaxClientUnsent bytes not sent yet, which
+ * is also what the socket's TCP_NOTSENT_LOWAT is set to, so that it only
+ * becomes writable again once that has drained.  A client whose backlog
+ * grows beyond rfbMaxClientBacklog, or which takes nothing for
+ * rfbMaxClientWait ms, is disconnected.
+ */
+
+typedef struct rfbOutBlock {
+  struct rfbOutBlock *next;	/* in the free list */
+  int refCount;
+  char data[UPDATE_BUF_SIZE];
+} rfbOutBlock;
+
+typedef struct {
+  const char *data;
+  int len;
+  rfbOutBlock *block;		/* NULL if the data is not ours */
+} rfbOutSegment;
+
+typedef struct {
+  rfbOutSegment *segments;
+  int numSegments, maxSegments;
+  int blockBytes;		/* bytes queued from blocks */
+  int queuedBytes;		/* all bytes queued */
+  rfbBool corked;
+
+  rfbBool waiting;		/* for the socket to become writable */
+  struct timeval lastProgress;	/* when data was last written */
+
+  rfbOutBlock *current;		/* the block cl->updateBuf points into */
+  rfbOutBlock *freeBlocks;
+  int numFreeBlocks;
+
+  struct iovec *iov;
+} rfbOutQueue;
+
+/* from outqueue.c */
+extern rfbBool rfbOutQueueInit(rfbClientPtr cl);
+extern void rfbOutQueueFree(rfbClientPtr cl);
+extern rfbBool rfbOutQueueUpdateBuf(rfbClientPtr cl);
+extern rfbBool rfbOutQueueData(rfbClientPtr cl, const char *data, int len);
+extern void rfbOutQueueCork(rfbClientPtr cl, rfbBool corked);
+extern int rfbOutQueueFlush(rfbClientPtr cl, rfbBool force);
+extern int rfbOutQueuePending(rfbClientPtr cl);
+extern rfbBool rfbOutQueueStalled(rfbClientPtr cl);
+
+/* from sockets.c */
+extern int rfbWriteExactVLocked(rfbClientPtr cl, struct iovec *iov, int iovcnt);
+extern int rfbWriteVNonBlocking(rfbClientPtr cl, struct iovec *iov, int iovcnt);
+extern int rfbSocketUnsent(int sock);
+
+#endif
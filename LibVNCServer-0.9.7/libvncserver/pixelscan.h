@@ -0,0 +1,100 @@
+/*
+ * pixelscan.h
+ *
+ * Pixel run scanning kernels shared by the Tight and Hextile encoders.
+ */
+
+/*
+ *  This is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This software is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this software; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307,
+ *  USA.
+ */
+
+#ifndef PIXELSCAN_H
+#define PIXELSCAN_H
+
+#include <rfb/rfb.h>
+
+/*
+ * The kernels below look at PIXEL_SCAN_BLOCK pixels at a time with a
+ * fixed trip count and no branches inside the block, which lets the
+ * compiler turn each block into a few vector compares on targets that
+ * have them (SSE2, NEON) and into straight-line code elsewhere. Only the
+ * block holding the first mismatch, and the tail, are scanned pixel by
+ * pixel, so the results are exactly those of the plain loops.
+ *
+ * Define the functions for a given pixel size with
+ * DEFINE_PIXEL_SCAN_FUNCTIONS(bpp) in the file using them:
+ *
+ *   PixelRunLength##bpp(data, count, c)
+ *     returns the number of leading pixels equal to c.
+ *
+ *   PixelTwoColourRun##bpp(data, count, c0, c1, &n0)
+ *     returns the number of leading pixels equal to c0 or c1, and adds
+ *     the number of those equal to c0 to n0.
+ */
+
+#define PIXEL_SCAN_BLOCK 8
+
+#define DEFINE_PIXEL_SCAN_FUNCTIONS(bpp)                                \
+                                                                        \
+static int                                                              \
+PixelRunLength##bpp(const uint##bpp##_t *data, int count,               \
+                    uint##bpp##_t c)                                    \
+{                                                                       \
+    int i = 0, k;                                                       \
+    uint##bpp##_t diff;                                                 \
+                                                                        \
+    while (i + PIXEL_SCAN_BLOCK <= count) {                             \
+        diff = 0;                                                       \
+        for (k = 0; k < PIXEL_SCAN_BLOCK; k++)                          \
+            diff |= data[i + k] ^ c;                                    \
+        if (diff)                                                       \
+            break;                                                      \
+        i += PIXEL_SCAN_BLOCK;                                          \
+    }                                                                   \
+    while (i < count && data[i] == c)                                   \
+        i++;                                                            \
+    return i;                                                           \
+}                                                                       \
+                                                                        \
+static int                                                              \
+PixelTwoColourRun##bpp(const uint##bpp##_t *data, int count,            \
+                       uint##bpp##_t c0, uint##bpp##_t c1, int *n0)     \
+{                                                                       \
+    int i = 0, k, n = 0, inBlock, ok;                                   \
+                                                                        \
+    while (i + PIXEL_SCAN_BLOCK <= count) {                             \
+        ok = 1;                                                         \
+        inBlock = 0;                                                    \
+        for (k = 0; k < PIXEL_SCAN_BLOCK; k++) {                        \
+            ok &= (data[i + k] == c0) | (data[i + k] == c1);            \
+            inBlock += (data[i + k] == c0);                             \
+        }                                                               \
+        if (!ok)                                                        \
+            break;                                                      \
+        n += inBlock;                                                   \
+        i += PIXEL_SCAN_BLOCK;                                          \
+    }                                                                   \
+    for (; i < count; i++) {                                            \
+        if (data[i] == c0)                                              \
+            n++;                                                        \
+        else if (data[i] != c1)                                         \
+            break;                                                      \
+    }                                                                   \
+    *n0 += n;                                                           \
+    return i;                                                           \
+}
+
+#endif
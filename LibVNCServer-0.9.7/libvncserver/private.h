@@ -1,44 +1,122 @@
 #ifndef RFB_PRIVATE_H
 #define RFB_PRIVATE_H
 
+/* from adaptive.c */
+
+extern void rfbAdaptSetEncodings(rfbClientPtr cl);
+extern int rfbAdaptUpdateDelay(rfbClientPtr cl);
+extern void rfbAdaptUpdateStart(rfbClientPtr cl);
+extern void rfbAdaptUpdateSent(rfbClientPtr cl);
+extern void rfbAdaptUpdateDelivered(rfbClientPtr cl);
+extern void rfbAdaptCleanup(rfbClientPtr cl);
+extern void rfbAdaptRectEncoded(rfbClientPtr cl, struct timeval* start);
+extern void rfbAdaptInitScreen(rfbScreenInfoPtr screen);
+extern void rfbAdaptCleanupScreen(rfbScreenInfoPtr screen);
+
 /* from cursor.c */
 
 void rfbShowCursor(rfbClientPtr cl);
 void rfbHideCursor(rfbClientPtr cl);
 void rfbRedrawAfterHideCursor(rfbClientPtr cl,sraRegionPtr updateRegion);
 
+/* from damage.c */
+
+extern void rfbDamageInitScreen(rfbScreenInfoPtr screen);
+extern void rfbDamageCleanupScreen(rfbScreenInfoPtr screen);
+extern void rfbDamageResizeScreen(rfbScreenInfoPtr screen);
+extern void rfbDamageInitClient(rfbClientPtr cl);
+extern void rfbDamageCleanupClient(rfbClientPtr cl);
+extern unsigned long rfbDamageMark(rfbScreenInfoPtr screen, sraRegionPtr region);
+
+/* the numbers of changes read and written without the journal's mutex */
+#if defined(__ATOMIC_ACQUIRE) && defined(LIBVNCSERVER_HAVE_LIBPTHREAD)
+#define DAMAGE_SEQ_LOAD(p) __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define DAMAGE_SEQ_STORE(p, v) __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+#else
+#define DAMAGE_SEQ_LOAD(p) (*(volatile unsigned long*)(p))
+#define DAMAGE_SEQ_STORE(p, v) (*(volatile unsigned long*)(p) = (v))
+#endif
+
 /* from main.c */
 
 rfbClientPtr rfbClientIteratorHead(rfbClientIteratorPtr i);
 
+/* from rectmerge.c */
+
+extern void rfbMergeUpdateRects(rfbClientPtr cl, sraRegionPtr region);
+
+/* from rfbserver.c */
+
+extern rfbBool rfbSendUpdateBufWithData(rfbClientPtr cl, const char *data, int len);
+extern rfbClientIteratorPtr rfbGetClientIteratorWithClosed(rfbScreenInfoPtr rfbScreen);
+
 /* from tight.c */
 
 #ifdef LIBVNCSERVER_HAVE_LIBZ
 #ifdef LIBVNCSERVER_HAVE_LIBJPEG
-extern void rfbTightCleanup(rfbScreenInfoPtr screen);
+extern void rfbFreeTightData(rfbClientPtr cl);
 #endif
 
-/* from zlib.c */
-extern void rfbZlibCleanup(rfbScreenInfoPtr screen);
-
 /* from zrle.c */
 void rfbFreeZrleData(rfbClientPtr cl);
+void rfbZrleCleanup(rfbScreenInfoPtr screen);
 
 #endif
 
 
 /* from ultra.c */
 
-extern void rfbUltraCleanup(rfbScreenInfoPtr screen);
 extern void rfbFreeUltraData(rfbClientPtr cl);
 
-/* from rre.c */
+/* from sockets.c */
+
+extern void rfbEpollAdd(rfbScreenInfoPtr rfbScreen, int sock, void *data, rfbBool client);
+extern void rfbEpollDel(rfbScreenInfoPtr rfbScreen, int sock);
+extern void rfbServiceClient(rfbClientPtr cl, rfbBool input, rfbBool output);
+
+/* whether sock can be put into an fd_set */
+#ifdef WIN32
+#define FD_SETTABLE(sock) TRUE
+#else
+#define FD_SETTABLE(sock) ((sock) >= 0 && (sock) < FD_SETSIZE)
+#endif
+
+/* from stats.c */
+
+extern void rfbFreeStats(rfbClientPtr cl);
+
+/* from log.c */
+
+extern void rfbLogInit(void);
 
-extern void rfbRRECleanup(rfbScreenInfoPtr screen);
+/* from trace.c */
 
-/* from corre.c */
+extern void rfbTraceInitServer(rfbScreenInfoPtr rfbScreen);
+extern void rfbTraceCheckDump(rfbScreenInfoPtr rfbScreen);
 
-extern void rfbCoRRECleanup(rfbScreenInfoPtr screen);
+/* from workers.c */
+
+/* what rfbScheduleClient() can have a worker thread do for a client */
+#define RFB_TASK_INPUT   1	/* process its messages */
+#define RFB_TASK_OUTPUT  2	/* write its queued output */
+#define RFB_TASK_UPDATE  4	/* send a framebuffer update, if due */
+#define RFB_TASK_POINTER 8	/* pass on a deferred pointer event */
+
+/* whether cl is served by worker threads */
+#ifdef LIBVNCSERVER_HAVE_LIBPTHREAD
+#define CLIENT_HAS_WORKERS(cl) ((cl)->workerData != NULL)
+#else
+#define CLIENT_HAS_WORKERS(cl) FALSE
+#endif
+
+#ifdef LIBVNCSERVER_HAVE_LIBPTHREAD
+extern rfbBool rfbStartWorkers(rfbScreenInfoPtr screen);
+#endif
+extern void rfbStopWorkers(rfbScreenInfoPtr screen);
+extern void rfbWorkersAddClient(rfbClientPtr cl);
+extern rfbBool rfbScheduleClient(rfbClientPtr cl, int tasks, int delay);
+extern void rfbScheduleUpdate(rfbClientPtr cl);
+extern rfbBool rfbClientScheduled(rfbClientPtr cl);
 
 #endif
 
@@ -0,0 +1,229 @@
+/*
+ * rectmerge.c - send nearby rectangles of an update as one when that
+ * costs less.
+ */
+
+/*
+ *  This is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This software is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this software; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307,
+ *  USA.
+ */
+
+/*
+ * Every rectangle of an update costs its header and whatever the encoder
+ * spends to start on it (a zlib flush, a palette), besides its
+ * pixels.  With screen->mergeRects set, rfbMergeUpdateRects() estimates
+ * both for the client's encoding, and sends two rectangles as one
+ * whenever the pixels between them cost less than the rectangles saved.
+ *
+ * The region is taken band by band, the way sraRegion keeps it: first
+ * the spans of a band are joined across small gaps, then a band is
+ * joined with the next one if covering both with the union of their
+ * spans is cheaper.  So the result is a region again, and the encoders
+ * never see overlapping rectangles.
+ */
+
+#include <rfb/rfb.h>
+#include <rfb/rfbregion.h>
+#include "private.h"
+
+typedef struct {
+	int encoding;
+	int rectCost;	/* bytes per rectangle, including encoder setup */
+	int pixelCost;	/* 16ths of a byte per byte of raw pixel data */
+} MergeCost;
+
+/*
+ * What a pixel costs is a guess at the unchanged screen between two
+ * changes, which is mostly background: cheap for encoders which find
+ * solid areas, as much as raw for raw.
+ */
+static const MergeCost mergeCosts[] = {
+	{ rfbEncodingRaw,      12, 16 },
+	{ rfbEncodingRRE,      20,  8 },
+	{ rfbEncodingCoRRE,    20,  8 },
+	{ rfbEncodingHextile,  12,  4 },
+	{ rfbEncodingUltra,    32,  6 },
+#ifdef LIBVNCSERVER_HAVE_LIBZ
+	{ rfbEncodingZlib,     48,  3 },
+	{ rfbEncodingZRLE,     40,  2 },
+	{ rfbEncodingZYWRLE,   40,  2 },
+#ifdef LIBVNCSERVER_HAVE_LIBJPEG
+	{ rfbEncodingTight,    32,  2 },
+#endif
+#endif
+};
+
+static void
+GetCosts(rfbClientPtr cl, long* rectCost, long* pixelCost)
+{
+	int i, encoding = cl->preferredEncoding == -1 ?
+		rfbEncodingRaw : cl->preferredEncoding;
+
+	*rectCost = 12;
+	*pixelCost = 16;
+	for (i = 0; i < (int)(sizeof(mergeCosts)/sizeof(mergeCosts[0])); i++)
+		if (mergeCosts[i].encoding == encoding) {
+			*rectCost = mergeCosts[i].rectCost;
+			*pixelCost = mergeCosts[i].pixelCost;
+		}
+	*rectCost *= 16;
+	*pixelCost *= cl->format.bitsPerPixel / 8;
+}
+
+static long
+SpanWidth(const int* xs, int n)
+{
+	long w = 0;
+	int i;
+
+	for (i = 0; i < n; i++)
+		w += xs[2 * i + 1] - xs[2 * i];
+	return w;
+}
+
+/* joins spans across gaps which cost less than a rectangle at this height */
+static int
+JoinSpans(int* xs, int n, int height, long rectCost, long pixelCost)
+{
+	int i, m = 0;
+
+	for (i = 1; i < n; i++) {
+		long gap = xs[2 * i] - xs[2 * m + 1];
+		if (gap * height * pixelCost < rectCost)
+			xs[2 * m + 1] = xs[2 * i + 1];
+		else {
+			m++;
+			xs[2 * m] = xs[2 * i];
+			xs[2 * m + 1] = xs[2 * i + 1];
+		}
+	}
+	return n ? m + 1 : 0;
+}
+
+/* out gets the union of the sorted spans a and b, and has room for na+nb */
+static int
+UnionSpans(const int* a, int na, const int* b, int nb, int* out)
+{
+	int ia = 0, ib = 0, n = 0;
+
+	while (ia < na || ib < nb) {
+		const int* s;
+		if (ib >= nb || (ia < na && a[2 * ia] <= b[2 * ib]))
+			s = &a[2 * ia++];
+		else
+			s = &b[2 * ib++];
+		if (n && s[0] <= out[2 * n - 1]) {
+			if (s[1] > out[2 * n - 1])
+				out[2 * n - 1] = s[1];
+		} else {
+			out[2 * n] = s[0];
+			out[2 * n + 1] = s[1];
+			n++;
+		}
+	}
+	return n;
+}
+
+void
+rfbMergeUpdateRects(rfbClientPtr cl, sraRegionPtr region)
+{
+	unsigned long count = sraRgnCountRects(region);
+	int *spans, *cur, *next, *joined, *tmp, nCur = 0, nNext, nJoined;
+	int curY1 = 0, curY2 = 0, nOut = 0, i;
+	long rectCost, pixelCost;
+	sraRectangleIterator* iter;
+	sraRect* out;
+	sraRect rect;
+	rfbBool more;
+
+	if (count < 2)
+		return;
+	GetCosts(cl, &rectCost, &pixelCost);
+
+	spans = (int*)malloc(3 * 2 * count * sizeof(int));
+	out = (sraRect*)malloc(count * sizeof(sraRect));
+	if (!spans || !out) {
+		free(spans);
+		free(out);
+		return;
+	}
+	cur = spans;
+	next = cur + 2 * count;
+	joined = next + 2 * count;
+
+	iter = sraRgnGetIterator(region);
+	more = sraRgnIteratorNext(iter, &rect);
+	while (more) {
+		/* the next band of the region */
+		int y1 = rect.y1, y2 = rect.y2;
+		nNext = 0;
+		do {
+			next[2 * nNext] = rect.x1;
+			next[2 * nNext + 1] = rect.x2;
+			nNext++;
+			more = sraRgnIteratorNext(iter, &rect);
+		} while (more && rect.y1 == y1);
+		nNext = JoinSpans(next, nNext, y2 - y1, rectCost, pixelCost);
+
+		if (nCur) {
+			/* would one band from curY1 to y2 cost less? */
+			long extra, saved;
+			nJoined = UnionSpans(cur, nCur, next, nNext, joined);
+			nJoined = JoinSpans(joined, nJoined, y2 - curY1, rectCost, pixelCost);
+			extra = SpanWidth(joined, nJoined) * (y2 - curY1)
+				- SpanWidth(cur, nCur) * (curY2 - curY1)
+				- SpanWidth(next, nNext) * (y2 - y1);
+			saved = nCur + nNext - nJoined;
+			if (extra * pixelCost < saved * rectCost) {
+				tmp = cur; cur = joined; joined = tmp;
+				nCur = nJoined;
+				curY2 = y2;
+				continue;
+			}
+			for (i = 0; i < nCur; i++) {
+				out[nOut].x1 = cur[2 * i];
+				out[nOut].x2 = cur[2 * i + 1];
+				out[nOut].y1 = curY1;
+				out[nOut].y2 = curY2;
+				nOut++;
+			}
+		}
+		tmp = cur; cur = next; next = tmp;
+		nCur = nNext;
+		curY1 = y1;
+		curY2 = y2;
+	}
+	sraRgnReleaseIterator(iter);
+	for (i = 0; i < nCur; i++) {
+		out[nOut].x1 = cur[2 * i];
+		out[nOut].x2 = cur[2 * i + 1];
+		out[nOut].y1 = curY1;
+		out[nOut].y2 = curY2;
+		nOut++;
+	}
+
+	if ((unsigned long)nOut < count) {
+		sraRgnMakeEmpty(region);
+		for (i = 0; i < nOut; i++) {
+			sraRegionPtr r = sraRgnCreateRect(out[i].x1, out[i].y1,
+							  out[i].x2, out[i].y2);
+			sraRgnOr(region, r);
+			sraRgnDestroy(r);
+		}
+	}
+
+	free(spans);
+	free(out);
+}
@@ -0,0 +1,612 @@
+/* -=- rfbbandregion.c
+ *
+ * The same regions as rfbregion.c, kept the way pixman keeps them: the
+ * y-bands of a region in one sorted array, and the x-spans of all bands
+ * in another.  A set operation merges the bands of the other region into
+ * those it overlaps, the number of rectangles and the bounding box are
+ * always at hand, and a region of thousands of small rectangles costs two
+ * blocks of memory instead of thousands.
+ *
+ * The functions are called sraBandRgn*; build with
+ * -DLIBVNCSERVER_BANDED_REGIONS to have every sraRgn* call use them.
+ */
+
+#include <limits.h>
+#include <rfb/rfb.h>
+#define SRA_LIST_REGIONS
+#include <rfb/rfbregion.h>
+
+typedef struct sraBand {
+  int y1, y2;
+  int first, count;	/* its spans are xs[2*first] .. xs[2*(first+count)-1] */
+} sraBand;
+
+typedef struct sraBandRegion {
+  sraBand *bands;
+  int nBands, maxBands;
+  int *xs;		/* x1, x2 of each span */
+  int nSpans, maxSpans;	/* spans in use, including gaps */
+  unsigned long nRects;
+  sraRect extents;	/* only valid if nRects > 0 */
+  sraBand *fixedBands;	/* storage which is not from malloc() */
+  int *fixedXs;
+  sraBand band1;	/* a single rectangle needs no more memory */
+  int xs1[2];
+} sraBandRegion;
+
+typedef struct sraBandIterator {
+  sraRectangleIterator common;	/* only reverseX and reverseY are used */
+  const sraBandRegion *rgn;
+  int band, span;
+} sraBandIterator;
+
+#define SRA_OR 0
+#define SRA_AND 1
+#define SRA_SUBTRACT 2
+
+/* -=- Storage */
+
+/* bands and xs have room for maxBands and maxSpans to start with */
+static void
+sraBandInit(sraBandRegion *r, sraBand *bands, int maxBands, int *xs, int maxSpans) {
+  memset(r, 0, sizeof(*r));
+  r->bands = r->fixedBands = bands ? bands : &r->band1;
+  r->maxBands = bands ? maxBands : 1;
+  r->xs = r->fixedXs = xs ? xs : r->xs1;
+  r->maxSpans = xs ? maxSpans : 1;
+}
+
+static void
+sraBandFree(sraBandRegion *r) {
+  if (r->bands != r->fixedBands)
+    free(r->bands);
+  if (r->xs != r->fixedXs)
+    free(r->xs);
+}
+
+static rfbBool
+sraBandReserve(sraBandRegion *r, int bands, int spans) {
+  if (r->nBands + bands > r->maxBands) {
+    int size = r->maxBands * 2;
+    sraBand *b;
+    if (size < r->nBands + bands)
+      size = r->nBands + bands;
+    if (size < 8)
+      size = 8;
+    if (r->bands == r->fixedBands) {
+      b = (sraBand*)malloc(size * sizeof(sraBand));
+      if (b)
+	memcpy(b, r->bands, r->nBands * sizeof(sraBand));
+    } else
+      b = (sraBand*)realloc(r->bands, size * sizeof(sraBand));
+    if (!b)
+      return FALSE;
+    r->bands = b;
+    r->maxBands = size;
+  }
+  if (r->nSpans + spans > r->maxSpans) {
+    int size = r->maxSpans * 2;
+    int *xs;
+    if (size < r->nSpans + spans)
+      size = r->nSpans + spans;
+    if (size < 16)
+      size = 16;
+    if (r->xs == r->fixedXs) {
+      xs = (int*)malloc(size * 2 * sizeof(int));
+      if (xs)
+	memcpy(xs, r->xs, r->nSpans * 2 * sizeof(int));
+    } else
+      xs = (int*)realloc(r->xs, size * 2 * sizeof(int));
+    if (!xs)
+      return FALSE;
+    r->xs = xs;
+    r->maxSpans = size;
+  }
+  return TRUE;
+}
+
+static void
+sraBandExtents(sraBandRegion *r) {
+  int i;
+
+  if (r->nRects == 0)
+    return;
+  r->extents.y1 = r->bands[0].y1;
+  r->extents.y2 = r->bands[r->nBands - 1].y2;
+  r->extents.x1 = INT_MAX;
+  r->extents.x2 = INT_MIN;
+  for (i = 0; i < r->nBands; i++) {
+    const sraBand *b = &r->bands[i];
+    if (r->xs[2 * b->first] < r->extents.x1)
+      r->extents.x1 = r->xs[2 * b->first];
+    if (r->xs[2 * (b->first + b->count) - 1] > r->extents.x2)
+      r->extents.x2 = r->xs[2 * (b->first + b->count) - 1];
+  }
+}
+
+/*
+ * Adds the n spans already written at xs[2*nSpans] as a band from y1 to
+ * y2, or makes the last band taller if it has the same spans and ends at
+ * y1.  The caller has reserved room for the band.
+ */
+static void
+sraBandCommit(sraBandRegion *r, int y1, int y2, int n) {
+  sraBand *last = r->nBands ? &r->bands[r->nBands - 1] : NULL;
+  const int *spans = r->xs + 2 * r->nSpans;
+
+  if (n == 0)
+    return;
+  if (last && last->y2 == y1 && last->count == n &&
+      !memcmp(r->xs + 2 * last->first, spans, 2 * n * sizeof(int))) {
+    last->y2 = y2;
+    return;
+  }
+  last = &r->bands[r->nBands++];
+  last->y1 = y1;
+  last->y2 = y2;
+  last->first = r->nSpans;
+  last->count = n;
+  r->nSpans += n;
+  r->nRects += n;
+}
+
+static rfbBool
+sraBandAppend(sraBandRegion *r, int y1, int y2, const int *xs, int n) {
+  if (!sraBandReserve(r, 1, n))
+    return FALSE;
+  memcpy(r->xs + 2 * r->nSpans, xs, 2 * n * sizeof(int));
+  sraBandCommit(r, y1, y2, n);
+  return TRUE;
+}
+
+static void
+sraBandCopy(sraBandRegion *dst, const sraBandRegion *src) {
+  int i;
+
+  dst->nBands = dst->nSpans = 0;
+  dst->nRects = 0;
+  if (!sraBandReserve(dst, src->nBands, src->nSpans))
+    return;
+  for (i = 0; i < src->nBands; i++) {
+    const sraBand *b = &src->bands[i];
+    if (!sraBandAppend(dst, b->y1, b->y2, src->xs + 2 * b->first, b->count))
+      break;
+  }
+  dst->extents = src->extents;
+}
+
+/* -=- Set operations */
+
+/*
+ * Combines two sorted lists of spans, which neither overlap nor touch, into
+ * out, which has room for na+nb spans.  Returns the number of spans in out;
+ * they do not touch either.
+ */
+static int
+sraBandSpanOp(int op, const int *a, int na, const int *b, int nb, int *out) {
+  int ea = 0, eb = 0, n = 0;
+  rfbBool inA = FALSE, inB = FALSE, in = FALSE, now;
+
+  na *= 2;
+  nb *= 2;
+  while (ea < na || eb < nb) {
+    int x = (eb >= nb || (ea < na && a[ea] <= b[eb])) ? a[ea] : b[eb];
+
+    while (ea < na && a[ea] == x)
+      inA = !(ea++ & 1);
+    while (eb < nb && b[eb] == x)
+      inB = !(eb++ & 1);
+
+    if (op == SRA_OR)
+      now = inA || inB;
+    else if (op == SRA_AND)
+      now = inA && inB;
+    else
+      now = inA && !inB;
+    if (now != in) {
+      out[n++] = x;
+      in = now;
+    }
+  }
+  return n / 2;
+}
+
+static rfbBool
+sraBandOverlap(const sraBandRegion *a, const sraBandRegion *b) {
+  return a->extents.x1 < b->extents.x2 && b->extents.x1 < a->extents.x2 &&
+    a->extents.y1 < b->extents.y2 && b->extents.y1 < a->extents.y2;
+}
+
+static rfbBool
+sraBandContains(const sraBandRegion *r, const sraRect *e) {
+  return r->nRects == 1 &&
+    r->extents.x1 <= e->x1 && r->extents.x2 >= e->x2 &&
+    r->extents.y1 <= e->y1 && r->extents.y2 >= e->y2;
+}
+
+/*
+ * Puts the bands of mid in place of bands lo to hi-1 of dst, moving the
+ * bands and spans after them.
+ */
+static rfbBool
+sraBandSplice(sraBandRegion *dst, int lo, int hi, const sraBandRegion *mid) {
+  int s0 = lo < dst->nBands ? dst->bands[lo].first : dst->nSpans;
+  int s1 = hi < dst->nBands ? dst->bands[hi].first : dst->nSpans;
+  int dSpans = mid->nSpans - (s1 - s0), dBands = mid->nBands - (hi - lo), i;
+  unsigned long removed = 0;
+
+  if (!sraBandReserve(dst, dBands > 0 ? dBands : 0, dSpans > 0 ? dSpans : 0))
+    return FALSE;
+  for (i = lo; i < hi; i++)
+    removed += dst->bands[i].count;
+
+  memmove(dst->xs + 2 * (s0 + mid->nSpans), dst->xs + 2 * s1,
+	  2 * (dst->nSpans - s1) * sizeof(int));
+  memcpy(dst->xs + 2 * s0, mid->xs, 2 * mid->nSpans * sizeof(int));
+  memmove(dst->bands + lo + mid->nBands, dst->bands + hi,
+	  (dst->nBands - hi) * sizeof(sraBand));
+  for (i = 0; i < mid->nBands; i++) {
+    dst->bands[lo + i] = mid->bands[i];
+    dst->bands[lo + i].first += s0;
+  }
+  dst->nBands += dBands;
+  for (i = lo + mid->nBands; i < dst->nBands; i++)
+    dst->bands[i].first += dSpans;
+  dst->nSpans += dSpans;
+  dst->nRects = dst->nRects - removed + mid->nRects;
+  return TRUE;
+}
+
+/*
+ * Makes band i-1 taller instead of band i if they have the same spans;
+ * the spans of band i are left as a gap.
+ */
+static void
+sraBandCoalesce(sraBandRegion *r, int i) {
+  sraBand *a, *b;
+
+  if (i <= 0 || i >= r->nBands)
+    return;
+  a = &r->bands[i - 1];
+  b = &r->bands[i];
+  if (a->y2 != b->y1 || a->count != b->count ||
+      memcmp(r->xs + 2 * a->first, r->xs + 2 * b->first, 2 * a->count * sizeof(int)))
+    return;
+  a->y2 = b->y2;
+  r->nRects -= b->count;
+  memmove(b, b + 1, (r->nBands - i - 1) * sizeof(sraBand));
+  r->nBands--;
+}
+
+/* closes the gaps left in xs */
+static void
+sraBandCompact(sraBandRegion *r) {
+  int i, n = 0;
+
+  for (i = 0; i < r->nBands; i++) {
+    sraBand *b = &r->bands[i];
+    if (b->first != n)
+      memmove(r->xs + 2 * n, r->xs + 2 * b->first, 2 * b->count * sizeof(int));
+    b->first = n;
+    n += b->count;
+  }
+  r->nSpans = n;
+}
+
+/* results up to this size are put together on the stack */
+#define SRA_STACK_BANDS 64
+#define SRA_STACK_SPANS 512
+
+static void
+sraBandOp(sraBandRegion *dst, const sraBandRegion *src, int op) {
+  sraBand bands[SRA_STACK_BANDS];
+  int xs[2 * SRA_STACK_SPANS];
+  sraBandRegion res;
+  int lo, hi, ia, ib = 0, y;
+
+  /* the cases damage tracking runs into most often */
+  if (op == SRA_OR) {
+    if (src->nRects == 0 || src == dst || sraBandContains(dst, &src->extents))
+      return;
+    if (dst->nRects == 0 || sraBandContains(src, &dst->extents)) {
+      sraBandCopy(dst, src);
+      return;
+    }
+    if (src->extents.y1 >= dst->extents.y2) {
+      for (ib = 0; ib < src->nBands; ib++) {
+	const sraBand *b = &src->bands[ib];
+	sraBandAppend(dst, b->y1, b->y2, src->xs + 2 * b->first, b->count);
+      }
+      sraBandExtents(dst);
+      return;
+    }
+  } else {
+    if (dst->nRects == 0)
+      return;
+    if (src->nRects == 0 || !sraBandOverlap(dst, src)) {
+      if (op == SRA_AND)
+	dst->nBands = dst->nSpans = dst->nRects = 0;
+      return;
+    }
+    if (sraBandContains(src, &dst->extents)) {
+      if (op == SRA_SUBTRACT)
+	dst->nBands = dst->nSpans = dst->nRects = 0;
+      return;
+    }
+  }
+
+  /* only AND changes the bands above and below src */
+  lo = 0;
+  hi = dst->nBands;
+  if (op != SRA_AND) {
+    /* the first band which ends below the top of src */
+    while (lo < hi) {
+      int mid = (lo + hi) / 2;
+      if (dst->bands[mid].y2 <= src->extents.y1)
+	lo = mid + 1;
+      else
+	hi = mid;
+    }
+    for (hi = lo; hi < dst->nBands && dst->bands[hi].y1 < src->extents.y2; hi++)
+      ;
+  }
+
+  sraBandInit(&res, bands, SRA_STACK_BANDS, xs, SRA_STACK_SPANS);
+  ia = lo;
+  y = ia < hi && dst->bands[ia].y1 < src->bands[0].y1 ?
+    dst->bands[ia].y1 : src->bands[0].y1;
+  while (ia < hi || ib < src->nBands) {
+    const sraBand *a = ia < hi ? &dst->bands[ia] : NULL;
+    const sraBand *b = ib < src->nBands ? &src->bands[ib] : NULL;
+    rfbBool inA = a && a->y1 <= y, inB = b && b->y1 <= y;
+    int next = INT_MAX, na, nb, n;
+
+    if ((op != SRA_OR && !a) || (op == SRA_AND && !b))
+      break;
+    if (a)
+      next = inA ? a->y2 : a->y1;
+    if (b && (inB ? b->y2 : b->y1) < next)
+      next = inB ? b->y2 : b->y1;
+
+    if (inA || inB) {
+      na = inA ? a->count : 0;
+      nb = inB ? b->count : 0;
+      if (!sraBandReserve(&res, 1, na + nb))
+	break;
+      n = sraBandSpanOp(op, inA ? dst->xs + 2 * a->first : NULL, na,
+			inB ? src->xs + 2 * b->first : NULL, nb,
+			res.xs + 2 * res.nSpans);
+      sraBandCommit(&res, y, next, n);
+    }
+
+    y = next;
+    if (a && a->y2 <= y)
+      ia++;
+    if (b && b->y2 <= y)
+      ib++;
+  }
+
+  sraBandSplice(dst, lo, hi, &res);
+  hi = lo + res.nBands;
+  sraBandFree(&res);
+  if (op != SRA_AND) {
+    sraBandCoalesce(dst, hi);
+    sraBandCoalesce(dst, lo);
+    if (dst->nSpans > 2 * (int)dst->nRects + 64)
+      sraBandCompact(dst);
+  }
+  if (op == SRA_OR) {
+    if (src->extents.x1 < dst->extents.x1)
+      dst->extents.x1 = src->extents.x1;
+    if (src->extents.x2 > dst->extents.x2)
+      dst->extents.x2 = src->extents.x2;
+    dst->extents.y1 = dst->bands[0].y1;
+    dst->extents.y2 = dst->bands[dst->nBands - 1].y2;
+  } else
+    sraBandExtents(dst);
+}
+
+/* -=- Region routines */
+
+sraRegion *
+sraBandRgnCreate(void) {
+  sraBandRegion *r = (sraBandRegion*)malloc(sizeof(sraBandRegion));
+  if (r)
+    sraBandInit(r, NULL, 0, NULL, 0);
+  return (sraRegion*)r;
+}
+
+sraRegion *
+sraBandRgnCreateRect(int x1, int y1, int x2, int y2) {
+  sraBandRegion *r = (sraBandRegion*)sraBandRgnCreate();
+  int xs[2];
+
+  if (!r || x1 >= x2 || y1 >= y2)
+    return (sraRegion*)r;
+  xs[0] = x1;
+  xs[1] = x2;
+  sraBandAppend(r, y1, y2, xs, 1);
+  sraBandExtents(r);
+  return (sraRegion*)r;
+}
+
+sraRegion *
+sraBandRgnCreateRgn(const sraRegion *src) {
+  sraBandRegion *r;
+
+  if (!src)
+    return NULL;
+  r = (sraBandRegion*)sraBandRgnCreate();
+  if (r)
+    sraBandCopy(r, (const sraBandRegion*)src);
+  return (sraRegion*)r;
+}
+
+void
+sraBandRgnDestroy(sraRegion *rgn) {
+  sraBandRegion *r = (sraBandRegion*)rgn;
+
+  if (!r)
+    return;
+  sraBandFree(r);
+  free(r);
+}
+
+void
+sraBandRgnMakeEmpty(sraRegion *rgn) {
+  sraBandRegion *r = (sraBandRegion*)rgn;
+  r->nBands = r->nSpans = 0;
+  r->nRects = 0;
+}
+
+rfbBool
+sraBandRgnAnd(sraRegion *dst, const sraRegion *src) {
+  sraBandOp((sraBandRegion*)dst, (const sraBandRegion*)src, SRA_AND);
+  return ((sraBandRegion*)dst)->nRects != 0;
+}
+
+void
+sraBandRgnOr(sraRegion *dst, const sraRegion *src) {
+  sraBandOp((sraBandRegion*)dst, (const sraBandRegion*)src, SRA_OR);
+}
+
+rfbBool
+sraBandRgnSubtract(sraRegion *dst, const sraRegion *src) {
+  sraBandOp((sraBandRegion*)dst, (const sraBandRegion*)src, SRA_SUBTRACT);
+  return ((sraBandRegion*)dst)->nRects != 0;
+}
+
+void
+sraBandRgnOffset(sraRegion *dst, int dx, int dy) {
+  sraBandRegion *r = (sraBandRegion*)dst;
+  int i, j;
+
+  for (i = 0; i < r->nBands; i++) {
+    sraBand *b = &r->bands[i];
+    b->y1 += dy;
+    b->y2 += dy;
+    for (j = 2 * b->first; j < 2 * (b->first + b->count); j++)
+      r->xs[j] += dx;
+  }
+  r->extents.x1 += dx;
+  r->extents.x2 += dx;
+  r->extents.y1 += dy;
+  r->extents.y2 += dy;
+}
+
+sraRegion *
+sraBandRgnBBox(const sraRegion *src) {
+  const sraBandRegion *r = (const sraBandRegion*)src;
+
+  if (!r || r->nRects == 0)
+    return sraBandRgnCreate();
+  return sraBandRgnCreateRect(r->extents.x1, r->extents.y1,
+			      r->extents.x2, r->extents.y2);
+}
+
+rfbBool
+sraBandRgnPopRect(sraRegion *rgn, sraRect *rect, unsigned long flags) {
+  sraBandRegion *r = (sraBandRegion*)rgn;
+  rfbBool right2left = (flags & 2) == 2;
+  rfbBool bottom2top = (flags & 1) == 1;
+  int i = bottom2top ? r->nBands - 1 : 0, k;
+  sraBand *b;
+
+  if (r->nRects == 0)
+    return FALSE;
+
+  /* leave a gap in xs instead of moving all the spans after it */
+  b = &r->bands[i];
+  k = right2left ? b->first + b->count - 1 : b->first;
+  rect->y1 = b->y1;
+  rect->y2 = b->y2;
+  rect->x1 = r->xs[2 * k];
+  rect->x2 = r->xs[2 * k + 1];
+  if (!right2left)
+    b->first++;
+  b->count--;
+  r->nRects--;
+
+  if (b->count == 0) {
+    memmove(b, b + 1, (r->nBands - i - 1) * sizeof(sraBand));
+    r->nBands--;
+  }
+  sraBandExtents(r);
+  return TRUE;
+}
+
+unsigned long
+sraBandRgnCountRects(const sraRegion *rgn) {
+  return ((const sraBandRegion*)rgn)->nRects;
+}
+
+rfbBool
+sraBandRgnEmpty(const sraRegion *rgn) {
+  return ((const sraBandRegion*)rgn)->nRects == 0;
+}
+
+/* -=- Rectangle iterator */
+
+sraRectangleIterator *
+sraBandRgnGetReverseIterator(sraRegion *s, rfbBool reverseX, rfbBool reverseY) {
+  sraBandIterator *i = (sraBandIterator*)calloc(sizeof(sraBandIterator), 1);
+
+  if (!i)
+    return NULL;
+  i->common.reverseX = reverseX;
+  i->common.reverseY = reverseY;
+  i->rgn = (const sraBandRegion*)s;
+  return &i->common;
+}
+
+sraRectangleIterator *
+sraBandRgnGetIterator(sraRegion *s) {
+  return sraBandRgnGetReverseIterator(s, FALSE, FALSE);
+}
+
+rfbBool
+sraBandRgnIteratorNext(sraRectangleIterator *common, sraRect *r) {
+  sraBandIterator *i = (sraBandIterator*)common;
+  const sraBandRegion *rgn = i->rgn;
+  const sraBand *b;
+  int k;
+
+  if (i->band < rgn->nBands &&
+      i->span >= rgn->bands[common->reverseY ?
+			    rgn->nBands - 1 - i->band : i->band].count) {
+    i->band++;
+    i->span = 0;
+  }
+  if (i->band >= rgn->nBands)
+    return FALSE;
+
+  b = &rgn->bands[common->reverseY ? rgn->nBands - 1 - i->band : i->band];
+  k = b->first + (common->reverseX ? b->count - 1 - i->span : i->span);
+  i->span++;
+  r->x1 = rgn->xs[2 * k];
+  r->x2 = rgn->xs[2 * k + 1];
+  r->y1 = b->y1;
+  r->y2 = b->y2;
+  return TRUE;
+}
+
+void
+sraBandRgnReleaseIterator(sraRectangleIterator *i) {
+  free(i);
+}
+
+void
+sraBandRgnPrint(const sraRegion *rgn) {
+  const sraBandRegion *r = (const sraBandRegion*)rgn;
+  int i, k;
+
+  printf("[");
+  for (i = 0; i < r->nBands; i++) {
+    const sraBand *b = &r->bands[i];
+    printf("(%d-%d)[", b->y1, b->y2);
+    for (k = b->first; k < b->first + b->count; k++)
+      printf("(%d-%d)", r->xs[2 * k], r->xs[2 * k + 1]);
+    printf("]");
+  }
+  printf("]");
+}
@@ -6,6 +6,7 @@
  */
 
 #include <rfb/rfb.h>
+#define SRA_LIST_REGIONS
 #include <rfb/rfbregion.h>
 
 /* -=- Internal Span structure */
@@ -25,6 +26,154 @@ typedef struct sraRegion {
   sraSpan back;
 } sraSpanList;
 
+/* -=- Allocation
+ *
+ * Spans, span lists and iterators hardly outlive an update or a merge of
+ * damage, so freed ones are kept on free lists instead of going back to
+ * free().  Each thread has its own lists, so that taking an item needs no
+ * lock; whatever a thread frees goes onto its own lists, wherever it was
+ * allocated.  A free item keeps the link to the next one in its first
+ * word; a free iterator keeps its sPtrs array.
+ */
+
+#define SRA_SPAN 0
+#define SRA_SPANLIST 1
+#define SRA_ITERATOR 2
+#define SRA_KINDS 3
+
+/* how many free items of each kind a thread keeps */
+#define SRA_POOL_MAX 1024
+
+typedef struct sraPool {
+  void *free[SRA_KINDS];
+  int count[SRA_KINDS];
+  sraAllocStats stats;
+  struct sraPool *next;
+} sraPool;
+
+static sraPool *sraPools = NULL;	/* the pools of all threads */
+static sraAllocStats sraRetired;	/* from threads which have exited */
+
+#ifdef LIBVNCSERVER_HAVE_LIBPTHREAD
+static pthread_once_t sraPoolOnce = PTHREAD_ONCE_INIT;
+static pthread_key_t sraPoolKey;
+static MUTEX(sraPoolMutex);
+
+static void
+sraPoolDestroy(void *arg) {
+  sraPool *pool = (sraPool*)arg, **p;
+  void *item;
+  int kind;
+
+  for (kind = 0; kind < SRA_KINDS; kind++)
+    while ((item = pool->free[kind])) {
+      pool->free[kind] = *(void**)item;
+      if (kind == SRA_ITERATOR)
+	free(((sraRectangleIterator*)item)->sPtrs);
+      free(item);
+    }
+
+  LOCK(sraPoolMutex);
+  for (p = &sraPools; *p; p = &(*p)->next)
+    if (*p == pool) {
+      *p = pool->next;
+      break;
+    }
+  sraRetired.allocs += pool->stats.allocs;
+  sraRetired.mallocs += pool->stats.mallocs;
+  sraRetired.frees += pool->stats.frees;
+  UNLOCK(sraPoolMutex);
+  free(pool);
+}
+
+static void
+sraPoolInit(void) {
+  INIT_MUTEX(sraPoolMutex);
+  pthread_key_create(&sraPoolKey, sraPoolDestroy);
+}
+#else
+static sraPool sraMainPool;
+#endif
+
+static sraPool *
+sraPoolGet(void) {
+#ifdef LIBVNCSERVER_HAVE_LIBPTHREAD
+  sraPool *pool;
+
+  pthread_once(&sraPoolOnce, sraPoolInit);
+  pool = (sraPool*)pthread_getspecific(sraPoolKey);
+  if (pool)
+    return pool;
+  pool = (sraPool*)calloc(sizeof(sraPool), 1);
+  if (!pool)
+    return NULL;
+  pthread_setspecific(sraPoolKey, pool);
+  LOCK(sraPoolMutex);
+  pool->next = sraPools;
+  sraPools = pool;
+  UNLOCK(sraPoolMutex);
+  return pool;
+#else
+  sraPools = &sraMainPool;
+  return &sraMainPool;
+#endif
+}
+
+/* returns a free item, or NULL if the caller has to malloc() one */
+static void *
+sraPoolTake(int kind) {
+  sraPool *pool = sraPoolGet();
+  void *item;
+
+  if (!pool)
+    return NULL;
+  pool->stats.allocs++;
+  item = pool->free[kind];
+  if (!item) {
+    pool->stats.mallocs++;
+    return NULL;
+  }
+  pool->free[kind] = *(void**)item;
+  pool->count[kind]--;
+  return item;
+}
+
+/* returns FALSE if the caller has to free() the item */
+static rfbBool
+sraPoolPut(int kind, void *item) {
+  sraPool *pool = sraPoolGet();
+
+  if (!pool)
+    return FALSE;
+  pool->stats.frees++;
+  if (pool->count[kind] >= SRA_POOL_MAX)
+    return FALSE;
+  *(void**)item = pool->free[kind];
+  pool->free[kind] = item;
+  pool->count[kind]++;
+  return TRUE;
+}
+
+void
+sraGetAllocStats(sraAllocStats *stats) {
+  sraPool *pool;
+  int kind;
+
+#ifdef LIBVNCSERVER_HAVE_LIBPTHREAD
+  pthread_once(&sraPoolOnce, sraPoolInit);
+#endif
+  LOCK(sraPoolMutex);
+  *stats = sraRetired;
+  for (pool = sraPools; pool; pool = pool->next) {
+    stats->allocs += pool->stats.allocs;
+    stats->mallocs += pool->stats.mallocs;
+    stats->frees += pool->stats.frees;
+    for (kind = 0; kind < SRA_KINDS; kind++)
+      stats->pooled += pool->count[kind];
+  }
+  UNLOCK(sraPoolMutex);
+}
+
 /* -=- Span routines */
 
 sraSpanList *sraSpanListDup(const sraSpanList *src);
@@ -32,7 +181,9 @@ void sraSpanListDestroy(sraSpanList *list);
 
 static sraSpan *
 sraSpanCreate(int start, int end, const sraSpanList *subspan) {
-  sraSpan *item = (sraSpan*)malloc(sizeof(sraSpan));
+  sraSpan *item = (sraSpan*)sraPoolTake(SRA_SPAN);
+  if (!item)
+    item = (sraSpan*)malloc(sizeof(sraSpan));
   item->_next = item->_prev = NULL;
   item->start = start;
   item->end = end;
@@ -73,7 +224,8 @@ sraSpanRemove(sraSpan *span) {
 static void
 sraSpanDestroy(sraSpan *span) {
   if (span->subspan) sraSpanListDestroy(span->subspan);
-  free(span);
+  if (!sraPoolPut(SRA_SPAN, span))
+    free(span);
 }
 
 #ifdef DEBUG
@@ -116,7 +268,9 @@ sraSpanPrint(const sraSpan *s) {
 
 static sraSpanList *
 sraSpanListCreate(void) {
-  sraSpanList *item = (sraSpanList*)malloc(sizeof(sraSpanList));
+  sraSpanList *item = (sraSpanList*)sraPoolTake(SRA_SPANLIST);
+  if (!item)
+    item = (sraSpanList*)malloc(sizeof(sraSpanList));
   item->front._next = &(item->back);
   item->front._prev = NULL;
   item->back._prev = &(item->front);
@@ -151,7 +305,8 @@ sraSpanListDestroy(sraSpanList *list) {
     sraSpanDestroy(curr);
     curr = next;
   }
-  free(list);
+  if (!sraPoolPut(SRA_SPANLIST, list))
+    free(list);
 }
 
 static void
@@ -686,20 +841,25 @@ sraRectangleIterator *sraRgnGetIterator(sraRegion *s)
 #define DEFSIZE 4
 #define DEFSTEP 8
   sraRectangleIterator *i =
-    (sraRectangleIterator*)malloc(sizeof(sraRectangleIterator));
-  if(!i)
-    return NULL;
-
-  /* we have to recurse eventually. So, the first sPtr is the pointer to
-     the sraSpan in the first level. the second sPtr is the pointer to
-     the sraRegion.back. The third and fourth sPtr are for the second
-     recursion level and so on. */
-  i->sPtrs = (sraSpan**)malloc(sizeof(sraSpan*)*DEFSIZE);
-  if(!i->sPtrs) {
-    free(i);
-    return NULL;
+    (sraRectangleIterator*)sraPoolTake(SRA_ITERATOR);
+
+  /* a pooled iterator still has its sPtrs array */
+  if(!i) {
+    i = (sraRectangleIterator*)malloc(sizeof(sraRectangleIterator));
+    if(!i)
+      return NULL;
+
+    /* we have to recurse eventually. So, the first sPtr is the pointer to
+       the sraSpan in the first level. the second sPtr is the pointer to
+       the sraRegion.back. The third and fourth sPtr are for the second
+       recursion level and so on. */
+    i->sPtrs = (sraSpan**)malloc(sizeof(sraSpan*)*DEFSIZE);
+    if(!i->sPtrs) {
+      free(i);
+      return NULL;
+    }
+    i->ptrSize = DEFSIZE;
   }
-  i->ptrSize = DEFSIZE;
   i->sPtrs[0] = &(s->front);
   i->sPtrs[1] = &(s->back);
   i->ptrPos = 0;
@@ -776,6 +936,8 @@ rfbBool sraRgnIteratorNext(sraRectangleIterator* i,sraRect* r)
 
 void sraRgnReleaseIterator(sraRectangleIterator* i)
 {
+  if(sraPoolPut(SRA_ITERATOR, i))
+    return;
   free(i->sPtrs);
   free(i);
 }
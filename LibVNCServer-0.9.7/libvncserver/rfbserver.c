@@ -32,6 +32,7 @@
 #include <rfb/rfb.h>
 #include <rfb/rfbregion.h>
 #include "private.h"
+#include "outqueue.h"
 
 #ifdef LIBVNCSERVER_HAVE_FCNTL_H
 #include <fcntl.h>
@@ -280,6 +281,14 @@ rfbNewTCPOrUDPClient(rfbScreenInfoPtr rfbScreen,
 
 	cl = (rfbClientPtr)calloc(sizeof(rfbClientRec),1);
 
+	if (!rfbOutQueueInit(cl)) {
+		rfbErr("rfbNewClient: out of memory\n");
+		if(!isUDP)
+			close(sock);
+		free(cl);
+		return NULL;
+	}
+
 	cl->screen = rfbScreen;
 	cl->sock = sock;
 	cl->viewOnly = FALSE;
@@ -322,8 +331,25 @@ rfbNewTCPOrUDPClient(rfbScreenInfoPtr rfbScreen,
 			return NULL;
 		}
 
-		FD_SET(sock,&(rfbScreen->allFds));
-		rfbScreen->maxFd = max(sock,rfbScreen->maxFd);
+#ifdef TCP_NOTSENT_LOWAT
+		/* only wake us for writing once the kernel has little left to
+		   send; older kernels do not know this, which is harmless */
+		if (rfbMaxClientUnsent > 0) {
+			int lowat = rfbMaxClientUnsent;
+			setsockopt(sock, IPPROTO_TCP, TCP_NOTSENT_LOWAT,
+					(char *)&lowat, sizeof(lowat));
+		}
+#endif
+
+		if (FD_SETTABLE(sock)) {
+			LOCK(rfbScreen->fdsMutex);
+			FD_SET(sock,&(rfbScreen->allFds));
+			rfbScreen->maxFd = max(sock,rfbScreen->maxFd);
+			UNLOCK(rfbScreen->fdsMutex);
+		} else if (rfbScreen->epollFd < 0) {
+			rfbLog("socket %d is too large for select()\n", sock);
+		}
+		rfbEpollAdd(rfbScreen, sock, cl, TRUE);
 
 		INIT_MUTEX(cl->outputMutex);
 		INIT_MUTEX(cl->refCountMutex);
@@ -339,6 +365,8 @@ rfbNewTCPOrUDPClient(rfbScreenInfoPtr rfbScreen,
 		cl->correMaxHeight = 48;
 #ifdef LIBVNCSERVER_HAVE_LIBZ
 		cl->zrleData = NULL;
+		cl->zrleTileData = NULL;
+		cl->zrlePalette = NULL;
 #endif
 
 		cl->copyRegion = sraRgnCreate();
@@ -347,6 +375,7 @@ rfbNewTCPOrUDPClient(rfbScreenInfoPtr rfbScreen,
 
 		cl->modifiedRegion =
 				sraRgnCreateRect(0,0,rfbScreen->width,rfbScreen->height);
+		rfbDamageInitClient(cl);
 
 		INIT_MUTEX(cl->updateMutex);
 		INIT_COND(cl->updateCond);
@@ -372,6 +401,7 @@ rfbNewTCPOrUDPClient(rfbScreenInfoPtr rfbScreen,
 		cl->tightQualityLevel = -1;
 #ifdef LIBVNCSERVER_HAVE_LIBJPEG
 		cl->tightCompressLevel = TIGHT_DEFAULT_COMPRESSION;
+		cl->tightData = NULL;
 		{
 			int i;
 			for (i = 0; i < 4; i++)
@@ -446,6 +476,8 @@ rfbNewTCPOrUDPClient(rfbScreenInfoPtr rfbScreen,
 		cl = NULL;
 		break;
 	}
+	if (cl && !isUDP)
+		rfbWorkersAddClient(cl);
 	return cl;
 }
 
@@ -475,6 +507,10 @@ rfbClientConnectionGone(rfbClientPtr cl)
 	int i;
 #endif
 
+	/* the queue depth is read from the socket and the output queue,
+	   so this comes before either is torn down */
+	rfbPrintStats(cl);
+
 	LOCK(rfbClientListMutex);
 
 	if (cl->prev)
@@ -511,7 +547,7 @@ rfbClientConnectionGone(rfbClientPtr cl)
 
 	UNLOCK(rfbClientListMutex);
 
-	if(cl->sock>=0)
+	if(FD_SETTABLE(cl->sock))
 		FD_CLR(cl->sock,&(cl->screen->allFds));
 
 	cl->clientGoneHook(cl);
@@ -530,6 +566,7 @@ rfbClientConnectionGone(rfbClientPtr cl)
 		if (cl->zsActive[i])
 			deflateEnd(&cl->zsStruct[i]);
 	}
+	rfbFreeTightData(cl);
 #endif
 #endif
 
@@ -539,8 +576,12 @@ rfbClientConnectionGone(rfbClientPtr cl)
 	sraRgnDestroy(cl->modifiedRegion);
 	sraRgnDestroy(cl->requestedRegion);
 	sraRgnDestroy(cl->copyRegion);
+	if (cl->continuousRegion)
+		sraRgnDestroy(cl->continuousRegion);
 
 	if (cl->translateLookupTable) free(cl->translateLookupTable);
+	free(cl->beforeEncBuf);
+	free(cl->afterEncBuf);
 
 	TINI_COND(cl->updateCond);
 	TINI_MUTEX(cl->updateMutex);
@@ -554,7 +595,11 @@ rfbClientConnectionGone(rfbClientPtr cl)
 	destroyConnection(cl);
 #endif
 
-	rfbPrintStats(cl);
+	rfbFreeStats(cl);
+
+	rfbAdaptCleanup(cl);
+	rfbDamageCleanupClient(cl);
+	rfbOutQueueFree(cl);
 
 	free(cl);
 }
@@ -884,6 +929,8 @@ rfbSendSupportedMessages(rfbClientPtr cl)
 	/*rfbSetBit(msgs.client2server, rfbTextChat);        */
 	/*rfbSetBit(msgs.client2server, rfbKeyFrameRequest); */
 	rfbSetBit(msgs.client2server, rfbPalmVNCSetScaleFactor);
+	rfbSetBit(msgs.client2server, rfbEnableContinuousUpdates);
+	rfbSetBit(msgs.client2server, rfbFence);
 
 	rfbSetBit(msgs.server2client, rfbFramebufferUpdate);
 	rfbSetBit(msgs.server2client, rfbSetColourMapEntries);
@@ -892,6 +939,8 @@ rfbSendSupportedMessages(rfbClientPtr cl)
 	rfbSetBit(msgs.server2client, rfbResizeFrameBuffer);
 	/*rfbSetBit(msgs.server2client, rfbKeyFrameUpdate);  */
 	rfbSetBit(msgs.server2client, rfbPalmVNCReSizeFrameBuffer);
+	rfbSetBit(msgs.server2client, rfbEndOfContinuousUpdates);
+	rfbSetBit(msgs.server2client, rfbFence);
 
 	memcpy(&cl->updateBuf[cl->ublen], (char *)&msgs, sz_rfbSupportedMessages);
 	cl->ublen += sz_rfbSupportedMessages;
@@ -940,6 +989,8 @@ rfbSendSupportedEncodings(rfbClientPtr cl)
 			rfbEncodingSupportedMessages,
 			rfbEncodingSupportedEncodings,
 			rfbEncodingServerIdentity,
+			rfbEncodingContinuousUpdates,
+			rfbEncodingFence,
 	};
 	uint32_t nEncodings = sizeof(supported) / sizeof(supported[0]), i;
 
@@ -1037,6 +1088,99 @@ rfbSendServerIdentity(rfbClientPtr cl)
 	return TRUE;
 }
 
+/*
+ * rfbSendFence sends a Fence message with the given flags and up to
+ * rfbFenceMaxDataSize bytes of data.
+ */
+
+rfbBool
+rfbSendFence(rfbClientPtr cl, uint32_t flags, int length, const char *data)
+{
+	rfbFenceMsg f;
+
+	if (length > rfbFenceMaxDataSize)
+		length = rfbFenceMaxDataSize;
+
+	memset((char *)&f, 0, sizeof(f));
+	f.type = rfbFence;
+	f.flags = Swap32IfLE(flags);
+	f.length = length;
+
+	if (cl->ublen + sz_rfbFenceMsg + length > UPDATE_BUF_SIZE) {
+		if (!rfbSendUpdateBuf(cl))
+			return FALSE;
+	}
+
+	memcpy(&cl->updateBuf[cl->ublen], (char *)&f, sz_rfbFenceMsg);
+	cl->ublen += sz_rfbFenceMsg;
+	if (length > 0) {
+		memcpy(&cl->updateBuf[cl->ublen], data, length);
+		cl->ublen += length;
+	}
+	rfbStatRecordMessageSent(cl, rfbFence, sz_rfbFenceMsg+length, sz_rfbFenceMsg+length);
+
+	return rfbSendUpdateBuf(cl);
+}
+
+/*
+ * Send a fence to time the round trip to the client, unless one is on its
+ * way already.  The client answers it only once it has dealt with
+ * everything sent before, so after an update this tells how long updates
+ * take to get through.
+ */
+
+static rfbBool
+rfbSendRoundTripFence(rfbClientPtr cl)
+{
+	if (cl->fencePending)
+		return TRUE;
+	cl->fencePending = TRUE;
+	gettimeofday(&cl->fenceSent, NULL);
+	return rfbSendFence(cl, rfbFenceFlagRequest | rfbFenceFlagBlockBefore, 0, NULL);
+}
+
+/*
+ * The answer to our fence is back: update the smoothed round trip time,
+ * as TCP does.
+ */
+
+static void
+rfbGotRoundTripFence(rfbClientPtr cl)
+{
+	struct timeval now;
+	int rtt;
+
+	if (!cl->fencePending)
+		return;
+	cl->fencePending = FALSE;
+	gettimeofday(&now, NULL);
+	rtt = (now.tv_sec - cl->fenceSent.tv_sec) * 1000000
+		+ (now.tv_usec - cl->fenceSent.tv_usec);
+	if (rtt < 1)
+		rtt = 1;
+	if (cl->roundTripTime == 0)
+		cl->roundTripTime = rtt;
+	else
+		cl->roundTripTime += (rtt - cl->roundTripTime) / 8;
+	rfbAdaptUpdateDelivered(cl);
+}
+
+static rfbBool
+rfbSendEndOfContinuousUpdates(rfbClientPtr cl)
+{
+	rfbEndOfContinuousUpdatesMsg eocu;
+
+	eocu.type = rfbEndOfContinuousUpdates;
+	if (rfbWriteExact(cl, (char *)&eocu, sz_rfbEndOfContinuousUpdatesMsg) < 0) {
+		rfbLogPerror("rfbSendEndOfContinuousUpdates: write");
+		rfbCloseClient(cl);
+		return FALSE;
+	}
+	rfbStatRecordMessageSent(cl, rfbEndOfContinuousUpdates,
+			sz_rfbEndOfContinuousUpdatesMsg, sz_rfbEndOfContinuousUpdatesMsg);
+	return TRUE;
+}
+
 rfbBool rfbSendTextChatMessage(rfbClientPtr cl, uint32_t length, char *buffer)
 {
 	rfbTextChatMsg tc;
@@ -1876,6 +2020,9 @@ rfbProcessClientNormalMessage(rfbClientPtr cl)
 		cl->enableSupportedMessages  = FALSE;
 		cl->enableSupportedEncodings = FALSE;
 		cl->enableServerIdentity     = FALSE;
+		cl->encodingsAdvertised      = 0;
+		/* enableFence and enableContinuousUpdates stay: the client has
+		   been told that we support them, which happens only once */
 
 
 		for (i = 0; i < msg.se.nEncodings; i++) {
@@ -1908,6 +2055,7 @@ rfbProcessClientNormalMessage(rfbClientPtr cl)
 				/* The first supported encoding is the 'preferred' encoding */
 				if (cl->preferredEncoding == -1)
 					cl->preferredEncoding = enc;
+				cl->encodingsAdvertised |= 1 << enc;
 
 
 				break;
@@ -1984,6 +2132,25 @@ rfbProcessClientNormalMessage(rfbClientPtr cl)
 					cl->enableServerIdentity = TRUE;
 				}
 				break;
+			case rfbEncodingFence:
+				if (!cl->enableFence) {
+					rfbLog("Enabling Fence protocol extension for client "
+							"%s\n", cl->host);
+					cl->enableFence = TRUE;
+					/* our first fence says that we support them */
+					if (!rfbSendRoundTripFence(cl))
+						return;
+				}
+				break;
+			case rfbEncodingContinuousUpdates:
+				if (!cl->enableContinuousUpdates) {
+					rfbLog("Enabling ContinuousUpdates protocol extension for client "
+							"%s\n", cl->host);
+					cl->enableContinuousUpdates = TRUE;
+					if (!rfbSendEndOfContinuousUpdates(cl))
+						return;
+				}
+				break;
 			default:
 #ifdef LIBVNCSERVER_HAVE_LIBZ
 				if ( enc >= (uint32_t)rfbEncodingCompressLevel0 &&
@@ -2042,7 +2209,7 @@ rfbProcessClientNormalMessage(rfbClientPtr cl)
 						rfbReleaseExtensionIterator();
 
 						if(!handled)
-							rfbLog("rfbProcessClientNormalMessage: "
+							rfbLogClient(cl, "rfbProcessClientNormalMessage: "
 									"ignoring unsupported encoding type %s\n",
 									encodingName(enc,encBuf,sizeof(encBuf)));
 					}
@@ -2079,6 +2246,8 @@ rfbProcessClientNormalMessage(rfbClientPtr cl)
 			cl->enableCursorPosUpdates = FALSE;
 		}
 
+		rfbAdaptSetEncodings(cl);
+
 		return;
 	}
 
@@ -2102,10 +2271,13 @@ rfbProcessClientNormalMessage(rfbClientPtr cl)
 		 */
 		if(!rectSwapIfLEAndClip(&msg.fur.x,&msg.fur.y,&msg.fur.w,&msg.fur.h,cl))
 		{
-			rfbLog("Warning, ignoring rfbFramebufferUpdateRequest: %dXx%dY-%dWx%dH\n",msg.fur.x, msg.fur.y, msg.fur.w, msg.fur.h);
+			rfbLogClient(cl, "Warning, ignoring rfbFramebufferUpdateRequest: %dXx%dY-%dWx%dH\n",msg.fur.x, msg.fur.y, msg.fur.w, msg.fur.h);
 			return;
 		}
 
+		/* without fences, asking for more says the last update is in */
+		if (!cl->enableFence)
+			rfbAdaptUpdateDelivered(cl);
 
 		tmpRegion =
 				sraRgnCreateRect(msg.fur.x,
@@ -2132,7 +2304,7 @@ rfbProcessClientNormalMessage(rfbClientPtr cl)
 			sraRgnOr(cl->modifiedRegion,tmpRegion);
 			sraRgnSubtract(cl->copyRegion,tmpRegion);
 		}
-		TSIGNAL(cl->updateCond);
+		rfbScheduleUpdate(cl);
 		UNLOCK(cl->updateMutex);
 
 		sraRgnDestroy(tmpRegion);
@@ -2140,6 +2312,111 @@ rfbProcessClientNormalMessage(rfbClientPtr cl)
 		return;
 	}
 
+	case rfbEnableContinuousUpdates:
+	{
+		sraRegionPtr tmpRegion;
+
+		if ((n = rfbReadExact(cl, ((char *)&msg) + 1,
+				sz_rfbEnableContinuousUpdatesMsg-1)) <= 0) {
+			if (n != 0)
+				rfbLogPerror("rfbProcessClientNormalMessage: read");
+			rfbCloseClient(cl);
+			return;
+		}
+
+		rfbStatRecordMessageRcvd(cl, msg.type, sz_rfbEnableContinuousUpdatesMsg,sz_rfbEnableContinuousUpdatesMsg);
+
+		if (!cl->enableContinuousUpdates) {
+			rfbLogClient(cl, "rfbProcessClientNormalMessage: EnableContinuousUpdates"
+					" without ContinuousUpdates encoding\n");
+			rfbCloseClient(cl);
+			return;
+		}
+
+		if (!msg.ecu.enable) {
+			LOCK(cl->updateMutex);
+			if (cl->continuousRegion) {
+				sraRgnDestroy(cl->continuousRegion);
+				cl->continuousRegion = NULL;
+			}
+			UNLOCK(cl->updateMutex);
+			rfbSendEndOfContinuousUpdates(cl);
+			return;
+		}
+
+		if(!rectSwapIfLEAndClip(&msg.ecu.x,&msg.ecu.y,&msg.ecu.w,&msg.ecu.h,cl))
+		{
+			rfbLogClient(cl, "Warning, ignoring rfbEnableContinuousUpdates: %dXx%dY-%dWx%dH\n",msg.ecu.x, msg.ecu.y, msg.ecu.w, msg.ecu.h);
+			return;
+		}
+
+		/*
+		 * From now on requestedRegion is set to this area again after
+		 * each update, so that changes there are sent without waiting
+		 * for a request.
+		 */
+		tmpRegion =
+				sraRgnCreateRect(msg.ecu.x,
+						msg.ecu.y,
+						msg.ecu.x+msg.ecu.w,
+						msg.ecu.y+msg.ecu.h);
+
+		LOCK(cl->updateMutex);
+		if (cl->continuousRegion)
+			sraRgnDestroy(cl->continuousRegion);
+		cl->continuousRegion = tmpRegion;
+		sraRgnOr(cl->requestedRegion,tmpRegion);
+		rfbScheduleUpdate(cl);
+		UNLOCK(cl->updateMutex);
+
+		return;
+	}
+
+	case rfbFence:
+	{
+		char data[rfbFenceMaxDataSize];
+		uint32_t flags;
+
+		if ((n = rfbReadExact(cl, ((char *)&msg) + 1,
+				sz_rfbFenceMsg-1)) <= 0) {
+			if (n != 0)
+				rfbLogPerror("rfbProcessClientNormalMessage: read");
+			rfbCloseClient(cl);
+			return;
+		}
+
+		if (msg.f.length > rfbFenceMaxDataSize) {
+			rfbLogClient(cl, "rfbProcessClientNormalMessage: fence with %d bytes of data\n",
+					msg.f.length);
+			rfbCloseClient(cl);
+			return;
+		}
+
+		if (msg.f.length > 0 && (n = rfbReadExact(cl, data, msg.f.length)) <= 0) {
+			if (n != 0)
+				rfbLogPerror("rfbProcessClientNormalMessage: read");
+			rfbCloseClient(cl);
+			return;
+		}
+
+		rfbStatRecordMessageRcvd(cl, msg.type, sz_rfbFenceMsg+msg.f.length,sz_rfbFenceMsg+msg.f.length);
+
+		flags = Swap32IfLE(msg.f.flags);
+		if (flags & rfbFenceFlagRequest) {
+			/*
+			 * Messages are dealt with one after the other, and the
+			 * answer is queued behind everything sent so far, so
+			 * all the flags are honoured as they are.
+			 */
+			rfbSendFence(cl, flags & rfbFenceFlagsSupported & ~rfbFenceFlagRequest,
+					msg.f.length, data);
+			return;
+		}
+
+		rfbGotRoundTripFence(cl);
+		return;
+	}
+
 	case rfbKeyEvent:
 
 		if ((n = rfbReadExact(cl, ((char *)&msg) + 1,
@@ -2153,7 +2430,10 @@ rfbProcessClientNormalMessage(rfbClientPtr cl)
 		rfbStatRecordMessageRcvd(cl, msg.type, sz_rfbKeyEventMsg, sz_rfbKeyEventMsg);
 
 		if(!cl->viewOnly) {
+			gettimeofday(&cl->lastInput, NULL);
+			RFB_TRACE_BEGIN("key event", Swap32IfLE(msg.ke.key));
 			cl->screen->kbdAddEvent(msg.ke.down, (rfbKeySym)Swap32IfLE(msg.ke.key), cl);
+			RFB_TRACE_END();
 		}
 
 		return;
@@ -2180,12 +2460,15 @@ rfbProcessClientNormalMessage(rfbClientPtr cl)
 			cl->screen->pointerClient = cl;
 
 		if(!cl->viewOnly) {
+			gettimeofday(&cl->lastInput, NULL);
 			if (msg.pe.buttonMask != cl->lastPtrButtons ||
 					cl->screen->deferPtrUpdateTime == 0) {
+				RFB_TRACE_BEGIN("pointer event", msg.pe.buttonMask);
 				cl->screen->ptrAddEvent(msg.pe.buttonMask,
 						ScaleX(cl->scaledScreen, cl->screen, Swap16IfLE(msg.pe.x)),
 						ScaleY(cl->scaledScreen, cl->screen, Swap16IfLE(msg.pe.y)),
 						cl);
+				RFB_TRACE_END();
 				cl->lastPtrButtons = msg.pe.buttonMask;
 			} else {
 				cl->lastPtrX = ScaleX(cl->scaledScreen, cl->screen, Swap16IfLE(msg.pe.x));
@@ -2381,9 +2664,8 @@ rfbProcessClientNormalMessage(rfbClientPtr cl)
 				e = next;
 			}
 
-			rfbLog("rfbProcessClientNormalMessage: unknown message type %d\n",
-					msg.type);
-			rfbLog(" ... closing connection\n");
+			rfbLogClient(cl, "rfbProcessClientNormalMessage: unknown message type %d,"
+					" closing connection\n", msg.type);
 			rfbCloseClient(cl);
 			return;
 		}
@@ -2392,6 +2674,78 @@ rfbProcessClientNormalMessage(rfbClientPtr cl)
 
 
 
+/* ms after its last key or pointer event a client is still interactive */
+#define INTERACTIVE_TIME 2000
+
+/*
+ * rfbClientClass tells how soon cl is served: the client holding the
+ * pointer or which sent input in the last INTERACTIVE_TIME ms comes first,
+ * view-only clients come last.
+ */
+
+int
+rfbClientClass(rfbClientPtr cl)
+{
+	struct timeval now;
+
+	if (cl->viewOnly)
+		return RFB_CLASS_VIEWONLY;
+	if (cl->screen->pointerClient == cl)
+		return RFB_CLASS_INTERACTIVE;
+	if (cl->lastInput.tv_sec != 0) {
+		gettimeofday(&now, NULL);
+		if ((now.tv_sec - cl->lastInput.tv_sec) * 1000
+				+ (now.tv_usec - cl->lastInput.tv_usec) / 1000
+				< INTERACTIVE_TIME)
+			return RFB_CLASS_INTERACTIVE;
+	}
+	return RFB_CLASS_NORMAL;
+}
+
+/* ms between looks at a kernel send buffer which is too full */
+#define UNSENT_POLL_TIME 10
+
+/*
+ * Returns TRUE if the next update should wait, because the client still has
+ * data queued, or the kernel has more than rfbMaxClientUnsent bytes for it
+ * which it has not sent yet.  Sending more would only pile up stale frames
+ * in the socket buffers, and add their transfer time to the latency of
+ * every change after them.  It also waits to keep to the update rate
+ * and the caps adaptive.c has for the client.
+ */
+
+static rfbBool
+DeferUpdate(rfbClientPtr cl)
+{
+	int queued = rfbOutQueuePending(cl);
+	int unsent = rfbMaxClientUnsent > 0 ? rfbSocketUnsent(cl->sock) : 0;
+	rfbBool defer = queued > 0 || unsent > rfbMaxClientUnsent;
+	int wait;
+
+	LOCK(cl->updateMutex);
+	/* changes which come in while deferred count as skipped */
+	rfbDamageCollect(cl);
+	if (queued + unsent > cl->maxQueueDepth)
+		cl->maxQueueDepth = queued + unsent;
+	cl->updateDeferred = defer;
+	UNLOCK(cl->updateMutex);
+
+	/*
+	 * The socket becoming writable tells us when the output queue has
+	 * drained, but an emptying kernel buffer may go unnoticed: look
+	 * again in a while.
+	 */
+	if (defer && queued == 0)
+		rfbScheduleClient(cl, RFB_TASK_UPDATE, UNSENT_POLL_TIME);
+	else if (!defer && (wait = rfbAdaptUpdateDelay(cl)) > 0) {
+		LOCK(cl->updateMutex);
+		cl->updateDeferred = defer = TRUE;
+		UNLOCK(cl->updateMutex);
+		rfbScheduleClient(cl, RFB_TASK_UPDATE, wait);
+	}
+	return defer;
+}
+
 /*
  * rfbSendFramebufferUpdate - send the currently pending framebuffer update to
  * the RFB client.
@@ -2415,6 +2769,21 @@ rfbSendFramebufferUpdate(rfbClientPtr cl,
 	rfbBool sendSupportedEncodings = FALSE;
 	rfbBool sendServerIdentity = FALSE;
 	rfbBool result = TRUE;
+	struct timeval encodeStart, damageTime;
+	rfbBool sent;
+	int bytesBefore;
+
+	/*
+	 * If the client has not taken the previous update yet, leave the
+	 * damage in modifiedRegion; it is sent, merged with whatever changes
+	 * in the meantime, once the backlog has drained.
+	 */
+
+	if (DeferUpdate(cl))
+		return TRUE;
+
+	rfbAdaptUpdateStart(cl);
+	bytesBefore = rfbStatGetSentBytes(cl);
 
 	if(cl->screen->displayHook)
 		cl->screen->displayHook(cl);
@@ -2504,6 +2873,7 @@ rfbSendFramebufferUpdate(rfbClientPtr cl,
 	}
 
 	LOCK(cl->updateMutex);
+	RFB_TRACE_BEGIN("regions", 0);
 
 	/*
 	 * The modifiedRegion may overlap the destination copyRegion.  We remove
@@ -2549,6 +2919,7 @@ rfbSendFramebufferUpdate(rfbClientPtr cl,
 					!sendCursorShape && !sendCursorPos && !sendKeyboardLedState &&
 					!sendSupportedMessages && !sendSupportedEncodings && !sendServerIdentity) {
 		sraRgnDestroy(updateRegion);
+		RFB_TRACE_END();
 		UNLOCK(cl->updateMutex);
 		return TRUE;
 	}
@@ -2579,6 +2950,16 @@ rfbSendFramebufferUpdate(rfbClientPtr cl,
 
 	sraRgnSubtract(updateRegion,updateCopyRegion);
 
+	/*
+	 * Rectangles close to each other may be cheaper to send as one; what
+	 * they then cover must still lie within requestedRegion.
+	 */
+
+	if (cl->screen->mergeRects) {
+		rfbMergeUpdateRects(cl, updateRegion);
+		sraRgnAnd(updateRegion, cl->requestedRegion);
+	}
+
 	/*
 	 * Finally we leave modifiedRegion to be the remainder (if any) of parts of
 	 * the screen which are modified but outside the requestedRegion.  We also
@@ -2591,10 +2972,20 @@ rfbSendFramebufferUpdate(rfbClientPtr cl,
 	sraRgnSubtract(cl->modifiedRegion,updateCopyRegion);
 
 	sraRgnMakeEmpty(cl->requestedRegion);
+	if (cl->continuousRegion)
+		sraRgnOr(cl->requestedRegion,cl->continuousRegion);
 	sraRgnMakeEmpty(cl->copyRegion);
 	cl->copyDX = 0;
 	cl->copyDY = 0;
 
+	/* what is left over has waited since now */
+	damageTime = cl->damageTime;
+	if (sraRgnEmpty(cl->modifiedRegion))
+		cl->damageTime.tv_sec = cl->damageTime.tv_usec = 0;
+	else
+		gettimeofday(&cl->damageTime, NULL);
+
+	RFB_TRACE_END();
 	UNLOCK(cl->updateMutex);
 
 	if (!cl->enableCursorShapeUpdates) {
@@ -2664,23 +3055,23 @@ rfbSendFramebufferUpdate(rfbClientPtr cl,
 	} else if (cl->preferredEncoding == rfbEncodingTight) {
 		nUpdateRegionRects = 0;
 
-		for(i = sraRgnGetIterator(updateRegion); sraRgnIteratorNext(i,&rect);){
-			int x = rect.x1;
-			int y = rect.y1;
-			int w = rect.x2 - x;
-			int h = rect.y2 - y;
-			int n;
-			/* We need to count the number of rects in the scaled screen */
-			if (cl->screen!=cl->scaledScreen)
-				rfbScaledCorrection(cl->screen, cl->scaledScreen, &x, &y, &w, &h, "rfbSendFramebufferUpdate");
-			n = rfbNumCodedRectsTight(cl, x, y, w, h);
-			if (n == 0) {
-				nUpdateRegionRects = 0xFFFF;
-				break;
+		/* Terminate the update with a LastRect marker whenever the client
+		   understands it, so the rectangles need not be counted here. */
+		if (cl->enableLastRectEncoding) {
+			nUpdateRegionRects = 0xFFFF;
+		} else {
+			for(i = sraRgnGetIterator(updateRegion); sraRgnIteratorNext(i,&rect);){
+				int x = rect.x1;
+				int y = rect.y1;
+				int w = rect.x2 - x;
+				int h = rect.y2 - y;
+				/* We need to count the number of rects in the scaled screen */
+				if (cl->screen!=cl->scaledScreen)
+					rfbScaledCorrection(cl->screen, cl->scaledScreen, &x, &y, &w, &h, "rfbSendFramebufferUpdate");
+				nUpdateRegionRects += rfbNumCodedRectsTight(cl, x, y, w, h);
 			}
-			nUpdateRegionRects += n;
+			sraRgnReleaseIterator(i); i=NULL;
 		}
-		sraRgnReleaseIterator(i); i=NULL;
 #endif
 #endif
 	} else {
@@ -2717,6 +3108,9 @@ rfbSendFramebufferUpdate(rfbClientPtr cl,
 	}
 	cl->ublen = sz_rfbFramebufferUpdateMsg;
 
+	/* collect the whole update before writing it out */
+	rfbOutQueueCork(cl, TRUE);
+
 	if (sendCursorShape) {
 		cl->cursorWasChanged = FALSE;
 		if (!rfbSendCursorShape(cl))
@@ -2762,48 +3156,47 @@ rfbSendFramebufferUpdate(rfbClientPtr cl,
 		if (cl->screen!=cl->scaledScreen)
 			rfbScaledCorrection(cl->screen, cl->scaledScreen, &x, &y, &w, &h, "rfbSendFramebufferUpdate");
 
+		gettimeofday(&encodeStart, NULL);
+		sent = TRUE;
+		RFB_TRACE_BEGIN(rfbTraceEncodingName(cl->preferredEncoding), w*h);
 		switch (cl->preferredEncoding) {
 		case -1:
 		case rfbEncodingRaw:
-			if (!rfbSendRectEncodingRaw(cl, x, y, w, h))
-				goto updateFailed;
+			sent = rfbSendRectEncodingRaw(cl, x, y, w, h);
 			break;
 		case rfbEncodingRRE:
-			if (!rfbSendRectEncodingRRE(cl, x, y, w, h))
-				goto updateFailed;
+			sent = rfbSendRectEncodingRRE(cl, x, y, w, h);
 			break;
 		case rfbEncodingCoRRE:
-			if (!rfbSendRectEncodingCoRRE(cl, x, y, w, h))
-				goto updateFailed;
+			sent = rfbSendRectEncodingCoRRE(cl, x, y, w, h);
 			break;
 		case rfbEncodingHextile:
-			if (!rfbSendRectEncodingHextile(cl, x, y, w, h))
-				goto updateFailed;
+			sent = rfbSendRectEncodingHextile(cl, x, y, w, h);
 			break;
 		case rfbEncodingUltra:
-			if (!rfbSendRectEncodingUltra(cl, x, y, w, h))
-				goto updateFailed;
+			sent = rfbSendRectEncodingUltra(cl, x, y, w, h);
 			break;
 #ifdef LIBVNCSERVER_HAVE_LIBZ
 		case rfbEncodingZlib:
-			if (!rfbSendRectEncodingZlib(cl, x, y, w, h))
-				goto updateFailed;
+			sent = rfbSendRectEncodingZlib(cl, x, y, w, h);
 			break;
 #ifdef LIBVNCSERVER_HAVE_LIBJPEG
 		case rfbEncodingTight:
-			if (!rfbSendRectEncodingTight(cl, x, y, w, h))
-				goto updateFailed;
+			sent = rfbSendRectEncodingTight(cl, x, y, w, h);
 			break;
 #endif
 #endif
 #ifdef LIBVNCSERVER_HAVE_LIBZ
 		case rfbEncodingZRLE:
 		case rfbEncodingZYWRLE:
-			if (!rfbSendRectEncodingZRLE(cl, x, y, w, h))
-				goto updateFailed;
+			sent = rfbSendRectEncodingZRLE(cl, x, y, w, h);
 			break;
 #endif
 		}
+		RFB_TRACE_END();
+		if (!sent)
+			goto updateFailed;
+		rfbAdaptRectEncoded(cl, &encodeStart);
 	}
 	if (i) {
 		sraRgnReleaseIterator(i);
@@ -2814,10 +3207,27 @@ rfbSendFramebufferUpdate(rfbClientPtr cl,
 			!rfbSendLastRectMarker(cl) )
 		goto updateFailed;
 
+	rfbOutQueueCork(cl, FALSE);
 	if (!rfbSendUpdateBuf(cl)) {
 		updateFailed:
 		result = FALSE;
 	}
+	rfbOutQueueCork(cl, FALSE);
+
+	if (result && damageTime.tv_sec != 0) {
+		struct timeval now;
+		gettimeofday(&now, NULL);
+		rfbStatRecordUpdateLatency(cl, (now.tv_sec - damageTime.tv_sec) * 1000000
+				+ (now.tv_usec - damageTime.tv_usec));
+	}
+	if (result)
+		rfbStatRecordUpdateSent(cl, rfbStatGetSentBytes(cl) - bytesBefore);
+
+	/* time how long the update takes to get through */
+	if (result)
+		rfbAdaptUpdateSent(cl);
+	if (result && cl->enableFence && !rfbSendRoundTripFence(cl))
+		result = FALSE;
 
 	if (!cl->enableCursorShapeUpdates) {
 		rfbHideCursor(cl);
@@ -2926,6 +3336,28 @@ rfbSendRectEncodingRaw(rfbClientPtr cl,
 	rfbStatRecordEncodingSent(cl, rfbEncodingRaw, sz_rfbFramebufferUpdateRectHeader + bytesPerLine * h,
 			sz_rfbFramebufferUpdateRectHeader + bytesPerLine * h);
 
+	/* Pixels that need no translation are queued straight from the frame
+	   buffer; they are read when the queue is flushed. */
+	if (cl->translateFn == rfbTranslateNone) {
+		int stride = cl->scaledScreen->paddedWidthInBytes;
+
+		if (!rfbOutQueueUpdateBuf(cl))
+			goto rawQueueFailed;
+		if (bytesPerLine == stride) {
+			if (!rfbOutQueueData(cl, fbptr, bytesPerLine * h))
+				goto rawQueueFailed;
+		} else {
+			for (; h > 0; h--, fbptr += stride)
+				if (!rfbOutQueueData(cl, fbptr, bytesPerLine))
+					goto rawQueueFailed;
+		}
+		return rfbSendUpdateBuf(cl);
+
+	rawQueueFailed:
+		rfbCloseClient(cl);
+		return FALSE;
+	}
+
 	nlines = (UPDATE_BUF_SIZE - cl->ublen) / bytesPerLine;
 
 	while (TRUE) {
@@ -3034,8 +3466,10 @@ rfbSendNewFBSize(rfbClientPtr cl,
 
 
 /*
- * Send the contents of cl->updateBuf.  Returns 1 if successful, -1 if
- * not (errno should be set).
+ * Send the contents of cl->updateBuf, and anything else queued before it.
+ * During a framebuffer update the output queue is corked and this may
+ * only queue the data.  Returns TRUE if successful, FALSE (and closes the
+ * client) if not.
  */
 
 rfbBool
@@ -3044,13 +3478,36 @@ rfbSendUpdateBuf(rfbClientPtr cl)
 	if(cl->sock<0)
 		return FALSE;
 
-	if (rfbWriteExact(cl, cl->updateBuf, cl->ublen) < 0) {
+	RFB_TRACE_BEGIN("send", cl->ublen);
+	if (!rfbOutQueueUpdateBuf(cl) || rfbOutQueueFlush(cl, FALSE) < 0) {
+		RFB_TRACE_END();
 		rfbLogPerror("rfbSendUpdateBuf: write");
 		rfbCloseClient(cl);
 		return FALSE;
 	}
+	RFB_TRACE_END();
+
+	return TRUE;
+}
+
+/*
+ * Send the contents of updateBuf followed by len bytes at data, without
+ * copying data into updateBuf.  data is written out before returning.
+ */
+
+rfbBool
+rfbSendUpdateBufWithData(rfbClientPtr cl, const char *data, int len)
+{
+	if(cl->sock<0)
+		return FALSE;
+
+	if (!rfbOutQueueUpdateBuf(cl) || !rfbOutQueueData(cl, data, len) ||
+			rfbOutQueueFlush(cl, TRUE) < 0) {
+		rfbLogPerror("rfbSendUpdateBufWithData: write");
+		rfbCloseClient(cl);
+		return FALSE;
+	}
 
-	cl->ublen = 0;
 	return TRUE;
 }
 
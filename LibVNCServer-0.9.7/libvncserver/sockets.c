@@ -61,6 +61,8 @@
 #ifdef LIBVNCSERVER_HAVE_UNISTD_H
 #include <unistd.h>
 #endif
+#include "private.h"
+#include "outqueue.h"
 
 #if defined(__linux__) && defined(NEED_TIMEVAL)
 struct timeval 
@@ -76,6 +78,20 @@ struct timeval
 
 #include <errno.h>
 
+#ifdef LIBVNCSERVER_HAVE_SYS_EPOLL_H
+#include <sys/epoll.h>
+#endif
+#ifdef LIBVNCSERVER_HAVE_SYS_TIMERFD_H
+#include <sys/timerfd.h>
+#endif
+#ifndef WIN32
+#include <poll.h>
+#endif
+#ifdef __linux__
+#include <sys/ioctl.h>
+#include <linux/sockios.h>
+#endif
+
 #ifdef USE_LIBWRAP
 #include <syslog.h>
 #include <tcpd.h>
@@ -97,6 +113,68 @@ int deny_severity=LOG_WARNING;
 
 int rfbMaxClientWait = 20000;   /* time (ms) after which we decide client has
                                    gone away - needed to stop us hanging */
+int rfbMaxClientBacklog = 0;    /* bytes which may be waiting for a client
+                                   before it is disconnected; 0 means twice
+                                   the frame buffer in 32 bit pixels */
+int rfbMaxClientUnsent = 32768; /* bytes the kernel may still have to send
+                                   to a client before its next update is
+                                   put off; 0 means not to look */
+
+/*
+ * rfbEpollAdd has epoll watch sock, with data to tell its events apart.
+ * Clients' sockets are watched edge-triggered and for writing too.  Does
+ * nothing if select() is used.
+ */
+
+void
+rfbEpollAdd(rfbScreenInfoPtr rfbScreen, int sock, void *data, rfbBool client)
+{
+#ifdef LIBVNCSERVER_HAVE_SYS_EPOLL_H
+	struct epoll_event ev;
+
+	if (rfbScreen->epollFd < 0 || sock < 0)
+		return;
+	memset(&ev, 0, sizeof(ev));
+	ev.events = client ? EPOLLIN | EPOLLOUT | EPOLLET : EPOLLIN;
+	ev.data.ptr = data;
+	if (epoll_ctl(rfbScreen->epollFd, EPOLL_CTL_ADD, sock, &ev) < 0)
+		rfbLogPerror("rfbEpollAdd: epoll_ctl");
+#endif
+}
+
+void
+rfbEpollDel(rfbScreenInfoPtr rfbScreen, int sock)
+{
+#ifdef LIBVNCSERVER_HAVE_SYS_EPOLL_H
+	struct epoll_event ev;
+
+	if (rfbScreen->epollFd < 0 || sock < 0)
+		return;
+	/* closing the socket would do, but it may have been dup()ed */
+	epoll_ctl(rfbScreen->epollFd, EPOLL_CTL_DEL, sock, &ev);
+#endif
+}
+
+static void
+InitEpoll(rfbScreenInfoPtr rfbScreen)
+{
+#ifdef LIBVNCSERVER_HAVE_SYS_EPOLL_H
+	if ((rfbScreen->epollFd = epoll_create(64)) < 0) {
+		rfbLogPerror("rfbInitSockets: epoll_create, using select");
+		return;
+	}
+	fcntl(rfbScreen->epollFd, F_SETFD, FD_CLOEXEC);
+#ifdef LIBVNCSERVER_HAVE_SYS_TIMERFD_H
+	if ((rfbScreen->timerFd = timerfd_create(CLOCK_REALTIME, 0)) < 0) {
+		rfbLogPerror("rfbInitSockets: timerfd_create");
+		return;
+	}
+	fcntl(rfbScreen->timerFd, F_SETFD, FD_CLOEXEC);
+	fcntl(rfbScreen->timerFd, F_SETFL, O_NONBLOCK);
+	rfbEpollAdd(rfbScreen, rfbScreen->timerFd, &rfbScreen->timerFd, FALSE);
+#endif
+#endif
+}
 
 /*
  * rfbInitSockets sets up the TCP and UDP sockets to listen for RFB
@@ -113,6 +191,8 @@ rfbInitSockets(rfbScreenInfoPtr rfbScreen)
 
 	rfbScreen->socketState = RFB_SOCKET_READY;
 
+	InitEpoll(rfbScreen);
+
 	if (rfbScreen->inetdSock != -1) {
 		const int one = 1;
 
@@ -154,6 +234,7 @@ rfbInitSockets(rfbScreenInfoPtr rfbScreen)
 		FD_ZERO(&(rfbScreen->allFds));
 		FD_SET(rfbScreen->listenSock, &(rfbScreen->allFds));
 		rfbScreen->maxFd = rfbScreen->listenSock;
+		rfbEpollAdd(rfbScreen, rfbScreen->listenSock, &rfbScreen->listenSock, FALSE);
 	}
 	else if(rfbScreen->port>0) {
 		rfbLog("Listening for VNC connections on TCP port %d\n", rfbScreen->port);
@@ -166,6 +247,7 @@ rfbInitSockets(rfbScreenInfoPtr rfbScreen)
 		FD_ZERO(&(rfbScreen->allFds));
 		FD_SET(rfbScreen->listenSock, &(rfbScreen->allFds));
 		rfbScreen->maxFd = rfbScreen->listenSock;
+		rfbEpollAdd(rfbScreen, rfbScreen->listenSock, &rfbScreen->listenSock, FALSE);
 	}
 
 	if (rfbScreen->udpPort != 0) {
@@ -177,6 +259,7 @@ rfbInitSockets(rfbScreenInfoPtr rfbScreen)
 		}
 		FD_SET(rfbScreen->udpSock, &(rfbScreen->allFds));
 		rfbScreen->maxFd = max((int)rfbScreen->udpSock,rfbScreen->maxFd);
+		rfbEpollAdd(rfbScreen, rfbScreen->udpSock, &rfbScreen->udpSock, FALSE);
 	}
 }
 
@@ -204,8 +287,320 @@ void rfbShutdownSockets(rfbScreenInfoPtr rfbScreen)
 		FD_CLR(rfbScreen->udpSock,&rfbScreen->allFds);
 		rfbScreen->udpSock=-1;
 	}
+
+	if(rfbScreen->timerFd>-1) {
+		close(rfbScreen->timerFd);
+		rfbScreen->timerFd=-1;
+	}
+
+	if(rfbScreen->epollFd>-1) {
+		close(rfbScreen->epollFd);
+		rfbScreen->epollFd=-1;
+	}
+}
+
+/*
+ * AcceptClient accepts a connection on the listening socket and makes a
+ * new client of it.  Returns 1 on success, -1 on failure.
+ */
+
+static int
+AcceptClient(rfbScreenInfoPtr rfbScreen)
+{
+	struct sockaddr_in addr;
+	socklen_t addrlen = sizeof(addr);
+	const int one = 1;
+	int sock;
+
+	if ((sock = accept(rfbScreen->listenSock,
+			(struct sockaddr *)&addr, &addrlen)) < 0) {
+		rfbLogPerror("rfbCheckFds: accept");
+		return -1;
+	}
+
+#ifndef WIN32
+	if (fcntl(sock, F_SETFL, O_NONBLOCK) < 0) {
+		rfbLogPerror("rfbCheckFds: fcntl");
+		closesocket(sock);
+		return -1;
+	}
+#endif
+
+	if (setsockopt(sock, IPPROTO_TCP, TCP_NODELAY,
+			(char *)&one, sizeof(one)) < 0) {
+		rfbLogPerror("rfbCheckFds: setsockopt");
+		closesocket(sock);
+		return -1;
+	}
+
+#ifdef USE_LIBWRAP
+	if(!hosts_ctl("vnc",STRING_UNKNOWN,inet_ntoa(addr.sin_addr),
+			STRING_UNKNOWN)) {
+		rfbLog("Rejected connection from client %s\n",
+				inet_ntoa(addr.sin_addr));
+		closesocket(sock);
+		return -1;
+	}
+#endif
+
+	rfbLog("Got connection from client %s\n", inet_ntoa(addr.sin_addr));
+
+	rfbNewClient(rfbScreen,sock);
+	return 1;
 }
 
+/*
+ * ProcessUDP handles a datagram waiting on the UDP socket.  Returns 1, or
+ * -1 if the socket could not be connected to a new remote end.
+ */
+
+static int
+ProcessUDP(rfbScreenInfoPtr rfbScreen)
+{
+	struct sockaddr_in addr;
+	socklen_t addrlen = sizeof(addr);
+	char buf[6];
+
+	if(!rfbScreen->udpClient)
+		rfbNewUDPClient(rfbScreen);
+	if (recvfrom(rfbScreen->udpSock, buf, 1, MSG_PEEK,
+			(struct sockaddr *)&addr, &addrlen) < 0) {
+		rfbLogPerror("rfbCheckFds: UDP: recvfrom");
+		rfbDisconnectUDPSock(rfbScreen);
+		rfbScreen->udpSockConnected = FALSE;
+	} else {
+		if (!rfbScreen->udpSockConnected ||
+				(memcmp(&addr, &rfbScreen->udpRemoteAddr, addrlen) != 0))
+		{
+			/* new remote end */
+			rfbLog("rfbCheckFds: UDP: got connection\n");
+
+			memcpy(&rfbScreen->udpRemoteAddr, &addr, addrlen);
+			rfbScreen->udpSockConnected = TRUE;
+
+			if (connect(rfbScreen->udpSock,
+					(struct sockaddr *)&addr, addrlen) < 0) {
+				rfbLogPerror("rfbCheckFds: UDP: connect");
+				rfbDisconnectUDPSock(rfbScreen);
+				return -1;
+			}
+
+			rfbNewUDPConnection(rfbScreen,rfbScreen->udpSock);
+		}
+
+		rfbProcessUDPInput(rfbScreen);
+	}
+	return 1;
+}
+
+/*
+ * DeferredWait shortens a wait of usec microseconds so that it ends when the
+ * earliest deferred update or pointer event is due.
+ */
+
+static long
+DeferredWait(rfbScreenInfoPtr rfbScreen, long usec)
+{
+	struct timeval now;
+	long left;
+
+	if (rfbScreen->deferDeadline.tv_sec == 0 || usec == 0)
+		return usec;
+	gettimeofday(&now, NULL);
+	left = (rfbScreen->deferDeadline.tv_sec - now.tv_sec) * 1000000
+		+ (rfbScreen->deferDeadline.tv_usec - now.tv_usec);
+	if (left < 0)
+		left = 0;
+	return left < usec ? left : usec;
+}
+
+static int WaitForSocket(int sock, rfbBool forWriting, int timeout);
+
+/*
+ * With edge-triggered notification, or when nobody else looks at the
+ * socket, a client's socket has to be read until it has no more data.
+ */
+
+static rfbBool
+MoreInput(rfbClientPtr cl)
+{
+	return WaitForSocket(cl->sock, FALSE, 0) != 0;
+}
+
+static void
+ProcessClientInput(rfbClientPtr cl)
+{
+	/* drain all messages, speed up mouse move processing */
+	do {
+		rfbProcessClientMessage(cl);
+	} while (cl->sock >= 0 && MoreInput(cl));
+}
+
+static void
+ProcessClientOutput(rfbClientPtr cl)
+{
+	if (rfbOutQueuePending(cl) > 0 && rfbOutQueueFlush(cl, TRUE) < 0) {
+		rfbLogPerror("rfbCheckFds: write");
+		rfbCloseClient(cl);
+		return;
+	}
+	/* there is no new event while the socket stays writable, so keep
+	   going until it is full */
+	while (cl->sock >= 0 && cl->fileTransfer.fd != -1
+			&& cl->fileTransfer.sending == 1 && rfbOutQueuePending(cl) == 0)
+		rfbSendFileTransferChunk(cl);
+}
+
+/*
+ * rfbServiceClient closes cl if it has stopped reading, and otherwise
+ * processes whatever input is waiting and/or writes its queued output.
+ */
+
+void
+rfbServiceClient(rfbClientPtr cl, rfbBool input, rfbBool output)
+{
+	if (rfbOutQueueStalled(cl)) {
+		rfbLog("rfbCheckFds: client is not reading, closing it\n");
+		rfbCloseClient(cl);
+		return;
+	}
+	if (input)
+		while (cl->sock >= 0 && MoreInput(cl))
+			rfbProcessClientMessage(cl);
+	if (output && cl->sock >= 0)
+		ProcessClientOutput(cl);
+}
+
+/* leave the events on a client's socket to its worker thread, if it has one */
+static void
+ClientEvents(rfbClientPtr cl, rfbBool input, rfbBool output)
+{
+	if (rfbScheduleClient(cl, (input ? RFB_TASK_INPUT : 0)
+			| (output ? RFB_TASK_OUTPUT : 0), 0))
+		return;
+	if (input)
+		ProcessClientInput(cl);
+	if (output && cl->sock >= 0)
+		ProcessClientOutput(cl);
+}
+
+#ifdef LIBVNCSERVER_HAVE_SYS_EPOLL_H
+
+#define EPOLL_MAX_EVENTS 64
+
+/* the time between checks for clients which have stopped reading */
+#define EPOLL_SWEEP_INTERVAL 1
+
+/*
+ * Look at every client now and then: close those which have stopped
+ * reading, and pick up input which arrived while a client was on hold (and
+ * so did not cause an event when it could be processed).
+ */
+
+static void
+SweepClients(rfbScreenInfoPtr rfbScreen)
+{
+	rfbClientIteratorPtr i;
+	rfbClientPtr cl;
+
+	rfbScreen->lastClientSweep = time(NULL);
+	i = rfbGetClientIterator(rfbScreen);
+	while((cl = rfbClientIteratorNext(i))) {
+		if (cl->sock < 0 || cl->onHold)
+			continue;
+		if (!rfbScheduleClient(cl, RFB_TASK_INPUT | RFB_TASK_OUTPUT, 0))
+			rfbServiceClient(cl, TRUE, TRUE);
+	}
+	rfbReleaseClientIterator(i);
+}
+
+/*
+ * The epoll counterpart of the select() loop in rfbCheckFds.  Client
+ * sockets are registered edge-triggered for both directions, with the
+ * client as data; the other sockets level-triggered, with the address of
+ * the rfbScreen field holding them as data.  timerFd, if there is one, is
+ * set to go off when the earliest deferred update or pointer event is due
+ * (rfbProcessEvents() keeps track of that in deferDeadline, which, like
+ * startDeferring, is in gettimeofday() time).
+ */
+
+static int
+EpollCheckFds(rfbScreenInfoPtr rfbScreen, long usec)
+{
+	struct epoll_event events[EPOLL_MAX_EVENTS];
+	int nfds, n, timeout, result = 0;
+	rfbClientPtr cl;
+	void *data;
+
+	do {
+		/* epoll_wait() counts in ms; round up rather than spin */
+		timeout = usec >= 2000000000L ? -1 : (int)((usec + 999) / 1000);
+		if (rfbScreen->deferDeadline.tv_sec != 0) {
+#ifdef LIBVNCSERVER_HAVE_SYS_TIMERFD_H
+			struct itimerspec its;
+
+			memset(&its, 0, sizeof(its));
+			its.it_value.tv_sec = rfbScreen->deferDeadline.tv_sec;
+			its.it_value.tv_nsec = rfbScreen->deferDeadline.tv_usec * 1000;
+			if (rfbScreen->timerFd < 0 || timerfd_settime(rfbScreen->timerFd,
+					TFD_TIMER_ABSTIME, &its, NULL) < 0)
+#endif
+				timeout = (DeferredWait(rfbScreen, usec) + 999) / 1000;
+		}
+		nfds = epoll_wait(rfbScreen->epollFd, events, EPOLL_MAX_EVENTS, timeout);
+		if (nfds < 0) {
+			if (errno != EINTR)
+				rfbLogPerror("rfbCheckFds: epoll_wait");
+			return -1;
+		}
+
+		result += nfds;
+
+		for (n = 0; n < nfds; n++) {
+			data = events[n].data.ptr;
+
+			if (data == &rfbScreen->timerFd) {
+				uint64_t expirations;
+				if (read(rfbScreen->timerFd, &expirations, sizeof(expirations)) < 0
+						&& errno != EAGAIN)
+					rfbLogPerror("rfbCheckFds: timerfd");
+				result--;
+				continue;
+			}
+
+			if (data == &rfbScreen->listenSock) {
+				if (AcceptClient(rfbScreen) < 0)
+					return -1;
+				continue;
+			}
+
+			if (data == &rfbScreen->udpSock) {
+				if (ProcessUDP(rfbScreen) < 0)
+					return -1;
+				continue;
+			}
+
+			/* rfbHttpCheckFds() takes care of these */
+			if (data == &rfbScreen->httpListenSock || data == &rfbScreen->httpSock)
+				continue;
+
+			cl = (rfbClientPtr)data;
+			if (cl->sock < 0 || cl->onHold)
+				continue;
+			ClientEvents(cl, (events[n].events & (EPOLLIN | EPOLLERR | EPOLLHUP)) != 0,
+					(events[n].events & EPOLLOUT) != 0);
+		}
+
+		if (time(NULL) - rfbScreen->lastClientSweep >= EPOLL_SWEEP_INTERVAL)
+			SweepClients(rfbScreen);
+		if (result == 0)
+			return 0;
+	} while(rfbScreen->handleEventsEagerly);
+	return result;
+}
+
+#endif
+
 /*
  * rfbCheckFds is called from ProcessInputEvents to check for input on the RFB
  * socket(s).  If there is input to process, the appropriate function in the
@@ -219,35 +614,74 @@ rfbCheckFds(rfbScreenInfoPtr rfbScreen,long usec)
 	int nfds;
 	fd_set fds;
 	struct timeval tv;
-	struct sockaddr_in addr;
-	socklen_t addrlen = sizeof(addr);
-	char buf[6];
-	const int one = 1;
-	int sock;
 	rfbClientIteratorPtr i;
 	rfbClientPtr cl;
 	struct timeval tv_msg;
 	fd_set fds_msg;
 	int nfds_msg;
-	int result = 0;
+	fd_set wfds, busy;
+	int fd, maxFd, result = 0;
 
 	if (!rfbScreen->inetdInitDone && rfbScreen->inetdSock != -1) {
 		rfbNewClientConnection(rfbScreen,rfbScreen->inetdSock);
 		rfbScreen->inetdInitDone = TRUE;
 	}
 
+#ifdef LIBVNCSERVER_HAVE_SYS_EPOLL_H
+	if (rfbScreen->epollFd >= 0)
+		return EpollCheckFds(rfbScreen, usec);
+#endif
+
+	usec = DeferredWait(rfbScreen, usec);
+
 	do {
+		/* wait for the sockets of clients with queued output to become
+		   writable, and give up on those which have stopped reading */
+		FD_ZERO(&wfds);
+		FD_ZERO(&busy);
+		i = rfbGetClientIterator(rfbScreen);
+		while((cl = rfbClientIteratorNext(i))) {
+			if (cl->sock < 0)
+				continue;
+			/* until its worker is done, the same input would only wake
+			   us up again */
+			if (rfbClientScheduled(cl)) {
+				if (FD_SETTABLE(cl->sock))
+					FD_SET(cl->sock, &busy);
+				continue;
+			}
+			if (!rfbOutQueuePending(cl))
+				continue;
+			if (!rfbOutQueueStalled(cl)) {
+				if (FD_SETTABLE(cl->sock))
+					FD_SET(cl->sock, &wfds);
+			} else if (!rfbScheduleClient(cl, RFB_TASK_OUTPUT, 0)) {
+				rfbLog("rfbCheckFds: client is not reading, closing it\n");
+				rfbCloseClient(cl);
+			}
+		}
+		rfbReleaseClientIterator(i);
+
+		LOCK(rfbScreen->fdsMutex);
 		memcpy((char *)&fds, (char *)&(rfbScreen->allFds), sizeof(fd_set));
+		maxFd = rfbScreen->maxFd;
+		UNLOCK(rfbScreen->fdsMutex);
+		for (fd = 0; fd <= maxFd; fd++)
+			if (FD_ISSET(fd, &busy))
+				FD_CLR(fd, &fds);
 		tv.tv_sec = 0;
 		tv.tv_usec = usec;
-		nfds = select(rfbScreen->maxFd + 1, &fds, NULL, NULL /* &fds */, &tv);
+		nfds = select(maxFd + 1, &fds, &wfds, NULL /* &fds */, &tv);
 		if (nfds == 0) {
 			/* timed out, check for async events */
 			i = rfbGetClientIterator(rfbScreen);
 			while((cl = rfbClientIteratorNext(i))) {
-				if (cl->onHold)
+				if (cl->onHold || !FD_SETTABLE(cl->sock))
 					continue;
-				if (FD_ISSET(cl->sock, &(rfbScreen->allFds)))
+				if (CLIENT_HAS_WORKERS(cl)) {
+					if (cl->fileTransfer.fd != -1)
+						rfbScheduleClient(cl, RFB_TASK_OUTPUT, 0);
+				} else if (FD_ISSET(cl->sock, &(rfbScreen->allFds)))
 					rfbSendFileTransferChunk(cl);
 			}
 			rfbReleaseClientIterator(i);
@@ -266,40 +700,8 @@ rfbCheckFds(rfbScreenInfoPtr rfbScreen,long usec)
 		result += nfds;
 
 		if (rfbScreen->listenSock != -1 && FD_ISSET(rfbScreen->listenSock, &fds)) {
-			if ((sock = accept(rfbScreen->listenSock,
-					(struct sockaddr *)&addr, &addrlen)) < 0) {
-				rfbLogPerror("rfbCheckFds: accept");
+			if (AcceptClient(rfbScreen) < 0)
 				return -1;
-			}
-
-#ifndef WIN32
-			if (fcntl(sock, F_SETFL, O_NONBLOCK) < 0) {
-				rfbLogPerror("rfbCheckFds: fcntl");
-				closesocket(sock);
-				return -1;
-			}
-#endif
-
-			if (setsockopt(sock, IPPROTO_TCP, TCP_NODELAY,
-					(char *)&one, sizeof(one)) < 0) {
-				rfbLogPerror("rfbCheckFds: setsockopt");
-				closesocket(sock);
-				return -1;
-			}
-
-#ifdef USE_LIBWRAP
-			if(!hosts_ctl("vnc",STRING_UNKNOWN,inet_ntoa(addr.sin_addr),
-					STRING_UNKNOWN)) {
-				rfbLog("Rejected connection from client %s\n",
-						inet_ntoa(addr.sin_addr));
-				closesocket(sock);
-				return -1;
-			}
-#endif
-
-			rfbLog("Got connection from client %s\n", inet_ntoa(addr.sin_addr));
-
-			rfbNewClient(rfbScreen,sock);
 
 			FD_CLR(rfbScreen->listenSock, &fds);
 			if (--nfds == 0)
@@ -307,35 +709,8 @@ rfbCheckFds(rfbScreenInfoPtr rfbScreen,long usec)
 		}
 
 		if ((rfbScreen->udpSock != -1) && FD_ISSET(rfbScreen->udpSock, &fds)) {
-			if(!rfbScreen->udpClient)
-				rfbNewUDPClient(rfbScreen);
-			if (recvfrom(rfbScreen->udpSock, buf, 1, MSG_PEEK,
-					(struct sockaddr *)&addr, &addrlen) < 0) {
-				rfbLogPerror("rfbCheckFds: UDP: recvfrom");
-				rfbDisconnectUDPSock(rfbScreen);
-				rfbScreen->udpSockConnected = FALSE;
-			} else {
-				if (!rfbScreen->udpSockConnected ||
-						(memcmp(&addr, &rfbScreen->udpRemoteAddr, addrlen) != 0))
-				{
-					/* new remote end */
-					rfbLog("rfbCheckFds: UDP: got connection\n");
-
-					memcpy(&rfbScreen->udpRemoteAddr, &addr, addrlen);
-					rfbScreen->udpSockConnected = TRUE;
-
-					if (connect(rfbScreen->udpSock,
-							(struct sockaddr *)&addr, addrlen) < 0) {
-						rfbLogPerror("rfbCheckFds: UDP: connect");
-						rfbDisconnectUDPSock(rfbScreen);
-						return -1;
-					}
-
-					rfbNewUDPConnection(rfbScreen,rfbScreen->udpSock);
-				}
-
-				rfbProcessUDPInput(rfbScreen);
-			}
+			if (ProcessUDP(rfbScreen) < 0)
+				return -1;
 
 			FD_CLR(rfbScreen->udpSock, &fds);
 			if (--nfds == 0)
@@ -345,9 +720,23 @@ rfbCheckFds(rfbScreenInfoPtr rfbScreen,long usec)
 		i = rfbGetClientIterator(rfbScreen);
 		while((cl = rfbClientIteratorNext(i))) {
 
-			if (cl->onHold)
+			if (cl->onHold || !FD_SETTABLE(cl->sock))
 				continue;
 
+			if (CLIENT_HAS_WORKERS(cl)) {
+				if (FD_ISSET(cl->sock, &fds) || FD_ISSET(cl->sock, &wfds))
+					ClientEvents(cl, FD_ISSET(cl->sock, &fds) != 0,
+							FD_ISSET(cl->sock, &wfds) != 0);
+				continue;
+			}
+
+			if (FD_ISSET(cl->sock, &wfds)
+					&& rfbOutQueueFlush(cl, TRUE) < 0) {
+				rfbLogPerror("rfbCheckFds: write");
+				rfbCloseClient(cl);
+				continue;
+			}
+
 			if (FD_ISSET(cl->sock, &(rfbScreen->allFds)))
 			{
 				if (FD_ISSET(cl->sock, &fds)) {
@@ -391,11 +780,15 @@ rfbCloseClient(rfbClientPtr cl)
 	if (cl->sock != -1)
 #endif
 	{
-		FD_CLR(cl->sock,&(cl->screen->allFds));
+		rfbEpollDel(cl->screen,cl->sock);
+		LOCK(cl->screen->fdsMutex);
+		if (FD_SETTABLE(cl->sock))
+			FD_CLR(cl->sock,&(cl->screen->allFds));
 		if(cl->sock==cl->screen->maxFd)
 			while(cl->screen->maxFd>0
 					&& !FD_ISSET(cl->screen->maxFd,&(cl->screen->allFds)))
 				cl->screen->maxFd--;
+		UNLOCK(cl->screen->fdsMutex);
 #ifndef __MINGW32__
 		shutdown(cl->sock,SHUT_RDWR);
 #endif
@@ -404,6 +797,8 @@ rfbCloseClient(rfbClientPtr cl)
 	}
 	TSIGNAL(cl->updateCond);
 	UNLOCK(cl->updateMutex);
+	/* have a worker notice that it is gone */
+	rfbScheduleClient(cl, 0, 0);
 }
 
 
@@ -443,12 +838,46 @@ rfbConnect(rfbScreenInfoPtr rfbScreen,
 	}
 
 	/* AddEnabledDevice(sock); */
-	FD_SET(sock, &rfbScreen->allFds);
-	rfbScreen->maxFd = max(sock,rfbScreen->maxFd);
+	if (FD_SETTABLE(sock)) {
+		LOCK(rfbScreen->fdsMutex);
+		FD_SET(sock, &rfbScreen->allFds);
+		rfbScreen->maxFd = max(sock,rfbScreen->maxFd);
+		UNLOCK(rfbScreen->fdsMutex);
+	}
 
 	return sock;
 }
 
+/*
+ * WaitForSocket waits up to timeout ms for sock to become readable (or
+ * writable).  Returns like select() on that socket alone; poll() is used
+ * where there is one, as it is not limited to FD_SETSIZE.
+ */
+
+static int
+WaitForSocket(int sock, rfbBool forWriting, int timeout)
+{
+#ifdef WIN32
+	fd_set fds;
+	struct timeval tv;
+
+	FD_ZERO(&fds);
+	FD_SET(sock, &fds);
+	tv.tv_sec = timeout / 1000;
+	tv.tv_usec = (timeout % 1000) * 1000;
+	if (forWriting)
+		return select(sock+1, NULL, &fds, NULL, &tv);
+	return select(sock+1, &fds, NULL, &fds, &tv);
+#else
+	struct pollfd pfd;
+
+	pfd.fd = sock;
+	pfd.events = forWriting ? POLLOUT : POLLIN;
+	pfd.revents = 0;
+	return poll(&pfd, 1, timeout);
+#endif
+}
+
 /*
  * ReadExact reads an exact number of bytes from a client.  Returns 1 if
  * those bytes have been read, 0 if the other end has closed, or -1 if an error
@@ -460,8 +889,6 @@ rfbReadExactTimeout(rfbClientPtr cl, char* buf, int len, int timeout)
 {
 	int sock = cl->sock;
 	int n;
-	fd_set fds;
-	struct timeval tv;
 
 	while (len > 0) {
 		n = read(sock, buf, len);
@@ -489,13 +916,9 @@ if (errno != ENOENT)
 		return n;
 	}
 
-FD_ZERO(&fds);
-FD_SET(sock, &fds);
-tv.tv_sec = timeout / 1000;
-tv.tv_usec = (timeout % 1000) * 1000;
-n = select(sock+1, &fds, NULL, &fds, &tv);
+n = WaitForSocket(sock, FALSE, timeout);
 if (n < 0) {
-	rfbLogPerror("ReadExact: select");
+	rfbLogPerror("ReadExact: poll");
 	return n;
 }
 if (n == 0) {
@@ -521,20 +944,17 @@ int rfbReadExact(rfbClientPtr cl,char* buf,int len)
 }
 
 /*
- * WriteExact writes an exact number of bytes to a client.  Returns 1 if
- * those bytes have been written, or -1 if an error occurred (errno is set to
- * ETIMEDOUT if it timed out).
+ * WriteExact writes an exact number of bytes to a client.  The caller holds
+ * cl->outputMutex.  Returns like rfbWriteExact.
  */
 
-int
-rfbWriteExact(rfbClientPtr cl,
+static int
+WriteExact(rfbClientPtr cl,
 		const char *buf,
 		int len)
 {
 	int sock = cl->sock;
 	int n;
-	fd_set fds;
-	struct timeval tv;
 	int totalTimeWaited = 0;
 
 #undef DEBUG_WRITE_EXACT
@@ -545,7 +965,6 @@ rfbWriteExact(rfbClientPtr cl,
 	fprintf(stderr,"\n");
 #endif
 
-	LOCK(cl->outputMutex);
 	while (len > 0) {
 		n = write(sock, buf, len);
 
@@ -567,7 +986,6 @@ rfbWriteExact(rfbClientPtr cl,
 				continue;
 
 			if (errno != EWOULDBLOCK && errno != EAGAIN) {
-				UNLOCK(cl->outputMutex);
 				return n;
 			}
 
@@ -575,23 +993,130 @@ rfbWriteExact(rfbClientPtr cl,
                need to do this because select doesn't necessarily return
                immediately when the other end has gone away */
 
-			FD_ZERO(&fds);
-			FD_SET(sock, &fds);
-			tv.tv_sec = 5;
-			tv.tv_usec = 0;
-			n = select(sock+1, NULL, &fds, NULL /* &fds */, &tv);
+			n = WaitForSocket(sock, TRUE, 5000);
+			if (n < 0) {
+				if(errno==EINTR)
+					continue;
+				rfbLogPerror("WriteExact: poll");
+				return n;
+			}
+			if (n == 0) {
+				totalTimeWaited += 5000;
+				if (totalTimeWaited >= rfbMaxClientWait) {
+					errno = ETIMEDOUT;
+					return -1;
+				}
+			} else {
+				totalTimeWaited = 0;
+			}
+		}
+	}
+	return 1;
+}
+
+/*
+ * rfbWriteExact sends an exact number of bytes to a client.  If the client
+ * has an output queue, the bytes are only appended to it, and as much of
+ * the queue as the socket takes right now is written; the rest is written
+ * later by rfbCheckFds(), so a return of 1 does not mean that any of them
+ * have reached the socket yet.  Without a queue, 1 means that they have
+ * all been written.  Returns -1 if an error occurred (errno is set to
+ * ETIMEDOUT if it timed out).
+ */
+
+int
+rfbWriteExact(rfbClientPtr cl,
+		const char *buf,
+		int len)
+{
+	int result;
+
+	RFB_TRACE_BEGIN("write", len);
+	if (cl->outputQueue) {
+		if (!rfbOutQueueData(cl, buf, len))
+			result = -1;
+		else
+			result = rfbOutQueueFlush(cl, TRUE);
+	} else {
+		LOCK(cl->outputMutex);
+		result = WriteExact(cl, buf, len);
+		UNLOCK(cl->outputMutex);
+	}
+	RFB_TRACE_END();
+	return result;
+}
+
+/*
+ * rfbWriteExactVLocked is the writev() counterpart of WriteExact: it writes
+ * all the buffers described by iov, in order, with as few system calls as
+ * possible.  The caller holds cl->outputMutex.  The iov array is modified.
+ * Returns like rfbWriteExact.
+ */
+
+int
+rfbWriteExactVLocked(rfbClientPtr cl,
+		struct iovec *iov,
+		int iovcnt)
+{
+#ifdef WIN32
+	int result = 1;
+
+	for (; iovcnt > 0 && result > 0; iov++, iovcnt--)
+		result = WriteExact(cl, iov->iov_base, iov->iov_len);
+	return result;
+#else
+	int sock = cl->sock;
+	int n;
+	int totalTimeWaited = 0;
+
+	while (iovcnt > 0) {
+		if (iov->iov_len == 0) {
+			iov++;
+			iovcnt--;
+			continue;
+		}
+
+		n = writev(sock, iov, iovcnt);
+
+		if (n > 0) {
+
+			while (n > 0 && n >= (int)iov->iov_len) {
+				n -= iov->iov_len;
+				iov++;
+				iovcnt--;
+			}
+			if (n > 0) {
+				iov->iov_base = (char *)iov->iov_base + n;
+				iov->iov_len -= n;
+			}
+
+		} else if (n == 0) {
+
+			rfbErr("WriteExactV: writev returned 0?\n");
+			return 0;
+
+		} else {
+			if (errno == EINTR)
+				continue;
+
+			if (errno != EWOULDBLOCK && errno != EAGAIN) {
+				return n;
+			}
+
+			/* Retry every 5 seconds until we exceed rfbMaxClientWait,
+			   as in WriteExact */
+
+			n = WaitForSocket(sock, TRUE, 5000);
 			if (n < 0) {
 				if(errno==EINTR)
 					continue;
-				rfbLogPerror("WriteExact: select");
-				UNLOCK(cl->outputMutex);
+				rfbLogPerror("WriteExactV: poll");
 				return n;
 			}
 			if (n == 0) {
 				totalTimeWaited += 5000;
 				if (totalTimeWaited >= rfbMaxClientWait) {
 					errno = ETIMEDOUT;
-					UNLOCK(cl->outputMutex);
 					return -1;
 				}
 			} else {
@@ -599,8 +1124,76 @@ rfbWriteExact(rfbClientPtr cl,
 			}
 		}
 	}
-	UNLOCK(cl->outputMutex);
 	return 1;
+#endif
+}
+
+/*
+ * rfbWriteVNonBlocking writes as much of the buffers described by iov as the
+ * socket takes without blocking.  The caller holds cl->outputMutex.  Returns
+ * the number of bytes written, 0 if the socket is full, or -1 on error.
+ */
+
+int
+rfbWriteVNonBlocking(rfbClientPtr cl,
+		struct iovec *iov,
+		int iovcnt)
+{
+	int n;
+
+#ifdef WIN32
+	int total = 0;
+
+	for (; iovcnt > 0; iov++, iovcnt--) {
+		n = send(cl->sock, iov->iov_base, iov->iov_len, 0);
+		if (n < 0) {
+			errno = WSAGetLastError();
+			if (errno == EWOULDBLOCK || errno == EAGAIN)
+				break;
+			return -1;
+		}
+		total += n;
+		if (n < (int)iov->iov_len)
+			break;
+	}
+	return total;
+#else
+	do {
+		n = writev(cl->sock, iov, iovcnt);
+	} while (n < 0 && errno == EINTR);
+
+	if (n < 0 && (errno == EWOULDBLOCK || errno == EAGAIN))
+		return 0;
+	if (n == 0) {
+		rfbErr("WriteVNonBlocking: writev returned 0?\n");
+		return -1;
+	}
+	return n;
+#endif
+}
+
+/*
+ * rfbSocketUnsent returns the number of bytes written to sock which the
+ * kernel has not sent yet, or 0 if it cannot tell.  Where only the whole
+ * send queue can be asked for, bytes waiting to be acknowledged count too.
+ */
+
+int
+rfbSocketUnsent(int sock)
+{
+	int n = 0;
+
+	if (sock < 0)
+		return 0;
+#ifdef SIOCOUTQNSD
+	if (ioctl(sock, SIOCOUTQNSD, &n) == 0)
+		return n;
+#endif
+#ifdef SIOCOUTQ
+	if (ioctl(sock, SIOCOUTQ, &n) == 0)
+		return n;
+#endif
+	return 0;
 }
 
 /* currently private, called by rfbProcessArguments() */
@@ -25,6 +25,8 @@
  */
 
 #include <rfb/rfb.h>
+#include "private.h"
+#include "outqueue.h"
 
 char *messageNameServer2Client(uint32_t type, char *buf, int len);
 char *messageNameClient2Server(uint32_t type, char *buf, int len);
@@ -55,6 +57,8 @@ char *messageNameServer2Client(uint32_t type, char *buf, int len) {
     case rfbFileTransfer:             snprintf(buf, len, "FileTransfer"); break;
     case rfbTextChat:                 snprintf(buf, len, "TextChat"); break;
     case rfbPalmVNCReSizeFrameBuffer: snprintf(buf, len, "PalmVNCReSize"); break;
+    case rfbEndOfContinuousUpdates:   snprintf(buf, len, "EndOfContinuous"); break;
+    case rfbFence:                    snprintf(buf, len, "Fence"); break;
     default:
         snprintf(buf, len, "svr2cli-0x%08X", 0xFF);
     }
@@ -78,6 +82,8 @@ char *messageNameClient2Server(uint32_t type, char *buf, int len) {
     case rfbTextChat:                 snprintf(buf, len, "TextChat"); break;
     case rfbKeyFrameRequest:          snprintf(buf, len, "KeyFrameRequest"); break;
     case rfbPalmVNCSetScaleFactor:    snprintf(buf, len, "PalmVNCSetScale"); break;
+    case rfbEnableContinuousUpdates:  snprintf(buf, len, "EnableContinuous"); break;
+    case rfbFence:                    snprintf(buf, len, "Fence"); break;
     default:
         snprintf(buf, len, "cli2svr-0x%08X", type);
 
@@ -125,6 +131,8 @@ char *encodingName(uint32_t type, char *buf, int len) {
     case rfbEncodingSupportedMessages:  snprintf(buf, len, "SupportedMessage");  break;
     case rfbEncodingSupportedEncodings: snprintf(buf, len, "SupportedEncoding"); break;
     case rfbEncodingServerIdentity:     snprintf(buf, len, "ServerIdentify");    break;
+    case rfbEncodingContinuousUpdates:  snprintf(buf, len, "ContinuousUpdate");  break;
+    case rfbEncodingFence:              snprintf(buf, len, "Fence");             break;
 
     /* The following lookups do not report in stats */
     case rfbEncodingCompressLevel0: snprintf(buf, len, "CompressLevel0");  break;
@@ -161,47 +169,179 @@ char *encodingName(uint32_t type, char *buf, int len) {
 
 
 
-rfbStatList *rfbStatLookupEncoding(rfbClientPtr cl, uint32_t type)
+/*
+ * The counters of a client are kept in tables with a fixed place for
+ * every message and encoding type, so recording one is an index and a
+ * few additions rather than a walk along a list.  The counters are added
+ * to atomically where the compiler can, so that the threads reading,
+ * encoding and sending for a client, and whoever reads the statistics
+ * while it is connected, never wait on each other.
+ *
+ * Next to the counters are histograms with a bucket for each power of
+ * two: of the time taken to encode a rectangle, of the bytes in an
+ * update, of how long updates took from the first change in them until
+ * they were sent, and of how many updates went out in each second.
+ * rfbStatGetSnapshot() copies all of it out.
+ */
+
+#if defined(__GNUC__) && defined(LIBVNCSERVER_HAVE_LIBPTHREAD)
+#define STAT_ATOMIC
+#define STAT_ADD(var, n) __sync_fetch_and_add(&(var), (n))
+#define STAT_READ(var) __sync_fetch_and_add(&(var), 0)
+#else
+#define STAT_ADD(var, n) ((var) += (n))
+#define STAT_READ(var) (var)
+#endif
+
+#define STAT_MESSAGES 256
+
+/* the encoding types counted, in runs of consecutive numbers */
+static const struct {
+    uint32_t first;
+    int count;
+} encodingRuns[] = {
+    { rfbEncodingRaw, 32 },
+    { rfbEncodingCompressLevel0, 64 },	/* up to the cursor and size pseudo-encodings */
+    { rfbEncodingQualityLevel0, 32 },
+    { 0xFFFFFEC0, 64 },			/* fences, continuous updates and the like */
+    { rfbEncodingCache, 16 },
+    { rfbEncodingKeyboardLedState, 16 }
+};
+#define STAT_ENCODING_RUNS (int)(sizeof(encodingRuns)/sizeof(encodingRuns[0]))
+#define STAT_ENCODINGS (32+64+32+64+16+16+1)	/* and one for all others */
+#define STAT_OTHER_ENCODING 0x80000000
+
+typedef struct {
+    rfbStatList messages[STAT_MESSAGES];
+    rfbStatList encodings[STAT_ENCODINGS];
+    uint32_t bytesSent, bytesSentIfRaw;	/* over all of the above */
+    uint32_t bytesRcvd, bytesRcvdIfRaw;
+    rfbStatHistogram encodeTime, updateBytes, updateLatency, fps;
+    time_t startTime;
+    time_t second;			/* the second updates are counted in */
+    uint32_t updatesThisSecond, bytesThisSecond;
+    uint32_t updatesLastSecond, bytesLastSecond;
+} rfbStats;
+
+static int EncodingSlot(uint32_t type)
 {
-    rfbStatList *ptr;
-    if (cl==NULL) return NULL;
-    for (ptr = cl->statEncList; ptr!=NULL; ptr=ptr->Next)
-    {
-        if (ptr->type==type) return ptr;
+    int r, slot = 0;
+
+    for (r = 0; r < STAT_ENCODING_RUNS; r++) {
+        if (type - encodingRuns[r].first < (uint32_t)encodingRuns[r].count)
+            return slot + (int)(type - encodingRuns[r].first);
+        slot += encodingRuns[r].count;
     }
-    /* Well, we are here... need to *CREATE* an entry */
-    ptr = (rfbStatList *)malloc(sizeof(rfbStatList));
-    if (ptr!=NULL)
-    {
-        memset((char *)ptr, 0, sizeof(rfbStatList));
-        ptr->type = type;
-        /* add to the top of the list */
-        ptr->Next = cl->statEncList;
-        cl->statEncList = ptr;
+    return slot;
+}
+
+static void InitStats(rfbStats *stats)
+{
+    int r, i, slot = 0;
+
+    memset((char *)stats, 0, sizeof(rfbStats));
+    for (i = 0; i < STAT_MESSAGES; i++)
+        stats->messages[i].type = i;
+    for (r = 0; r < STAT_ENCODING_RUNS; r++)
+        for (i = 0; i < encodingRuns[r].count; i++)
+            stats->encodings[slot++].type = encodingRuns[r].first + i;
+    stats->encodings[slot].type = STAT_OTHER_ENCODING;
+    stats->startTime = time(NULL);
+}
+
+/* what was counted in the second before now, given what is counted in
+   second and what was in the one before it */
+static uint32_t LastSecond(time_t now, time_t second, uint32_t thisSecond, uint32_t lastSecond)
+{
+    if (second == now)
+        return lastSecond;
+    if (second == now - 1)
+        return thisSecond;
+    return 0;
+}
+
+/* bucket 0 holds 0, bucket n the values from 2^(n-1) up to 2^n-1 */
+static int HistogramBucket(uint32_t value)
+{
+    int bucket;
+
+    if (value == 0)
+        return 0;
+#ifdef __GNUC__
+    bucket = 32 - __builtin_clz(value);
+#else
+    for (bucket = 0; value; bucket++)
+        value >>= 1;
+#endif
+    return bucket < RFB_STAT_BUCKETS ? bucket : RFB_STAT_BUCKETS - 1;
+}
+
+static void HistogramAdd(rfbStatHistogram *h, int value)
+{
+    uint32_t v = value > 0 ? (uint32_t)value : 0;
+#ifdef STAT_ATOMIC
+    uint32_t max;
+#endif
+
+    STAT_ADD(h->buckets[HistogramBucket(v)], 1);
+    STAT_ADD(h->count, 1);
+    STAT_ADD(h->sum, v);
+#ifdef STAT_ATOMIC
+    while ((max = h->max) < v && !__sync_bool_compare_and_swap(&h->max, max, v))
+        ;
+#else
+    if (h->max < v)
+        h->max = v;
+#endif
+}
+
+static void HistogramCopy(rfbStatHistogram *to, rfbStatHistogram *from)
+{
+    int i;
+
+    for (i = 0; i < RFB_STAT_BUCKETS; i++)
+        to->buckets[i] = STAT_READ(from->buckets[i]);
+    to->count = STAT_READ(from->count);
+    to->sum = STAT_READ(from->sum);
+    to->max = STAT_READ(from->max);
+}
+
+/* The value below which percent of the recorded ones are: the top of
+   their bucket, so at most twice too high */
+int rfbStatHistogramPercentile(const rfbStatHistogram *h, int percent)
+{
+    uint32_t seen = 0, wanted;
+    int i;
+
+    if (h==NULL || h->count==0) return 0;
+    wanted = (uint32_t)(((double)h->count * percent + 99) / 100);
+    for (i = 0; i < RFB_STAT_BUCKETS; i++) {
+        seen += h->buckets[i];
+        if (seen >= wanted && seen > 0)
+            break;
     }
-    return ptr;
+    if (i == 0)
+        return 0;
+    if (i >= 31 || (((uint32_t)1 << i) - 1) > h->max)
+        return h->max;
+    return ((uint32_t)1 << i) - 1;
+}
+
+rfbStatList *rfbStatLookupEncoding(rfbClientPtr cl, uint32_t type)
+{
+    rfbStats *stats;
+    if (cl==NULL || cl->statData==NULL) return NULL;
+    stats = (rfbStats *)cl->statData;
+    return &stats->encodings[EncodingSlot(type)];
 }
 
 
 rfbStatList *rfbStatLookupMessage(rfbClientPtr cl, uint32_t type)
 {
-    rfbStatList *ptr;
-    if (cl==NULL) return NULL;
-    for (ptr = cl->statMsgList; ptr!=NULL; ptr=ptr->Next)
-    {
-        if (ptr->type==type) return ptr;
-    }
-    /* Well, we are here... need to *CREATE* an entry */
-    ptr = (rfbStatList *)malloc(sizeof(rfbStatList));
-    if (ptr!=NULL)
-    {
-        memset((char *)ptr, 0, sizeof(rfbStatList));
-        ptr->type = type;
-        /* add to the top of the list */
-        ptr->Next = cl->statMsgList;
-        cl->statMsgList = ptr;
-    }
-    return ptr;
+    rfbStats *stats;
+    if (cl==NULL || cl->statData==NULL) return NULL;
+    stats = (rfbStats *)cl->statData;
+    return &stats->messages[type % STAT_MESSAGES];
 }
 
 void rfbStatRecordEncodingSentAdd(rfbClientPtr cl, uint32_t type, int byteCount) /* Specifically for tight encoding */
@@ -210,7 +350,10 @@ void rfbStatRecordEncodingSentAdd(rfbClientPtr cl, uint32_t type, int byteCount)
 
     ptr = rfbStatLookupEncoding(cl, type);
     if (ptr!=NULL)
-        ptr->bytesSent      += byteCount;
+    {
+        STAT_ADD(ptr->bytesSent, byteCount);
+        STAT_ADD(((rfbStats *)cl->statData)->bytesSent, byteCount);
+    }
 }
 
 
@@ -221,9 +364,12 @@ void  rfbStatRecordEncodingSent(rfbClientPtr cl, uint32_t type, int byteCount, i
     ptr = rfbStatLookupEncoding(cl, type);
     if (ptr!=NULL)
     {
-        ptr->sentCount++;
-        ptr->bytesSent      += byteCount;
-        ptr->bytesSentIfRaw += byteIfRaw;
+        rfbStats *stats = (rfbStats *)cl->statData;
+        STAT_ADD(ptr->sentCount, 1);
+        STAT_ADD(ptr->bytesSent, byteCount);
+        STAT_ADD(ptr->bytesSentIfRaw, byteIfRaw);
+        STAT_ADD(stats->bytesSent, byteCount);
+        STAT_ADD(stats->bytesSentIfRaw, byteIfRaw);
     }
 }
 
@@ -234,9 +380,12 @@ void  rfbStatRecordEncodingRcvd(rfbClientPtr cl, uint32_t type, int byteCount, i
     ptr = rfbStatLookupEncoding(cl, type);
     if (ptr!=NULL)
     {
-        ptr->rcvdCount++;
-        ptr->bytesRcvd      += byteCount;
-        ptr->bytesRcvdIfRaw += byteIfRaw;
+        rfbStats *stats = (rfbStats *)cl->statData;
+        STAT_ADD(ptr->rcvdCount, 1);
+        STAT_ADD(ptr->bytesRcvd, byteCount);
+        STAT_ADD(ptr->bytesRcvdIfRaw, byteIfRaw);
+        STAT_ADD(stats->bytesRcvd, byteCount);
+        STAT_ADD(stats->bytesRcvdIfRaw, byteIfRaw);
     }
 }
 
@@ -247,9 +396,12 @@ void  rfbStatRecordMessageSent(rfbClientPtr cl, uint32_t type, int byteCount, in
     ptr = rfbStatLookupMessage(cl, type);
     if (ptr!=NULL)
     {
-        ptr->sentCount++;
-        ptr->bytesSent      += byteCount;
-        ptr->bytesSentIfRaw += byteIfRaw;
+        rfbStats *stats = (rfbStats *)cl->statData;
+        STAT_ADD(ptr->sentCount, 1);
+        STAT_ADD(ptr->bytesSent, byteCount);
+        STAT_ADD(ptr->bytesSentIfRaw, byteIfRaw);
+        STAT_ADD(stats->bytesSent, byteCount);
+        STAT_ADD(stats->bytesSentIfRaw, byteIfRaw);
     }
 }
 
@@ -260,119 +412,281 @@ void  rfbStatRecordMessageRcvd(rfbClientPtr cl, uint32_t type, int byteCount, in
     ptr = rfbStatLookupMessage(cl, type);
     if (ptr!=NULL)
     {
-        ptr->rcvdCount++;
-        ptr->bytesRcvd      += byteCount;
-        ptr->bytesRcvdIfRaw += byteIfRaw;
+        rfbStats *stats = (rfbStats *)cl->statData;
+        STAT_ADD(ptr->rcvdCount, 1);
+        STAT_ADD(ptr->bytesRcvd, byteCount);
+        STAT_ADD(ptr->bytesRcvdIfRaw, byteIfRaw);
+        STAT_ADD(stats->bytesRcvd, byteCount);
+        STAT_ADD(stats->bytesRcvdIfRaw, byteIfRaw);
     }
 }
 
 
 int rfbStatGetSentBytes(rfbClientPtr cl)
 {
-    rfbStatList *ptr=NULL;
-    int bytes=0;
-    if (cl==NULL) return 0;
-    for (ptr = cl->statMsgList; ptr!=NULL; ptr=ptr->Next)
-        bytes += ptr->bytesSent;
-    for (ptr = cl->statEncList; ptr!=NULL; ptr=ptr->Next)
-        bytes += ptr->bytesSent;
-    return bytes;
+    if (cl==NULL || cl->statData==NULL) return 0;
+    return STAT_READ(((rfbStats *)cl->statData)->bytesSent);
 }
 
 int rfbStatGetSentBytesIfRaw(rfbClientPtr cl)
 {
-    rfbStatList *ptr=NULL;
-    int bytes=0;
-    if (cl==NULL) return 0;
-    for (ptr = cl->statMsgList; ptr!=NULL; ptr=ptr->Next)
-        bytes += ptr->bytesSentIfRaw;
-    for (ptr = cl->statEncList; ptr!=NULL; ptr=ptr->Next)
-        bytes += ptr->bytesSentIfRaw;
-    return bytes;
+    if (cl==NULL || cl->statData==NULL) return 0;
+    return STAT_READ(((rfbStats *)cl->statData)->bytesSentIfRaw);
 }
 
 int rfbStatGetRcvdBytes(rfbClientPtr cl)
 {
-    rfbStatList *ptr=NULL;
-    int bytes=0;
-    if (cl==NULL) return 0;
-    for (ptr = cl->statMsgList; ptr!=NULL; ptr=ptr->Next)
-        bytes += ptr->bytesRcvd;
-    for (ptr = cl->statEncList; ptr!=NULL; ptr=ptr->Next)
-        bytes += ptr->bytesRcvd;
-    return bytes;
+    if (cl==NULL || cl->statData==NULL) return 0;
+    return STAT_READ(((rfbStats *)cl->statData)->bytesRcvd);
 }
 
 int rfbStatGetRcvdBytesIfRaw(rfbClientPtr cl)
 {
-    rfbStatList *ptr=NULL;
-    int bytes=0;
-    if (cl==NULL) return 0;
-    for (ptr = cl->statMsgList; ptr!=NULL; ptr=ptr->Next)
-        bytes += ptr->bytesRcvdIfRaw;
-    for (ptr = cl->statEncList; ptr!=NULL; ptr=ptr->Next)
-        bytes += ptr->bytesRcvdIfRaw;
-    return bytes;
+    if (cl==NULL || cl->statData==NULL) return 0;
+    return STAT_READ(((rfbStats *)cl->statData)->bytesRcvdIfRaw);
 }
 
 int rfbStatGetMessageCountSent(rfbClientPtr cl, uint32_t type)
 {
-  rfbStatList *ptr=NULL;
-    if (cl==NULL) return 0;
-  for (ptr = cl->statMsgList; ptr!=NULL; ptr=ptr->Next)
-      if (ptr->type==type) return ptr->sentCount;
-  return 0;
+  rfbStatList *ptr = rfbStatLookupMessage(cl, type);
+  return ptr!=NULL && ptr->type==type ? (int)STAT_READ(ptr->sentCount) : 0;
 }
 int rfbStatGetMessageCountRcvd(rfbClientPtr cl, uint32_t type)
 {
-  rfbStatList *ptr=NULL;
-    if (cl==NULL) return 0;
-  for (ptr = cl->statMsgList; ptr!=NULL; ptr=ptr->Next)
-      if (ptr->type==type) return ptr->rcvdCount;
-  return 0;
+  rfbStatList *ptr = rfbStatLookupMessage(cl, type);
+  return ptr!=NULL && ptr->type==type ? (int)STAT_READ(ptr->rcvdCount) : 0;
+}
+
+/* Changes which were merged into an update held back for a slow client */
+int rfbStatGetFramesSkipped(rfbClientPtr cl)
+{
+  if (cl==NULL) return 0;
+  return cl->framesSkipped;
+}
+
+/* Bytes queued for the client or not sent by the kernel yet, right now */
+int rfbStatGetQueueDepth(rfbClientPtr cl)
+{
+  if (cl==NULL) return 0;
+  return rfbOutQueuePending(cl) + rfbSocketUnsent(cl->sock);
+}
+
+int rfbStatGetMaxQueueDepth(rfbClientPtr cl)
+{
+  if (cl==NULL) return 0;
+  return cl->maxQueueDepth;
 }
 
 int rfbStatGetEncodingCountSent(rfbClientPtr cl, uint32_t type)
 {
-  rfbStatList *ptr=NULL;
-    if (cl==NULL) return 0;
-  for (ptr = cl->statEncList; ptr!=NULL; ptr=ptr->Next)
-      if (ptr->type==type) return ptr->sentCount;
-  return 0;
+  rfbStatList *ptr = rfbStatLookupEncoding(cl, type);
+  return ptr!=NULL && ptr->type==type ? (int)STAT_READ(ptr->sentCount) : 0;
 }
 int rfbStatGetEncodingCountRcvd(rfbClientPtr cl, uint32_t type)
 {
-  rfbStatList *ptr=NULL;
-    if (cl==NULL) return 0;
-  for (ptr = cl->statEncList; ptr!=NULL; ptr=ptr->Next)
-      if (ptr->type==type) return ptr->rcvdCount;
-  return 0;
+  rfbStatList *ptr = rfbStatLookupEncoding(cl, type);
+  return ptr!=NULL && ptr->type==type ? (int)STAT_READ(ptr->rcvdCount) : 0;
 }
 
+/* From the first change in an update until it was sent, for the client
+   and per class of clients, see rfbClientClass() */
+void rfbStatRecordUpdateLatency(rfbClientPtr cl, int us)
+{
+    rfbScreenInfoPtr screen = cl->screen;
+    rfbClassStats *stats = &screen->classStats[rfbClientClass(cl)];
+
+    if (cl->statData!=NULL)
+        HistogramAdd(&((rfbStats *)cl->statData)->updateLatency, us);
+
+    LOCK(screen->classStatsMutex);
+    stats->updates++;
+    stats->totalLatency += us;
+    if ((uint32_t)us > stats->maxLatency)
+        stats->maxLatency = us;
+    UNLOCK(screen->classStatsMutex);
+}
 
+/* An update of byteCount bytes was sent.  Only the thread sending the
+   client's updates calls this, so the count for the current second needs
+   no atomics; seconds in which nothing was sent are not counted. */
+void rfbStatRecordUpdateSent(rfbClientPtr cl, int byteCount)
+{
+    rfbStats *stats;
+    time_t now = time(NULL);
+
+    if (cl==NULL || cl->statData==NULL) return;
+    stats = (rfbStats *)cl->statData;
+    HistogramAdd(&stats->updateBytes, byteCount);
+    if (now != stats->second) {
+        if (stats->updatesThisSecond > 0)
+            HistogramAdd(&stats->fps, stats->updatesThisSecond);
+        stats->updatesLastSecond = LastSecond(now, stats->second, stats->updatesThisSecond, 0);
+        stats->bytesLastSecond = LastSecond(now, stats->second, stats->bytesThisSecond, 0);
+        stats->second = now;
+        stats->updatesThisSecond = 0;
+        stats->bytesThisSecond = 0;
+    }
+    stats->updatesThisSecond++;
+    stats->bytesThisSecond += byteCount;
+}
 
+/* The application scanned the screen for changes, see rfbCaptureStats.
+   Only the thread scanning calls this. */
+void rfbStatRecordCapture(rfbScreenInfoPtr screen, int us, rfbBool changed)
+{
+    rfbCaptureStats *stats;
+    time_t now = time(NULL);
+
+    if (screen==NULL) return;
+    stats = &screen->captureStats;
+    STAT_ADD(stats->scans, 1);
+    HistogramAdd(&stats->scanTime, us);
+    if (now != stats->second) {
+        if (stats->framesThisSecond > 0)
+            HistogramAdd(&stats->fps, stats->framesThisSecond);
+        stats->framesLastSecond = LastSecond(now, stats->second, stats->framesThisSecond, 0);
+        stats->second = now;
+        stats->framesThisSecond = 0;
+    }
+    if (changed) {
+        STAT_ADD(stats->frames, 1);
+        stats->framesThisSecond++;
+    }
+}
 
-void rfbResetStats(rfbClientPtr cl)
+void rfbStatGetCaptureSnapshot(rfbScreenInfoPtr screen, rfbCaptureStats *snapshot)
+{
+    rfbCaptureStats *stats;
+
+    if (snapshot==NULL) return;
+    memset((char *)snapshot, 0, sizeof(rfbCaptureStats));
+    if (screen==NULL) return;
+    stats = &screen->captureStats;
+    snapshot->scans = STAT_READ(stats->scans);
+    snapshot->frames = STAT_READ(stats->frames);
+    HistogramCopy(&snapshot->scanTime, &stats->scanTime);
+    HistogramCopy(&snapshot->fps, &stats->fps);
+    snapshot->second = stats->second;
+    snapshot->framesThisSecond = stats->framesThisSecond;
+    snapshot->framesLastSecond = LastSecond(time(NULL), snapshot->second,
+            snapshot->framesThisSecond, stats->framesLastSecond);
+}
+
+int rfbStatGetClassUpdates(rfbScreenInfoPtr screen, int clientClass)
+{
+    if (screen==NULL || clientClass<0 || clientClass>=RFB_CLIENT_CLASSES) return 0;
+    return screen->classStats[clientClass].updates;
+}
+
+/* on average, in us */
+int rfbStatGetClassLatency(rfbScreenInfoPtr screen, int clientClass)
+{
+    rfbClassStats *stats;
+    if (screen==NULL || clientClass<0 || clientClass>=RFB_CLIENT_CLASSES) return 0;
+    stats = &screen->classStats[clientClass];
+    return stats->updates ? (int)(stats->totalLatency/stats->updates) : 0;
+}
+
+int rfbStatGetClassMaxLatency(rfbScreenInfoPtr screen, int clientClass)
+{
+    if (screen==NULL || clientClass<0 || clientClass>=RFB_CLIENT_CLASSES) return 0;
+    return screen->classStats[clientClass].maxLatency;
+}
+
+/* Time spent encoding rectangles, see rfbSendFramebufferUpdate() */
+void rfbStatRecordEncodingTime(rfbClientPtr cl, uint32_t type, int us)
 {
     rfbStatList *ptr;
-    if (cl==NULL) return;
-    while (cl->statEncList!=NULL)
-    {
-        ptr = cl->statEncList;
-        cl->statEncList = ptr->Next;
-        free(ptr);
-    }
-    while (cl->statMsgList!=NULL)
+
+    ptr = rfbStatLookupEncoding(cl, type);
+    if (ptr!=NULL)
     {
-        ptr = cl->statMsgList;
-        cl->statMsgList = ptr->Next;
-        free(ptr);
+        STAT_ADD(ptr->encodeCount, 1);
+        STAT_ADD(ptr->encodeTime, us);
+        HistogramAdd(&((rfbStats *)cl->statData)->encodeTime, us);
     }
 }
 
+/* in us */
+int rfbStatGetEncodingTime(rfbClientPtr cl, uint32_t type)
+{
+  rfbStatList *ptr = rfbStatLookupEncoding(cl, type);
+  return ptr!=NULL && ptr->type==type ? (int)STAT_READ(ptr->encodeTime) : 0;
+}
+
+/*
+ * What has been counted for the client so far, while it is connected and
+ * from any thread.  Each number is read atomically, but they are not
+ * taken at one instant: an update being sent may be in some of them and
+ * not yet in others, and the counts for the last second may be a little
+ * off while it ends.
+ */
+void rfbStatGetSnapshot(rfbClientPtr cl, rfbStatSnapshot *snapshot)
+{
+    rfbStats *stats;
+
+    if (snapshot==NULL) return;
+    memset((char *)snapshot, 0, sizeof(rfbStatSnapshot));
+    if (cl==NULL || cl->statData==NULL) return;
+    stats = (rfbStats *)cl->statData;
+
+    snapshot->bytesSent = STAT_READ(stats->bytesSent);
+    snapshot->bytesSentIfRaw = STAT_READ(stats->bytesSentIfRaw);
+    snapshot->bytesRcvd = STAT_READ(stats->bytesRcvd);
+    snapshot->bytesRcvdIfRaw = STAT_READ(stats->bytesRcvdIfRaw);
+    snapshot->updatesSent = STAT_READ(stats->messages[rfbFramebufferUpdate].sentCount);
+    snapshot->updatesLastSecond = LastSecond(time(NULL), stats->second,
+            stats->updatesThisSecond, stats->updatesLastSecond);
+    snapshot->bytesLastSecond = LastSecond(time(NULL), stats->second,
+            stats->bytesThisSecond, stats->bytesLastSecond);
+    snapshot->keyEvents = STAT_READ(stats->messages[rfbKeyEvent].rcvdCount);
+    snapshot->pointerEvents = STAT_READ(stats->messages[rfbPointerEvent].rcvdCount);
+    snapshot->startTime = stats->startTime;
+    snapshot->framesSkipped = cl->framesSkipped;
+    snapshot->queueDepth = rfbStatGetQueueDepth(cl);
+    snapshot->maxQueueDepth = cl->maxQueueDepth;
+    snapshot->roundTripTime = cl->roundTripTime;
+    snapshot->adaptLevel = cl->adaptData ? rfbAdaptGetLevel(cl) : 0;
+    HistogramCopy(&snapshot->encodeTime, &stats->encodeTime);
+    HistogramCopy(&snapshot->updateBytes, &stats->updateBytes);
+    HistogramCopy(&snapshot->updateLatency, &stats->updateLatency);
+    HistogramCopy(&snapshot->fps, &stats->fps);
+}
+
+
+
+
+void rfbResetStats(rfbClientPtr cl)
+{
+    if (cl==NULL) return;
+    if (cl->statData==NULL)
+        cl->statData = malloc(sizeof(rfbStats));
+    if (cl->statData!=NULL)
+        InitStats((rfbStats *)cl->statData);
+    cl->framesSkipped = 0;
+    cl->maxQueueDepth = 0;
+}
+
+void rfbFreeStats(rfbClientPtr cl)
+{
+    if (cl==NULL) return;
+    free(cl->statData);
+    cl->statData = NULL;
+}
+
+
+static void PrintHistogram(const char *name, rfbStatHistogram *h)
+{
+    if (h->count>0)
+        rfbLog("%s: median %d, 90%% %d, 99%% %d, at most %u (%u samples)\n",
+                name, rfbStatHistogramPercentile(h, 50),
+                rfbStatHistogramPercentile(h, 90),
+                rfbStatHistogramPercentile(h, 99), h->max, h->count);
+}
 
 void rfbPrintStats(rfbClientPtr cl)
 {
+    rfbStats *stats;
     rfbStatList *ptr=NULL;
     char encBuf[64];
     double savings=0.0;
@@ -385,10 +699,11 @@ void rfbPrintStats(rfbClientPtr cl)
     int bytesIfRaw=0;
     int count=0;
 
-    if (cl==NULL) return;
-    
+    if (cl==NULL || cl->statData==NULL) return;
+    stats = (rfbStats *)cl->statData;
+
     rfbLog("%-21.21s  %-6.6s   %9.9s/%9.9s (%6.6s)\n", "Statistics", "events", "Transmit","RawEquiv","saved");
-    for (ptr = cl->statMsgList; ptr!=NULL; ptr=ptr->Next)
+    for (ptr = stats->messages; ptr < stats->messages + STAT_MESSAGES; ptr++)
     {
         name       = messageNameServer2Client(ptr->type, encBuf, sizeof(encBuf));
         count      = ptr->sentCount;
@@ -406,9 +721,10 @@ void rfbPrintStats(rfbClientPtr cl)
         totalBytesIfRaw += bytesIfRaw;
     }
 
-    for (ptr = cl->statEncList; ptr!=NULL; ptr=ptr->Next)
+    for (ptr = stats->encodings; ptr < stats->encodings + STAT_ENCODINGS; ptr++)
     {
-        name       = encodingName(ptr->type, encBuf, sizeof(encBuf));
+        name       = ptr->type==STAT_OTHER_ENCODING ? "other" :
+                     encodingName(ptr->type, encBuf, sizeof(encBuf));
         count      = ptr->sentCount;
         bytes      = ptr->bytesSent;
         bytesIfRaw = ptr->bytesSentIfRaw;
@@ -434,7 +750,7 @@ void rfbPrintStats(rfbClientPtr cl)
     totalBytesIfRaw=0.0;
 
     rfbLog("%-21.21s  %-6.6s   %9.9s/%9.9s (%6.6s)\n", "Statistics", "events", "Received","RawEquiv","saved");
-    for (ptr = cl->statMsgList; ptr!=NULL; ptr=ptr->Next)
+    for (ptr = stats->messages; ptr < stats->messages + STAT_MESSAGES; ptr++)
     {
         name       = messageNameClient2Server(ptr->type, encBuf, sizeof(encBuf));
         count      = ptr->rcvdCount;
@@ -451,9 +767,10 @@ void rfbPrintStats(rfbClientPtr cl)
         totalBytes += bytes;
         totalBytesIfRaw += bytesIfRaw;
     }
-    for (ptr = cl->statEncList; ptr!=NULL; ptr=ptr->Next)
+    for (ptr = stats->encodings; ptr < stats->encodings + STAT_ENCODINGS; ptr++)
     {
-        name       = encodingName(ptr->type, encBuf, sizeof(encBuf));
+        name       = ptr->type==STAT_OTHER_ENCODING ? "other" :
+                     encodingName(ptr->type, encBuf, sizeof(encBuf));
         count      = ptr->rcvdCount;
         bytes      = ptr->bytesRcvd;
         bytesIfRaw = ptr->bytesRcvdIfRaw;
@@ -473,6 +790,36 @@ void rfbPrintStats(rfbClientPtr cl)
         savings = 100.0 - ((totalBytes/totalBytesIfRaw)*100.0);
     rfbLog(" %-20.20s: %6d | %9.0f/%9.0f (%5.1f%%)\n",
             "TOTALS", totalRects, totalBytes,totalBytesIfRaw, savings);
-      
-} 
 
+    rfbLog("Pacing: %d frames skipped, queue depth %d bytes (at most %d)\n",
+            rfbStatGetFramesSkipped(cl), rfbStatGetQueueDepth(cl),
+            rfbStatGetMaxQueueDepth(cl));
+    if (cl->roundTripTime>0)
+        rfbLog("Round trip time: %.1f ms\n", cl->roundTripTime/1000.0);
+    if (cl->adaptData)
+        rfbLog("Adaptive quality: level %d\n", rfbAdaptGetLevel(cl));
+    for (ptr = stats->encodings; ptr < stats->encodings + STAT_ENCODINGS; ptr++)
+        if (ptr->encodeCount>0)
+            rfbLog("Encoding %s: %d rects in %.1f ms (%.1f us per rect)\n",
+                    encodingName(ptr->type, encBuf, sizeof(encBuf)),
+                    ptr->encodeCount, ptr->encodeTime/1000.0,
+                    (double)ptr->encodeTime/ptr->encodeCount);
+    PrintHistogram("Encode time per rect (us)", &stats->encodeTime);
+    PrintHistogram("Bytes per update", &stats->updateBytes);
+    PrintHistogram("Update latency (us)", &stats->updateLatency);
+    PrintHistogram("Updates per second", &stats->fps);
+}
+
+void rfbPrintClassStats(rfbScreenInfoPtr screen)
+{
+    static const char *names[RFB_CLIENT_CLASSES] = { "interactive", "normal", "view-only" };
+    int c;
+
+    if (screen==NULL) return;
+    for (c = 0; c < RFB_CLIENT_CLASSES; c++)
+        if (screen->classStats[c].updates>0)
+            rfbLog("Latency of %s clients: %d updates in %.1f ms on average (at most %.1f)\n",
+                    names[c], rfbStatGetClassUpdates(screen, c),
+                    rfbStatGetClassLatency(screen, c)/1000.0,
+                    rfbStatGetClassMaxLatency(screen, c)/1000.0);
+}
@@ -27,6 +27,7 @@
 /*#include <stdio.h>*/
 #include <rfb/rfb.h>
 #include "private.h"
+#include "pixelscan.h"
 
 #ifdef WIN32
 #define XMD_H
@@ -47,9 +48,6 @@
 /* May be set to TRUE with "-lazytight" Xvnc option. */
 rfbBool rfbTightDisableGradient = FALSE;
 
-/* This variable is set on every rfbSendRectEncodingTight() call. */
-static rfbBool usePixelFormat24;
-
 
 /* Compression level stuff. The following array contains various
    encoder parameters for each of 10 compression levels (0..9).
@@ -77,58 +75,70 @@ static TIGHT_CONF tightConf[10] = {
     { 65536, 2048,  32,  8192, 9, 9, 9, 6, 200, 500,  96, 80,   200,   500 }
 };
 
-static int compressLevel;
-static int qualityLevel;
-
-/* Stuff dealing with palettes. */
+/* Stuff dealing with palettes. Entries are kept sorted by pixel count;
+   colors are found through a flat open-addressing table whose slots
+   hold the index of the entry. */
 
-typedef struct COLOR_LIST_s {
-    struct COLOR_LIST_s *next;
-    int idx;
-    uint32_t rgb;
-} COLOR_LIST;
+#define PALETTE_HASH_SIZE 512
 
 typedef struct PALETTE_ENTRY_s {
-    COLOR_LIST *listNode;
+    uint32_t rgb;
     int numPixels;
+    int slot;
 } PALETTE_ENTRY;
 
 typedef struct PALETTE_s {
     PALETTE_ENTRY entry[256];
-    COLOR_LIST *hash[256];
-    COLOR_LIST list[256];
+    uint32_t slotColor[PALETTE_HASH_SIZE];
+    uint8_t slotIdx[PALETTE_HASH_SIZE];
+    uint8_t slotUsed[PALETTE_HASH_SIZE];
 } PALETTE;
 
-/* TODO: move into rfbScreen struct */
-static int paletteNumColors, paletteMaxColors;
-static uint32_t monoBackground, monoForeground;
-static PALETTE palette;
+/* Encoding plan: the list of rectangles the one being sent is going to
+   be split into. */
 
-/* Pointers to dynamically-allocated buffers. */
+typedef struct TIGHT_PLAN_RECT_s {
+    int x, y, w, h;
+    rfbBool solid;
+} TIGHT_PLAN_RECT;
 
-static int tightBeforeBufSize = 0;
-static char *tightBeforeBuf = NULL;
+/* Per client state, kept in cl->tightData until the client goes away:
+   the levels and pixel format of the rectangle being sent, its palette,
+   the solid-tile map and the plan made from it, and the JPEG compressor.
+   The pixels themselves go through cl->beforeEncBuf and cl->afterEncBuf. */
 
-static int tightAfterBufSize = 0;
-static char *tightAfterBuf = NULL;
+typedef struct TIGHT_DATA_s {
+    /* set on every rfbSendRectEncodingTight() call */
+    int compressLevel;
+    int qualityLevel;
+    rfbBool usePixelFormat24;
 
-static int *prevRowBuf = NULL;
+    int paletteNumColors, paletteMaxColors;
+    uint32_t monoBackground, monoForeground;
+    PALETTE palette;
 
-void rfbTightCleanup(rfbScreenInfoPtr screen)
-{
-  if(tightBeforeBufSize) {
-    free(tightBeforeBuf);
-    tightBeforeBufSize=0;
-  }
-  if(tightAfterBufSize) {
-    free(tightAfterBuf);
-    tightAfterBufSize=0;
-  }
-}
+    int *prevRowBuf;
+
+    int tileX, tileY, tileW, tileH;
+    int tileCols, tileRows;
+    int tileMapSize;
+    uint32_t *tileColor;
+    char *tileSolid;
+
+    int planSize, planLen;
+    TIGHT_PLAN_RECT *plan;
+
+    struct TIGHT_JPEG_s *jpeg;
+} TIGHT_DATA;
 
 /* Prototypes for static functions. */
 
-static void FindBestSolidArea (rfbClientPtr cl, int x, int y, int w, int h,
+static TIGHT_DATA *TightGetData (rfbClientPtr cl);
+static rfbBool PlanTiles        (rfbClientPtr cl, int x, int y, int w, int h);
+static rfbBool PlanRect         (rfbClientPtr cl, int x, int y, int w, int h,
+                                 int nMaxRows);
+static void FindBestSolidArea (TIGHT_DATA *td, int col, int row,
+                               int col1, int row1,
                                uint32_t colorValue, int *w_ptr, int *h_ptr);
 static void ExtendSolidArea   (rfbClientPtr cl, int x, int y, int w, int h,
                                uint32_t colorValue,
@@ -156,21 +166,22 @@ static rfbBool CompressData(rfbClientPtr cl, int streamId, int dataLen,
                          int zlibLevel, int zlibStrategy);
 static rfbBool SendCompressedData(rfbClientPtr cl, int compressedLen);
 
-static void FillPalette8(int count);
-static void FillPalette16(int count);
-static void FillPalette32(int count);
+static void FillPalette8(rfbClientPtr cl, int count);
+static void FillPalette16(rfbClientPtr cl, int count);
+static void FillPalette32(rfbClientPtr cl, int count);
 
-static void PaletteReset(void);
-static int PaletteInsert(uint32_t rgb, int numPixels, int bpp);
+static void PaletteReset(TIGHT_DATA *td);
+static int PaletteFindSlot(TIGHT_DATA *td, uint32_t rgb, int bpp);
+static int PaletteInsert(TIGHT_DATA *td, uint32_t rgb, int numPixels, int bpp);
 
 static void Pack24(rfbClientPtr cl, char *buf, rfbPixelFormat *fmt, int count);
 
-static void EncodeIndexedRect16(uint8_t *buf, int count);
-static void EncodeIndexedRect32(uint8_t *buf, int count);
+static void EncodeIndexedRect16(TIGHT_DATA *td, uint8_t *buf, int count);
+static void EncodeIndexedRect32(TIGHT_DATA *td, uint8_t *buf, int count);
 
-static void EncodeMonoRect8(uint8_t *buf, int w, int h);
-static void EncodeMonoRect16(uint8_t *buf, int w, int h);
-static void EncodeMonoRect32(uint8_t *buf, int w, int h);
+static void EncodeMonoRect8(TIGHT_DATA *td, uint8_t *buf, int w, int h);
+static void EncodeMonoRect16(TIGHT_DATA *td, uint8_t *buf, int w, int h);
+static void EncodeMonoRect32(TIGHT_DATA *td, uint8_t *buf, int w, int h);
 
 static void FilterGradient24(rfbClientPtr cl, char *buf, rfbPixelFormat *fmt, int w, int h);
 static void FilterGradient16(rfbClientPtr cl, uint16_t *buf, rfbPixelFormat *fmt, int w, int h);
@@ -181,17 +192,24 @@ static unsigned long DetectSmoothImage24(rfbClientPtr cl, rfbPixelFormat *fmt, i
 static unsigned long DetectSmoothImage16(rfbClientPtr cl, rfbPixelFormat *fmt, int w, int h);
 static unsigned long DetectSmoothImage32(rfbClientPtr cl, rfbPixelFormat *fmt, int w, int h);
 
+struct TIGHT_JPEG_s;
+
 static rfbBool SendJpegRect(rfbClientPtr cl, int x, int y, int w, int h,
                          int quality);
-static void PrepareRowForJpeg(rfbClientPtr cl, uint8_t *dst, int x, int y, int count);
+static void PrepareRowForJpeg(rfbClientPtr cl, struct TIGHT_JPEG_s *jpeg,
+                              uint8_t *dst, int x, int y, int count);
 static void PrepareRowForJpeg24(rfbClientPtr cl, uint8_t *dst, int x, int y, int count);
-static void PrepareRowForJpeg16(rfbClientPtr cl, uint8_t *dst, int x, int y, int count);
-static void PrepareRowForJpeg32(rfbClientPtr cl, uint8_t *dst, int x, int y, int count);
+static void PrepareRowForJpeg16(rfbClientPtr cl, struct TIGHT_JPEG_s *jpeg,
+                                uint8_t *dst, int x, int y, int count);
+static void PrepareRowForJpeg32(rfbClientPtr cl, struct TIGHT_JPEG_s *jpeg,
+                                uint8_t *dst, int x, int y, int count);
+static rfbBool JpegUpdateLookupTables(rfbClientPtr cl, struct TIGHT_JPEG_s *jpeg);
 
 static void JpegInitDestination(j_compress_ptr cinfo);
 static boolean JpegEmptyOutputBuffer(j_compress_ptr cinfo);
 static void JpegTermDestination(j_compress_ptr cinfo);
-static void JpegSetDstManager(j_compress_ptr cinfo);
+static void JpegSetDstManager(j_compress_ptr cinfo,
+                              struct jpeg_destination_mgr *dst);
 
 
 /*
@@ -208,11 +226,6 @@ rfbNumCodedRectsTight(rfbClientPtr cl,
     int maxRectSize, maxRectWidth;
     int subrectMaxWidth, subrectMaxHeight;
 
-    /* No matter how many rectangles we will send if LastRect markers
-       are used to terminate rectangle stream. */
-    if (cl->enableLastRectEncoding && w * h >= MIN_SPLIT_RECT_SIZE)
-      return 0;
-
     maxRectSize = tightConf[cl->tightCompressLevel].maxRectSize;
     maxRectWidth = tightConf[cl->tightCompressLevel].maxRectWidth;
 
@@ -233,36 +246,40 @@ rfbSendRectEncodingTight(rfbClientPtr cl,
                          int w,
                          int h)
 {
+    TIGHT_DATA *td;
     int nMaxRows;
-    uint32_t colorValue;
-    int dx, dy, dw, dh;
-    int x_best, y_best, w_best, h_best;
+    int n;
+    TIGHT_PLAN_RECT *r;
     char *fbptr;
 
     rfbSendUpdateBuf(cl);
 
-    compressLevel = cl->tightCompressLevel;
-    qualityLevel = cl->tightQualityLevel;
+    td = TightGetData(cl);
+    if (td == NULL)
+        return FALSE;
+
+    td->compressLevel = cl->tightCompressLevel;
+    td->qualityLevel = cl->tightQualityLevel;
 
     if ( cl->format.depth == 24 && cl->format.redMax == 0xFF &&
          cl->format.greenMax == 0xFF && cl->format.blueMax == 0xFF ) {
-        usePixelFormat24 = TRUE;
+        td->usePixelFormat24 = TRUE;
     } else {
-        usePixelFormat24 = FALSE;
+        td->usePixelFormat24 = FALSE;
     }
 
     if (!cl->enableLastRectEncoding || w * h < MIN_SPLIT_RECT_SIZE)
         return SendRectSimple(cl, x, y, w, h);
 
-    /* Make sure we can write at least one pixel into tightBeforeBuf. */
+    /* Make sure we can write at least one pixel into cl->beforeEncBuf. */
 
-    if (tightBeforeBufSize < 4) {
-        tightBeforeBufSize = 4;
-        if (tightBeforeBuf == NULL)
-            tightBeforeBuf = (char *)malloc(tightBeforeBufSize);
+    if (cl->beforeEncBufSize < 4) {
+        cl->beforeEncBufSize = 4;
+        if (cl->beforeEncBuf == NULL)
+            cl->beforeEncBuf = (char *)malloc(cl->beforeEncBufSize);
         else
-            tightBeforeBuf = (char *)realloc(tightBeforeBuf,
-                                              tightBeforeBufSize);
+            cl->beforeEncBuf = (char *)realloc(cl->beforeEncBuf,
+                                               cl->beforeEncBufSize);
     }
 
     /* Calculate maximum number of rows in one non-solid rectangle. */
@@ -270,142 +287,297 @@ rfbSendRectEncodingTight(rfbClientPtr cl,
     {
         int maxRectSize, maxRectWidth, nMaxWidth;
 
-        maxRectSize = tightConf[compressLevel].maxRectSize;
-        maxRectWidth = tightConf[compressLevel].maxRectWidth;
+        maxRectSize = tightConf[td->compressLevel].maxRectSize;
+        maxRectWidth = tightConf[td->compressLevel].maxRectWidth;
         nMaxWidth = (w > maxRectWidth) ? maxRectWidth : w;
         nMaxRows = maxRectSize / nMaxWidth;
     }
 
-    /* Try to find large solid-color areas and send them separately. */
+    /* Analyze the pixels once, then send what the plan says. */
 
-    for (dy = y; dy < y + h; dy += MAX_SPLIT_TILE_SIZE) {
+    if (!PlanTiles(cl, x, y, w, h))
+        return SendRectSimple(cl, x, y, w, h);
 
-        /* If a rectangle becomes too large, send its upper part now. */
+    td->planLen = 0;
+    if (!PlanRect(cl, x, y, w, h, nMaxRows))
+        return SendRectSimple(cl, x, y, w, h);
 
-        if (dy - y >= nMaxRows) {
-            if (!SendRectSimple(cl, x, y, w, nMaxRows))
-                return 0;
-            y += nMaxRows;
-            h -= nMaxRows;
+    for (n = 0; n < td->planLen; n++) {
+        r = &td->plan[n];
+
+        if (!r->solid) {
+            if (!SendRectSimple(cl, r->x, r->y, r->w, r->h))
+                return FALSE;
+            continue;
         }
 
-        dh = (dy + MAX_SPLIT_TILE_SIZE <= y + h) ?
-            MAX_SPLIT_TILE_SIZE : (y + h - dy);
+        if (!SendTightHeader(cl, r->x, r->y, r->w, r->h))
+            return FALSE;
+
+        fbptr = (cl->scaledScreen->frameBuffer +
+                 (cl->scaledScreen->paddedWidthInBytes * r->y) +
+                 (r->x * (cl->scaledScreen->bitsPerPixel / 8)));
+
+        (*cl->translateFn)(cl->translateLookupTable, &cl->screen->serverFormat,
+                           &cl->format, fbptr, cl->beforeEncBuf,
+                           cl->scaledScreen->paddedWidthInBytes, 1, 1);
+
+        if (!SendSolidRect(cl))
+            return FALSE;
+    }
+
+    return TRUE;
+}
+
+/*
+ * Encoding plan. The rectangle is cut into MAX_SPLIT_TILE_SIZE tiles
+ * and every tile is checked for a solid color exactly once by
+ * PlanTiles(). PlanRect() then searches for large solid-color areas
+ * using only that tile map (plus a pixel-exact extension of the area
+ * edges), and records the resulting list of solid and non-solid
+ * rectangles in the client's plan for rfbSendRectEncodingTight() to
+ * send.
+ */
+
+static TIGHT_DATA *
+TightGetData(rfbClientPtr cl)
+{
+    if (cl->tightData == NULL)
+        cl->tightData = calloc(sizeof(TIGHT_DATA), 1);
+    return (TIGHT_DATA *)cl->tightData;
+}
+
+static rfbBool
+PlanTiles(rfbClientPtr cl,
+          int x,
+          int y,
+          int w,
+          int h)
+{
+    TIGHT_DATA *td = (TIGHT_DATA *)cl->tightData;
+    int cols, rows, row, col;
+    int dx, dy, dw, dh;
+
+    cols = (w + MAX_SPLIT_TILE_SIZE - 1) / MAX_SPLIT_TILE_SIZE;
+    rows = (h + MAX_SPLIT_TILE_SIZE - 1) / MAX_SPLIT_TILE_SIZE;
+
+    if (td->tileMapSize < cols * rows) {
+        free(td->tileColor);
+        free(td->tileSolid);
+        td->tileMapSize = cols * rows;
+        td->tileColor = (uint32_t *)malloc(td->tileMapSize * sizeof(uint32_t));
+        td->tileSolid = (char *)malloc(td->tileMapSize);
+        if (td->tileColor == NULL || td->tileSolid == NULL) {
+            free(td->tileColor);
+            free(td->tileSolid);
+            td->tileColor = NULL;
+            td->tileSolid = NULL;
+            td->tileMapSize = 0;
+            return FALSE;
+        }
+    }
 
-        for (dx = x; dx < x + w; dx += MAX_SPLIT_TILE_SIZE) {
+    td->tileX = x;
+    td->tileY = y;
+    td->tileW = w;
+    td->tileH = h;
+    td->tileCols = cols;
+    td->tileRows = rows;
 
+    for (row = 0; row < rows; row++) {
+        dy = y + row * MAX_SPLIT_TILE_SIZE;
+        dh = (dy + MAX_SPLIT_TILE_SIZE <= y + h) ?
+            MAX_SPLIT_TILE_SIZE : (y + h - dy);
+        for (col = 0; col < cols; col++) {
+            dx = x + col * MAX_SPLIT_TILE_SIZE;
             dw = (dx + MAX_SPLIT_TILE_SIZE <= x + w) ?
                 MAX_SPLIT_TILE_SIZE : (x + w - dx);
+            td->tileSolid[row * cols + col] =
+                CheckSolidTile(cl, dx, dy, dw, dh,
+                               &td->tileColor[row * cols + col], FALSE);
+        }
+    }
 
-            if (CheckSolidTile(cl, dx, dy, dw, dh, &colorValue, FALSE)) {
+    return TRUE;
+}
 
-                /* Get dimensions of solid-color area. */
+/* Is the tile at (col, row) of the map solid and of the given color? */
 
-                FindBestSolidArea(cl, dx, dy, w - (dx - x), h - (dy - y),
-				  colorValue, &w_best, &h_best);
+#define TILE_IS_SOLID(td, col, row, colorValue)                        \
+    ((td)->tileSolid[(row) * (td)->tileCols + (col)] &&                \
+     (td)->tileColor[(row) * (td)->tileCols + (col)] == (colorValue))
 
-                /* Make sure a solid rectangle is large enough
-                   (or the whole rectangle is of the same color). */
+/* Right/bottom pixel edge of a tile column/row, clipped to the map. */
 
-                if ( w_best * h_best != w * h &&
-                     w_best * h_best < MIN_SOLID_SUBRECT_SIZE )
-                    continue;
+static int
+TileRight(TIGHT_DATA *td, int col)
+{
+    int edge = td->tileX + (col + 1) * MAX_SPLIT_TILE_SIZE;
+    return (edge < td->tileX + td->tileW) ? edge : td->tileX + td->tileW;
+}
 
-                /* Try to extend solid rectangle to maximum size. */
+static int
+TileBottom(TIGHT_DATA *td, int row)
+{
+    int edge = td->tileY + (row + 1) * MAX_SPLIT_TILE_SIZE;
+    return (edge < td->tileY + td->tileH) ? edge : td->tileY + td->tileH;
+}
 
-                x_best = dx; y_best = dy;
-                ExtendSolidArea(cl, x, y, w, h, colorValue,
-                                &x_best, &y_best, &w_best, &h_best);
+static rfbBool
+PlanAppend(TIGHT_DATA *td, int x, int y, int w, int h, rfbBool solid)
+{
+    TIGHT_PLAN_RECT *r;
 
-                /* Send rectangles at top and left to solid-color area. */
+    if (td->planLen == td->planSize) {
+        int newSize = td->planSize ? td->planSize * 2 : 64;
+        TIGHT_PLAN_RECT *newPlan = (TIGHT_PLAN_RECT *)
+            realloc(td->plan, newSize * sizeof(TIGHT_PLAN_RECT));
+        if (newPlan == NULL)
+            return FALSE;
+        td->plan = newPlan;
+        td->planSize = newSize;
+    }
 
-                if ( y_best != y &&
-                     !SendRectSimple(cl, x, y, w, y_best-y) )
-                    return FALSE;
-                if ( x_best != x &&
-                     !rfbSendRectEncodingTight(cl, x, y_best,
-                                               x_best-x, h_best) )
-                    return FALSE;
+    r = &td->plan[td->planLen++];
+    r->x = x;
+    r->y = y;
+    r->w = w;
+    r->h = h;
+    r->solid = solid;
+    return TRUE;
+}
 
-                /* Send solid-color rectangle. */
+static rfbBool
+PlanRect(rfbClientPtr cl,
+         int x,
+         int y,
+         int w,
+         int h,
+         int nMaxRows)
+{
+    TIGHT_DATA *td = (TIGHT_DATA *)cl->tightData;
+    int col0, col1, row0, row1, col, row;
+    int x_best, y_best, w_best, h_best;
+    uint32_t colorValue;
 
-                if (!SendTightHeader(cl, x_best, y_best, w_best, h_best))
-                    return FALSE;
+    if (w <= 0 || h <= 0)
+        return TRUE;
 
-                fbptr = (cl->scaledScreen->frameBuffer +
-                         (cl->scaledScreen->paddedWidthInBytes * y_best) +
-                         (x_best * (cl->scaledScreen->bitsPerPixel / 8)));
+    /* Only tiles lying completely inside this rectangle are looked at. */
 
-                (*cl->translateFn)(cl->translateLookupTable, &cl->screen->serverFormat,
-                                   &cl->format, fbptr, tightBeforeBuf,
-                                   cl->scaledScreen->paddedWidthInBytes, 1, 1);
+    col0 = (x - td->tileX + MAX_SPLIT_TILE_SIZE - 1) / MAX_SPLIT_TILE_SIZE;
+    row0 = (y - td->tileY + MAX_SPLIT_TILE_SIZE - 1) / MAX_SPLIT_TILE_SIZE;
+    for (col1 = col0; col1 < td->tileCols && TileRight(td, col1) <= x + w; col1++);
+    for (row1 = row0; row1 < td->tileRows && TileBottom(td, row1) <= y + h; row1++);
 
-                if (!SendSolidRect(cl))
-                    return FALSE;
+    for (row = row0; row < row1; row++) {
 
-                /* Send remaining rectangles (at right and bottom). */
+        /* If a rectangle becomes too large, send its upper part now. */
 
-                if ( x_best + w_best != x + w &&
-                     !rfbSendRectEncodingTight(cl, x_best+w_best, y_best,
-                                               w-(x_best-x)-w_best, h_best) )
-                    return FALSE;
-                if ( y_best + h_best != y + h &&
-                     !rfbSendRectEncodingTight(cl, x, y_best+h_best,
-                                               w, h-(y_best-y)-h_best) )
-                    return FALSE;
+        if (td->tileY + row * MAX_SPLIT_TILE_SIZE - y >= nMaxRows) {
+            if (!PlanAppend(td, x, y, w, nMaxRows, FALSE))
+                return FALSE;
+            y += nMaxRows;
+            h -= nMaxRows;
+        }
 
-                /* Return after all recursive calls are done. */
+        for (col = col0; col < col1; col++) {
 
-                return TRUE;
-            }
+            if (!td->tileSolid[row * td->tileCols + col])
+                continue;
 
-        }
+            colorValue = td->tileColor[row * td->tileCols + col];
+
+            /* Get dimensions of solid-color area. */
+
+            FindBestSolidArea(td, col, row, col1, row1, colorValue,
+                              &w_best, &h_best);
+
+            /* Make sure a solid rectangle is large enough
+               (or the whole rectangle is of the same color). */
+
+            if ( w_best * h_best != w * h &&
+                 w_best * h_best < MIN_SOLID_SUBRECT_SIZE )
+                continue;
+
+            /* Try to extend solid rectangle to maximum size. */
+
+            x_best = td->tileX + col * MAX_SPLIT_TILE_SIZE;
+            y_best = td->tileY + row * MAX_SPLIT_TILE_SIZE;
+            ExtendSolidArea(cl, x, y, w, h, colorValue,
+                            &x_best, &y_best, &w_best, &h_best);
+
+            /* Rectangles at top and left to solid-color area. */
+
+            if ( y_best != y &&
+                 !PlanAppend(td, x, y, w, y_best-y, FALSE) )
+                return FALSE;
+            if ( x_best != x &&
+                 !PlanRect(cl, x, y_best, x_best-x, h_best, nMaxRows) )
+                return FALSE;
 
+            /* Solid-color rectangle. */
+
+            if (!PlanAppend(td, x_best, y_best, w_best, h_best, TRUE))
+                return FALSE;
+
+            /* Remaining rectangles (at right and bottom). */
+
+            if ( x_best + w_best != x + w &&
+                 !PlanRect(cl, x_best+w_best, y_best,
+                           w-(x_best-x)-w_best, h_best, nMaxRows) )
+                return FALSE;
+            if ( y_best + h_best != y + h &&
+                 !PlanRect(cl, x, y_best+h_best,
+                           w, h-(y_best-y)-h_best, nMaxRows) )
+                return FALSE;
+
+            /* Return after all recursive calls are done. */
+
+            return TRUE;
+        }
     }
 
     /* No suitable solid-color rectangles found. */
 
-    return SendRectSimple(cl, x, y, w, h);
+    return PlanAppend(td, x, y, w, h, FALSE);
 }
 
+/*
+ * Find the largest area of tiles of colorValue whose top-left tile is
+ * (col, row), without leaving the tile range ending at col1/row1.
+ * The result is returned in pixels.
+ */
+
 static void
-FindBestSolidArea(rfbClientPtr cl,
-                  int x,
-                  int y,
-                  int w,
-                  int h,
+FindBestSolidArea(TIGHT_DATA *td,
+                  int col,
+                  int row,
+                  int col1,
+                  int row1,
                   uint32_t colorValue,
                   int *w_ptr,
                   int *h_ptr)
 {
-    int dx, dy, dw, dh;
-    int w_prev;
+    int c, r;
+    int c_prev;
+    int x = td->tileX + col * MAX_SPLIT_TILE_SIZE;
+    int y = td->tileY + row * MAX_SPLIT_TILE_SIZE;
     int w_best = 0, h_best = 0;
 
-    w_prev = w;
-
-    for (dy = y; dy < y + h; dy += MAX_SPLIT_TILE_SIZE) {
+    c_prev = col1;
 
-        dh = (dy + MAX_SPLIT_TILE_SIZE <= y + h) ?
-            MAX_SPLIT_TILE_SIZE : (y + h - dy);
-        dw = (w_prev > MAX_SPLIT_TILE_SIZE) ?
-            MAX_SPLIT_TILE_SIZE : w_prev;
+    for (r = row; r < row1; r++) {
 
-        if (!CheckSolidTile(cl, x, dy, dw, dh, &colorValue, TRUE))
+        for (c = col; c < c_prev && TILE_IS_SOLID(td, c, r, colorValue); c++);
+        if (c == col)
             break;
 
-        for (dx = x + dw; dx < x + w_prev;) {
-            dw = (dx + MAX_SPLIT_TILE_SIZE <= x + w_prev) ?
-                MAX_SPLIT_TILE_SIZE : (x + w_prev - dx);
-            if (!CheckSolidTile(cl, dx, dy, dw, dh, &colorValue, TRUE))
-                break;
-	    dx += dw;
-        }
-
-        w_prev = dx - x;
-        if (w_prev * (dy + dh - y) > w_best * h_best) {
-            w_best = w_prev;
-            h_best = dy + dh - y;
+        c_prev = c;
+        if ((TileRight(td, c_prev - 1) - x) * (TileBottom(td, r) - y) >
+            w_best * h_best) {
+            w_best = TileRight(td, c_prev - 1) - x;
+            h_best = TileBottom(td, r) - y;
         }
     }
 
@@ -483,7 +655,7 @@ CheckSolidTile##bpp(rfbClientPtr cl, int x, int y, int w, int h,              \
 {                                                                             \
     uint##bpp##_t *fbptr;                                                     \
     uint##bpp##_t colorValue;                                                 \
-    int dx, dy;                                                               \
+    int dy;                                                                   \
                                                                               \
     fbptr = (uint##bpp##_t *)                                                 \
         &cl->scaledScreen->frameBuffer[y * cl->scaledScreen->paddedWidthInBytes + x * (bpp/8)]; \
@@ -493,10 +665,8 @@ CheckSolidTile##bpp(rfbClientPtr cl, int x, int y, int w, int h,              \
         return FALSE;                                                         \
                                                                               \
     for (dy = 0; dy < h; dy++) {                                              \
-        for (dx = 0; dx < w; dx++) {                                          \
-            if (colorValue != fbptr[dx])                                      \
-                return FALSE;                                                 \
-        }                                                                     \
+        if (PixelRunLength##bpp(fbptr, w, colorValue) != w)                   \
+            return FALSE;                                                     \
         fbptr = (uint##bpp##_t *)((uint8_t *)fbptr + cl->scaledScreen->paddedWidthInBytes); \
     }                                                                         \
                                                                               \
@@ -504,6 +674,10 @@ CheckSolidTile##bpp(rfbClientPtr cl, int x, int y, int w, int h,              \
     return TRUE;                                                              \
 }
 
+DEFINE_PIXEL_SCAN_FUNCTIONS(8)
+DEFINE_PIXEL_SCAN_FUNCTIONS(16)
+DEFINE_PIXEL_SCAN_FUNCTIONS(32)
+
 DEFINE_CHECK_SOLID_FUNCTION(8)
 DEFINE_CHECK_SOLID_FUNCTION(16)
 DEFINE_CHECK_SOLID_FUNCTION(32)
@@ -511,34 +685,35 @@ DEFINE_CHECK_SOLID_FUNCTION(32)
 static rfbBool
 SendRectSimple(rfbClientPtr cl, int x, int y, int w, int h)
 {
+    TIGHT_DATA *td = (TIGHT_DATA *)cl->tightData;
     int maxBeforeSize, maxAfterSize;
     int maxRectSize, maxRectWidth;
     int subrectMaxWidth, subrectMaxHeight;
     int dx, dy;
     int rw, rh;
 
-    maxRectSize = tightConf[compressLevel].maxRectSize;
-    maxRectWidth = tightConf[compressLevel].maxRectWidth;
+    maxRectSize = tightConf[td->compressLevel].maxRectSize;
+    maxRectWidth = tightConf[td->compressLevel].maxRectWidth;
 
     maxBeforeSize = maxRectSize * (cl->format.bitsPerPixel / 8);
     maxAfterSize = maxBeforeSize + (maxBeforeSize + 99) / 100 + 12;
 
-    if (tightBeforeBufSize < maxBeforeSize) {
-        tightBeforeBufSize = maxBeforeSize;
-        if (tightBeforeBuf == NULL)
-            tightBeforeBuf = (char *)malloc(tightBeforeBufSize);
+    if (cl->beforeEncBufSize < maxBeforeSize) {
+        cl->beforeEncBufSize = maxBeforeSize;
+        if (cl->beforeEncBuf == NULL)
+            cl->beforeEncBuf = (char *)malloc(cl->beforeEncBufSize);
         else
-            tightBeforeBuf = (char *)realloc(tightBeforeBuf,
-                                              tightBeforeBufSize);
+            cl->beforeEncBuf = (char *)realloc(cl->beforeEncBuf,
+                                               cl->beforeEncBufSize);
     }
 
-    if (tightAfterBufSize < maxAfterSize) {
-        tightAfterBufSize = maxAfterSize;
-        if (tightAfterBuf == NULL)
-            tightAfterBuf = (char *)malloc(tightAfterBufSize);
+    if (cl->afterEncBufSize < maxAfterSize) {
+        cl->afterEncBufSize = maxAfterSize;
+        if (cl->afterEncBuf == NULL)
+            cl->afterEncBuf = (char *)malloc(cl->afterEncBufSize);
         else
-            tightAfterBuf = (char *)realloc(tightAfterBuf,
-                                             tightAfterBufSize);
+            cl->afterEncBuf = (char *)realloc(cl->afterEncBuf,
+                                              cl->afterEncBufSize);
     }
 
     if (w > maxRectWidth || w * h > maxRectSize) {
@@ -568,6 +743,7 @@ SendSubrect(rfbClientPtr cl,
             int w,
             int h)
 {
+    TIGHT_DATA *td = (TIGHT_DATA *)cl->tightData;
     char *fbptr;
     rfbBool success = FALSE;
 
@@ -584,32 +760,32 @@ SendSubrect(rfbClientPtr cl,
              + (x * (cl->scaledScreen->bitsPerPixel / 8)));
 
     (*cl->translateFn)(cl->translateLookupTable, &cl->screen->serverFormat,
-                       &cl->format, fbptr, tightBeforeBuf,
+                       &cl->format, fbptr, cl->beforeEncBuf,
                        cl->scaledScreen->paddedWidthInBytes, w, h);
 
-    paletteMaxColors = w * h / tightConf[compressLevel].idxMaxColorsDivisor;
-    if ( paletteMaxColors < 2 &&
-         w * h >= tightConf[compressLevel].monoMinRectSize ) {
-        paletteMaxColors = 2;
+    td->paletteMaxColors = w * h / tightConf[td->compressLevel].idxMaxColorsDivisor;
+    if ( td->paletteMaxColors < 2 &&
+         w * h >= tightConf[td->compressLevel].monoMinRectSize ) {
+        td->paletteMaxColors = 2;
     }
     switch (cl->format.bitsPerPixel) {
     case 8:
-        FillPalette8(w * h);
+        FillPalette8(cl, w * h);
         break;
     case 16:
-        FillPalette16(w * h);
+        FillPalette16(cl, w * h);
         break;
     default:
-        FillPalette32(w * h);
+        FillPalette32(cl, w * h);
     }
 
-    switch (paletteNumColors) {
+    switch (td->paletteNumColors) {
     case 0:
         /* Truecolor image */
         if (DetectSmoothImage(cl, &cl->format, w, h)) {
-            if (qualityLevel != -1) {
+            if (td->qualityLevel != -1) {
                 success = SendJpegRect(cl, x, y, w, h,
-                                       tightConf[qualityLevel].jpegQuality);
+                                       tightConf[td->qualityLevel].jpegQuality);
             } else {
                 success = SendGradientRect(cl, w, h);
             }
@@ -627,11 +803,11 @@ SendSubrect(rfbClientPtr cl,
         break;
     default:
         /* Up to 256 different colors */
-        if ( paletteNumColors > 96 &&
-             qualityLevel != -1 && qualityLevel <= 3 &&
+        if ( td->paletteNumColors > 96 &&
+             td->qualityLevel != -1 && td->qualityLevel <= 3 &&
              DetectSmoothImage(cl, &cl->format, w, h) ) {
             success = SendJpegRect(cl, x, y, w, h,
-                                   tightConf[qualityLevel].jpegQuality);
+                                   tightConf[td->qualityLevel].jpegQuality);
         } else {
             success = SendIndexedRect(cl, w, h);
         }
@@ -676,10 +852,11 @@ SendTightHeader(rfbClientPtr cl,
 static rfbBool
 SendSolidRect(rfbClientPtr cl)
 {
+    TIGHT_DATA *td = (TIGHT_DATA *)cl->tightData;
     int len;
 
-    if (usePixelFormat24) {
-        Pack24(cl, tightBeforeBuf, &cl->format, 1);
+    if (td->usePixelFormat24) {
+        Pack24(cl, cl->beforeEncBuf, &cl->format, 1);
         len = 3;
     } else
         len = cl->format.bitsPerPixel / 8;
@@ -690,7 +867,7 @@ SendSolidRect(rfbClientPtr cl)
     }
 
     cl->updateBuf[cl->ublen++] = (char)(rfbTightFill << 4);
-    memcpy (&cl->updateBuf[cl->ublen], tightBeforeBuf, len);
+    memcpy (&cl->updateBuf[cl->ublen], cl->beforeEncBuf, len);
     cl->ublen += len;
 
     rfbStatRecordEncodingSentAdd(cl, rfbEncodingTight, len+1);
@@ -703,6 +880,7 @@ SendMonoRect(rfbClientPtr cl,
              int w,
              int h)
 {
+    TIGHT_DATA *td = (TIGHT_DATA *)cl->tightData;
     int streamId = 1;
     int paletteLen, dataLen;
 
@@ -724,42 +902,42 @@ SendMonoRect(rfbClientPtr cl,
     switch (cl->format.bitsPerPixel) {
 
     case 32:
-        EncodeMonoRect32((uint8_t *)tightBeforeBuf, w, h);
+        EncodeMonoRect32(td, (uint8_t *)cl->beforeEncBuf, w, h);
 
-        ((uint32_t *)tightAfterBuf)[0] = monoBackground;
-        ((uint32_t *)tightAfterBuf)[1] = monoForeground;
-        if (usePixelFormat24) {
-            Pack24(cl, tightAfterBuf, &cl->format, 2);
+        ((uint32_t *)cl->afterEncBuf)[0] = td->monoBackground;
+        ((uint32_t *)cl->afterEncBuf)[1] = td->monoForeground;
+        if (td->usePixelFormat24) {
+            Pack24(cl, cl->afterEncBuf, &cl->format, 2);
             paletteLen = 6;
         } else
             paletteLen = 8;
 
-        memcpy(&cl->updateBuf[cl->ublen], tightAfterBuf, paletteLen);
+        memcpy(&cl->updateBuf[cl->ublen], cl->afterEncBuf, paletteLen);
         cl->ublen += paletteLen;
         rfbStatRecordEncodingSentAdd(cl, rfbEncodingTight, 3 + paletteLen);
         break;
 
     case 16:
-        EncodeMonoRect16((uint8_t *)tightBeforeBuf, w, h);
+        EncodeMonoRect16(td, (uint8_t *)cl->beforeEncBuf, w, h);
 
-        ((uint16_t *)tightAfterBuf)[0] = (uint16_t)monoBackground;
-        ((uint16_t *)tightAfterBuf)[1] = (uint16_t)monoForeground;
+        ((uint16_t *)cl->afterEncBuf)[0] = (uint16_t)td->monoBackground;
+        ((uint16_t *)cl->afterEncBuf)[1] = (uint16_t)td->monoForeground;
 
-        memcpy(&cl->updateBuf[cl->ublen], tightAfterBuf, 4);
+        memcpy(&cl->updateBuf[cl->ublen], cl->afterEncBuf, 4);
         cl->ublen += 4;
         rfbStatRecordEncodingSentAdd(cl, rfbEncodingTight, 7);
         break;
 
     default:
-        EncodeMonoRect8((uint8_t *)tightBeforeBuf, w, h);
+        EncodeMonoRect8(td, (uint8_t *)cl->beforeEncBuf, w, h);
 
-        cl->updateBuf[cl->ublen++] = (char)monoBackground;
-        cl->updateBuf[cl->ublen++] = (char)monoForeground;
+        cl->updateBuf[cl->ublen++] = (char)td->monoBackground;
+        cl->updateBuf[cl->ublen++] = (char)td->monoForeground;
         rfbStatRecordEncodingSentAdd(cl, rfbEncodingTight, 5);
     }
 
     return CompressData(cl, streamId, dataLen,
-                        tightConf[compressLevel].monoZlibLevel,
+                        tightConf[td->compressLevel].monoZlibLevel,
                         Z_DEFAULT_STRATEGY);
 }
 
@@ -768,11 +946,12 @@ SendIndexedRect(rfbClientPtr cl,
                 int w,
                 int h)
 {
+    TIGHT_DATA *td = (TIGHT_DATA *)cl->tightData;
     int streamId = 2;
     int i, entryLen;
 
     if ( cl->ublen + TIGHT_MIN_TO_COMPRESS + 6 +
-	 paletteNumColors * cl->format.bitsPerPixel / 8 >
+	 td->paletteNumColors * cl->format.bitsPerPixel / 8 >
          UPDATE_BUF_SIZE ) {
         if (!rfbSendUpdateBuf(cl))
             return FALSE;
@@ -781,40 +960,40 @@ SendIndexedRect(rfbClientPtr cl,
     /* Prepare tight encoding header. */
     cl->updateBuf[cl->ublen++] = (streamId | rfbTightExplicitFilter) << 4;
     cl->updateBuf[cl->ublen++] = rfbTightFilterPalette;
-    cl->updateBuf[cl->ublen++] = (char)(paletteNumColors - 1);
+    cl->updateBuf[cl->ublen++] = (char)(td->paletteNumColors - 1);
 
     /* Prepare palette, convert image. */
     switch (cl->format.bitsPerPixel) {
 
     case 32:
-        EncodeIndexedRect32((uint8_t *)tightBeforeBuf, w * h);
+        EncodeIndexedRect32(td, (uint8_t *)cl->beforeEncBuf, w * h);
 
-        for (i = 0; i < paletteNumColors; i++) {
-            ((uint32_t *)tightAfterBuf)[i] =
-                palette.entry[i].listNode->rgb;
+        for (i = 0; i < td->paletteNumColors; i++) {
+            ((uint32_t *)cl->afterEncBuf)[i] =
+                td->palette.entry[i].rgb;
         }
-        if (usePixelFormat24) {
-            Pack24(cl, tightAfterBuf, &cl->format, paletteNumColors);
+        if (td->usePixelFormat24) {
+            Pack24(cl, cl->afterEncBuf, &cl->format, td->paletteNumColors);
             entryLen = 3;
         } else
             entryLen = 4;
 
-        memcpy(&cl->updateBuf[cl->ublen], tightAfterBuf, paletteNumColors * entryLen);
-        cl->ublen += paletteNumColors * entryLen;
-        rfbStatRecordEncodingSentAdd(cl, rfbEncodingTight, 3 + paletteNumColors * entryLen);
+        memcpy(&cl->updateBuf[cl->ublen], cl->afterEncBuf, td->paletteNumColors * entryLen);
+        cl->ublen += td->paletteNumColors * entryLen;
+        rfbStatRecordEncodingSentAdd(cl, rfbEncodingTight, 3 + td->paletteNumColors * entryLen);
         break;
 
     case 16:
-        EncodeIndexedRect16((uint8_t *)tightBeforeBuf, w * h);
+        EncodeIndexedRect16(td, (uint8_t *)cl->beforeEncBuf, w * h);
 
-        for (i = 0; i < paletteNumColors; i++) {
-            ((uint16_t *)tightAfterBuf)[i] =
-                (uint16_t)palette.entry[i].listNode->rgb;
+        for (i = 0; i < td->paletteNumColors; i++) {
+            ((uint16_t *)cl->afterEncBuf)[i] =
+                (uint16_t)td->palette.entry[i].rgb;
         }
 
-        memcpy(&cl->updateBuf[cl->ublen], tightAfterBuf, paletteNumColors * 2);
-        cl->ublen += paletteNumColors * 2;
-        rfbStatRecordEncodingSentAdd(cl, rfbEncodingTight, 3 + paletteNumColors * 2);
+        memcpy(&cl->updateBuf[cl->ublen], cl->afterEncBuf, td->paletteNumColors * 2);
+        cl->ublen += td->paletteNumColors * 2;
+        rfbStatRecordEncodingSentAdd(cl, rfbEncodingTight, 3 + td->paletteNumColors * 2);
         break;
 
     default:
@@ -822,7 +1001,7 @@ SendIndexedRect(rfbClientPtr cl,
     }
 
     return CompressData(cl, streamId, w * h,
-                        tightConf[compressLevel].idxZlibLevel,
+                        tightConf[td->compressLevel].idxZlibLevel,
                         Z_DEFAULT_STRATEGY);
 }
 
@@ -831,6 +1010,7 @@ SendFullColorRect(rfbClientPtr cl,
                   int w,
                   int h)
 {
+    TIGHT_DATA *td = (TIGHT_DATA *)cl->tightData;
     int streamId = 0;
     int len;
 
@@ -842,14 +1022,14 @@ SendFullColorRect(rfbClientPtr cl,
     cl->updateBuf[cl->ublen++] = 0x00;  /* stream id = 0, no flushing, no filter */
     rfbStatRecordEncodingSentAdd(cl, rfbEncodingTight, 1);
 
-    if (usePixelFormat24) {
-        Pack24(cl, tightBeforeBuf, &cl->format, w * h);
+    if (td->usePixelFormat24) {
+        Pack24(cl, cl->beforeEncBuf, &cl->format, w * h);
         len = 3;
     } else
         len = cl->format.bitsPerPixel / 8;
 
     return CompressData(cl, streamId, w * h * len,
-                        tightConf[compressLevel].rawZlibLevel,
+                        tightConf[td->compressLevel].rawZlibLevel,
                         Z_DEFAULT_STRATEGY);
 }
 
@@ -858,6 +1038,7 @@ SendGradientRect(rfbClientPtr cl,
                  int w,
                  int h)
 {
+    TIGHT_DATA *td = (TIGHT_DATA *)cl->tightData;
     int streamId = 3;
     int len;
 
@@ -869,26 +1050,29 @@ SendGradientRect(rfbClientPtr cl,
             return FALSE;
     }
 
-    if (prevRowBuf == NULL)
-        prevRowBuf = (int *)malloc(2048 * 3 * sizeof(int));
+    if (td->prevRowBuf == NULL) {
+        td->prevRowBuf = (int *)malloc(2048 * 3 * sizeof(int));
+        if (td->prevRowBuf == NULL)
+            return SendFullColorRect(cl, w, h);
+    }
 
     cl->updateBuf[cl->ublen++] = (streamId | rfbTightExplicitFilter) << 4;
     cl->updateBuf[cl->ublen++] = rfbTightFilterGradient;
     rfbStatRecordEncodingSentAdd(cl, rfbEncodingTight, 2);
 
-    if (usePixelFormat24) {
-        FilterGradient24(cl, tightBeforeBuf, &cl->format, w, h);
+    if (td->usePixelFormat24) {
+        FilterGradient24(cl, cl->beforeEncBuf, &cl->format, w, h);
         len = 3;
     } else if (cl->format.bitsPerPixel == 32) {
-        FilterGradient32(cl, (uint32_t *)tightBeforeBuf, &cl->format, w, h);
+        FilterGradient32(cl, (uint32_t *)cl->beforeEncBuf, &cl->format, w, h);
         len = 4;
     } else {
-        FilterGradient16(cl, (uint16_t *)tightBeforeBuf, &cl->format, w, h);
+        FilterGradient16(cl, (uint16_t *)cl->beforeEncBuf, &cl->format, w, h);
         len = 2;
     }
 
     return CompressData(cl, streamId, w * h * len,
-                        tightConf[compressLevel].gradientZlibLevel,
+                        tightConf[td->compressLevel].gradientZlibLevel,
                         Z_FILTERED);
 }
 
@@ -903,7 +1087,7 @@ CompressData(rfbClientPtr cl,
     int err;
 
     if (dataLen < TIGHT_MIN_TO_COMPRESS) {
-        memcpy(&cl->updateBuf[cl->ublen], tightBeforeBuf, dataLen);
+        memcpy(&cl->updateBuf[cl->ublen], cl->beforeEncBuf, dataLen);
         cl->ublen += dataLen;
         rfbStatRecordEncodingSentAdd(cl, rfbEncodingTight, dataLen);
         return TRUE;
@@ -927,10 +1111,10 @@ CompressData(rfbClientPtr cl,
     }
 
     /* Prepare buffer pointers. */
-    pz->next_in = (Bytef *)tightBeforeBuf;
+    pz->next_in = (Bytef *)cl->beforeEncBuf;
     pz->avail_in = dataLen;
-    pz->next_out = (Bytef *)tightAfterBuf;
-    pz->avail_out = tightAfterBufSize;
+    pz->next_out = (Bytef *)cl->afterEncBuf;
+    pz->avail_out = cl->afterEncBufSize;
 
     /* Change compression parameters if needed. */
     if (zlibLevel != cl->zsLevel[streamId]) {
@@ -946,7 +1130,7 @@ CompressData(rfbClientPtr cl,
         return FALSE;
     }
 
-    return SendCompressedData(cl, tightAfterBufSize - pz->avail_out);
+    return SendCompressedData(cl, cl->afterEncBufSize - pz->avail_out);
 }
 
 static rfbBool SendCompressedData(rfbClientPtr cl,
@@ -976,7 +1160,7 @@ static rfbBool SendCompressedData(rfbClientPtr cl,
             if (!rfbSendUpdateBuf(cl))
                 return FALSE;
         }
-        memcpy(&cl->updateBuf[cl->ublen], &tightAfterBuf[i], portionLen);
+        memcpy(&cl->updateBuf[cl->ublen], &cl->afterEncBuf[i], portionLen);
         cl->ublen += portionLen;
     }
     rfbStatRecordEncodingSentAdd(cl, rfbEncodingTight, compressedLen);
@@ -989,107 +1173,95 @@ static rfbBool SendCompressedData(rfbClientPtr cl,
  */
 
 static void
-FillPalette8(int count)
+FillPalette8(rfbClientPtr cl, int count)
 {
-    uint8_t *data = (uint8_t *)tightBeforeBuf;
+    TIGHT_DATA *td = (TIGHT_DATA *)cl->tightData;
+    uint8_t *data = (uint8_t *)cl->beforeEncBuf;
     uint8_t c0, c1;
-    int i, n0, n1;
+    int i, n0, n1, nc0;
 
-    paletteNumColors = 0;
+    td->paletteNumColors = 0;
 
     c0 = data[0];
-    for (i = 1; i < count && data[i] == c0; i++);
+    i = 1 + PixelRunLength8(data + 1, count - 1, c0);
     if (i == count) {
-        paletteNumColors = 1;
+        td->paletteNumColors = 1;
         return;                 /* Solid rectangle */
     }
 
-    if (paletteMaxColors < 2)
+    if (td->paletteMaxColors < 2)
         return;
 
+    /* Count the rest; as before, the first c1 pixel is not in n1. */
     n0 = i;
     c1 = data[i];
-    n1 = 0;
-    for (i++; i < count; i++) {
-        if (data[i] == c0) {
-            n0++;
-        } else if (data[i] == c1) {
-            n1++;
-        } else
-            break;
-    }
+    nc0 = 0;
+    i += 1 + PixelTwoColourRun8(data + i + 1, count - i - 1, c0, c1, &nc0);
+    n1 = i - n0 - 1 - nc0;
+    n0 += nc0;
     if (i == count) {
         if (n0 > n1) {
-            monoBackground = (uint32_t)c0;
-            monoForeground = (uint32_t)c1;
+            td->monoBackground = (uint32_t)c0;
+            td->monoForeground = (uint32_t)c1;
         } else {
-            monoBackground = (uint32_t)c1;
-            monoForeground = (uint32_t)c0;
+            td->monoBackground = (uint32_t)c1;
+            td->monoForeground = (uint32_t)c0;
         }
-        paletteNumColors = 2;   /* Two colors */
+        td->paletteNumColors = 2;   /* Two colors */
     }
 }
 
 #define DEFINE_FILL_PALETTE_FUNCTION(bpp)                               \
                                                                         \
 static void                                                             \
-FillPalette##bpp(int count) {                                           \
-    uint##bpp##_t *data = (uint##bpp##_t *)tightBeforeBuf;              \
+FillPalette##bpp(rfbClientPtr cl, int count) {                          \
+    TIGHT_DATA *td = (TIGHT_DATA *)cl->tightData;                       \
+    uint##bpp##_t *data = (uint##bpp##_t *)cl->beforeEncBuf;            \
     uint##bpp##_t c0, c1, ci;                                           \
-    int i, n0, n1, ni;                                                  \
+    int i, n0, n1, nc0, ni;                                             \
                                                                         \
     c0 = data[0];                                                       \
-    for (i = 1; i < count && data[i] == c0; i++);                       \
+    i = 1 + PixelRunLength##bpp(data + 1, count - 1, c0);               \
     if (i >= count) {                                                   \
-        paletteNumColors = 1;   /* Solid rectangle */                   \
+        td->paletteNumColors = 1;   /* Solid rectangle */               \
         return;                                                         \
     }                                                                   \
                                                                         \
-    if (paletteMaxColors < 2) {                                         \
-        paletteNumColors = 0;   /* Full-color encoding preferred */     \
+    if (td->paletteMaxColors < 2) {                                     \
+        td->paletteNumColors = 0;   /* Full-color encoding preferred */ \
         return;                                                         \
     }                                                                   \
                                                                         \
     n0 = i;                                                             \
     c1 = data[i];                                                       \
-    n1 = 0;                                                             \
-    for (i++; i < count; i++) {                                         \
-        ci = data[i];                                                   \
-        if (ci == c0) {                                                 \
-            n0++;                                                       \
-        } else if (ci == c1) {                                          \
-            n1++;                                                       \
-        } else                                                          \
-            break;                                                      \
-    }                                                                   \
+    nc0 = 0;                                                            \
+    i += 1 + PixelTwoColourRun##bpp(data + i + 1, count - i - 1,        \
+                                    c0, c1, &nc0);                      \
+    n1 = i - n0 - 1 - nc0;                                              \
+    n0 += nc0;                                                          \
     if (i >= count) {                                                   \
         if (n0 > n1) {                                                  \
-            monoBackground = (uint32_t)c0;                              \
-            monoForeground = (uint32_t)c1;                              \
+            td->monoBackground = (uint32_t)c0;                          \
+            td->monoForeground = (uint32_t)c1;                          \
         } else {                                                        \
-            monoBackground = (uint32_t)c1;                              \
-            monoForeground = (uint32_t)c0;                              \
+            td->monoBackground = (uint32_t)c1;                          \
+            td->monoForeground = (uint32_t)c0;                          \
         }                                                               \
-        paletteNumColors = 2;   /* Two colors */                        \
+        td->paletteNumColors = 2;   /* Two colors */                    \
         return;                                                         \
     }                                                                   \
                                                                         \
-    PaletteReset();                                                     \
-    PaletteInsert (c0, (uint32_t)n0, bpp);                              \
-    PaletteInsert (c1, (uint32_t)n1, bpp);                              \
+    PaletteReset(td);                                                   \
+    PaletteInsert (td, c0, (uint32_t)n0, bpp);                          \
+    PaletteInsert (td, c1, (uint32_t)n1, bpp);                          \
                                                                         \
-    ni = 1;                                                             \
-    for (i++; i < count; i++) {                                         \
-        if (data[i] == ci) {                                            \
-            ni++;                                                       \
-        } else {                                                        \
-            if (!PaletteInsert (ci, (uint32_t)ni, bpp))                 \
-                return;                                                 \
-            ci = data[i];                                               \
-            ni = 1;                                                     \
-        }                                                               \
+    while (i < count) {                                                 \
+        ci = data[i];                                                   \
+        ni = 1 + PixelRunLength##bpp(data + i + 1, count - i - 1, ci);  \
+        if (!PaletteInsert (td, ci, (uint32_t)ni, bpp))                 \
+            return;                                                     \
+        i += ni;                                                        \
     }                                                                   \
-    PaletteInsert (ci, (uint32_t)ni, bpp);                              \
 }
 
 DEFINE_FILL_PALETTE_FUNCTION(16)
@@ -1100,79 +1272,82 @@ DEFINE_FILL_PALETTE_FUNCTION(32)
  * Functions to operate with palette structures.
  */
 
-#define HASH_FUNC16(rgb) ((int)(((rgb >> 8) + rgb) & 0xFF))
-#define HASH_FUNC32(rgb) ((int)(((rgb >> 16) + (rgb >> 8)) & 0xFF))
+#define HASH_FUNC16(rgb) ((int)(((rgb >> 8) + rgb) & (PALETTE_HASH_SIZE - 1)))
+#define HASH_FUNC32(rgb) ((int)(((rgb >> 16) + (rgb >> 8) + rgb) & (PALETTE_HASH_SIZE - 1)))
 
 static void
-PaletteReset(void)
+PaletteReset(TIGHT_DATA *td)
 {
-    paletteNumColors = 0;
-    memset(palette.hash, 0, 256 * sizeof(COLOR_LIST *));
+    td->paletteNumColors = 0;
+    memset(td->palette.slotUsed, 0, PALETTE_HASH_SIZE);
 }
 
+/* Returns the slot holding rgb, or the free slot where it belongs. */
+
 static int
-PaletteInsert(uint32_t rgb,
+PaletteFindSlot(TIGHT_DATA *td,
+                uint32_t rgb,
+                int bpp)
+{
+    int slot;
+
+    slot = (bpp == 16) ? HASH_FUNC16(rgb) : HASH_FUNC32(rgb);
+
+    while (td->palette.slotUsed[slot] && td->palette.slotColor[slot] != rgb)
+        slot = (slot + 1) & (PALETTE_HASH_SIZE - 1);
+
+    return slot;
+}
+
+static int
+PaletteInsert(TIGHT_DATA *td,
+              uint32_t rgb,
               int numPixels,
               int bpp)
 {
-    COLOR_LIST *pnode;
-    COLOR_LIST *prev_pnode = NULL;
-    int hash_key, idx, new_idx, count;
-
-    hash_key = (bpp == 16) ? HASH_FUNC16(rgb) : HASH_FUNC32(rgb);
-
-    pnode = palette.hash[hash_key];
-
-    while (pnode != NULL) {
-        if (pnode->rgb == rgb) {
-            /* Such palette entry already exists. */
-            new_idx = idx = pnode->idx;
-            count = palette.entry[idx].numPixels + numPixels;
-            if (new_idx && palette.entry[new_idx-1].numPixels < count) {
-                do {
-                    palette.entry[new_idx] = palette.entry[new_idx-1];
-                    palette.entry[new_idx].listNode->idx = new_idx;
-                    new_idx--;
-                }
-                while (new_idx && palette.entry[new_idx-1].numPixels < count);
-                palette.entry[new_idx].listNode = pnode;
-                pnode->idx = new_idx;
-            }
-            palette.entry[new_idx].numPixels = count;
-            return paletteNumColors;
+    int slot, idx, count;
+
+    slot = PaletteFindSlot(td, rgb, bpp);
+
+    if (td->palette.slotUsed[slot]) {
+        /* Such palette entry already exists. */
+        idx = td->palette.slotIdx[slot];
+        count = td->palette.entry[idx].numPixels + numPixels;
+        while (idx && td->palette.entry[idx-1].numPixels < count) {
+            td->palette.entry[idx] = td->palette.entry[idx-1];
+            td->palette.slotIdx[td->palette.entry[idx].slot] = idx;
+            idx--;
         }
-        prev_pnode = pnode;
-        pnode = pnode->next;
+        td->palette.entry[idx].rgb = rgb;
+        td->palette.entry[idx].numPixels = count;
+        td->palette.entry[idx].slot = slot;
+        td->palette.slotIdx[slot] = idx;
+        return td->paletteNumColors;
     }
 
     /* Check if palette is full. */
-    if (paletteNumColors == 256 || paletteNumColors == paletteMaxColors) {
-        paletteNumColors = 0;
+    if (td->paletteNumColors == 256 || td->paletteNumColors == td->paletteMaxColors) {
+        td->paletteNumColors = 0;
         return 0;
     }
 
     /* Move palette entries with lesser pixel counts. */
-    for ( idx = paletteNumColors;
-          idx > 0 && palette.entry[idx-1].numPixels < numPixels;
+    for ( idx = td->paletteNumColors;
+          idx > 0 && td->palette.entry[idx-1].numPixels < numPixels;
           idx-- ) {
-        palette.entry[idx] = palette.entry[idx-1];
-        palette.entry[idx].listNode->idx = idx;
+        td->palette.entry[idx] = td->palette.entry[idx-1];
+        td->palette.slotIdx[td->palette.entry[idx].slot] = idx;
     }
 
     /* Add new palette entry into the freed slot. */
-    pnode = &palette.list[paletteNumColors];
-    if (prev_pnode != NULL) {
-        prev_pnode->next = pnode;
-    } else {
-        palette.hash[hash_key] = pnode;
-    }
-    pnode->next = NULL;
-    pnode->idx = idx;
-    pnode->rgb = rgb;
-    palette.entry[idx].listNode = pnode;
-    palette.entry[idx].numPixels = numPixels;
-
-    return (++paletteNumColors);
+    td->palette.slotUsed[slot] = 1;
+    td->palette.slotColor[slot] = rgb;
+    td->palette.slotIdx[slot] = idx;
+    td->palette.entry[idx].rgb = rgb;
+    td->palette.entry[idx].numPixels = numPixels;
+    td->palette.entry[idx].slot = slot;
+
+    return (++td->paletteNumColors);
 }
 
 
@@ -1219,31 +1394,22 @@ static void Pack24(rfbClientPtr cl,
 #define DEFINE_IDX_ENCODE_FUNCTION(bpp)                                 \
                                                                         \
 static void                                                             \
-EncodeIndexedRect##bpp(uint8_t *buf, int count) {                       \
-    COLOR_LIST *pnode;                                                  \
+EncodeIndexedRect##bpp(TIGHT_DATA *td, uint8_t *buf, int count) {       \
     uint##bpp##_t *src;                                                 \
     uint##bpp##_t rgb;                                                  \
-    int rep = 0;                                                        \
+    uint8_t idx;                                                        \
+    int rep;                                                            \
                                                                         \
     src = (uint##bpp##_t *) buf;                                        \
                                                                         \
-    while (count--) {                                                   \
-        rgb = *src++;                                                   \
-        while (count && *src == rgb) {                                  \
-            rep++, src++, count--;                                      \
-        }                                                               \
-        pnode = palette.hash[HASH_FUNC##bpp(rgb)];                      \
-        while (pnode != NULL) {                                         \
-            if ((uint##bpp##_t)pnode->rgb == rgb) {                     \
-                *buf++ = (uint8_t)pnode->idx;                           \
-                while (rep) {                                           \
-                    *buf++ = (uint8_t)pnode->idx;                       \
-                    rep--;                                              \
-                }                                                       \
-                break;                                                  \
-            }                                                           \
-            pnode = pnode->next;                                        \
-        }                                                               \
+    while (count) {                                                     \
+        rgb = *src;                                                     \
+        rep = PixelRunLength##bpp(src, count, rgb);                     \
+        src += rep;                                                     \
+        count -= rep;                                                   \
+        idx = td->palette.slotIdx[PaletteFindSlot(td, (uint32_t)rgb, bpp)]; \
+        memset(buf, idx, rep);                                          \
+        buf += rep;                                                     \
     }                                                                   \
 }
 
@@ -1253,7 +1419,7 @@ DEFINE_IDX_ENCODE_FUNCTION(32)
 #define DEFINE_MONO_ENCODE_FUNCTION(bpp)                                \
                                                                         \
 static void                                                             \
-EncodeMonoRect##bpp(uint8_t *buf, int w, int h) {                       \
+EncodeMonoRect##bpp(TIGHT_DATA *td, uint8_t *buf, int w, int h) {       \
     uint##bpp##_t *ptr;                                                 \
     uint##bpp##_t bg;                                                   \
     unsigned int value, mask;                                           \
@@ -1261,7 +1427,7 @@ EncodeMonoRect##bpp(uint8_t *buf, int w, int h) {                       \
     int x, y, bg_bits;                                                  \
                                                                         \
     ptr = (uint##bpp##_t *) buf;                                        \
-    bg = (uint##bpp##_t) monoBackground;                                \
+    bg = (uint##bpp##_t) td->monoBackground;                            \
     aligned_width = w - w % 8;                                          \
                                                                         \
     for (y = 0; y < h; y++) {                                           \
@@ -1314,6 +1480,7 @@ DEFINE_MONO_ENCODE_FUNCTION(32)
 static void
 FilterGradient24(rfbClientPtr cl, char *buf, rfbPixelFormat *fmt, int w, int h)
 {
+    TIGHT_DATA *td = (TIGHT_DATA *)cl->tightData;
     uint32_t *buf32;
     uint32_t pix32;
     int *prevRowPtr;
@@ -1323,7 +1490,7 @@ FilterGradient24(rfbClientPtr cl, char *buf, rfbPixelFormat *fmt, int w, int h)
     int x, y, c;
 
     buf32 = (uint32_t *)buf;
-    memset (prevRowBuf, 0, w * 3 * sizeof(int));
+    memset (td->prevRowBuf, 0, w * 3 * sizeof(int));
 
     if (!cl->screen->serverFormat.bigEndian == !fmt->bigEndian) {
         shiftBits[0] = fmt->redShift;
@@ -1340,7 +1507,7 @@ FilterGradient24(rfbClientPtr cl, char *buf, rfbPixelFormat *fmt, int w, int h)
             pixUpper[c] = 0;
             pixHere[c] = 0;
         }
-        prevRowPtr = prevRowBuf;
+        prevRowPtr = td->prevRowBuf;
         for (x = 0; x < w; x++) {
             pix32 = *buf32++;
             for (c = 0; c < 3; c++) {
@@ -1373,6 +1540,7 @@ static void                                                              \
 FilterGradient##bpp(rfbClientPtr cl, uint##bpp##_t *buf,                 \
 		rfbPixelFormat *fmt, int w, int h) {                     \
     uint##bpp##_t pix, diff;                                             \
+    TIGHT_DATA *td = (TIGHT_DATA *)cl->tightData;                        \
     rfbBool endianMismatch;                                              \
     int *prevRowPtr;                                                     \
     int maxColor[3], shiftBits[3];                                       \
@@ -1380,7 +1548,7 @@ FilterGradient##bpp(rfbClientPtr cl, uint##bpp##_t *buf,                 \
     int prediction;                                                      \
     int x, y, c;                                                         \
                                                                          \
-    memset (prevRowBuf, 0, w * 3 * sizeof(int));                         \
+    memset (td->prevRowBuf, 0, w * 3 * sizeof(int));                     \
                                                                          \
     endianMismatch = (!cl->screen->serverFormat.bigEndian != !fmt->bigEndian);    \
                                                                          \
@@ -1396,7 +1564,7 @@ FilterGradient##bpp(rfbClientPtr cl, uint##bpp##_t *buf,                 \
             pixUpper[c] = 0;                                             \
             pixHere[c] = 0;                                              \
         }                                                                \
-        prevRowPtr = prevRowBuf;                                         \
+        prevRowPtr = td->prevRowBuf;                                     \
         for (x = 0; x < w; x++) {                                        \
             pix = *buf;                                                  \
             if (endianMismatch) {                                        \
@@ -1445,6 +1613,7 @@ DEFINE_GRADIENT_FILTER_FUNCTION(32)
 static int
 DetectSmoothImage (rfbClientPtr cl, rfbPixelFormat *fmt, int w, int h)
 {
+    TIGHT_DATA *td = (TIGHT_DATA *)cl->tightData;
     long avgError;
 
     if ( cl->screen->serverFormat.bitsPerPixel == 8 || fmt->bitsPerPixel == 8 ||
@@ -1452,34 +1621,34 @@ DetectSmoothImage (rfbClientPtr cl, rfbPixelFormat *fmt, int w, int h)
         return 0;
     }
 
-    if (qualityLevel != -1) {
+    if (td->qualityLevel != -1) {
         if (w * h < JPEG_MIN_RECT_SIZE) {
             return 0;
         }
     } else {
         if ( rfbTightDisableGradient ||
-             w * h < tightConf[compressLevel].gradientMinRectSize ) {
+             w * h < tightConf[td->compressLevel].gradientMinRectSize ) {
             return 0;
         }
     }
 
     if (fmt->bitsPerPixel == 32) {
-        if (usePixelFormat24) {
+        if (td->usePixelFormat24) {
             avgError = DetectSmoothImage24(cl, fmt, w, h);
-            if (qualityLevel != -1) {
-                return (avgError < tightConf[qualityLevel].jpegThreshold24);
+            if (td->qualityLevel != -1) {
+                return (avgError < tightConf[td->qualityLevel].jpegThreshold24);
             }
-            return (avgError < tightConf[compressLevel].gradientThreshold24);
+            return (avgError < tightConf[td->compressLevel].gradientThreshold24);
         } else {
             avgError = DetectSmoothImage32(cl, fmt, w, h);
         }
     } else {
         avgError = DetectSmoothImage16(cl, fmt, w, h);
     }
-    if (qualityLevel != -1) {
-        return (avgError < tightConf[qualityLevel].jpegThreshold);
+    if (td->qualityLevel != -1) {
+        return (avgError < tightConf[td->qualityLevel].jpegThreshold);
     }
-    return (avgError < tightConf[compressLevel].gradientThreshold);
+    return (avgError < tightConf[td->compressLevel].gradientThreshold);
 }
 
 static unsigned long
@@ -1505,11 +1674,11 @@ DetectSmoothImage24 (rfbClientPtr cl,
     while (y < h && x < w) {
         for (d = 0; d < h - y && d < w - x - DETECT_SUBROW_WIDTH; d++) {
             for (c = 0; c < 3; c++) {
-                left[c] = (int)tightBeforeBuf[((y+d)*w+x+d)*4+off+c] & 0xFF;
+                left[c] = (int)cl->beforeEncBuf[((y+d)*w+x+d)*4+off+c] & 0xFF;
             }
             for (dx = 1; dx <= DETECT_SUBROW_WIDTH; dx++) {
                 for (c = 0; c < 3; c++) {
-                    pix = (int)tightBeforeBuf[((y+d)*w+x+d+dx)*4+off+c] & 0xFF;
+                    pix = (int)cl->beforeEncBuf[((y+d)*w+x+d+dx)*4+off+c] & 0xFF;
                     diffStat[abs(pix - left[c])]++;
                     left[c] = pix;
                 }
@@ -1569,7 +1738,7 @@ DetectSmoothImage##bpp (rfbClientPtr cl, rfbPixelFormat *fmt, int w, int h) {\
     y = 0, x = 0;                                                            \
     while (y < h && x < w) {                                                 \
         for (d = 0; d < h - y && d < w - x - DETECT_SUBROW_WIDTH; d++) {     \
-            pix = ((uint##bpp##_t *)tightBeforeBuf)[(y+d)*w+x+d];            \
+            pix = ((uint##bpp##_t *)cl->beforeEncBuf)[(y+d)*w+x+d];          \
             if (endianMismatch) {                                            \
                 pix = Swap##bpp(pix);                                        \
             }                                                                \
@@ -1577,7 +1746,7 @@ DetectSmoothImage##bpp (rfbClientPtr cl, rfbPixelFormat *fmt, int w, int h) {\
                 left[c] = (int)(pix >> shiftBits[c] & maxColor[c]);          \
             }                                                                \
             for (dx = 1; dx <= DETECT_SUBROW_WIDTH; dx++) {                  \
-                pix = ((uint##bpp##_t *)tightBeforeBuf)[(y+d)*w+x+d+dx];     \
+                pix = ((uint##bpp##_t *)cl->beforeEncBuf)[(y+d)*w+x+d+dx];   \
                 if (endianMismatch) {                                        \
                     pix = Swap##bpp(pix);                                    \
                 }                                                            \
@@ -1625,60 +1794,141 @@ DEFINE_DETECT_FUNCTION(32)
 
 /*
  * JPEG compression stuff.
+ *
+ * The compressor is created on the first JPEG rectangle sent to a client
+ * and kept in the client's Tight data until it goes away, so the per
+ * rectangle cost is only jpeg_start_compress()/jpeg_finish_compress().
+ * Quantization tables are recomputed only when the quality changes.
  */
 
-static struct jpeg_destination_mgr jpegDstManager;
-static rfbBool jpegError;
-static int jpegDstDataLen;
+/* Number of scanlines handed to jpeg_write_scanlines() at once (one
+   MCU row with 2x2 chroma subsampling). */
+#define JPEG_BATCH_ROWS 16
+
+typedef struct TIGHT_JPEG_s {
+    struct jpeg_compress_struct cinfo;
+    struct jpeg_error_mgr jerr;
+    struct jpeg_destination_mgr dstManager;
+    rfbBool error;
+    int dstDataLen;
+    int quality;                /* quality of the loaded tables, or -1 */
+    uint8_t *rowBuf;
+    int rowBufSize;
+    /* sample -> 8 bit lookup tables for non-24 bit server formats */
+    uint8_t *lut[3];
+    int lutMax[3];
+} TIGHT_JPEG;
+
+static TIGHT_JPEG *
+JpegGetCompressor(rfbClientPtr cl)
+{
+    TIGHT_DATA *td = TightGetData(cl);
+    TIGHT_JPEG *jpeg;
+
+    if (td == NULL)
+        return NULL;
+    if (td->jpeg != NULL)
+        return td->jpeg;
+
+    jpeg = (TIGHT_JPEG *)calloc(sizeof(TIGHT_JPEG), 1);
+    if (jpeg == NULL)
+        return NULL;
+
+    jpeg->cinfo.err = jpeg_std_error(&jpeg->jerr);
+    jpeg_create_compress(&jpeg->cinfo);
+
+    jpeg->cinfo.input_components = 3;
+    jpeg->cinfo.in_color_space = JCS_RGB;
+    jpeg_set_defaults(&jpeg->cinfo);
+    jpeg->quality = -1;
+
+    JpegSetDstManager(&jpeg->cinfo, &jpeg->dstManager);
+    /* the destination is the client's cl->afterEncBuf */
+    jpeg->cinfo.client_data = cl;
+
+    td->jpeg = jpeg;
+    return jpeg;
+}
+
+void
+rfbFreeTightData(rfbClientPtr cl)
+{
+    TIGHT_DATA *td = (TIGHT_DATA *)cl->tightData;
+    TIGHT_JPEG *jpeg;
+    int c;
+
+    if (td == NULL)
+        return;
+
+    jpeg = td->jpeg;
+    if (jpeg != NULL) {
+        jpeg_destroy_compress(&jpeg->cinfo);
+        free(jpeg->rowBuf);
+        for (c = 0; c < 3; c++)
+            free(jpeg->lut[c]);
+        free(jpeg);
+    }
+    free(td->prevRowBuf);
+    free(td->tileColor);
+    free(td->tileSolid);
+    free(td->plan);
+    free(td);
+    cl->tightData = NULL;
+}
 
 static rfbBool
 SendJpegRect(rfbClientPtr cl, int x, int y, int w, int h, int quality)
 {
-    struct jpeg_compress_struct cinfo;
-    struct jpeg_error_mgr jerr;
-    uint8_t *srcBuf;
-    JSAMPROW rowPointer[1];
-    int dy;
+    TIGHT_JPEG *jpeg;
+    JSAMPROW rowPointer[JPEG_BATCH_ROWS];
+    int dy, n, i;
 
     if (cl->screen->serverFormat.bitsPerPixel == 8)
         return SendFullColorRect(cl, w, h);
 
-    srcBuf = (uint8_t *)malloc(w * 3);
-    if (srcBuf == NULL) {
+    jpeg = JpegGetCompressor(cl);
+    if (jpeg == NULL)
         return SendFullColorRect(cl, w, h);
-    }
-    rowPointer[0] = srcBuf;
 
-    cinfo.err = jpeg_std_error(&jerr);
-    jpeg_create_compress(&cinfo);
+    if (jpeg->rowBufSize < w * 3 * JPEG_BATCH_ROWS) {
+        free(jpeg->rowBuf);
+        jpeg->rowBufSize = w * 3 * JPEG_BATCH_ROWS;
+        jpeg->rowBuf = (uint8_t *)malloc(jpeg->rowBufSize);
+        if (jpeg->rowBuf == NULL) {
+            jpeg->rowBufSize = 0;
+            return SendFullColorRect(cl, w, h);
+        }
+    }
+    for (i = 0; i < JPEG_BATCH_ROWS; i++)
+        rowPointer[i] = jpeg->rowBuf + i * w * 3;
 
-    cinfo.image_width = w;
-    cinfo.image_height = h;
-    cinfo.input_components = 3;
-    cinfo.in_color_space = JCS_RGB;
+    if (!JpegUpdateLookupTables(cl, jpeg))
+        return SendFullColorRect(cl, w, h);
 
-    jpeg_set_defaults(&cinfo);
-    jpeg_set_quality(&cinfo, quality, TRUE);
+    if (quality != jpeg->quality) {
+        jpeg_set_quality(&jpeg->cinfo, quality, TRUE);
+        jpeg->quality = quality;
+    }
 
-    JpegSetDstManager (&cinfo);
+    jpeg->cinfo.image_width = w;
+    jpeg->cinfo.image_height = h;
 
-    jpeg_start_compress(&cinfo, TRUE);
+    jpeg_start_compress(&jpeg->cinfo, TRUE);
 
-    for (dy = 0; dy < h; dy++) {
-        PrepareRowForJpeg(cl, srcBuf, x, y + dy, w);
-        jpeg_write_scanlines(&cinfo, rowPointer, 1);
-        if (jpegError)
-            break;
+    for (dy = 0; dy < h && !jpeg->error; dy += n) {
+        n = (h - dy < JPEG_BATCH_ROWS) ? h - dy : JPEG_BATCH_ROWS;
+        for (i = 0; i < n; i++)
+            PrepareRowForJpeg(cl, jpeg, rowPointer[i], x, y + dy + i, w);
+        jpeg_write_scanlines(&jpeg->cinfo, rowPointer, n);
     }
 
-    if (!jpegError)
-        jpeg_finish_compress(&cinfo);
-
-    jpeg_destroy_compress(&cinfo);
-    free(srcBuf);
-
-    if (jpegError)
+    if (jpeg->error) {
+        /* Return the compressor to the idle state for the next rect. */
+        jpeg_abort_compress(&jpeg->cinfo);
         return SendFullColorRect(cl, w, h);
+    }
+
+    jpeg_finish_compress(&jpeg->cinfo);
 
     if (cl->ublen + TIGHT_MIN_TO_COMPRESS + 1 > UPDATE_BUF_SIZE) {
         if (!rfbSendUpdateBuf(cl))
@@ -1688,11 +1938,12 @@ SendJpegRect(rfbClientPtr cl, int x, int y, int w, int h, int quality)
     cl->updateBuf[cl->ublen++] = (char)(rfbTightJpeg << 4);
     rfbStatRecordEncodingSentAdd(cl, rfbEncodingTight, 1);
 
-    return SendCompressedData(cl, jpegDstDataLen);
+    return SendCompressedData(cl, jpeg->dstDataLen);
 }
 
 static void
 PrepareRowForJpeg(rfbClientPtr cl,
+                  TIGHT_JPEG *jpeg,
                   uint8_t *dst,
                   int x,
                   int y,
@@ -1704,14 +1955,45 @@ PrepareRowForJpeg(rfbClientPtr cl,
              cl->screen->serverFormat.blueMax == 0xFF ) {
             PrepareRowForJpeg24(cl, dst, x, y, count);
         } else {
-            PrepareRowForJpeg32(cl, dst, x, y, count);
+            PrepareRowForJpeg32(cl, jpeg, dst, x, y, count);
         }
     } else {
         /* 16 bpp assumed. */
-        PrepareRowForJpeg16(cl, dst, x, y, count);
+        PrepareRowForJpeg16(cl, jpeg, dst, x, y, count);
     }
 }
 
+/*
+ * Scale n-bit color samples to 8 bits through small lookup tables
+ * instead of dividing by redMax/greenMax/blueMax for every pixel.
+ * The tables follow the server format and are rebuilt when it changes.
+ * Returns FALSE if there is no memory for them.
+ */
+
+static rfbBool
+JpegUpdateLookupTables(rfbClientPtr cl, TIGHT_JPEG *jpeg)
+{
+    int max[3];
+    int c, v;
+
+    max[0] = cl->screen->serverFormat.redMax;
+    max[1] = cl->screen->serverFormat.greenMax;
+    max[2] = cl->screen->serverFormat.blueMax;
+
+    for (c = 0; c < 3; c++) {
+        if (jpeg->lut[c] != NULL && jpeg->lutMax[c] == max[c])
+            continue;
+        free(jpeg->lut[c]);
+        jpeg->lut[c] = (uint8_t *)malloc(max[c] + 1);
+        if (jpeg->lut[c] == NULL)
+            return FALSE;
+        for (v = 0; v <= max[c]; v++)
+            jpeg->lut[c][v] = (uint8_t)((v * 255 + max[c] / 2) / max[c]);
+        jpeg->lutMax[c] = max[c];
+    }
+    return TRUE;
+}
+
 static void
 PrepareRowForJpeg24(rfbClientPtr cl,
                     uint8_t *dst,
@@ -1736,10 +2018,19 @@ PrepareRowForJpeg24(rfbClientPtr cl,
 #define DEFINE_JPEG_GET_ROW_FUNCTION(bpp)                                   \
                                                                             \
 static void                                                                 \
-PrepareRowForJpeg##bpp(rfbClientPtr cl, uint8_t *dst, int x, int y, int count) { \
+PrepareRowForJpeg##bpp(rfbClientPtr cl, TIGHT_JPEG *jpeg, uint8_t *dst,     \
+                       int x, int y, int count) {                           \
     uint##bpp##_t *fbptr;                                                   \
     uint##bpp##_t pix;                                                      \
-    int inRed, inGreen, inBlue;                                             \
+    const uint8_t *rLut = jpeg->lut[0];                                     \
+    const uint8_t *gLut = jpeg->lut[1];                                     \
+    const uint8_t *bLut = jpeg->lut[2];                                     \
+    int rShift = cl->screen->serverFormat.redShift;                         \
+    int gShift = cl->screen->serverFormat.greenShift;                       \
+    int bShift = cl->screen->serverFormat.blueShift;                        \
+    int rMax = cl->screen->serverFormat.redMax;                             \
+    int gMax = cl->screen->serverFormat.greenMax;                           \
+    int bMax = cl->screen->serverFormat.blueMax;                            \
                                                                             \
     fbptr = (uint##bpp##_t *)                                               \
         &cl->scaledScreen->frameBuffer[y * cl->scaledScreen->paddedWidthInBytes +       \
@@ -1747,20 +2038,9 @@ PrepareRowForJpeg##bpp(rfbClientPtr cl, uint8_t *dst, int x, int y, int count) {
                                                                             \
     while (count--) {                                                       \
         pix = *fbptr++;                                                     \
-                                                                            \
-        inRed = (int)                                                       \
-            (pix >> cl->screen->serverFormat.redShift   & cl->screen->serverFormat.redMax); \
-        inGreen = (int)                                                     \
-            (pix >> cl->screen->serverFormat.greenShift & cl->screen->serverFormat.greenMax); \
-        inBlue  = (int)                                                     \
-            (pix >> cl->screen->serverFormat.blueShift  & cl->screen->serverFormat.blueMax); \
-                                                                            \
-	*dst++ = (uint8_t)((inRed   * 255 + cl->screen->serverFormat.redMax / 2) / \
-                         cl->screen->serverFormat.redMax);                  \
-	*dst++ = (uint8_t)((inGreen * 255 + cl->screen->serverFormat.greenMax / 2) / \
-                         cl->screen->serverFormat.greenMax);                \
-	*dst++ = (uint8_t)((inBlue  * 255 + cl->screen->serverFormat.blueMax / 2) / \
-                         cl->screen->serverFormat.blueMax);                 \
+        *dst++ = rLut[pix >> rShift & rMax];                                \
+        *dst++ = gLut[pix >> gShift & gMax];                                \
+        *dst++ = bLut[pix >> bShift & bMax];                                \
     }                                                                       \
 }
 
@@ -1774,17 +2054,23 @@ DEFINE_JPEG_GET_ROW_FUNCTION(32)
 static void
 JpegInitDestination(j_compress_ptr cinfo)
 {
-    jpegError = FALSE;
-    jpegDstManager.next_output_byte = (JOCTET *)tightAfterBuf;
-    jpegDstManager.free_in_buffer = (size_t)tightAfterBufSize;
+    TIGHT_JPEG *jpeg = (TIGHT_JPEG *)cinfo;
+    rfbClientPtr cl = (rfbClientPtr)cinfo->client_data;
+
+    jpeg->error = FALSE;
+    cinfo->dest->next_output_byte = (JOCTET *)cl->afterEncBuf;
+    cinfo->dest->free_in_buffer = (size_t)cl->afterEncBufSize;
 }
 
 static boolean
 JpegEmptyOutputBuffer(j_compress_ptr cinfo)
 {
-    jpegError = TRUE;
-    jpegDstManager.next_output_byte = (JOCTET *)tightAfterBuf;
-    jpegDstManager.free_in_buffer = (size_t)tightAfterBufSize;
+    TIGHT_JPEG *jpeg = (TIGHT_JPEG *)cinfo;
+    rfbClientPtr cl = (rfbClientPtr)cinfo->client_data;
+
+    jpeg->error = TRUE;
+    cinfo->dest->next_output_byte = (JOCTET *)cl->afterEncBuf;
+    cinfo->dest->free_in_buffer = (size_t)cl->afterEncBufSize;
 
     return TRUE;
 }
@@ -1792,15 +2078,18 @@ JpegEmptyOutputBuffer(j_compress_ptr cinfo)
 static void
 JpegTermDestination(j_compress_ptr cinfo)
 {
-    jpegDstDataLen = tightAfterBufSize - jpegDstManager.free_in_buffer;
+    TIGHT_JPEG *jpeg = (TIGHT_JPEG *)cinfo;
+    rfbClientPtr cl = (rfbClientPtr)cinfo->client_data;
+
+    jpeg->dstDataLen = cl->afterEncBufSize - cinfo->dest->free_in_buffer;
 }
 
 static void
-JpegSetDstManager(j_compress_ptr cinfo)
+JpegSetDstManager(j_compress_ptr cinfo, struct jpeg_destination_mgr *dst)
 {
-    jpegDstManager.init_destination = JpegInitDestination;
-    jpegDstManager.empty_output_buffer = JpegEmptyOutputBuffer;
-    jpegDstManager.term_destination = JpegTermDestination;
-    cinfo->dest = &jpegDstManager;
+    dst->init_destination = JpegInitDestination;
+    dst->empty_output_buffer = JpegEmptyOutputBuffer;
+    dst->term_destination = JpegTermDestination;
+    cinfo->dest = dst;
 }
 
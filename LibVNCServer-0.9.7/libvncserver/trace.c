@@ -0,0 +1,327 @@
+/*
+ * trace.c - trace points on the way from the screen to the socket.
+ */
+
+/*
+ *  This is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This software is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this software; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307,
+ *  USA.
+ */
+
+/*
+ * The RFB_TRACE_* macros in rfb.h compile to nothing unless
+ * LIBVNCSERVER_WITH_TRACE is defined (configure --with-trace, or
+ * make TRACE=1).  With it, every thread that reaches a trace point gets a
+ * ring of its own holding its last TRACE_EVENTS events.  Only that thread
+ * writes to the ring, so recording an event takes no lock: the event is
+ * filled in, and then the count of recorded events is published behind a
+ * memory barrier.
+ *
+ * rfbTraceWrite() gives the rings as a Chrome trace (the JSON read by
+ * chrome://tracing and Perfetto).  A reader copies a ring and then reads
+ * the count again; whatever the writer may have overwritten meanwhile is
+ * left out, so a dump never stops the threads being traced.  The trace is
+ * served over http as /trace (see httpd.c), and written to
+ * rfbScreen->traceFile when the process gets SIGUSR2.
+ *
+ * At most TRACE_THREADS rings are made.  The ring of a thread which has
+ * exited is kept for the dump, and is only handed to a new thread when
+ * there is no room for another ring.
+ */
+
+#include <rfb/rfb.h>
+#include "private.h"
+#include <signal.h>
+
+#define WRITE_STRING(writer, data, s) (writer)((data), (s), strlen(s))
+
+#ifdef LIBVNCSERVER_WITH_TRACE
+
+#define TRACE_EVENTS 8192	/* per thread */
+#define TRACE_THREADS 64
+
+#if defined(__GNUC__) && defined(LIBVNCSERVER_HAVE_LIBPTHREAD)
+#define PUBLISH_COUNT(r, n) do { __sync_synchronize(); (r)->recorded = (n); } while (0)
+#define READ_COUNT(r) __sync_fetch_and_add(&(r)->recorded, 0)
+#else
+#define PUBLISH_COUNT(r, n) ((r)->recorded = (n))
+#define READ_COUNT(r) ((r)->recorded)
+#endif
+
+typedef struct {
+	const char* name;
+	struct timeval time;
+	int value;
+	char phase;		/* 'B'egin, 'E'nd or 'i'nstant */
+} TraceEvent;
+
+typedef struct TraceRing {
+	TraceEvent events[TRACE_EVENTS];
+	volatile unsigned long recorded;	/* events ever recorded */
+	int tid;
+	rfbBool owned;		/* whether its thread is still running */
+	struct TraceRing* next;
+} TraceRing;
+
+static TraceRing* traceRings = NULL;
+static int traceRingCount = 0;
+static struct timeval traceStart;
+static volatile sig_atomic_t traceDumpRequested = 0;
+
+#ifdef LIBVNCSERVER_HAVE_LIBPTHREAD
+static pthread_once_t traceOnce = PTHREAD_ONCE_INIT;
+static pthread_key_t traceKey;
+static MUTEX(traceMutex);
+
+static void
+TraceThreadExit(void* arg)
+{
+	TraceRing* ring = (TraceRing*)arg;
+
+	LOCK(traceMutex);
+	ring->owned = FALSE;
+	UNLOCK(traceMutex);
+}
+
+static void
+TraceInit(void)
+{
+	INIT_MUTEX(traceMutex);
+	pthread_key_create(&traceKey, TraceThreadExit);
+	gettimeofday(&traceStart, NULL);
+}
+#else
+static TraceRing* traceMainRing = NULL;
+#endif
+
+/* a new ring, or one left by a thread that has exited; NULL if there is
+   neither */
+static TraceRing*
+TraceNewRing(void)
+{
+	TraceRing* ring;
+
+	LOCK(traceMutex);
+	if (traceRingCount < TRACE_THREADS) {
+		ring = (TraceRing*)calloc(sizeof(TraceRing), 1);
+		if (ring) {
+			ring->tid = ++traceRingCount;
+			ring->next = traceRings;
+			traceRings = ring;
+		}
+	} else {
+		for (ring = traceRings; ring && ring->owned; ring = ring->next)
+			;
+		if (ring) {
+			ring->recorded = 0;
+			ring->tid = ++traceRingCount;
+		}
+	}
+	if (ring)
+		ring->owned = TRUE;
+	UNLOCK(traceMutex);
+	return ring;
+}
+
+static TraceRing*
+TraceGetRing(void)
+{
+#ifdef LIBVNCSERVER_HAVE_LIBPTHREAD
+	TraceRing* ring;
+
+	pthread_once(&traceOnce, TraceInit);
+	ring = (TraceRing*)pthread_getspecific(traceKey);
+	if (!ring && (ring = TraceNewRing()) != NULL)
+		pthread_setspecific(traceKey, ring);
+	return ring;
+#else
+	if (!traceMainRing) {
+		gettimeofday(&traceStart, NULL);
+		traceMainRing = TraceNewRing();
+	}
+	return traceMainRing;
+#endif
+}
+
+void
+rfbTraceEvent(const char* name, char phase, int value)
+{
+	TraceRing* ring = TraceGetRing();
+	unsigned long n;
+	TraceEvent* e;
+
+	if (!ring)
+		return;
+	n = ring->recorded;
+	e = &ring->events[n % TRACE_EVENTS];
+	e->name = name;
+	e->phase = phase;
+	e->value = value;
+	gettimeofday(&e->time, NULL);
+	PUBLISH_COUNT(ring, n + 1);
+}
+
+/* copies the events of a ring which were not overwritten while copying;
+   returns how many there are */
+static int
+TraceCopyRing(TraceRing* ring, TraceEvent* events)
+{
+	unsigned long before, after, first, i;
+
+	before = READ_COUNT(ring);
+	first = before > TRACE_EVENTS ? before - TRACE_EVENTS : 0;
+	for (i = first; i < before; i++)
+		events[i - first] = ring->events[i % TRACE_EVENTS];
+	/* the writer may have been at work on these while they were copied,
+	   and may be filling in the next one */
+	after = READ_COUNT(ring) + 1;
+	if (after > TRACE_EVENTS && after - TRACE_EVENTS > first) {
+		unsigned long lost = after - TRACE_EVENTS - first;
+		if (lost >= before - first)
+			return 0;
+		memmove(events, events + lost, (before - first - lost) * sizeof(TraceEvent));
+		first += lost;
+	}
+	return (int)(before - first);
+}
+
+void
+rfbTraceWrite(rfbTraceWriter writer, void* data)
+{
+	TraceEvent* events = (TraceEvent*)malloc(TRACE_EVENTS * sizeof(TraceEvent));
+	TraceRing* ring;
+	char buf[256];
+	const char* sep = "";
+	int pid = (int)getpid(), i, n, len;
+
+	WRITE_STRING(writer, data, "{\"traceEvents\":[");
+	if (events) {
+#ifdef LIBVNCSERVER_HAVE_LIBPTHREAD
+		pthread_once(&traceOnce, TraceInit);
+#endif
+		LOCK(traceMutex);
+		for (ring = traceRings; ring; ring = ring->next) {
+			n = TraceCopyRing(ring, events);
+			for (i = 0; i < n; i++) {
+				TraceEvent* e = &events[i];
+				double ts = (e->time.tv_sec - traceStart.tv_sec) * 1e6
+					+ (e->time.tv_usec - traceStart.tv_usec);
+
+				if (e->phase == 'E')
+					len = snprintf(buf, sizeof(buf),
+						"%s\n{\"ph\":\"E\",\"ts\":%.0f,\"pid\":%d,\"tid\":%d}",
+						sep, ts, pid, ring->tid);
+				else
+					len = snprintf(buf, sizeof(buf),
+						"%s\n{\"name\":\"%s\",\"ph\":\"%c\",\"ts\":%.0f,\"pid\":%d,\"tid\":%d%s"
+						"\"args\":{\"value\":%d}}",
+						sep, e->name, e->phase, ts, pid, ring->tid,
+						e->phase == 'i' ? ",\"s\":\"t\"," : ",", e->value);
+				if (len > 0 && len < (int)sizeof(buf))
+					writer(data, buf, len);
+				sep = ",";
+			}
+		}
+		UNLOCK(traceMutex);
+		free(events);
+	}
+	WRITE_STRING(writer, data, "\n],\"displayTimeUnit\":\"ms\"}\n");
+}
+
+/* a name that lives as long as the program, for a trace point */
+const char*
+rfbTraceEncodingName(int encoding)
+{
+	switch (encoding) {
+	case rfbEncodingRaw: return "raw";
+	case rfbEncodingRRE: return "rre";
+	case rfbEncodingCoRRE: return "corre";
+	case rfbEncodingHextile: return "hextile";
+	case rfbEncodingUltra: return "ultra";
+	case rfbEncodingZlib: return "zlib";
+	case rfbEncodingZRLE: return "zrle";
+	case rfbEncodingZYWRLE: return "zywrle";
+	case rfbEncodingTight: return "tight";
+	default: return "encode";
+	}
+}
+
+static void
+TraceSignalHandler(int sig)
+{
+	traceDumpRequested = 1;
+}
+
+static void
+TraceWriteFile(void* data, const char* text, size_t len)
+{
+	fwrite(text, 1, len, (FILE*)data);
+}
+
+void
+rfbTraceInitServer(rfbScreenInfoPtr rfbScreen)
+{
+#ifndef WIN32
+	if (rfbScreen->traceFile)
+		signal(SIGUSR2, TraceSignalHandler);
+#endif
+}
+
+void
+rfbTraceCheckDump(rfbScreenInfoPtr rfbScreen)
+{
+	FILE* f;
+
+	if (!traceDumpRequested || !rfbScreen->traceFile)
+		return;
+	traceDumpRequested = 0;
+	if ((f = fopen(rfbScreen->traceFile, "w")) == NULL) {
+		rfbLogPerror("rfbTraceCheckDump: fopen");
+		return;
+	}
+	rfbTraceWrite(TraceWriteFile, f);
+	fclose(f);
+	rfbLog("trace written to %s\n", rfbScreen->traceFile);
+}
+
+#else
+
+void
+rfbTraceEvent(const char* name, char phase, int value)
+{
+}
+
+void
+rfbTraceWrite(rfbTraceWriter writer, void* data)
+{
+	WRITE_STRING(writer, data, "{\"traceEvents\":[]}\n");
+}
+
+const char*
+rfbTraceEncodingName(int encoding)
+{
+	return "encode";
+}
+
+void
+rfbTraceInitServer(rfbScreenInfoPtr rfbScreen)
+{
+}
+
+void
+rfbTraceCheckDump(rfbScreenInfoPtr rfbScreen)
+{
+}
+
+#endif
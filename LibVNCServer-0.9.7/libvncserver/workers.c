@@ -0,0 +1,534 @@
+/*
+ * workers.c - a fixed pool of threads serving all clients when the server
+ * runs in the background.
+ */
+
+/*
+ *  This is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This software is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this software; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307,
+ *  USA.
+ */
+
+/*
+ * rfbRunEventLoop(screen, usec, TRUE) starts one event thread and
+ * workerThreads workers (one per processor by default), however many
+ * clients there are.  The event thread waits on the sockets and hands
+ * whatever happens to a client over as a task: reading its messages,
+ * writing its queued output, sending it an update or passing on a deferred
+ * pointer event.  Workers take clients from one shared run queue, so an
+ * idle worker picks up the next client with something to do, and a client
+ * is only ever served by one worker at a time.
+ *
+ * Deferring updates and pointer events does not cost a sleeping thread
+ * either: each client has at most one timer, and scheduling another task
+ * for later only moves it earlier.  The earliest timer bounds the workers'
+ * wait.
+ *
+ * There is a run queue per class of clients (see rfbClientClass()), and
+ * workers take from the interactive one first.  View-only clients get at
+ * most all workers but one, so the client which is being used never has
+ * to wait for updates to those which only watch.
+ *
+ * Clients which have gone away are handed back to the event thread, which
+ * calls rfbClientConnectionGone() for them.
+ */
+
+#include <rfb/rfb.h>
+#include <rfb/rfbregion.h>
+#include "private.h"
+#include "outqueue.h"
+
+#ifdef LIBVNCSERVER_HAVE_LIBPTHREAD
+
+#ifdef LIBVNCSERVER_HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+
+/* how long (us) the event thread waits for sockets before looking for
+   clients which have gone */
+#define EVENT_WAIT 100000
+
+typedef struct rfbWorkerClient {
+	rfbClientPtr cl;
+	int tasks;			/* to be done as soon as possible */
+	int timerTasks;			/* to be done when due */
+	struct timeval due;
+	int clientClass;		/* when it was queued */
+	rfbBool queued, running, timed, dead;
+	struct rfbWorkerClient *next;	/* in the run queue or gone list */
+	struct rfbWorkerClient *nextTimer;
+} rfbWorkerClient;
+
+typedef struct rfbWorkers {
+	rfbScreenInfoPtr screen;
+	MUTEX(mutex);
+	COND(cond);
+	rfbBool stop;
+	int count;
+	pthread_t *threads;
+	pthread_t eventThread;
+	rfbBool eventThreadRunning;
+	/* run queues, per class of clients */
+	rfbWorkerClient *head[RFB_CLIENT_CLASSES], *tail[RFB_CLIENT_CLASSES];
+	int runningViewOnly;
+	rfbWorkerClient *timers;	/* sorted by due */
+	rfbWorkerClient *gone;
+} rfbWorkers;
+
+static rfbBool
+Earlier(struct timeval *a, struct timeval *b)
+{
+	return a->tv_sec < b->tv_sec
+		|| (a->tv_sec == b->tv_sec && a->tv_usec < b->tv_usec);
+}
+
+/* these expect the pool's mutex to be held */
+
+static void
+Enqueue(rfbWorkers *p, rfbWorkerClient *w)
+{
+	int c;
+
+	if (w->queued || w->running || w->dead)
+		return;
+	w->queued = TRUE;
+	w->next = NULL;
+	c = w->clientClass = rfbClientClass(w->cl);
+	if (p->tail[c])
+		p->tail[c]->next = w;
+	else
+		p->head[c] = w;
+	p->tail[c] = w;
+	TSIGNAL(p->cond);
+}
+
+/* the next client to serve, or NULL */
+static rfbWorkerClient *
+Dequeue(rfbWorkers *p)
+{
+	rfbWorkerClient *w;
+	int c;
+
+	for (c = 0; c < RFB_CLIENT_CLASSES; c++) {
+		if (!p->head[c])
+			continue;
+		/* keep a worker for the others */
+		if (c == RFB_CLASS_VIEWONLY && p->count > 1
+				&& p->runningViewOnly >= p->count - 1)
+			return NULL;
+		w = p->head[c];
+		p->head[c] = w->next;
+		if (!p->head[c])
+			p->tail[c] = NULL;
+		if (c == RFB_CLASS_VIEWONLY)
+			p->runningViewOnly++;
+		return w;
+	}
+	return NULL;
+}
+
+static void
+RemoveTimer(rfbWorkers *p, rfbWorkerClient *w)
+{
+	rfbWorkerClient **t;
+
+	if (!w->timed)
+		return;
+	for (t = &p->timers; *t != w; t = &(*t)->nextTimer)
+		;
+	*t = w->nextTimer;
+	w->timed = FALSE;
+}
+
+static void
+AddTimer(rfbWorkers *p, rfbWorkerClient *w, struct timeval *due)
+{
+	rfbWorkerClient **t;
+
+	if (w->timed) {
+		if (!Earlier(due, &w->due))
+			return;
+		RemoveTimer(p, w);
+	}
+	w->due = *due;
+	w->timed = TRUE;
+	for (t = &p->timers; *t && !Earlier(due, &(*t)->due); t = &(*t)->nextTimer)
+		;
+	w->nextTimer = *t;
+	*t = w;
+	/* the new timer may be the earliest, have a worker look again */
+	if (p->timers == w)
+		TSIGNAL(p->cond);
+}
+
+/* move the tasks whose time has come to the run queue */
+static void
+RunDueTimers(rfbWorkers *p)
+{
+	struct timeval now;
+	rfbWorkerClient *w;
+
+	gettimeofday(&now, NULL);
+	while ((w = p->timers) != NULL && !Earlier(&now, &w->due)) {
+		p->timers = w->nextTimer;
+		w->timed = FALSE;
+		w->tasks |= w->timerTasks;
+		w->timerTasks = 0;
+		Enqueue(p, w);
+	}
+}
+
+/*
+ * rfbScheduleClient has tasks done for cl by a worker, after delay ms.
+ * Returns FALSE if the client is not served by workers, so the caller has to
+ * do them itself.
+ */
+
+rfbBool
+rfbScheduleClient(rfbClientPtr cl, int tasks, int delay)
+{
+	rfbWorkers *p = (rfbWorkers *)cl->screen->workers;
+	rfbWorkerClient *w = (rfbWorkerClient *)cl->workerData;
+	struct timeval due;
+
+	if (!p || !w)
+		return FALSE;
+
+	LOCK(p->mutex);
+	if (delay <= 0) {
+		w->tasks |= tasks;
+		Enqueue(p, w);
+	} else if (!w->dead) {
+		gettimeofday(&due, NULL);
+		due.tv_sec += delay / 1000;
+		due.tv_usec += (delay % 1000) * 1000;
+		if (due.tv_usec >= 1000000) {
+			due.tv_sec++;
+			due.tv_usec -= 1000000;
+		}
+		w->timerTasks |= tasks;
+		AddTimer(p, w, &due);
+	}
+	UNLOCK(p->mutex);
+	return TRUE;
+}
+
+/*
+ * rfbScheduleUpdate is called with cl->updateMutex held whenever there may
+ * be something new to send to cl.
+ */
+
+void
+rfbScheduleUpdate(rfbClientPtr cl)
+{
+	TSIGNAL(cl->updateCond);
+	rfbScheduleClient(cl, RFB_TASK_UPDATE, cl->screen->deferUpdateTime);
+}
+
+rfbBool
+rfbClientScheduled(rfbClientPtr cl)
+{
+	rfbWorkers *p = (rfbWorkers *)cl->screen->workers;
+	rfbWorkerClient *w = (rfbWorkerClient *)cl->workerData;
+	rfbBool result;
+
+	if (!p || !w)
+		return FALSE;
+	LOCK(p->mutex);
+	result = w->queued || w->running;
+	UNLOCK(p->mutex);
+	return result;
+}
+
+void
+rfbWorkersAddClient(rfbClientPtr cl)
+{
+	if (!cl->screen->workers || cl->workerData)
+		return;
+	cl->workerData = calloc(1, sizeof(rfbWorkerClient));
+	if (cl->workerData)
+		((rfbWorkerClient *)cl->workerData)->cl = cl;
+	else
+		rfbErr("rfbWorkersAddClient: out of memory\n");
+}
+
+/*
+ * rfbSendFramebufferUpdate() takes what is in modifiedRegion under
+ * updateMutex, and collects the journal's damage into it first.
+ */
+
+static void
+SendUpdate(rfbClientPtr cl)
+{
+	rfbBool pending;
+
+	LOCK(cl->updateMutex);
+	pending = FB_UPDATE_PENDING(cl) && !sraRgnEmpty(cl->requestedRegion);
+	UNLOCK(cl->updateMutex);
+
+	if (pending)
+		rfbSendFramebufferUpdate(cl, cl->modifiedRegion);
+}
+
+static void
+RunTasks(rfbClientPtr cl, int tasks)
+{
+	if (cl->sock < 0 || cl->onHold)
+		return;
+
+	if (tasks & (RFB_TASK_INPUT | RFB_TASK_OUTPUT)) {
+		rfbServiceClient(cl, tasks & RFB_TASK_INPUT, tasks & RFB_TASK_OUTPUT);
+		if (cl->sock < 0)
+			return;
+		/* rfbProcessClientMessage() leaves pointer motion for later */
+		if (!cl->viewOnly && cl->lastPtrX >= 0)
+			rfbScheduleClient(cl, RFB_TASK_POINTER,
+					cl->screen->deferPtrUpdateTime);
+		/* the backlog is gone, send what has piled up meanwhile */
+		if ((tasks & RFB_TASK_OUTPUT) && rfbOutQueuePending(cl) == 0)
+			tasks |= RFB_TASK_UPDATE;
+	}
+
+	if ((tasks & RFB_TASK_POINTER) && !cl->viewOnly && cl->lastPtrX >= 0) {
+		cl->screen->ptrAddEvent(cl->lastPtrButtons,
+				cl->lastPtrX, cl->lastPtrY, cl);
+		cl->lastPtrX = -1;
+	}
+
+	if ((tasks & RFB_TASK_UPDATE) && cl->sock >= 0)
+		SendUpdate(cl);
+}
+
+static void *
+WorkerRun(void *data)
+{
+	rfbWorkers *p = (rfbWorkers *)data;
+	rfbWorkerClient *w;
+	struct timespec ts;
+	int tasks;
+
+	LOCK(p->mutex);
+	while (!p->stop) {
+		RunDueTimers(p);
+
+		if ((w = Dequeue(p)) != NULL) {
+			w->queued = FALSE;
+			w->running = TRUE;
+			tasks = w->tasks;
+			w->tasks = 0;
+			UNLOCK(p->mutex);
+
+			RunTasks(w->cl, tasks);
+
+			LOCK(p->mutex);
+			w->running = FALSE;
+			if (w->clientClass == RFB_CLASS_VIEWONLY)
+				p->runningViewOnly--;
+			if (w->cl->sock < 0) {
+				w->dead = TRUE;
+				RemoveTimer(p, w);
+				w->next = p->gone;
+				p->gone = w;
+			} else if (w->tasks) {
+				Enqueue(p, w);
+			}
+			continue;
+		}
+
+		if (p->timers) {
+			ts.tv_sec = p->timers->due.tv_sec;
+			ts.tv_nsec = p->timers->due.tv_usec * 1000;
+			pthread_cond_timedwait(&p->cond, &p->mutex, &ts);
+		} else
+			WAIT(p->cond, p->mutex);
+	}
+	UNLOCK(p->mutex);
+	return NULL;
+}
+
+/* call rfbClientConnectionGone() for the clients the workers are done with */
+static void
+ReapClients(rfbWorkers *p)
+{
+	rfbWorkerClient *w;
+
+	for (;;) {
+		LOCK(p->mutex);
+		if ((w = p->gone) != NULL)
+			p->gone = w->next;
+		UNLOCK(p->mutex);
+		if (!w)
+			break;
+		rfbClientConnectionGone(w->cl);
+		free(w);
+	}
+}
+
+static void *
+EventRun(void *data)
+{
+	rfbWorkers *p = (rfbWorkers *)data;
+	rfbScreenInfoPtr screen = p->screen;
+	rfbBool stop = FALSE;
+
+	while (!stop && screen->socketState != RFB_SOCKET_SHUTDOWN) {
+		ReapClients(p);
+		rfbCheckFds(screen, EVENT_WAIT);
+		rfbHttpCheckFds(screen);
+#ifdef CORBA
+		corbaCheckFds(screen);
+#endif
+		LOCK(p->mutex);
+		stop = p->stop;
+		UNLOCK(p->mutex);
+	}
+	return NULL;
+}
+
+rfbBool
+rfbStartWorkers(rfbScreenInfoPtr screen)
+{
+	rfbWorkers *p;
+	rfbClientIteratorPtr i;
+	rfbClientPtr cl;
+	int n;
+
+	if (screen->workers)
+		return TRUE;
+
+	p = (rfbWorkers *)calloc(1, sizeof(rfbWorkers));
+	if (!p)
+		return FALSE;
+	p->screen = screen;
+	p->count = screen->workerThreads;
+#ifdef _SC_NPROCESSORS_ONLN
+	if (p->count <= 0)
+		p->count = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+	if (p->count <= 0)
+		p->count = 1;
+	p->threads = (pthread_t *)calloc(p->count, sizeof(pthread_t));
+	if (!p->threads) {
+		free(p);
+		return FALSE;
+	}
+	INIT_MUTEX(p->mutex);
+	INIT_COND(p->cond);
+	screen->workers = p;
+
+	/* clients which are already there */
+	i = rfbGetClientIterator(screen);
+	while ((cl = rfbClientIteratorNext(i)))
+		rfbWorkersAddClient(cl);
+	rfbReleaseClientIterator(i);
+
+	for (n = 0; n < p->count; n++)
+		if (pthread_create(&p->threads[n], NULL, WorkerRun, p) != 0) {
+			rfbLogPerror("rfbStartWorkers: pthread_create");
+			break;
+		}
+	p->count = n;
+	if (n > 0 && pthread_create(&p->eventThread, NULL, EventRun, p) == 0)
+		p->eventThreadRunning = TRUE;
+	if (!p->eventThreadRunning) {
+		rfbErr("rfbStartWorkers: could not start threads\n");
+		rfbStopWorkers(screen);
+		return FALSE;
+	}
+
+	rfbLog("Serving clients with %d worker threads\n", p->count);
+	return TRUE;
+}
+
+/*
+ * rfbStopWorkers waits for the threads to finish and takes care of the
+ * clients which have gone meanwhile.
+ */
+
+void
+rfbStopWorkers(rfbScreenInfoPtr screen)
+{
+	rfbWorkers *p = (rfbWorkers *)screen->workers;
+	rfbClientIteratorPtr i;
+	rfbClientPtr cl, clPrev;
+	rfbWorkerClient *w;
+	int n;
+
+	if (!p)
+		return;
+
+	LOCK(p->mutex);
+	p->stop = TRUE;
+	pthread_cond_broadcast(&p->cond);
+	UNLOCK(p->mutex);
+	if (p->eventThreadRunning)
+		pthread_join(p->eventThread, NULL);
+	for (n = 0; n < p->count; n++)
+		pthread_join(p->threads[n], NULL);
+
+	while ((w = p->gone) != NULL) {
+		p->gone = w->next;
+		w->cl->workerData = NULL;
+		free(w);
+	}
+	screen->workers = NULL;
+
+	i = rfbGetClientIteratorWithClosed(screen);
+	cl = rfbClientIteratorHead(i);
+	while (cl) {
+		free(cl->workerData);
+		cl->workerData = NULL;
+		clPrev = cl;
+		cl = rfbClientIteratorNext(i);
+		if (clPrev->sock < 0)
+			rfbClientConnectionGone(clPrev);
+	}
+	rfbReleaseClientIterator(i);
+
+	TINI_COND(p->cond);
+	TINI_MUTEX(p->mutex);
+	free(p->threads);
+	free(p);
+}
+
+#else
+
+rfbBool
+rfbScheduleClient(rfbClientPtr cl, int tasks, int delay)
+{
+	return FALSE;
+}
+
+void
+rfbScheduleUpdate(rfbClientPtr cl)
+{
+}
+
+rfbBool
+rfbClientScheduled(rfbClientPtr cl)
+{
+	return FALSE;
+}
+
+void
+rfbWorkersAddClient(rfbClientPtr cl)
+{
+}
+
+void
+rfbStopWorkers(rfbScreenInfoPtr screen)
+{
+}
+
+#endif
@@ -33,32 +33,13 @@
 #include <rfb/rfb.h>
 
 /*
- * zlibBeforeBuf contains pixel data in the client's format.
- * zlibAfterBuf contains the zlib (deflated) encoding version.
+ * cl->beforeEncBuf contains pixel data in the client's format.
+ * cl->afterEncBuf contains the zlib (deflated) encoding version.
  * If the zlib compressed/encoded version is
- * larger than the raw data or if it exceeds zlibAfterBufSize then
+ * larger than the raw data or if it exceeds cl->afterEncBufSize then
  * raw encoding is used instead.
  */
 
-static int zlibBeforeBufSize = 0;
-static char *zlibBeforeBuf = NULL;
-
-static int zlibAfterBufSize = 0;
-static char *zlibAfterBuf = NULL;
-static int zlibAfterBufLen;
-
-void rfbZlibCleanup(rfbScreenInfoPtr screen)
-{
-  if (zlibBeforeBufSize) {
-    free(zlibBeforeBuf);
-    zlibBeforeBufSize=0;
-  }
-  if (zlibAfterBufSize) {
-    zlibAfterBufSize=0;
-    free(zlibAfterBuf);
-  }
-}
-
 
 /*
  * rfbSendOneRectEncodingZlib - send a given rectangle using one Zlib
@@ -83,15 +64,15 @@ rfbSendOneRectEncodingZlib(rfbClientPtr cl,
     int maxRawSize;
     int maxCompSize;
 
-    maxRawSize = (cl->scaledScreen->width * cl->scaledScreen->height
-                  * (cl->format.bitsPerPixel / 8));
+    /* the buffers are the client's own, so only as big as needed */
+    maxRawSize = w * h * (cl->format.bitsPerPixel / 8);
 
-    if (zlibBeforeBufSize < maxRawSize) {
-	zlibBeforeBufSize = maxRawSize;
-	if (zlibBeforeBuf == NULL)
-	    zlibBeforeBuf = (char *)malloc(zlibBeforeBufSize);
+    if (cl->beforeEncBufSize < maxRawSize) {
+	cl->beforeEncBufSize = maxRawSize;
+	if (cl->beforeEncBuf == NULL)
+	    cl->beforeEncBuf = (char *)malloc(cl->beforeEncBufSize);
 	else
-	    zlibBeforeBuf = (char *)realloc(zlibBeforeBuf, zlibBeforeBufSize);
+	    cl->beforeEncBuf = (char *)realloc(cl->beforeEncBuf, cl->beforeEncBufSize);
     }
 
     /* zlib compression is not useful for very small data sets.
@@ -126,12 +107,12 @@ rfbSendOneRectEncodingZlib(rfbClientPtr cl,
      */
     maxCompSize = maxRawSize + (( maxRawSize + 99 ) / 100 ) + 12;
 
-    if (zlibAfterBufSize < maxCompSize) {
-	zlibAfterBufSize = maxCompSize;
-	if (zlibAfterBuf == NULL)
-	    zlibAfterBuf = (char *)malloc(zlibAfterBufSize);
+    if (cl->afterEncBufSize < maxCompSize) {
+	cl->afterEncBufSize = maxCompSize;
+	if (cl->afterEncBuf == NULL)
+	    cl->afterEncBuf = (char *)malloc(cl->afterEncBufSize);
 	else
-	    zlibAfterBuf = (char *)realloc(zlibAfterBuf, zlibAfterBufSize);
+	    cl->afterEncBuf = (char *)realloc(cl->afterEncBuf, cl->afterEncBufSize);
     }
 
 
@@ -139,12 +120,12 @@ rfbSendOneRectEncodingZlib(rfbClientPtr cl,
      * Convert pixel data to client format.
      */
     (*cl->translateFn)(cl->translateLookupTable, &cl->screen->serverFormat,
-		       &cl->format, fbptr, zlibBeforeBuf,
+		       &cl->format, fbptr, cl->beforeEncBuf,
 		       cl->scaledScreen->paddedWidthInBytes, w, h);
 
-    cl->compStream.next_in = ( Bytef * )zlibBeforeBuf;
+    cl->compStream.next_in = ( Bytef * )cl->beforeEncBuf;
     cl->compStream.avail_in = w * h * (cl->format.bitsPerPixel / 8);
-    cl->compStream.next_out = ( Bytef * )zlibAfterBuf;
+    cl->compStream.next_out = ( Bytef * )cl->afterEncBuf;
     cl->compStream.avail_out = maxCompSize;
     cl->compStream.data_type = Z_BINARY;
 
@@ -175,7 +156,7 @@ rfbSendOneRectEncodingZlib(rfbClientPtr cl,
     deflateResult = deflate( &(cl->compStream), Z_SYNC_FLUSH );
 
     /* Find the total size of the resulting compressed data. */
-    zlibAfterBufLen = cl->compStream.total_out - previousOut;
+    cl->afterEncBufLen = cl->compStream.total_out - previousOut;
 
     if ( deflateResult != Z_OK ) {
         rfbErr("zlib deflation error: %s\n", cl->compStream.msg);
@@ -190,7 +171,7 @@ rfbSendOneRectEncodingZlib(rfbClientPtr cl,
      */
 
     /* Update statics */
-    rfbStatRecordEncodingSent(cl, rfbEncodingZlib, sz_rfbFramebufferUpdateRectHeader + sz_rfbZlibHeader + zlibAfterBufLen,
+    rfbStatRecordEncodingSent(cl, rfbEncodingZlib, sz_rfbFramebufferUpdateRectHeader + sz_rfbZlibHeader + cl->afterEncBufLen,
         + w * (cl->format.bitsPerPixel / 8) * h);
 
     if (cl->ublen + sz_rfbFramebufferUpdateRectHeader + sz_rfbZlibHeader
@@ -210,20 +191,20 @@ rfbSendOneRectEncodingZlib(rfbClientPtr cl,
 	   sz_rfbFramebufferUpdateRectHeader);
     cl->ublen += sz_rfbFramebufferUpdateRectHeader;
 
-    hdr.nBytes = Swap32IfLE(zlibAfterBufLen);
+    hdr.nBytes = Swap32IfLE(cl->afterEncBufLen);
 
     memcpy(&cl->updateBuf[cl->ublen], (char *)&hdr, sz_rfbZlibHeader);
     cl->ublen += sz_rfbZlibHeader;
 
-    for (i = 0; i < zlibAfterBufLen;) {
+    for (i = 0; i < cl->afterEncBufLen;) {
 
 	int bytesToCopy = UPDATE_BUF_SIZE - cl->ublen;
 
-	if (i + bytesToCopy > zlibAfterBufLen) {
-	    bytesToCopy = zlibAfterBufLen - i;
+	if (i + bytesToCopy > cl->afterEncBufLen) {
+	    bytesToCopy = cl->afterEncBufLen - i;
 	}
 
-	memcpy(&cl->updateBuf[cl->ublen], &zlibAfterBuf[i], bytesToCopy);
+	memcpy(&cl->updateBuf[cl->ublen], &cl->afterEncBuf[i], bytesToCopy);
 
 	cl->ublen += bytesToCopy;
 	i += bytesToCopy;
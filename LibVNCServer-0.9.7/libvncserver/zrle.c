@@ -27,6 +27,10 @@
 #include "rfb/rfb.h"
 #include "private.h"
 #include "zrleoutstream.h"
+#include "zrlepalettehelper.h"
+#ifdef LIBVNCSERVER_HAVE_UNISTD_H
+#include <unistd.h>
+#endif
 
 
 #define GET_IMAGE_INTO_BUF(tx,ty,tw,th,buf)                                \
@@ -40,6 +44,40 @@
 
 #define EXTRA_ARGS , rfbClientPtr cl
 
+#ifdef LIBVNCSERVER_HAVE_LIBPTHREAD
+
+/*
+ * The palette and run analysis of the 64x64 tiles of a large rectangle is
+ * split between up to ZRLE_MAX_THREADS threads: the encoding thread and
+ * the screen's helpers, which are started the first time one of its
+ * rectangles is split, wait for work until rfbScreenCleanup() stops them.
+ * Each thread encodes its share of the tiles into its own uncompressed
+ * stream; the results are then fed, in tile order, through the client's
+ * single deflate stream.  The helpers work on one rectangle at a time;
+ * one encoded while they are busy is done by its own thread alone.
+ */
+
+#define ZRLE_TILE_JOBS
+#define ZRLE_MAX_THREADS 4
+#define ZRLE_MIN_PARALLEL_TILES 8
+
+typedef struct zrleTileJob_s {
+  rfbClientPtr cl;
+  int x, y, w, h;
+  int first, last;
+  void (*encodeTiles)(struct zrleTileJob_s* job);
+  zrleOutStream* os;
+  zrlePaletteHelper ph;
+  int zywrleBuf[rfbZRLETileWidth * rfbZRLETileHeight];
+  char buf[rfbZRLETileWidth * rfbZRLETileHeight * 4 + 4];
+} zrleTileJob;
+
+static rfbBool zrleEncodeParallel(int x, int y, int w, int h,
+                                  zrleOutStream* os, rfbClientPtr cl,
+                                  void (*encodeTiles)(zrleTileJob* job));
+
+#endif
+
 #define ENDIAN_LITTLE 0
 #define ENDIAN_BIG 1
 #define ENDIAN_NO 2
@@ -90,14 +128,177 @@
 
 
 /*
- * zrleBeforeBuf contains pixel data in the client's format.  It must be at
- * least one pixel bigger than the largest tile of pixel data, since the
+ * cl->zrleBeforeBuf contains pixel data in the client's format.  It must be
+ * at least one pixel bigger than the largest tile of pixel data, since the
  * ZRLE encoding algorithm writes to the position one past the end of the pixel
  * data.
  */
 
-/* TODO: put into rfbClient struct */
-static char zrleBeforeBuf[rfbZRLETileWidth * rfbZRLETileHeight * 4 + 4];
+
+#ifdef ZRLE_TILE_JOBS
+
+/* set up once: the lock guarding the creation of the screens' pools, and
+   how many threads share a rectangle, one per processor up to the maximum */
+static pthread_once_t zrlePoolsOnce = PTHREAD_ONCE_INIT;
+static MUTEX(zrlePoolsMutex);
+static int zrleThreads;
+
+static void zrleInitPools(void)
+{
+  long n = 1;
+#ifdef _SC_NPROCESSORS_ONLN
+  n = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+  if (n < 1)
+    n = 1;
+  zrleThreads = (n > ZRLE_MAX_THREADS) ? ZRLE_MAX_THREADS : (int)n;
+  INIT_MUTEX(zrlePoolsMutex);
+}
+
+static int zrleNumThreads(void)
+{
+  pthread_once(&zrlePoolsOnce, zrleInitPools);
+  return zrleThreads;
+}
+
+typedef struct zrleHelper_s {
+  struct zrleHelperPool_s* pool;
+  zrleTileJob* job;		/* to do, NULL when there is none */
+  pthread_t thread;
+} zrleHelper;
+
+typedef struct zrleHelperPool_s {
+  MUTEX(busy);			/* held while a rectangle is split */
+  MUTEX(mutex);
+  COND(work);
+  COND(done);
+  zrleHelper helpers[ZRLE_MAX_THREADS - 1];
+  int count, pending;
+  rfbBool stop;
+} zrleHelperPool;
+
+static void* zrleHelperThread(void* arg)
+{
+  zrleHelper* h = (zrleHelper*)arg;
+  zrleHelperPool* p = h->pool;
+  zrleTileJob* job;
+
+  LOCK(p->mutex);
+  while (1) {
+    while (h->job == NULL && !p->stop)
+      WAIT(p->work, p->mutex);
+    if (p->stop)
+      break;
+    job = h->job;
+    UNLOCK(p->mutex);
+    job->encodeTiles(job);
+    LOCK(p->mutex);
+    h->job = NULL;
+    if (--p->pending == 0)
+      TSIGNAL(p->done);
+  }
+  UNLOCK(p->mutex);
+  return NULL;
+}
+
+/* the screen's helpers, started if there are none yet */
+static zrleHelperPool* zrleGetHelpers(rfbScreenInfoPtr screen)
+{
+  zrleHelperPool* p;
+  int n = zrleNumThreads(), i;
+
+  LOCK(zrlePoolsMutex);
+  p = (zrleHelperPool*)screen->zrleHelpers;
+  if (!p && (p = (zrleHelperPool*)calloc(1, sizeof(zrleHelperPool))) != NULL) {
+    INIT_MUTEX(p->busy);
+    INIT_MUTEX(p->mutex);
+    INIT_COND(p->work);
+    INIT_COND(p->done);
+    for (i = 0; i < n - 1; i++) {
+      p->helpers[i].pool = p;
+      if (pthread_create(&p->helpers[i].thread, NULL, zrleHelperThread,
+                         &p->helpers[i]) != 0)
+        break;
+      p->count++;
+    }
+    screen->zrleHelpers = p;
+  }
+  UNLOCK(zrlePoolsMutex);
+  return p;
+}
+
+static rfbBool zrleEncodeParallel(int x, int y, int w, int h,
+                                  zrleOutStream* os, rfbClientPtr cl,
+                                  void (*encodeTiles)(zrleTileJob* job))
+{
+  zrleHelperPool* pool;
+  zrleTileJob* jobs;
+  int nTiles, nThreads, i;
+
+  nTiles = ((w + rfbZRLETileWidth - 1) / rfbZRLETileWidth) *
+           ((h + rfbZRLETileHeight - 1) / rfbZRLETileHeight);
+  if (nTiles < ZRLE_MIN_PARALLEL_TILES || zrleNumThreads() < 2)
+    return FALSE;
+  pool = zrleGetHelpers(cl->screen);
+  if (!pool || pool->count == 0 || pthread_mutex_trylock(&pool->busy) != 0)
+    return FALSE;
+  nThreads = pool->count + 1;
+
+  if (!cl->zrleTileData) {
+    jobs = (zrleTileJob*)calloc(ZRLE_MAX_THREADS, sizeof(zrleTileJob));
+    if (!jobs) {
+      UNLOCK(pool->busy);
+      return FALSE;
+    }
+    for (i = 0; i < ZRLE_MAX_THREADS; i++) {
+      jobs[i].os = zrleOutStreamNewUncompressed();
+      if (!jobs[i].os) {
+        while (i--)
+          zrleOutStreamFree(jobs[i].os);
+        free(jobs);
+        UNLOCK(pool->busy);
+        return FALSE;
+      }
+    }
+    cl->zrleTileData = jobs;
+  }
+  jobs = (zrleTileJob*)cl->zrleTileData;
+
+  for (i = 0; i < nThreads; i++) {
+    jobs[i].cl = cl;
+    jobs[i].x = x;
+    jobs[i].y = y;
+    jobs[i].w = w;
+    jobs[i].h = h;
+    jobs[i].first = nTiles * i / nThreads;
+    jobs[i].last = nTiles * (i + 1) / nThreads;
+    jobs[i].encodeTiles = encodeTiles;
+    jobs[i].os->in.ptr = jobs[i].os->in.start;
+  }
+
+  /* The calling thread takes the first share itself. */
+  LOCK(pool->mutex);
+  for (i = 1; i < nThreads; i++)
+    pool->helpers[i - 1].job = &jobs[i];
+  pool->pending = nThreads - 1;
+  pthread_cond_broadcast(&pool->work);
+  UNLOCK(pool->mutex);
+  encodeTiles(&jobs[0]);
+  LOCK(pool->mutex);
+  while (pool->pending > 0)
+    WAIT(pool->done, pool->mutex);
+  UNLOCK(pool->mutex);
+  UNLOCK(pool->busy);
+
+  for (i = 0; i < nThreads; i++)
+    zrleOutStreamWriteBytes(os, jobs[i].os->in.start,
+                            ZRLE_BUFFER_LENGTH(&jobs[i].os->in));
+  zrleOutStreamFlush(os);
+
+  return TRUE;
+}
+
+#endif
 
 
 
@@ -111,7 +312,7 @@ rfbBool rfbSendRectEncodingZRLE(rfbClientPtr cl, int x, int y, int w, int h)
   zrleOutStream* zos;
   rfbFramebufferUpdateRectHeader rect;
   rfbZRLEHeader hdr;
-  int i;
+  int len;
 
   if (cl->preferredEncoding == rfbEncodingZYWRLE) {
 	  if (cl->tightQualityLevel < 0) {
@@ -128,6 +329,10 @@ rfbBool rfbSendRectEncodingZRLE(rfbClientPtr cl, int x, int y, int w, int h)
 
   if (!cl->zrleData)
     cl->zrleData = zrleOutStreamNew();
+  if (!cl->zrlePalette)
+    cl->zrlePalette = malloc(sizeof(zrlePaletteHelper));
+  if (!cl->zrlePalette)
+    return FALSE;
   zos = cl->zrleData;
   zos->in.ptr = zos->in.start;
   zos->out.ptr = zos->out.start;
@@ -135,20 +340,20 @@ rfbBool rfbSendRectEncodingZRLE(rfbClientPtr cl, int x, int y, int w, int h)
   switch (cl->format.bitsPerPixel) {
 
   case 8:
-    zrleEncode8NE(x, y, w, h, zos, zrleBeforeBuf, cl);
+    zrleEncode8NE(x, y, w, h, zos, cl->zrleBeforeBuf, cl);
     break;
 
   case 16:
 	if (cl->format.greenMax > 0x1F) {
 		if (cl->format.bigEndian)
-		  zrleEncode16BE(x, y, w, h, zos, zrleBeforeBuf, cl);
+		  zrleEncode16BE(x, y, w, h, zos, cl->zrleBeforeBuf, cl);
 		else
-		  zrleEncode16LE(x, y, w, h, zos, zrleBeforeBuf, cl);
+		  zrleEncode16LE(x, y, w, h, zos, cl->zrleBeforeBuf, cl);
 	} else {
 		if (cl->format.bigEndian)
-		  zrleEncode15BE(x, y, w, h, zos, zrleBeforeBuf, cl);
+		  zrleEncode15BE(x, y, w, h, zos, cl->zrleBeforeBuf, cl);
 		else
-		  zrleEncode15LE(x, y, w, h, zos, zrleBeforeBuf, cl);
+		  zrleEncode15LE(x, y, w, h, zos, cl->zrleBeforeBuf, cl);
 	}
     break;
 
@@ -165,22 +370,22 @@ rfbBool rfbSendRectEncodingZRLE(rfbClientPtr cl, int x, int y, int w, int h)
     if ((fitsInLS3Bytes && !cl->format.bigEndian) ||
         (fitsInMS3Bytes && cl->format.bigEndian)) {
 	if (cl->format.bigEndian)
-		zrleEncode24ABE(x, y, w, h, zos, zrleBeforeBuf, cl);
+		zrleEncode24ABE(x, y, w, h, zos, cl->zrleBeforeBuf, cl);
 	else
-		zrleEncode24ALE(x, y, w, h, zos, zrleBeforeBuf, cl);
+		zrleEncode24ALE(x, y, w, h, zos, cl->zrleBeforeBuf, cl);
     }
     else if ((fitsInLS3Bytes && cl->format.bigEndian) ||
              (fitsInMS3Bytes && !cl->format.bigEndian)) {
 	if (cl->format.bigEndian)
-		zrleEncode24BBE(x, y, w, h, zos, zrleBeforeBuf, cl);
+		zrleEncode24BBE(x, y, w, h, zos, cl->zrleBeforeBuf, cl);
 	else
-		zrleEncode24BLE(x, y, w, h, zos, zrleBeforeBuf, cl);
+		zrleEncode24BLE(x, y, w, h, zos, cl->zrleBeforeBuf, cl);
     }
     else {
 	if (cl->format.bigEndian)
-		zrleEncode32BE(x, y, w, h, zos, zrleBeforeBuf, cl);
+		zrleEncode32BE(x, y, w, h, zos, cl->zrleBeforeBuf, cl);
 	else
-		zrleEncode32LE(x, y, w, h, zos, zrleBeforeBuf, cl);
+		zrleEncode32LE(x, y, w, h, zos, cl->zrleBeforeBuf, cl);
     }
   }
     break;
@@ -206,33 +411,22 @@ rfbBool rfbSendRectEncodingZRLE(rfbClientPtr cl, int x, int y, int w, int h)
          sz_rfbFramebufferUpdateRectHeader);
   cl->ublen += sz_rfbFramebufferUpdateRectHeader;
 
-  hdr.length = Swap32IfLE(ZRLE_BUFFER_LENGTH(&zos->out));
+  len = ZRLE_BUFFER_LENGTH(&zos->out);
+  hdr.length = Swap32IfLE(len);
 
   memcpy(cl->updateBuf+cl->ublen, (char *)&hdr, sz_rfbZRLEHeader);
   cl->ublen += sz_rfbZRLEHeader;
 
-  /* copy into updateBuf and send from there.  Maybe should send directly? */
-
-  for (i = 0; i < ZRLE_BUFFER_LENGTH(&zos->out);) {
-
-    int bytesToCopy = UPDATE_BUF_SIZE - cl->ublen;
-
-    if (i + bytesToCopy > ZRLE_BUFFER_LENGTH(&zos->out)) {
-      bytesToCopy = ZRLE_BUFFER_LENGTH(&zos->out) - i;
-    }
-
-    memcpy(cl->updateBuf+cl->ublen, (uint8_t*)zos->out.start + i, bytesToCopy);
-
-    cl->ublen += bytesToCopy;
-    i += bytesToCopy;
+  /* Small results are batched in updateBuf; anything else is written
+     straight from the zlib output buffer, together with updateBuf. */
 
-    if (cl->ublen == UPDATE_BUF_SIZE) {
-      if (!rfbSendUpdateBuf(cl))
-        return FALSE;
-    }
+  if (cl->ublen + len <= UPDATE_BUF_SIZE) {
+    memcpy(cl->updateBuf+cl->ublen, zos->out.start, len);
+    cl->ublen += len;
+    return TRUE;
   }
 
-  return TRUE;
+  return rfbSendUpdateBufWithData(cl, (char *)zos->out.start, len);
 }
 
 
@@ -241,5 +435,43 @@ void rfbFreeZrleData(rfbClientPtr cl)
   if (cl->zrleData)
     zrleOutStreamFree(cl->zrleData);
   cl->zrleData = NULL;
+
+  free(cl->zrlePalette);
+  cl->zrlePalette = NULL;
+
+#ifdef ZRLE_TILE_JOBS
+  if (cl->zrleTileData) {
+    zrleTileJob* jobs = (zrleTileJob*)cl->zrleTileData;
+    int i;
+    for (i = 0; i < ZRLE_MAX_THREADS; i++)
+      zrleOutStreamFree(jobs[i].os);
+    free(jobs);
+  }
+#endif
+  cl->zrleTileData = NULL;
+}
+
+/* stops the screen's helpers, when it has no clients left */
+void rfbZrleCleanup(rfbScreenInfoPtr screen)
+{
+#ifdef ZRLE_TILE_JOBS
+  zrleHelperPool* p = (zrleHelperPool*)screen->zrleHelpers;
+  int i;
+
+  if (!p)
+    return;
+  LOCK(p->mutex);
+  p->stop = TRUE;
+  pthread_cond_broadcast(&p->work);
+  UNLOCK(p->mutex);
+  for (i = 0; i < p->count; i++)
+    pthread_join(p->helpers[i].thread, NULL);
+  TINI_COND(p->work);
+  TINI_COND(p->done);
+  TINI_MUTEX(p->mutex);
+  TINI_MUTEX(p->busy);
+  free(p);
+  screen->zrleHelpers = NULL;
+#endif
 }
 
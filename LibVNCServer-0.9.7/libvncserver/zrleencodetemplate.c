@@ -62,18 +62,21 @@
 #define zrleOutStreamWRITE_PIXEL __RFB_CONCAT2E(zrleOutStreamWriteOpaque,CPIXEL)
 #define ZRLE_ENCODE __RFB_CONCAT3E(zrleEncode,CPIXEL,END_FIX)
 #define ZRLE_ENCODE_TILE __RFB_CONCAT3E(zrleEncodeTile,CPIXEL,END_FIX)
+#define ZRLE_ENCODE_TILES __RFB_CONCAT3E(zrleEncodeTiles,CPIXEL,END_FIX)
 #define BPPOUT 24
 #elif BPP==15
 #define PIXEL_T __RFB_CONCAT2E(zrle_U,16)
 #define zrleOutStreamWRITE_PIXEL __RFB_CONCAT2E(zrleOutStreamWriteOpaque,16)
 #define ZRLE_ENCODE __RFB_CONCAT3E(zrleEncode,BPP,END_FIX)
 #define ZRLE_ENCODE_TILE __RFB_CONCAT3E(zrleEncodeTile,BPP,END_FIX)
+#define ZRLE_ENCODE_TILES __RFB_CONCAT3E(zrleEncodeTiles,BPP,END_FIX)
 #define BPPOUT 16
 #else
 #define PIXEL_T __RFB_CONCAT2E(zrle_U,BPP)
 #define zrleOutStreamWRITE_PIXEL __RFB_CONCAT2E(zrleOutStreamWriteOpaque,BPP)
 #define ZRLE_ENCODE __RFB_CONCAT3E(zrleEncode,BPP,END_FIX)
 #define ZRLE_ENCODE_TILE __RFB_CONCAT3E(zrleEncodeTile,BPP,END_FIX)
+#define ZRLE_ENCODE_TILES __RFB_CONCAT3E(zrleEncodeTiles,BPP,END_FIX)
 #define BPPOUT BPP
 #endif
 
@@ -84,24 +87,55 @@ static const int bitsPerPackedPixel[] = {
   0, 1, 2, 2, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4
 };
 
-static zrlePaletteHelper paletteHelper;
-
 #endif /* ZRLE_ONCE */
 
 void ZRLE_ENCODE_TILE (PIXEL_T* data, int w, int h, zrleOutStream* os,
-		int zywrle_level, int *zywrleBuf);
+		int zywrle_level, int *zywrleBuf, zrlePaletteHelper *ph);
 
 #if BPP!=8
 #define ZYWRLE_ENCODE
 #include "zywrletemplate.c"
 #endif
 
+#ifdef ZRLE_TILE_JOBS
+
+/* Encode the tiles job->first .. job->last-1 of the job's rectangle (in
+   row-major order) into job->os.  Used by zrleEncodeParallel(). */
+
+static void ZRLE_ENCODE_TILES (zrleTileJob* job)
+{
+  rfbClientPtr cl = job->cl;
+  int tilesPerRow = (job->w + rfbZRLETileWidth - 1) / rfbZRLETileWidth;
+  int tile;
+
+  for (tile = job->first; tile < job->last; tile++) {
+    int tx = job->x + (tile % tilesPerRow) * rfbZRLETileWidth;
+    int ty = job->y + (tile / tilesPerRow) * rfbZRLETileHeight;
+    int tw = rfbZRLETileWidth, th = rfbZRLETileHeight;
+    if (tw > job->x+job->w-tx) tw = job->x+job->w-tx;
+    if (th > job->y+job->h-ty) th = job->y+job->h-ty;
+
+    GET_IMAGE_INTO_BUF(tx,ty,tw,th,job->buf);
+
+    ZRLE_ENCODE_TILE((PIXEL_T*)job->buf, tw, th, job->os,
+		    cl->zywrleLevel, job->zywrleBuf, &job->ph);
+  }
+}
+
+#endif
+
 static void ZRLE_ENCODE (int x, int y, int w, int h,
 		  zrleOutStream* os, void* buf
                   EXTRA_ARGS
                   )
 {
   int ty;
+
+#ifdef ZRLE_TILE_JOBS
+  if (zrleEncodeParallel(x, y, w, h, os, cl, ZRLE_ENCODE_TILES))
+    return;
+#endif
+
   for (ty = y; ty < y+h; ty += rfbZRLETileHeight) {
     int tx, th = rfbZRLETileHeight;
     if (th > y+h-ty) th = y+h-ty;
@@ -112,7 +146,8 @@ static void ZRLE_ENCODE (int x, int y, int w, int h,
       GET_IMAGE_INTO_BUF(tx,ty,tw,th,buf);
 
       ZRLE_ENCODE_TILE((PIXEL_T*)buf, tw, th, os,
-		      cl->zywrleLevel, cl->zywrleBuf);
+		      cl->zywrleLevel, cl->zywrleBuf,
+		      (zrlePaletteHelper*)cl->zrlePalette);
     }
   }
   zrleOutStreamFlush(os);
@@ -120,12 +155,10 @@ static void ZRLE_ENCODE (int x, int y, int w, int h,
 
 
 void ZRLE_ENCODE_TILE(PIXEL_T* data, int w, int h, zrleOutStream* os,
-	int zywrle_level, int *zywrleBuf)
+	int zywrle_level, int *zywrleBuf, zrlePaletteHelper *ph)
 {
   /* First find the palette and the number of runs */
 
-  zrlePaletteHelper *ph;
-
   int runs = 0;
   int singlePixels = 0;
 
@@ -140,7 +173,6 @@ void ZRLE_ENCODE_TILE(PIXEL_T* data, int w, int h, zrleOutStream* os,
   PIXEL_T* end = ptr + h * w;
   *end = ~*(end-1); /* one past the end is different so the while loop ends */
 
-  ph = &paletteHelper;
   zrlePaletteHelperInit(ph);
 
   while (ptr < end) {
@@ -289,7 +321,7 @@ void ZRLE_ENCODE_TILE(PIXEL_T* data, int w, int h, zrleOutStream* os,
 #if BPP!=8
       if (zywrle_level > 0 && !(zywrle_level & 0x80)) {
         ZYWRLE_ANALYZE(data, data, w, h, w, zywrle_level, zywrleBuf);
-	ZRLE_ENCODE_TILE(data, w, h, os, zywrle_level | 0x80, zywrleBuf);
+	ZRLE_ENCODE_TILE(data, w, h, os, zywrle_level | 0x80, zywrleBuf, ph);
       }
       else
 #endif
@@ -310,5 +342,6 @@ void ZRLE_ENCODE_TILE(PIXEL_T* data, int w, int h, zrleOutStream* os,
 #undef zrleOutStreamWRITE_PIXEL
 #undef ZRLE_ENCODE
 #undef ZRLE_ENCODE_TILE
+#undef ZRLE_ENCODE_TILES
 #undef ZYWRLE_ENCODE_TILE
 #undef BPPOUT
@@ -91,12 +91,40 @@ zrleOutStream *zrleOutStreamNew(void)
     return NULL;
   }
 
+  os->compressed = TRUE;
+
+  return os;
+}
+
+/*
+ * An uncompressed stream never deflates: its input buffer just grows, so
+ * ZRLE tiles can be encoded into it by one thread and appended to the
+ * client's compressed stream by another, in order.
+ */
+
+zrleOutStream *zrleOutStreamNewUncompressed(void)
+{
+  zrleOutStream *os;
+
+  os = malloc(sizeof(zrleOutStream));
+  if (os == NULL)
+    return NULL;
+
+  if (!zrleBufferAlloc(&os->in, ZRLE_IN_BUFFER_SIZE)) {
+    free(os);
+    return NULL;
+  }
+
+  os->out.start = os->out.ptr = os->out.end = NULL;
+  os->compressed = FALSE;
+
   return os;
 }
 
 void zrleOutStreamFree (zrleOutStream *os)
 {
-  deflateEnd(&os->zs);
+  if (os->compressed)
+    deflateEnd(&os->zs);
   zrleBufferFree(&os->in);
   zrleBufferFree(&os->out);
   free(os);
@@ -155,6 +183,15 @@ static int zrleOutStreamOverrun(zrleOutStream *os,
   rfbLog("zrleOutStreamOverrun\n");
 #endif
 
+  if (!os->compressed) {
+    if (!zrleBufferGrow(&os->in, size > os->in.end - os->in.start ?
+                                 size : os->in.end - os->in.start)) {
+      rfbLog("zrleOutStreamOverrun: failed to grow input buffer\n");
+      return 0;
+    }
+    return size;
+  }
+
   while (os->in.end - os->in.ptr < size && os->in.ptr > os->in.start) {
     os->zs.next_in = os->in.start;
     os->zs.avail_in = ZRLE_BUFFER_LENGTH (&os->in);
@@ -36,11 +36,16 @@ typedef struct {
   zrleBuffer out;
 
   z_stream   zs;
+
+  /* FALSE for a stream only collecting uncompressed data in "in", see
+     zrleOutStreamNewUncompressed() */
+  rfbBool    compressed;
 } zrleOutStream;
 
 #define ZRLE_BUFFER_LENGTH(b) ((b)->ptr - (b)->start)
 
 zrleOutStream *zrleOutStreamNew           (void);
+zrleOutStream *zrleOutStreamNewUncompressed(void);
 void           zrleOutStreamFree          (zrleOutStream *os);
 rfbBool        zrleOutStreamFlush         (zrleOutStream *os);
 void           zrleOutStreamWriteBytes    (zrleOutStream *os,
@@ -146,6 +146,14 @@ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #define InlineX inline
 #endif
 
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#define ZYWRLE_SIMD 1
+#elif defined(__ARM_NEON__) || defined(__ARM_NEON)
+#include <arm_neon.h>
+#define ZYWRLE_SIMD 1
+#endif
+
 #ifdef ZYWRLE_ENCODE
 /* Tables for Coefficients filtering. */
 #  ifndef ZYWRLE_QUANTIZE
@@ -372,6 +380,188 @@ static InlineX void WaveletLevel(int* data, int size, int l, int SkipPixel)
 }
 #define InvWaveletLevel(d,s,l,pix) WaveletLevel(d,s,l,pix)
 
+/*
+ Vector versions of the level 0 passes.
+
+ Harr() treats the three colour bytes of a coefficient independently, so a
+ vector of coefficients can go through PLHarr as 16 signed byte lanes: both
+ branches are computed and then selected with the sign masks. The fourth
+ byte of a coefficient is not used and is never read back, so it does not
+ matter what happens to it.
+
+ Level 0 is where nearly all of the work is (each level has a quarter of
+ the coefficients of the previous one), and it is the only level where
+ the pairs are next to each other: in the vertical pass whole rows are
+ paired, and in the horizontal pass even and odd coefficients. The other
+ levels and the tails use the plain Harr().
+
+ The vector code is used when zywrleUseSimd is set (the default when the
+ compiler targets SSE2 or NEON); clearing it selects the plain code, which
+ gives exactly the same result.
+*/
+#ifdef ZYWRLE_SIMD
+static int zywrleUseSimd = 1;
+
+#if defined(__SSE2__)
+typedef __m128i zywrleVec;
+#define ZYWRLE_VEC_SELECT(m,a,b) \
+	_mm_or_si128(_mm_and_si128(m,a), _mm_andnot_si128(m,b))
+#define ZYWRLE_VEC_NEGATIVE(x) _mm_cmplt_epi8(x, _mm_setzero_si128())
+
+static InlineX void HarrVec(zywrleVec* pX0, zywrleVec* pX1)
+{
+	zywrleVec X0 = *pX0, X1 = *pX1;
+	zywrleVec differ, keep, dL, dH, sL, sH;
+
+	differ = ZYWRLE_VEC_NEGATIVE(_mm_xor_si128(X0, X1));
+	/* differ sign */
+	dL = _mm_add_epi8(X1, X0);
+	keep = ZYWRLE_VEC_NEGATIVE(_mm_xor_si128(dL, X1));
+	dH = ZYWRLE_VEC_SELECT(keep, X0, _mm_sub_epi8(X0, dL));
+	/* same sign */
+	sH = _mm_sub_epi8(X0, X1);
+	keep = ZYWRLE_VEC_NEGATIVE(_mm_xor_si128(sH, X0));
+	sL = ZYWRLE_VEC_SELECT(keep, X1, _mm_add_epi8(X1, sH));
+
+	*pX0 = ZYWRLE_VEC_SELECT(differ, dL, sL);
+	*pX1 = ZYWRLE_VEC_SELECT(differ, dH, sH);
+}
+
+/* Pair rows pX0[] and pX1[], 4 coefficients at a time. Returns the number done. */
+static InlineX int HarrRowsVec(int* pX0, int* pX1, int n)
+{
+	int x;
+	zywrleVec X0, X1;
+
+	for (x = 0; x + 4 <= n; x += 4) {
+		X0 = _mm_loadu_si128((const __m128i*)(pX0+x));
+		X1 = _mm_loadu_si128((const __m128i*)(pX1+x));
+		HarrVec(&X0, &X1);
+		_mm_storeu_si128((__m128i*)(pX0+x), X0);
+		_mm_storeu_si128((__m128i*)(pX1+x), X1);
+	}
+	return x;
+}
+
+/* Pair even and odd coefficients of data[], 8 at a time. Returns the number done. */
+static InlineX int HarrPairsVec(int* data, int n)
+{
+	int x;
+	zywrleVec a, b, X0, X1;
+
+	for (x = 0; x + 8 <= n; x += 8) {
+		a = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i*)(data+x)), _MM_SHUFFLE(3,1,2,0));
+		b = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i*)(data+x+4)), _MM_SHUFFLE(3,1,2,0));
+		X0 = _mm_unpacklo_epi64(a, b);
+		X1 = _mm_unpackhi_epi64(a, b);
+		HarrVec(&X0, &X1);
+		_mm_storeu_si128((__m128i*)(data+x), _mm_unpacklo_epi32(X0, X1));
+		_mm_storeu_si128((__m128i*)(data+x+4), _mm_unpackhi_epi32(X0, X1));
+	}
+	return x;
+}
+#else
+typedef int8x16_t zywrleVec;
+#define ZYWRLE_VEC_NEGATIVE(x) vcltq_s8(x, vdupq_n_s8(0))
+
+static InlineX void HarrVec(zywrleVec* pX0, zywrleVec* pX1)
+{
+	zywrleVec X0 = *pX0, X1 = *pX1;
+	zywrleVec dL, dH, sL, sH;
+	uint8x16_t differ, keep;
+
+	differ = ZYWRLE_VEC_NEGATIVE(veorq_s8(X0, X1));
+	/* differ sign */
+	dL = vaddq_s8(X1, X0);
+	keep = ZYWRLE_VEC_NEGATIVE(veorq_s8(dL, X1));
+	dH = vbslq_s8(keep, X0, vsubq_s8(X0, dL));
+	/* same sign */
+	sH = vsubq_s8(X0, X1);
+	keep = ZYWRLE_VEC_NEGATIVE(veorq_s8(sH, X0));
+	sL = vbslq_s8(keep, X1, vaddq_s8(X1, sH));
+
+	*pX0 = vbslq_s8(differ, dL, sL);
+	*pX1 = vbslq_s8(differ, dH, sH);
+}
+
+static InlineX int HarrRowsVec(int* pX0, int* pX1, int n)
+{
+	int x;
+	zywrleVec X0, X1;
+
+	for (x = 0; x + 4 <= n; x += 4) {
+		X0 = vld1q_s8((const int8_t*)(pX0+x));
+		X1 = vld1q_s8((const int8_t*)(pX1+x));
+		HarrVec(&X0, &X1);
+		vst1q_s8((int8_t*)(pX0+x), X0);
+		vst1q_s8((int8_t*)(pX1+x), X1);
+	}
+	return x;
+}
+
+static InlineX int HarrPairsVec(int* data, int n)
+{
+	int x;
+	int32x4x2_t v;
+	zywrleVec X0, X1;
+
+	for (x = 0; x + 8 <= n; x += 8) {
+		v = vld2q_s32((const int32_t*)(data+x));
+		X0 = vreinterpretq_s8_s32(v.val[0]);
+		X1 = vreinterpretq_s8_s32(v.val[1]);
+		HarrVec(&X0, &X1);
+		v.val[0] = vreinterpretq_s32_s8(X0);
+		v.val[1] = vreinterpretq_s32_s8(X1);
+		vst2q_s32((int32_t*)(data+x), v);
+	}
+	return x;
+}
+#endif
+#endif
+
+/* Horizontal pass of level 0 over one row. */
+static InlineX void WaveletLevel0(int* data, int size)
+{
+	int x = 0;
+
+#ifdef ZYWRLE_SIMD
+	if (zywrleUseSimd)
+		x = HarrPairsVec(data, size & ~1);
+#endif
+	if (x < size)
+		WaveletLevel(data+x, size-x, 0, 1);
+}
+
+/*
+ Vertical pass of one level: the same pairs as calling WaveletLevel() on
+ every (1<<l)th column, but walked a row pair at a time. The pairs are
+ independent, so the order does not change the result.
+*/
+static InlineX void WaveletLevelRows(int* data, int width, int height, int l)
+{
+	int x, y, s;
+	int* pX0;
+	int* pX1;
+
+	s = 1<<l;
+	for (y = 0; y < (height>>(l+1)); y++) {
+		pX0 = data + y*(2<<l)*width;
+		pX1 = pX0 + s*width;
+		x = 0;
+#ifdef ZYWRLE_SIMD
+		if (l == 0 && zywrleUseSimd)
+			x = HarrRowsVec(pX0, pX1, width);
+#endif
+		for (; x < width; x += s) {
+			Harr((signed char*)(pX0+x), (signed char*)(pX1+x));
+			Harr((signed char*)(pX0+x)+1, (signed char*)(pX1+x)+1);
+			Harr((signed char*)(pX0+x)+2, (signed char*)(pX1+x)+2);
+		}
+	}
+}
+#define InvWaveletLevel0(d,s) WaveletLevel0(d,s)
+#define InvWaveletLevelRows(d,w,h,l) WaveletLevelRows(d,w,h,l)
+
 #ifdef ZYWRLE_ENCODE
 #  ifndef ZYWRLE_QUANTIZE
 /* Type A:lower bit omitting of EZW style. */
@@ -452,6 +642,24 @@ static InlineX void FilterWaveletSquare(int* pBuf, int width, int height, int le
 
 	pM = zywrleParam[level-1][l];
 	s = 2<<l;
+	if (pM[0] == zywrleConv[0] && pM[1] == zywrleConv[0] && pM[2] == zywrleConv[0]) {
+		/* the first table maps everything to 0 */
+		for (r = 1; r < 4; r++) {
+			pH   = pBuf;
+			if (r & 0x01)
+				pH +=  s>>1;
+			if (r & 0x02)
+				pH += (s>>1)*width;
+			for (y = 0; y < height / s; y++) {
+				for (x = 0; x < width / s; x++) {
+					*pH = 0;
+					pH += s;
+				}
+				pH += (s-1)*width;
+			}
+		}
+		return;
+	}
 	for (r = 1; r < 4; r++) {
 		pH   = pBuf;
 		if (r & 0x01)
@@ -482,16 +690,13 @@ static InlineX void Wavelet(int* pBuf, int width, int height, int level)
 		pEnd = pBuf+height*width;
 		s = width<<l;
 		while (pTop < pEnd) {
-			WaveletLevel(pTop, width, l, 1);
-			pTop += s;
-		}
-		pTop = pBuf;
-		pEnd = pBuf+width;
-		s = 1<<l;
-		while (pTop < pEnd) {
-			WaveletLevel(pTop, height,l, width);
+			if (l == 0)
+				WaveletLevel0(pTop, width);
+			else
+				WaveletLevel(pTop, width, l, 1);
 			pTop += s;
 		}
+		WaveletLevelRows(pBuf, width, height, l);
 		FilterWaveletSquare(pBuf, width, height, level, l);
 	}
 }
@@ -504,18 +709,15 @@ static InlineX void InvWavelet(int* pBuf, int width, int height, int level)
 	int* pEnd;
 
 	for (l = level - 1; l >= 0; l--) {
-		pTop = pBuf;
-		pEnd = pBuf+width;
-		s = 1<<l;
-		while (pTop < pEnd) {
-			InvWaveletLevel(pTop, height,l, width);
-			pTop += s;
-		}
+		InvWaveletLevelRows(pBuf, width, height, l);
 		pTop = pBuf;
 		pEnd = pBuf+height*width;
 		s = width<<l;
 		while (pTop < pEnd) {
-			InvWaveletLevel(pTop, width, l, 1);
+			if (l == 0)
+				InvWaveletLevel0(pTop, width);
+			else
+				InvWaveletLevel(pTop, width, l, 1);
 			pTop += s;
 		}
 	}
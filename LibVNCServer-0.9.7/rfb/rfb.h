@@ -212,6 +212,45 @@ typedef struct _rfbExtensionData {
 	struct _rfbExtensionData* next;
 } rfbExtensionData;
 
+/*
+ * Clients are served in this order of classes, see rfbClientClass(): the
+ * one using the screen, then the others which may, then those which only
+ * watch.
+ */
+
+#define RFB_CLASS_INTERACTIVE 0
+#define RFB_CLASS_NORMAL      1
+#define RFB_CLASS_VIEWONLY    2
+#define RFB_CLIENT_CLASSES    3
+
+/* how long updates took, from the first change in them until they were
+   sent, for one class of clients */
+typedef struct _rfbClassStats {
+    uint32_t updates;
+    double totalLatency;	/* us */
+    uint32_t maxLatency;	/* us */
+} rfbClassStats;
+
+/* how often values fell in each power of two, see stats.c */
+#define RFB_STAT_BUCKETS 32
+typedef struct _rfbStatHistogram {
+    uint32_t buckets[RFB_STAT_BUCKETS];	/* 0, 1, 2-3, 4-7, ... */
+    uint32_t count;
+    uint32_t sum;		/* wraps, like the counters */
+    uint32_t max;
+} rfbStatHistogram;
+
+/* the screen scans the application reports, see rfbStatRecordCapture() */
+typedef struct _rfbCaptureStats {
+    uint32_t scans;
+    uint32_t frames;		/* scans which found changes */
+    rfbStatHistogram scanTime;	/* us */
+    rfbStatHistogram fps;	/* frames found in each second */
+    time_t second;		/* the second frames are counted in */
+    uint32_t framesThisSecond;
+    uint32_t framesLastSecond;
+} rfbCaptureStats;
+
 /*
  * Per-screen (framebuffer) structure.  There can be as many as you wish,
  * each serving different clients. However, you have to call
@@ -257,6 +296,14 @@ typedef struct _rfbScreenInfo
 #else
     fd_set allFds;
 #endif
+    /* epoll instance watching the sockets, and a timer for its waits;
+       -1 if select() is used */
+    int epollFd;
+    int timerFd;
+    time_t lastClientSweep;
+    /* when the earliest deferred update or pointer event is due, tv_sec
+       is 0 if none is */
+    struct timeval deferDeadline;
 
     enum rfbSocketState socketState;
     SOCKET inetdSock;
@@ -273,6 +320,8 @@ typedef struct _rfbScreenInfo
     /* http stuff */
     rfbBool httpInitDone;
     rfbBool httpEnableProxyConnect;
+    rfbBool httpMetrics;	/* serve /metrics and /status, see httpd.c */
+    char* traceFile;	/* where SIGUSR2 writes the trace, see trace.c */
     int httpPort;
     char* httpDir;
     SOCKET httpListenSock;
@@ -286,6 +335,9 @@ typedef struct _rfbScreenInfo
 
     /* send only this many rectangles in one update */
     int maxRectsPerUpdate;
+    /* send nearby rectangles as one where that is cheaper (default on),
+     * see rectmerge.c */
+    rfbBool mergeRects;
     /* this is the amount of milliseconds to wait at least before sending
      * an update. */
     int deferUpdateTime;
@@ -331,6 +383,14 @@ typedef struct _rfbScreenInfo
 #ifdef LIBVNCSERVER_HAVE_LIBPTHREAD
     MUTEX(cursorMutex);
     rfbBool backgroundLoop;
+    /* number of threads serving the clients when running in the
+       background, 0 means one per processor */
+    int workerThreads;
+    void* workers;
+    /* protects allFds and maxFd once clients come and go in several
+       threads */
+    MUTEX(fdsMutex);
+    MUTEX(classStatsMutex);
 #endif
 
     /* if TRUE, an ignoring signal handler is installed for SIGPIPE */
@@ -341,6 +401,26 @@ typedef struct _rfbScreenInfo
      * link more interactive. */
     int progressiveSliceHeight;
 
+    /* if not zero, lower the quality of updates for clients which take
+     * longer than this many ms to get them, see adaptive.c */
+    int targetLatency;
+    /* if not zero, ms per second all clients may spend encoding before
+     * they are moved to cheaper settings, see adaptive.c */
+    int cpuBudget;
+    void* governor;
+    /* what has changed on the screen, for all clients, see damage.c */
+    void* damageJournal;
+    /* threads sharing the encoding of large ZRLE rectangles, see zrle.c */
+    void* zrleHelpers;
+    /* caps for view-only clients which have none of their own, 0 for
+     * none */
+    int viewOnlyMaxBytesPerSecond;
+    int viewOnlyMaxUpdatesPerSecond;
+
+    /* update latency per class of clients */
+    rfbClassStats classStats[RFB_CLIENT_CLASSES];
+    rfbCaptureStats captureStats;
+
     in_addr_t listenInterface;
     int deferPtrUpdateTime;
 
@@ -399,9 +479,29 @@ typedef struct _rfbStatList {
     uint32_t rcvdCount;
     uint32_t bytesRcvd;
     uint32_t bytesRcvdIfRaw;
-    struct _rfbStatList *Next;
+    uint32_t encodeCount;	/* rectangles timed */
+    uint32_t encodeTime;	/* us spent encoding them */
+    struct _rfbStatList *Next;	/* not used, the counters are in a table */
 } rfbStatList;
 
+/* everything counted for a client, see rfbStatGetSnapshot() */
+typedef struct _rfbStatSnapshot {
+    uint32_t bytesSent, bytesSentIfRaw;
+    uint32_t bytesRcvd, bytesRcvdIfRaw;
+    uint32_t updatesSent;
+    uint32_t updatesLastSecond, bytesLastSecond;
+    uint32_t keyEvents, pointerEvents;
+    time_t startTime;		/* when counting began */
+    int framesSkipped;
+    int queueDepth, maxQueueDepth;	/* bytes */
+    int roundTripTime;		/* us */
+    int adaptLevel;
+    rfbStatHistogram encodeTime;	/* us per rectangle */
+    rfbStatHistogram updateBytes;	/* bytes per update */
+    rfbStatHistogram updateLatency;	/* us from the first change to sending it */
+    rfbStatHistogram fps;		/* updates sent in each second */
+} rfbStatSnapshot;
+
 typedef struct _rfbClientRec {
   
     /* back pointer to the screen */
@@ -431,6 +531,8 @@ typedef struct _rfbClientRec {
 
 #ifdef LIBVNCSERVER_HAVE_LIBPTHREAD
     pthread_t client_thread;
+    /* what the worker threads have to do for this client */
+    void* workerData;
 #endif
                                 /* Possible client states: */
     enum {
@@ -446,6 +548,8 @@ typedef struct _rfbClientRec {
     rfbBool readyForSetColourMapEntries;
     rfbBool useCopyRect;
     int preferredEncoding;
+    /* bit n is set if the client listed encoding n in SetEncodings */
+    uint32_t encodingsAdvertised;
     int correMaxWidth, correMaxHeight;
 
     rfbBool viewOnly;
@@ -480,6 +584,11 @@ typedef struct _rfbClientRec {
     int copyDX, copyDY;		/* the translation by which the copy happens */
 
     sraRegionPtr modifiedRegion;
+    /* the changes recorded in the screen's damage journal up to this one
+       have been added to modifiedRegion, see damage.c */
+    unsigned long damageSeq;
+    uint32_t* damageTiles;	/* where they are gathered */
+    int damageWords;
 
     /* As part of the FramebufferUpdateRequest, a client can express interest
        in a subrectangle of the whole framebuffer.  This is stored in the
@@ -496,6 +605,8 @@ typedef struct _rfbClientRec {
 
       struct timeval startDeferring;
       struct timeval startPtrDeferring;
+      struct timeval damageTime;	/* oldest change not sent, or 0 */
+      struct timeval lastInput;		/* last key or pointer event */
       int lastPtrX;
       int lastPtrY;
       int lastPtrButtons;
@@ -511,19 +622,40 @@ typedef struct _rfbClientRec {
      * UPDATE_BUF_SIZE must be big enough to send at least one whole line of the
      * framebuffer.  So for a max screen width of say 2K with 32-bit pixels this
      * means 8K minimum.
+     *
+     * updateBuf points to UPDATE_BUF_SIZE bytes owned by the output queue;
+     * rfbSendUpdateBuf() hands them to the queue and moves updateBuf on to
+     * an empty buffer.
      */
 
 #define UPDATE_BUF_SIZE 30000
 
-    char updateBuf[UPDATE_BUF_SIZE];
+    char *updateBuf;
     int ublen;
 
+    void* outputQueue;
+
     /* statistics */
-    struct _rfbStatList *statEncList;
-    struct _rfbStatList *statMsgList;
+    void* statData;		/* see stats.c */
     int rawBytesEquivalent;
     int bytesSent;
+
+    /* pacing, see rfbSendFramebufferUpdate() */
+    rfbBool updateDeferred;	/* waiting for the backlog to drain */
+    int framesSkipped;		/* changes merged into a deferred update */
+    int maxQueueDepth;		/* most bytes seen waiting to be sent */
+    void* adaptData;		/* see adaptive.c */
+    int maxBytesPerSecond;	/* caps on what is sent, 0 for none */
+    int maxUpdatesPerSecond;
         
+    /* scratch space of the RRE, CoRRE, Ultra, Zlib and Tight encoders:
+       the rectangle in the client's format, and encoded */
+    char *beforeEncBuf;
+    int beforeEncBufSize;
+    char *afterEncBuf;
+    int afterEncBufSize;
+    int afterEncBufLen;
+
 #ifdef LIBVNCSERVER_HAVE_LIBZ
     /* zlib encoding -- necessary compression state info per client */
 
@@ -539,6 +671,8 @@ typedef struct _rfbClientRec {
     rfbBool zsActive[4];
     int zsLevel[4];
     int tightCompressLevel;
+    /* encoding plan and JPEG compressor kept between rectangles, see tight.c */
+    void* tightData;
 #endif
 #endif
 
@@ -565,6 +699,13 @@ typedef struct _rfbClientRec {
     rfbBool useNewFBSize;             /* client supports NewFBSize encoding */
     rfbBool newFBSizePending;         /* framebuffer size was changed */
 
+    rfbBool enableFence;              /* client supports Fence messages */
+    rfbBool enableContinuousUpdates;  /* client supports ContinuousUpdates */
+    sraRegionPtr continuousRegion;    /* sent without requests, or NULL */
+    rfbBool fencePending;             /* our fence has not come back yet */
+    struct timeval fenceSent;         /* when it was sent */
+    int roundTripTime;                /* smoothed, in us; 0 until measured */
+
     struct _rfbClientRec *prev;
     struct _rfbClientRec *next;
 
@@ -585,8 +726,14 @@ typedef struct _rfbClientRec {
 
 #ifdef LIBVNCSERVER_HAVE_LIBZ
     void* zrleData;
+    /* per-thread tile encoding state, see zrle.c */
+    void* zrleTileData;
+    /* palette of the tile being encoded, see zrle.c */
+    void* zrlePalette;
     int zywrleLevel;
     int zywrleBuf[rfbZRLETileWidth * rfbZRLETileHeight];
+    /* a tile in the client's format, and one pixel more, see zrle.c */
+    char zrleBeforeBuf[rfbZRLETileWidth * rfbZRLETileHeight * 4 + 4];
 #endif
 
     /* if progressive updating is on, this variable holds the current
@@ -608,7 +755,8 @@ typedef struct _rfbClientRec {
 	(cl)->cursorY != (cl)->screen->cursorY))) ||                       \
      ((cl)->useNewFBSize && (cl)->newFBSizePending) ||                     \
      ((cl)->enableCursorPosUpdates && (cl)->cursorWasMoved) ||             \
-     !sraRgnEmpty((cl)->copyRegion) || !sraRgnEmpty((cl)->modifiedRegion))
+     !sraRgnEmpty((cl)->copyRegion) ||                                     \
+     !sraRgnEmpty((cl)->modifiedRegion) || rfbDamagePending(cl))
 
 /*
  * Macros for endian swapping.
@@ -639,6 +787,8 @@ extern char rfbEndianTest;
 /* sockets.c */
 
 extern int rfbMaxClientWait;
+extern int rfbMaxClientBacklog;
+extern int rfbMaxClientUnsent;
 
 extern void rfbInitSockets(rfbScreenInfoPtr rfbScreen);
 extern void rfbShutdownSockets(rfbScreenInfoPtr rfbScreen);
@@ -685,6 +835,8 @@ extern rfbBool rfbSendLastRectMarker(rfbClientPtr cl);
 extern rfbBool rfbSendNewFBSize(rfbClientPtr cl, int w, int h);
 extern rfbBool rfbSendSetColourMapEntries(rfbClientPtr cl, int firstColour, int nColours);
 extern void rfbSendBell(rfbScreenInfoPtr rfbScreen);
+extern rfbBool rfbSendFence(rfbClientPtr cl, uint32_t flags, int length, const char *data);
+extern int rfbClientClass(rfbClientPtr cl);
 
 extern char *rfbProcessFileTransferReadBuffer(rfbClientPtr cl, uint32_t length);
 extern rfbBool rfbSendFileTransferChunk(rfbClientPtr cl);
@@ -818,10 +970,16 @@ extern void rfbDefaultPtrAddEvent(int buttonMask,int x,int y,rfbClientPtr cl);
 extern rfbBool rfbSendRectEncodingZRLE(rfbClientPtr cl, int x, int y, int w,int h);
 #endif
 
+/* damage.c */
+
+extern rfbBool rfbDamagePending(rfbClientPtr cl);
+extern void rfbDamageCollect(rfbClientPtr cl);
+
 /* stats.c */
 
 extern void rfbResetStats(rfbClientPtr cl);
 extern void rfbPrintStats(rfbClientPtr cl);
+extern void rfbPrintClassStats(rfbScreenInfoPtr screen);
 
 /* font.c */
 
@@ -877,12 +1035,24 @@ extern void rfbPurgeArguments(int* argc,int* position,int count,char *argv[]);
 extern rfbBool rfbProcessArguments(rfbScreenInfoPtr rfbScreen,int* argc, char *argv[]);
 extern rfbBool rfbProcessSizeArguments(int* width,int* height,int* bpp,int* argc, char *argv[]);
 
-/* main.c */
+/* log.c */
 
 extern void rfbLogEnable(int enabled);
 typedef void (*rfbLogProc)(const char *format, ...);
 extern rfbLogProc rfbLog, rfbErr;
 extern void rfbLogPerror(const char *str);
+/* rfbLog() with the client's host, socket and encoding in front */
+extern void rfbLogClient(rfbClientPtr cl, const char *format, ...);
+/* how many messages one format string may log in a second; 0 for no limit */
+extern void rfbLogSetRateLimit(int perSecond);
+/* have a thread of its own write the log, so that logging never waits for
+   stderr; FALSE if that cannot be done here */
+extern rfbBool rfbLogStartAsync(void);
+extern void rfbLogStopAsync(void);
+/* returns once what has been logged so far is written out */
+extern void rfbLogFlush(void);
+
+/* main.c */
 
 void rfbScheduleCopyRect(rfbScreenInfoPtr rfbScreen,int x1,int y1,int x2,int y2,int dx,int dy);
 void rfbScheduleCopyRegion(rfbScreenInfoPtr rfbScreen,sraRegionPtr copyRegion,int dx,int dy);
@@ -929,7 +1099,9 @@ extern void rfbRefuseOnHoldClient(rfbClientPtr cl);
  usec are the microseconds the select on the fds waits.
  if you are using the event loop, set this to some value > 0, so the
  server doesn't get a high load just by listening.
- rfbProcessEvents() returns TRUE if an update was pending. */
+ rfbProcessEvents() returns TRUE if an update was pending.
+ With runInBackground, rfbRunEventLoop() returns at once and the clients
+ are served by workerThreads threads (see workers.c). */
 
 extern void rfbRunEventLoop(rfbScreenInfoPtr screenInfo, long usec, rfbBool runInBackground);
 extern rfbBool rfbProcessEvents(rfbScreenInfoPtr screenInfo,long usec);
@@ -964,6 +1136,47 @@ extern int rfbStatGetMessageCountSent(rfbClientPtr cl, uint32_t type);
 extern int rfbStatGetMessageCountRcvd(rfbClientPtr cl, uint32_t type);
 extern int rfbStatGetEncodingCountSent(rfbClientPtr cl, uint32_t type);
 extern int rfbStatGetEncodingCountRcvd(rfbClientPtr cl, uint32_t type);
+extern void rfbStatRecordEncodingTime(rfbClientPtr cl, uint32_t type, int us);
+extern int rfbStatGetEncodingTime(rfbClientPtr cl, uint32_t type);
+extern int rfbStatGetFramesSkipped(rfbClientPtr cl);
+extern int rfbStatGetQueueDepth(rfbClientPtr cl);
+extern int rfbStatGetMaxQueueDepth(rfbClientPtr cl);
+extern void rfbStatRecordUpdateLatency(rfbClientPtr cl, int us);
+extern int rfbStatGetClassUpdates(rfbScreenInfoPtr screen, int clientClass);
+extern int rfbStatGetClassLatency(rfbScreenInfoPtr screen, int clientClass);
+extern int rfbStatGetClassMaxLatency(rfbScreenInfoPtr screen, int clientClass);
+extern void rfbStatRecordUpdateSent(rfbClientPtr cl, int byteCount);
+/* can be called from any thread while the client is connected */
+extern void rfbStatGetSnapshot(rfbClientPtr cl, rfbStatSnapshot *snapshot);
+extern int rfbStatHistogramPercentile(const rfbStatHistogram *h, int percent);
+/* for applications which scan the screen for changes: a scan took us,
+   and found some or not */
+extern void rfbStatRecordCapture(rfbScreenInfoPtr screen, int us, rfbBool changed);
+extern void rfbStatGetCaptureSnapshot(rfbScreenInfoPtr screen, rfbCaptureStats *snapshot);
+
+/* trace.c: trace points, recorded only when built with
+   LIBVNCSERVER_WITH_TRACE.  Names must be string constants; the events
+   between a BEGIN and its END nest, per thread. */
+#ifdef LIBVNCSERVER_WITH_TRACE
+#define RFB_TRACE_BEGIN(name, value) rfbTraceEvent((name), 'B', (value))
+#define RFB_TRACE_END() rfbTraceEvent(NULL, 'E', 0)
+#define RFB_TRACE_INSTANT(name, value) rfbTraceEvent((name), 'i', (value))
+#else
+#define RFB_TRACE_BEGIN(name, value)
+#define RFB_TRACE_END()
+#define RFB_TRACE_INSTANT(name, value)
+#endif
+typedef void (*rfbTraceWriter)(void *data, const char *text, size_t len);
+extern void rfbTraceEvent(const char *name, char phase, int value);
+/* writes the events kept as Chrome trace JSON; any thread may call it */
+extern void rfbTraceWrite(rfbTraceWriter writer, void *data);
+extern const char *rfbTraceEncodingName(int encoding);
+
+/* how many levels below what it asked for the client's updates are, see
+   adaptive.c */
+extern int rfbAdaptGetLevel(rfbClientPtr cl);
+/* and how many levels below their settings the CPU budget keeps them */
+extern int rfbAdaptGetCpuLevel(rfbScreenInfoPtr screen);
 
 /* Set which version you want to advertise 3.3, 3.6, 3.7 and 3.8 are currently supported*/
 extern void rfbSetProtocolVersion(rfbScreenInfoPtr rfbScreen, int major_, int minor_);
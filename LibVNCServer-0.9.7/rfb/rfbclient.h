@@ -221,6 +221,12 @@ typedef struct _rfbClient {
 
 	int canHandleNewFBSize;
 
+	/* Continuous Updates and Fence extensions */
+	rfbBool canUseContinuousUpdates;   /* turn them on if the server can */
+	rfbBool supportsFence;             /* the server has sent a fence */
+	rfbBool supportsContinuousUpdates; /* ...an EndOfContinuousUpdates */
+	rfbBool continuousUpdates;         /* they are on */
+
 	/* hooks */
 	HandleTextChatProc         HandleTextChat;
 	HandleKeyboardLedStateProc HandleKeyboardLedState;
@@ -275,6 +281,9 @@ extern rfbBool SendScaleSetting(rfbClient* client,int scaleSetting);
 extern rfbBool SendPointerEvent(rfbClient* client,int x, int y, int buttonMask);
 extern rfbBool SendKeyEvent(rfbClient* client,uint32_t key, rfbBool down);
 extern rfbBool SendClientCutText(rfbClient* client,char *str, int len);
+extern rfbBool SendEnableContinuousUpdates(rfbClient* client, rfbBool enable,
+					 int x, int y, int w, int h);
+extern rfbBool SendFence(rfbClient* client, uint32_t flags, int length, const char *data);
 extern rfbBool HandleRFBServerMessage(rfbClient* client);
 
 extern rfbBool TextChatSend(rfbClient* client, char *text);
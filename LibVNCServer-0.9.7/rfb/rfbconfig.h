@@ -310,6 +310,11 @@
 /* Use the system libvncserver build environment for x11vnc. */
 /* #undef LIBVNCSERVER_HAVE_SYSTEM_LIBVNCSERVER */
 
+/* Define to 1 if you have the <sys/epoll.h> header file. */
+#ifndef LIBVNCSERVER_HAVE_SYS_EPOLL_H 
+#define LIBVNCSERVER_HAVE_SYS_EPOLL_H  1 
+#endif
+
 /* Define to 1 if you have the <sys/ioctl.h> header file. */
 /* #undef LIBVNCSERVER_HAVE_SYS_IOCTL_H */
 
@@ -326,6 +331,11 @@
 /* Define to 1 if you have the <sys/stropts.h> header file. */
 /* #undef LIBVNCSERVER_HAVE_SYS_STROPTS_H */
 
+/* Define to 1 if you have the <sys/timerfd.h> header file. */
+#ifndef LIBVNCSERVER_HAVE_SYS_TIMERFD_H 
+#define LIBVNCSERVER_HAVE_SYS_TIMERFD_H  1 
+#endif
+
 /* Define to 1 if you have the <sys/timeb.h> header file. */
 #ifndef LIBVNCSERVER_HAVE_SYS_TIMEB_H 
 #define LIBVNCSERVER_HAVE_SYS_TIMEB_H  1 
@@ -477,6 +487,9 @@
 #define LIBVNCSERVER_WITH_TIGHTVNC_FILETRANSFER  1 
 #endif
 
+/* Record trace points, see libvncserver/trace.c */
+/* #undef LIBVNCSERVER_WITH_TRACE */
+
 /* Define to 1 if your processor stores words with the most significant byte
    first (like Motorola and SPARC, unlike Intel and VAX). */
 /* #undef LIBVNCSERVER_WORDS_BIGENDIAN */
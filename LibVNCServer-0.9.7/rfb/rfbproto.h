@@ -359,6 +359,8 @@ typedef struct {
 #define rfbResizeFrameBuffer 4
 #define rfbKeyFrameUpdate 5
 #define rfbPalmVNCReSizeFrameBuffer 0xF
+/* Continuous Updates, as in TigerVNC */
+#define rfbEndOfContinuousUpdates 150
 
 /* client -> server */
 
@@ -383,6 +385,10 @@ typedef struct {
 #define rfbKeyFrameRequest 12
 /* PalmVNC 1.4 & 2.0 SetScale Factor message */
 #define rfbPalmVNCSetScaleFactor 0xF
+/* Continuous Updates, as in TigerVNC */
+#define rfbEnableContinuousUpdates 150
+/* Fence, as in TigerVNC - bidirectional */
+#define rfbFence 248
 
 
 
@@ -456,6 +462,9 @@ typedef struct {
 #define rfbEncodingQualityLevel8   0xFFFFFFE8
 #define rfbEncodingQualityLevel9   0xFFFFFFE9
 
+#define rfbEncodingContinuousUpdates  0xFFFFFEC7
+#define rfbEncodingFence              0xFFFFFEC8
+
 
 /* LibVNCServer additions.   We claim 0xFFFE0000 - 0xFFFE00FF */
 #define rfbEncodingKeyboardLedState   0xFFFE0000
@@ -1079,6 +1088,49 @@ typedef struct {
 
 
 
+/*-----------------------------------------------------------------------------
+ * EndOfContinuousUpdates - the server has stopped sending continuous updates,
+ * or (the first time) tells the client that it can send them.
+ */
+
+typedef struct {
+    uint8_t type;			/* always rfbEndOfContinuousUpdates */
+} rfbEndOfContinuousUpdatesMsg;
+
+#define sz_rfbEndOfContinuousUpdatesMsg 1
+
+
+/*-----------------------------------------------------------------------------
+ * Fence - sent both ways.  A fence with rfbFenceFlagRequest set has to be
+ * answered with the same data and those of its flags the receiver supports,
+ * honouring them: with BlockBefore, everything received before the fence is
+ * dealt with first; with BlockAfter, nothing received after it is dealt with
+ * until the answer has gone out; with SyncNext, the message after the fence
+ * is dealt with on its own, after everything before it and before anything
+ * after it.  As the answer is sent in order with the updates, a fence also
+ * tells how long they take to arrive.  The server tells a client which lists
+ * rfbEncodingFence that it supports fences by sending it one.
+ */
+
+typedef struct {
+    uint8_t type;			/* always rfbFence */
+    uint8_t pad[3];
+    uint32_t flags;
+    uint8_t length;			/* at most rfbFenceMaxDataSize */
+    /* followed by char data[length] */
+} rfbFenceMsg;
+
+#define sz_rfbFenceMsg 9
+
+#define rfbFenceFlagBlockBefore 1
+#define rfbFenceFlagBlockAfter  2
+#define rfbFenceFlagSyncNext    4
+#define rfbFenceFlagRequest     0x80000000
+#define rfbFenceFlagsSupported  (rfbFenceFlagBlockBefore|rfbFenceFlagBlockAfter|\
+				 rfbFenceFlagSyncNext|rfbFenceFlagRequest)
+#define rfbFenceMaxDataSize     64
+
+
 /*-----------------------------------------------------------------------------
  * Union of all server->client messages.
  */
@@ -1093,6 +1145,8 @@ typedef union {
 	rfbPalmVNCReSizeFrameBufferMsg prsfb; 
 	rfbFileTransferMsg ft;
 	rfbTextChatMsg tc;
+	rfbEndOfContinuousUpdatesMsg eocu;
+	rfbFenceMsg f;
 } rfbServerToClientMsg;
 
 
@@ -1328,6 +1382,25 @@ typedef struct _rfbSetSWMsg {
 #define sz_rfbSetSWMsg 6
 
 
+/*-----------------------------------------------------------------------------
+ * EnableContinuousUpdates - with enable set, the server sends updates of the
+ * given area whenever it changes, without waiting for FramebufferUpdateRequest
+ * messages.  Without, it stops doing so and sends EndOfContinuousUpdates.
+ * Only to be sent once the server has sent an EndOfContinuousUpdates.
+ */
+
+typedef struct {
+    uint8_t type;			/* always rfbEnableContinuousUpdates */
+    uint8_t enable;
+    uint16_t x;
+    uint16_t y;
+    uint16_t w;
+    uint16_t h;
+} rfbEnableContinuousUpdatesMsg;
+
+#define sz_rfbEnableContinuousUpdatesMsg 10
+
+
 /*-----------------------------------------------------------------------------
  * Union of all client->server messages.
  */
@@ -1347,6 +1420,8 @@ typedef union {
 	rfbFileTransferMsg ft;
 	rfbSetSWMsg sw;
 	rfbTextChatMsg tc;
+	rfbEnableContinuousUpdatesMsg ecu;
+	rfbFenceMsg f;
 } rfbClientToServerMsg;
 
 /* 
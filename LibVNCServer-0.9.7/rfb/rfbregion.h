@@ -54,6 +54,67 @@ extern void sraRgnReleaseIterator(sraRectangleIterator *i);
 
 void sraRgnPrint(const sraRegion *s);
 
+/* -=- banded regions
+ *
+ * The same operations on regions kept as arrays of y-bands and x-spans
+ * (see rfbbandregion.c).  Regions of one kind must not be passed to the
+ * functions of the other.  Build with -DLIBVNCSERVER_BANDED_REGIONS to
+ * have the sraRgn* names refer to these; code which needs both kinds at
+ * once defines SRA_LIST_REGIONS before including this file.
+ */
+
+extern sraRegion *sraBandRgnCreate(void);
+extern sraRegion *sraBandRgnCreateRect(int x1, int y1, int x2, int y2);
+extern sraRegion *sraBandRgnCreateRgn(const sraRegion *src);
+extern void sraBandRgnDestroy(sraRegion *rgn);
+extern void sraBandRgnMakeEmpty(sraRegion *rgn);
+extern rfbBool sraBandRgnAnd(sraRegion *dst, const sraRegion *src);
+extern void sraBandRgnOr(sraRegion *dst, const sraRegion *src);
+extern rfbBool sraBandRgnSubtract(sraRegion *dst, const sraRegion *src);
+extern void sraBandRgnOffset(sraRegion *dst, int dx, int dy);
+extern rfbBool sraBandRgnPopRect(sraRegion *region, sraRect *rect,
+			  unsigned long flags);
+extern unsigned long sraBandRgnCountRects(const sraRegion *rgn);
+extern rfbBool sraBandRgnEmpty(const sraRegion *rgn);
+extern sraRegion *sraBandRgnBBox(const sraRegion *src);
+extern sraRectangleIterator *sraBandRgnGetIterator(sraRegion *s);
+extern sraRectangleIterator *sraBandRgnGetReverseIterator(sraRegion *s,rfbBool reverseX,rfbBool reverseY);
+extern rfbBool sraBandRgnIteratorNext(sraRectangleIterator *i,sraRect *r);
+extern void sraBandRgnReleaseIterator(sraRectangleIterator *i);
+extern void sraBandRgnPrint(const sraRegion *s);
+
+#if defined(LIBVNCSERVER_BANDED_REGIONS) && !defined(SRA_LIST_REGIONS)
+#define sraRgnCreate sraBandRgnCreate
+#define sraRgnCreateRect sraBandRgnCreateRect
+#define sraRgnCreateRgn sraBandRgnCreateRgn
+#define sraRgnDestroy sraBandRgnDestroy
+#define sraRgnMakeEmpty sraBandRgnMakeEmpty
+#define sraRgnAnd sraBandRgnAnd
+#define sraRgnOr sraBandRgnOr
+#define sraRgnSubtract sraBandRgnSubtract
+#define sraRgnOffset sraBandRgnOffset
+#define sraRgnPopRect sraBandRgnPopRect
+#define sraRgnCountRects sraBandRgnCountRects
+#define sraRgnEmpty sraBandRgnEmpty
+#define sraRgnBBox sraBandRgnBBox
+#define sraRgnGetIterator sraBandRgnGetIterator
+#define sraRgnGetReverseIterator sraBandRgnGetReverseIterator
+#define sraRgnIteratorNext sraBandRgnIteratorNext
+#define sraRgnReleaseIterator sraBandRgnReleaseIterator
+#define sraRgnPrint sraBandRgnPrint
+#endif
+
+/* -=- allocation statistics, over all threads (span lists only) */
+
+typedef struct sraAllocStats {
+  unsigned long allocs;		/* spans, span lists and iterators handed out */
+  unsigned long mallocs;	/* of those, how many were not on a free list */
+  unsigned long frees;
+  unsigned long pooled;		/* kept on free lists right now */
+} sraAllocStats;
+
+extern void sraGetAllocStats(sraAllocStats *stats);
+
 /* -=- Rectangle clipper (for speed) */
 
 extern rfbBool sraClipRect(int *x, int *y, int *w, int *h,
@@ -0,0 +1,119 @@
+/*
+ * adapttest: the quality of updates follows the latency of the client.
+ *
+ * A libvncclient client asks for Tight with JPEG quality 8, and at first
+ * takes much longer over each update than the server's target latency
+ * allows: the server must lower the quality it sends.  Once the client
+ * keeps up easily, the server must raise it again.
+ */
+
+#include <time.h>
+#include <sys/time.h>
+#include <unistd.h>
+#include <rfb/rfb.h>
+#include <rfb/rfbclient.h>
+
+#ifndef LIBVNCSERVER_HAVE_LIBPTHREAD
+#error This test needs pthread support (the server runs in the background)
+#endif
+
+static const int width=160,height=128,bpp=4;
+static int slow;
+
+static double now(void)
+{
+	struct timeval tv;
+	gettimeofday(&tv,NULL);
+	return tv.tv_sec+tv.tv_usec/1e6;
+}
+
+static void update(rfbClient* client,int x,int y,int w,int h)
+{
+	if(slow)
+		usleep(30000);
+}
+
+/* a moving 16x16 square, while the client takes what it gets */
+static int run(rfbScreenInfoPtr server,rfbClient* client,double seconds,int frame)
+{
+	double start=now(),t=start;
+
+	while(now()-start<seconds) {
+		if(now()-t>0.02) {
+			int x=(frame*16)%width,y=(frame*16/width*16)%height,n;
+			for(n=0;n<16;n++)
+				memset(server->frameBuffer+((y+n)*width+x)*bpp,frame*37,16*bpp);
+			rfbMarkRectAsModified(server,x,y,x+16,y+16);
+			frame++;
+			t=now();
+		}
+		if(WaitForMessage(client,10000)>0 && !HandleRFBServerMessage(client)) {
+			rfbErr("client was disconnected\n");
+			exit(1);
+		}
+	}
+	return frame;
+}
+
+int main(int argc,char** argv)
+{
+	rfbScreenInfoPtr server;
+	rfbClient* client;
+	rfbClientPtr cl;
+	char* fb;
+	int frame=0,failed=0,level;
+	double start;
+
+	server=rfbGetScreen(&argc,argv,width,height,8,3,bpp);
+	server->frameBuffer=malloc(width*height*bpp);
+	memset(server->frameBuffer,0,width*height*bpp);
+	server->cursor=NULL;
+	server->targetLatency=10;
+	rfbInitServer(server);
+	rfbRunEventLoop(server,-1,TRUE);
+
+	client=rfbGetClient(8,3,bpp);
+	client->serverHost=strdup("127.0.0.1");
+	client->serverPort=server->port;
+	client->GotFrameBufferUpdate=update;
+	client->appData.encodingsString="tight";
+	client->appData.qualityLevel=8;
+	if(!rfbInitClient(client,NULL,NULL)) {
+		rfbErr("could not connect\n");
+		return 1;
+	}
+	cl=server->clientHead;
+
+	slow=1;
+	frame=run(server,client,2,frame);
+	level=rfbAdaptGetLevel(cl);
+	rfbLog("slow client: level %d, quality %d, compression %d\n",
+			level,cl->tightQualityLevel,cl->tightCompressLevel);
+	if(level==0 || cl->tightQualityLevel>=8) {
+		rfbErr("the quality was not lowered\n");
+		failed++;
+	}
+
+	slow=0;
+	server->targetLatency=1000;
+	frame=run(server,client,3,frame);
+	rfbLog("fast client: level %d, quality %d, compression %d\n",
+			rfbAdaptGetLevel(cl),cl->tightQualityLevel,cl->tightCompressLevel);
+	if(rfbAdaptGetLevel(cl)>=level) {
+		rfbErr("the quality was not raised again\n");
+		failed++;
+	}
+
+	close(client->sock);
+	rfbClientCleanup(client);
+	start=now();
+	while(server->clientHead && now()-start<5)
+		usleep(10000);
+
+	rfbShutdownServer(server,TRUE);
+	fb=server->frameBuffer;
+	rfbScreenCleanup(server);
+	free(fb);
+	rfbLog("adaptive quality: %d failed\n",failed);
+	return failed?1:0;
+}
@@ -0,0 +1,121 @@
+/*
+ * continuoustest: continuous updates and fences.
+ *
+ * A libvncclient client connects to a server running in the background,
+ * while a small part of the screen changes all the time.  The client must
+ * turn on continuous updates and then keep getting updates without asking
+ * for them, and the server must learn the round trip time from its fences.
+ */
+
+#include <time.h>
+#include <sys/time.h>
+#include <unistd.h>
+#include <rfb/rfb.h>
+#include <rfb/rfbclient.h>
+
+#ifndef LIBVNCSERVER_HAVE_LIBPTHREAD
+#error This test needs pthread support (the server runs in the background)
+#endif
+
+static const int width=160,height=128,bpp=4;
+static int updates;
+
+static double now(void)
+{
+	struct timeval tv;
+	gettimeofday(&tv,NULL);
+	return tv.tv_sec+tv.tv_usec/1e6;
+}
+
+static void update(rfbClient* client,int x,int y,int w,int h)
+{
+	updates++;
+}
+
+int main(int argc,char** argv)
+{
+	rfbScreenInfoPtr server;
+	rfbClient* client;
+	rfbClientPtr cl;
+	char* fb;
+	int frame=0,failed=0,requests;
+	double start,t;
+
+	server=rfbGetScreen(&argc,argv,width,height,8,3,bpp);
+	server->frameBuffer=malloc(width*height*bpp);
+	memset(server->frameBuffer,0,width*height*bpp);
+	server->cursor=NULL;
+	rfbInitServer(server);
+	rfbRunEventLoop(server,-1,TRUE);
+
+	client=rfbGetClient(8,3,bpp);
+	client->serverHost=strdup("127.0.0.1");
+	client->serverPort=server->port;
+	client->GotFrameBufferUpdate=update;
+	if(!rfbInitClient(client,NULL,NULL)) {
+		rfbErr("could not connect\n");
+		return 1;
+	}
+
+	start=t=now();
+	while(now()-start<3) {
+		/* a moving 16x16 square */
+		if(now()-t>0.02) {
+			int x=(frame*16)%width,y=(frame*16/width*16)%height,n;
+			for(n=0;n<16;n++)
+				memset(server->frameBuffer+((y+n)*width+x)*bpp,frame,16*bpp);
+			rfbMarkRectAsModified(server,x,y,x+16,y+16);
+			frame++;
+			t=now();
+		}
+		if(WaitForMessage(client,10000)>0 && !HandleRFBServerMessage(client)) {
+			rfbErr("client was disconnected\n");
+			return 1;
+		}
+	}
+
+	cl=server->clientHead;
+	requests=rfbStatGetMessageCountRcvd(cl,rfbFramebufferUpdateRequest);
+	rfbLog("%d screen changes, %d updates after %d requests, round trip %d us\n",
+			frame,updates,requests,cl->roundTripTime);
+	if(!client->continuousUpdates) {
+		rfbErr("continuous updates were not turned on\n");
+		failed++;
+	}
+	if(updates<frame/4) {
+		rfbErr("too few updates\n");
+		failed++;
+	}
+	if(requests>1) {
+		rfbErr("the client kept asking for updates\n");
+		failed++;
+	}
+	if(cl->roundTripTime<=0) {
+		rfbErr("no round trip time was measured\n");
+		failed++;
+	}
+
+	/* and back to asking for each update */
+	SendEnableContinuousUpdates(client,FALSE,0,0,width,height);
+	start=now();
+	while(now()-start<1)
+		if(WaitForMessage(client,10000)>0 && !HandleRFBServerMessage(client))
+			break;
+	if(cl->continuousRegion) {
+		rfbErr("continuous updates were not turned off\n");
+		failed++;
+	}
+
+	close(client->sock);
+	rfbClientCleanup(client);
+	start=now();
+	while(server->clientHead && now()-start<5)
+		usleep(10000);
+
+	rfbShutdownServer(server,TRUE);
+	fb=server->frameBuffer;
+	rfbScreenCleanup(server);
+	free(fb);
+	rfbLog("continuous updates: %d failed\n",failed);
+	return failed?1:0;
+}
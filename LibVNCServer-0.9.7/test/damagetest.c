@@ -0,0 +1,179 @@
+/*
+ * damagetest: the damage journal gives every client what changed since
+ * it last looked.
+ *
+ * Random rectangles are marked as modified, and three clients take the
+ * damage at different rates: one after every change, one now and then,
+ * and one so rarely that the journal has to merge entries in between.
+ * What a client gets must cover everything marked since it last looked;
+ * for the first two it must be just the tiles touched.
+ */
+
+#include <rfb/rfb.h>
+#include <rfb/rfbregion.h>
+
+#define WIDTH 203
+#define HEIGHT 150
+#define TILE 16
+#define ROUNDS 400
+#define CLIENTS 3
+
+static const int every[CLIENTS]={ 1, 7, 50 };
+
+static int errors=0;
+
+/* Connect a client over loopback; nothing is ever sent to it. */
+static rfbClientPtr newTestClient(rfbScreenInfoPtr screen)
+{
+	struct sockaddr_in addr;
+	socklen_t len=sizeof(addr);
+	int listenSock,sock,peer;
+	rfbClientPtr cl;
+
+	memset(&addr,0,sizeof(addr));
+	addr.sin_family=AF_INET;
+	addr.sin_addr.s_addr=htonl(INADDR_LOOPBACK);
+	listenSock=socket(AF_INET,SOCK_STREAM,0);
+	if(listenSock<0 || bind(listenSock,(struct sockaddr*)&addr,sizeof(addr))<0
+			|| listen(listenSock,1)<0
+			|| getsockname(listenSock,(struct sockaddr*)&addr,&len)<0)
+		return NULL;
+	peer=socket(AF_INET,SOCK_STREAM,0);
+	if(connect(peer,(struct sockaddr*)&addr,sizeof(addr))<0)
+		return NULL;
+	sock=accept(listenSock,NULL,NULL);
+	close(listenSock);
+	if(sock<0)
+		return NULL;
+
+	cl=rfbNewClient(screen,sock);
+	if(!cl)
+		return NULL;
+	cl->state=RFB_NORMAL;
+	return cl;
+}
+
+/* what cl is to send, taken out of its modifiedRegion, as a bitmap */
+static void takeDamage(rfbClientPtr cl,char* got)
+{
+	sraRectangleIterator* i;
+	sraRect r;
+	int x,y;
+
+	memset(got,0,WIDTH*HEIGHT);
+	LOCK(cl->updateMutex);
+	rfbDamageCollect(cl);
+	i=sraRgnGetIterator(cl->modifiedRegion);
+	while(sraRgnIteratorNext(i,&r))
+		for(y=r.y1;y<r.y2;y++)
+			for(x=r.x1;x<r.x2;x++)
+				got[y*WIDTH+x]=1;
+	sraRgnReleaseIterator(i);
+	sraRgnMakeEmpty(cl->modifiedRegion);
+	UNLOCK(cl->updateMutex);
+}
+
+static void check(int c,const char* got,const char* marked,rfbBool exact)
+{
+	int x,y,missing=0,extra=0;
+
+	for(y=0;y<HEIGHT;y++)
+		for(x=0;x<WIDTH;x++) {
+			/* marked somewhere in the same tile */
+			int tile=0,tx,ty;
+			for(ty=y/TILE*TILE;ty<y/TILE*TILE+TILE && ty<HEIGHT;ty++)
+				for(tx=x/TILE*TILE;tx<x/TILE*TILE+TILE && tx<WIDTH;tx++)
+					tile|=marked[ty*WIDTH+tx];
+			if(marked[y*WIDTH+x] && !got[y*WIDTH+x])
+				missing++;
+			if(exact && got[y*WIDTH+x] && !tile)
+				extra++;
+		}
+	if(missing || extra) {
+		rfbErr("client %d: %d pixels missing, %d too many\n",c,missing,extra);
+		errors++;
+	}
+}
+
+int main(int argc,char** argv)
+{
+	rfbScreenInfoPtr screen;
+	rfbClientPtr clients[CLIENTS];
+	static char marked[CLIENTS][WIDTH*HEIGHT],got[WIDTH*HEIGHT];
+	unsigned int seed=1;
+	int c,n,x,y;
+
+	screen=rfbGetScreen(&argc,argv,WIDTH,HEIGHT,8,3,4);
+	screen->frameBuffer=(char*)calloc(WIDTH*4,HEIGHT);
+	screen->autoPort=FALSE;
+	screen->port=0;
+	screen->httpPort=0;
+	rfbInitServer(screen);
+
+	for(c=0;c<CLIENTS;c++) {
+		clients[c]=newTestClient(screen);
+		if(!clients[c]) {
+			rfbErr("could not connect a client\n");
+			return 1;
+		}
+		/* a new client starts with the whole screen */
+		takeDamage(clients[c],got);
+		for(n=0;n<WIDTH*HEIGHT;n++)
+			if(!got[n]) {
+				rfbErr("client %d: new client did not get the whole screen\n",c);
+				errors++;
+				break;
+			}
+	}
+
+	for(n=1;n<=ROUNDS;n++) {
+		int x1=rand_r(&seed)%WIDTH,y1=rand_r(&seed)%HEIGHT;
+		int x2=x1+1+rand_r(&seed)%40,y2=y1+1+rand_r(&seed)%30;
+
+		rfbMarkRectAsModified(screen,x1,y1,x2,y2);
+		if(x2>WIDTH) x2=WIDTH;
+		if(y2>HEIGHT) y2=HEIGHT;
+		for(c=0;c<CLIENTS;c++) {
+			for(y=y1;y<y2;y++)
+				for(x=x1;x<x2;x++)
+					marked[c][y*WIDTH+x]=1;
+			if(!rfbDamagePending(clients[c])) {
+				rfbErr("client %d: no damage pending after a change\n",c);
+				errors++;
+			}
+			if(n%every[c]==0) {
+				takeDamage(clients[c],got);
+				check(c,got,marked[c],every[c]<32);
+				memset(marked[c],0,WIDTH*HEIGHT);
+				if(rfbDamagePending(clients[c])) {
+					rfbErr("client %d: damage pending after taking it\n",c);
+					errors++;
+				}
+			}
+		}
+	}
+
+	/* a new framebuffer: everybody gets the whole screen again */
+	rfbMarkRectAsModified(screen,0,0,10,10);
+	free(screen->frameBuffer);
+	rfbNewFramebuffer(screen,(char*)calloc(WIDTH*4,HEIGHT),WIDTH,HEIGHT,8,3,4);
+	for(c=0;c<CLIENTS;c++) {
+		takeDamage(clients[c],got);
+		for(n=0;n<WIDTH*HEIGHT;n++)
+			if(!got[n]) {
+				rfbErr("client %d: resize did not send the whole screen\n",c);
+				errors++;
+				break;
+			}
+	}
+
+	for(c=0;c<CLIENTS;c++) {
+		rfbCloseClient(clients[c]);
+		rfbClientConnectionGone(clients[c]);
+	}
+	free(screen->frameBuffer);
+	rfbScreenCleanup(screen);
+
+	rfbLog("damage journal: %d errors\n",errors);
+	return errors?1:0;
+}
@@ -0,0 +1,549 @@
+/*
+ * encbench: throughput and compression of every encoder, on a sequence
+ * of phone screens.
+ *
+ *   encbench [-json] [-loops n] [corpus]
+ *
+ * The corpus is a directory of screen captures, as written by Android's
+ * "screencap" without -p (a header of width, height and format, and
+ * sometimes a colour space, then the pixels), named so that they sort in
+ * the order they were taken: *.raw.  The damage of each capture is the
+ * set of 16x16 tiles that differ from the one before, unless the
+ * directory holds a file "damage" with lines "frame x y w h", which is
+ * used instead.  Without a corpus, a sequence of synthetic screens with a
+ * ticking clock, a scrolling list and a keyboard being typed on is used.
+ *
+ * Every encoder is given the damaged rectangles of every frame, loops
+ * times, and the time of each call is taken.  For each, the throughput in
+ * MB of framebuffer per second, the bytes per frame, the compression
+ * ratio against Raw and the median and 99th percentile time per
+ * rectangle are printed; with -json, as one JSON object per line, for
+ * keeping track of regressions.
+ *
+ * As in tilebench, the client's end of the connection is drained by a
+ * separate thread, and the client asks for 32 bits per pixel.
+ */
+
+#ifdef __STRICT_ANSI__
+#define _BSD_SOURCE
+#endif
+#include <time.h>
+#include <dirent.h>
+#include <sys/time.h>
+#include <rfb/rfb.h>
+#include <rfb/rfbregion.h>
+
+#ifndef LIBVNCSERVER_HAVE_LIBPTHREAD
+#error This benchmark needs pthread support (to drain the client socket)
+#endif
+
+#define TILE 16
+#define SYNTHETIC_FRAMES 120
+
+typedef struct {
+	const char* dir;	/* NULL for the synthetic screens */
+	char** files;
+	int frames, width, height;
+	sraRegionPtr* damage;	/* per frame */
+	unsigned char* rgba;	/* the frame last loaded, 4 bytes a pixel */
+} corpus_t;
+
+typedef struct { char* name; int encoding; int compress; int quality; } encoder_t;
+
+static encoder_t encoders[]={
+	{ "raw", rfbEncodingRaw, 0, -1 },
+	{ "rre", rfbEncodingRRE, 0, -1 },
+	{ "corre", rfbEncodingCoRRE, 0, -1 },
+	{ "hextile", rfbEncodingHextile, 0, -1 },
+	{ "ultra", rfbEncodingUltra, 0, -1 },
+#ifdef LIBVNCSERVER_HAVE_LIBZ
+	{ "zlib", rfbEncodingZlib, 6, -1 },
+#ifdef LIBVNCSERVER_HAVE_LIBJPEG
+	{ "tight", rfbEncodingTight, 6, -1 },
+	{ "tight-q9", rfbEncodingTight, 6, 9 },
+	{ "tight-q6", rfbEncodingTight, 6, 6 },
+	{ "tight-q2", rfbEncodingTight, 6, 2 },
+#endif
+	{ "zrle", rfbEncodingZRLE, 0, -1 },
+	{ "zywrle", rfbEncodingZYWRLE, 0, -1 },
+#endif
+	{ NULL, 0, 0, 0 }
+};
+
+static uint32_t readLE32(const unsigned char* p)
+{
+	return p[0]|(p[1]<<8)|(p[2]<<16)|((uint32_t)p[3]<<24);
+}
+
+/* reads a screencap frame into c->rgba; FALSE if it is not one, or not
+   the size of the first */
+static rfbBool loadCapture(corpus_t* c,int n)
+{
+	char path[1024];
+	unsigned char header[12];
+	uint32_t w,h,format;
+	long size,pixels;
+	int bytes,i;
+	unsigned char* p;
+	FILE* f;
+
+	snprintf(path,sizeof(path),"%s/%s",c->dir,c->files[n]);
+	if((f=fopen(path,"rb"))==NULL)
+		return FALSE;
+	fseek(f,0,SEEK_END);
+	size=ftell(f);
+	fseek(f,0,SEEK_SET);
+	if(fread(header,1,12,f)!=12) {
+		fclose(f);
+		return FALSE;
+	}
+	w=readLE32(header);
+	h=readLE32(header+4);
+	format=readLE32(header+8);
+	/* 1 RGBA_8888, 2 RGBX_8888, 4 RGB_565, 5 BGRA_8888 */
+	bytes=format==4?2:4;
+	pixels=(long)w*h;
+	if(w==0 || h==0 || (format!=1 && format!=2 && format!=4 && format!=5)
+			|| (size-pixels*bytes!=12 && size-pixels*bytes!=16)
+			|| (c->rgba && ((int)w!=c->width || (int)h!=c->height))) {
+		rfbErr("%s: not a screen capture like the first\n",path);
+		fclose(f);
+		return FALSE;
+	}
+	if(!c->rgba) {
+		c->width=w;
+		c->height=h;
+		c->rgba=(unsigned char*)malloc(pixels*4);
+	}
+	fseek(f,size-pixels*bytes,SEEK_SET);
+	if(fread(c->rgba,bytes,pixels,f)!=(size_t)pixels) {
+		fclose(f);
+		return FALSE;
+	}
+	fclose(f);
+
+	/* in place, into R, G, B, A; backwards for the 2 byte pixels */
+	if(format==4)
+		for(i=pixels-1;i>=0;i--) {
+			int v=c->rgba[i*2]|(c->rgba[i*2+1]<<8);
+			p=c->rgba+i*4;
+			p[0]=(v>>11)*255/31;
+			p[1]=((v>>5)&63)*255/63;
+			p[2]=(v&31)*255/31;
+			p[3]=255;
+		}
+	else if(format==5)
+		for(i=0,p=c->rgba;i<pixels;i++,p+=4) {
+			unsigned char t=p[0];
+			p[0]=p[2];
+			p[2]=t;
+		}
+	return TRUE;
+}
+
+static void setRGB(unsigned char* p,int r,int g,int b)
+{
+	p[0]=r; p[1]=g; p[2]=b; p[3]=255;
+}
+
+/* how far the list has scrolled in frame n: it scrolls for 30 frames out
+   of every 60 */
+static int listScroll(int n)
+{
+	return (n/60)*360+(n%60<30?n%60:30)*12;
+}
+
+/* a status bar with a clock, a list of rows with an icon, two lines of
+   text and now and then a photo, and a keyboard */
+static void synthFrame(corpus_t* c,int n)
+{
+	int w=c->width,h=c->height,keyboard=h-260,scroll=listScroll(n);
+	int x,y;
+
+	for(y=0;y<h;y++)
+		for(x=0;x<w;x++) {
+			unsigned char* p=c->rgba+(y*w+x)*4;
+			if(y<25) {
+				int ink=x>=420 && x<460 && y>=6 && y<18
+					&& ((x*31+y*17+(n/15)*7)%5)<2;
+				setRGB(p,ink?240:20,ink?240:20,ink?240:20);
+			} else if(y<keyboard) {
+				int ly=y-25+scroll,row=ly/72,ry=ly%72;
+				unsigned int noise=((x*73856093u)^(ly*19349663u)^(row*83492791u))>>30;
+				if(ry==71)
+					setRGB(p,210,210,210);
+				else if(row%5==4 && ry>=4 && ry<68)
+					setRGB(p,(x*255/w+noise)&255,(ry*3+row*40+noise)&255,(128+ry+noise)&255);
+				else if(x>=16 && x<56 && ry>=16 && ry<56)
+					setRGB(p,(row*53)&255,(row*97+x)&255,(row*29+ry)&255);
+				else if(((x>=72 && x<252 && ry>=14 && ry<30)
+						|| (x>=72 && x<332 && ry>=40 && ry<52))
+						&& ((x*31+ly*17+row*7)%5)<2)
+					setRGB(p,40,40,40);
+				else
+					setRGB(p,250,250,250);
+			} else {
+				int kx=x*10/w,ky=(y-keyboard)*4/260,key=ky*10+kx;
+				int pressed=n%60>=30 && key==(n*7)%40;
+				int edge=x%(w/10)<3 || (y-keyboard)%65<3;
+				if(edge)
+					setRGB(p,200,200,205);
+				else if(pressed)
+					setRGB(p,120,160,230);
+				else
+					setRGB(p,235,235,240);
+			}
+		}
+}
+
+static void loadFrame(corpus_t* c,int n)
+{
+	if(c->dir)
+		loadCapture(c,n);
+	else
+		synthFrame(c,n);
+}
+
+static int compareNames(const void* a,const void* b)
+{
+	return strcmp(*(char* const*)a,*(char* const*)b);
+}
+
+/* the *.raw files of the directory, in order */
+static rfbBool listCaptures(corpus_t* c)
+{
+	DIR* d=opendir(c->dir);
+	struct dirent* e;
+	int size=0;
+
+	if(!d)
+		return FALSE;
+	while((e=readdir(d))!=NULL) {
+		size_t len=strlen(e->d_name);
+		if(len<5 || strcmp(e->d_name+len-4,".raw")!=0)
+			continue;
+		if(c->frames==size) {
+			size=size?size*2:64;
+			c->files=(char**)realloc(c->files,size*sizeof(char*));
+		}
+		c->files[c->frames++]=strdup(e->d_name);
+	}
+	closedir(d);
+	qsort(c->files,c->frames,sizeof(char*),compareNames);
+	return c->frames>0;
+}
+
+/* "frame x y w h" lines; FALSE if there is no such file */
+static rfbBool readDamage(corpus_t* c)
+{
+	char path[1024];
+	int n,x,y,w,h;
+	FILE* f;
+
+	snprintf(path,sizeof(path),"%s/damage",c->dir);
+	if((f=fopen(path,"r"))==NULL)
+		return FALSE;
+	while(fscanf(f,"%d %d %d %d %d",&n,&x,&y,&w,&h)==5) {
+		sraRegionPtr r;
+		if(n<0 || n>=c->frames)
+			continue;
+		r=sraRgnCreateRect(x,y,x+w,y+h);
+		sraRgnOr(c->damage[n],r);
+		sraRgnDestroy(r);
+	}
+	fclose(f);
+	return TRUE;
+}
+
+/* the tiles of each frame which differ from the frame before */
+static void diffFrames(corpus_t* c)
+{
+	size_t size=(size_t)c->width*c->height*4;
+	unsigned char* last=(unsigned char*)malloc(size);
+	int n,tx,ty,y;
+
+	for(n=0;n<c->frames;n++) {
+		loadFrame(c,n);
+		if(n==0) {
+			sraRgnDestroy(c->damage[0]);
+			c->damage[0]=sraRgnCreateRect(0,0,c->width,c->height);
+		} else
+			for(ty=0;ty<c->height;ty+=TILE)
+				for(tx=0;tx<c->width;tx+=TILE) {
+					int tw=tx+TILE>c->width?c->width-tx:TILE;
+					int th=ty+TILE>c->height?c->height-ty:TILE;
+					for(y=ty;y<ty+th;y++) {
+						size_t off=((size_t)y*c->width+tx)*4;
+						if(memcmp(c->rgba+off,last+off,tw*4)!=0) {
+							sraRegionPtr r=sraRgnCreateRect(tx,ty,tx+tw,ty+th);
+							sraRgnOr(c->damage[n],r);
+							sraRgnDestroy(r);
+							break;
+						}
+					}
+				}
+		memcpy(last,c->rgba,size);
+	}
+	free(last);
+}
+
+static rfbBool openCorpus(corpus_t* c,const char* dir)
+{
+	int n;
+
+	memset(c,0,sizeof(*c));
+	c->dir=dir;
+	if(dir) {
+		if(!listCaptures(c) || !loadCapture(c,0))
+			return FALSE;
+	} else {
+		c->frames=SYNTHETIC_FRAMES;
+		c->width=480;
+		c->height=800;
+		c->rgba=(unsigned char*)malloc(c->width*c->height*4);
+	}
+	c->damage=(sraRegionPtr*)malloc(c->frames*sizeof(sraRegionPtr));
+	for(n=0;n<c->frames;n++)
+		c->damage[n]=sraRgnCreate();
+	if(!dir || !readDamage(c))
+		diffFrames(c);
+	return TRUE;
+}
+
+static void closeCorpus(corpus_t* c)
+{
+	int n;
+
+	for(n=0;n<c->frames;n++) {
+		sraRgnDestroy(c->damage[n]);
+		if(c->files)
+			free(c->files[n]);
+	}
+	free(c->damage);
+	free(c->files);
+	free(c->rgba);
+}
+
+/* into the framebuffer, which is in the server's format */
+static void showFrame(rfbScreenInfoPtr s,corpus_t* c,int n)
+{
+	rfbPixelFormat* f=&s->serverFormat;
+	unsigned char* p;
+	int x,y;
+
+	loadFrame(c,n);
+	for(y=0,p=c->rgba;y<c->height;y++)
+		for(x=0;x<c->width;x++,p+=4)
+			*(uint32_t*)(s->frameBuffer+y*s->paddedWidthInBytes+x*4)=
+				((p[0]*f->redMax/255)<<f->redShift)
+				|((p[1]*f->greenMax/255)<<f->greenShift)
+				|((p[2]*f->blueMax/255)<<f->blueShift);
+}
+
+static void* drainLoop(void* data)
+{
+	int sock=*(int*)data;
+	char buf[65536];
+	while(read(sock,buf,sizeof(buf))>0);
+	return NULL;
+}
+
+/* Connect a client to the screen over loopback; the other end of the
+ * connection is drained by a thread. */
+static rfbClientPtr newBenchClient(rfbScreenInfoPtr screen,int* peer)
+{
+	struct sockaddr_in addr;
+	socklen_t len=sizeof(addr);
+	int listenSock,sock;
+	pthread_t drainThread;
+	rfbClientPtr cl;
+
+	memset(&addr,0,sizeof(addr));
+	addr.sin_family=AF_INET;
+	addr.sin_addr.s_addr=htonl(INADDR_LOOPBACK);
+	listenSock=socket(AF_INET,SOCK_STREAM,0);
+	if(listenSock<0 || bind(listenSock,(struct sockaddr*)&addr,sizeof(addr))<0
+			|| listen(listenSock,1)<0
+			|| getsockname(listenSock,(struct sockaddr*)&addr,&len)<0)
+		return NULL;
+	*peer=socket(AF_INET,SOCK_STREAM,0);
+	if(connect(*peer,(struct sockaddr*)&addr,sizeof(addr))<0)
+		return NULL;
+	sock=accept(listenSock,NULL,NULL);
+	close(listenSock);
+	if(sock<0)
+		return NULL;
+
+	pthread_create(&drainThread,NULL,drainLoop,(void*)peer);
+	pthread_detach(drainThread);
+
+	cl=rfbNewClient(screen,sock);
+	if(!cl)
+		return NULL;
+	cl->state=RFB_NORMAL;
+	cl->enableLastRectEncoding=TRUE;
+	return cl;
+}
+
+static double now(void)
+{
+	struct timeval tv;
+	gettimeofday(&tv,NULL);
+	return tv.tv_sec+tv.tv_usec/1000000.0;
+}
+
+static rfbBool sendRect(rfbClientPtr cl,int encoding,int x,int y,int w,int h)
+{
+	switch(encoding) {
+	case rfbEncodingRaw: return rfbSendRectEncodingRaw(cl,x,y,w,h);
+	case rfbEncodingRRE: return rfbSendRectEncodingRRE(cl,x,y,w,h);
+	case rfbEncodingCoRRE: return rfbSendRectEncodingCoRRE(cl,x,y,w,h);
+	case rfbEncodingHextile: return rfbSendRectEncodingHextile(cl,x,y,w,h);
+	case rfbEncodingUltra: return rfbSendRectEncodingUltra(cl,x,y,w,h);
+#ifdef LIBVNCSERVER_HAVE_LIBZ
+	case rfbEncodingZlib: return rfbSendRectEncodingZlib(cl,x,y,w,h);
+#ifdef LIBVNCSERVER_HAVE_LIBJPEG
+	case rfbEncodingTight: return rfbSendRectEncodingTight(cl,x,y,w,h);
+#endif
+	case rfbEncodingZRLE:
+	case rfbEncodingZYWRLE: return rfbSendRectEncodingZRLE(cl,x,y,w,h);
+#endif
+	}
+	return FALSE;
+}
+
+static int compareTimes(const void* a,const void* b)
+{
+	double d=*(const double*)a-*(const double*)b;
+	return d<0?-1:d>0?1:0;
+}
+
+typedef struct {
+	int frames, rects;
+	double pixels, bytes, rawBytes, seconds, p50, p99;
+} result_t;
+
+static void runBench(rfbClientPtr cl,corpus_t* c,encoder_t* e,int loops,result_t* res)
+{
+	rfbScreenInfoPtr screen=cl->screen;
+	double* times=NULL;
+	int size=0,bytes,rawBytes,i,n;
+
+	memset(res,0,sizeof(*res));
+	cl->preferredEncoding=e->encoding;
+	cl->tightCompressLevel=e->compress;
+	cl->zlibCompressLevel=e->compress;
+	cl->tightQualityLevel=e->quality;
+	cl->ublen=0;
+	bytes=rfbStatGetSentBytes(cl);
+	rawBytes=rfbStatGetSentBytesIfRaw(cl);
+
+	for(i=0;i<loops;i++)
+		for(n=0;n<c->frames;n++) {
+			sraRectangleIterator* it;
+			sraRect r;
+
+			showFrame(screen,c,n);
+			for(it=sraRgnGetIterator(c->damage[n]);sraRgnIteratorNext(it,&r);) {
+				double start;
+				if(res->rects==size) {
+					size=size?size*2:1024;
+					times=(double*)realloc(times,size*sizeof(double));
+				}
+				start=now();
+				sendRect(cl,e->encoding,r.x1,r.y1,r.x2-r.x1,r.y2-r.y1);
+				times[res->rects]=now()-start;
+				res->seconds+=times[res->rects++];
+				res->pixels+=(double)(r.x2-r.x1)*(r.y2-r.y1);
+			}
+			sraRgnReleaseIterator(it);
+			rfbSendUpdateBuf(cl);
+			while(rfbStatGetQueueDepth(cl)>0)
+				rfbProcessEvents(screen,1000);
+			res->frames++;
+		}
+
+	res->bytes=rfbStatGetSentBytes(cl)-bytes;
+	res->rawBytes=rfbStatGetSentBytesIfRaw(cl)-rawBytes;
+	if(res->rects>0) {
+		qsort(times,res->rects,sizeof(double),compareTimes);
+		res->p50=times[res->rects/2];
+		res->p99=times[(int)(res->rects*0.99)];
+	}
+	free(times);
+}
+
+int main(int argc,char** argv)
+{
+	rfbScreenInfoPtr screen;
+	rfbClientPtr cl;
+	corpus_t corpus;
+	const char* dir=NULL;
+	rfbBool json=FALSE;
+	int loops=1,peer,e,i;
+
+	for(i=1;i<argc;i++) {
+		if(strcmp(argv[i],"-json")==0)
+			json=TRUE;
+		else if(strcmp(argv[i],"-loops")==0 && i+1<argc)
+			loops=atoi(argv[++i]);
+		else if(argv[i][0]!='-')
+			dir=argv[i];
+		else {
+			fprintf(stderr,"usage: %s [-json] [-loops n] [corpus]\n",argv[0]);
+			return 1;
+		}
+	}
+	if(loops<1)
+		loops=1;
+
+	rfbLogEnable(0);
+	if(!openCorpus(&corpus,dir)) {
+		fprintf(stderr,"%s: no screen captures (*.raw) found\n",dir);
+		return 1;
+	}
+	i=1;
+	screen=rfbGetScreen(&i,argv,corpus.width,corpus.height,8,3,4);
+	screen->frameBuffer=(char*)malloc(screen->paddedWidthInBytes*corpus.height);
+	screen->autoPort=FALSE;
+	screen->port=0;
+	screen->httpPort=0;
+	rfbInitServer(screen);
+
+	cl=newBenchClient(screen,&peer);
+	if(!cl) {
+		rfbErr("could not connect a client\n");
+		return 1;
+	}
+
+	if(!json)
+		printf("%s: %d frames of %dx%d, %d loops\n"
+				"%-10s %9s %12s %8s %10s %10s\n",
+				dir?dir:"synthetic",corpus.frames,corpus.width,corpus.height,loops,
+				"encoder","MB/s","bytes/frame","ratio","p50 us","p99 us");
+	for(e=0;encoders[e].name;e++) {
+		result_t r;
+		double mbps,perFrame,ratio;
+
+		runBench(cl,&corpus,&encoders[e],loops,&r);
+		mbps=r.seconds>0?r.pixels*4/r.seconds/1e6:0;
+		perFrame=r.bytes/r.frames;
+		ratio=r.bytes>0?r.rawBytes/r.bytes:0;
+		if(json)
+			printf("{\"corpus\":\"%s\",\"encoder\":\"%s\",\"width\":%d,\"height\":%d,"
+					"\"frames\":%d,\"rects\":%d,\"mb_per_s\":%.2f,\"bytes_per_frame\":%.0f,"
+					"\"compression_ratio\":%.3f,\"rect_us_p50\":%.1f,\"rect_us_p99\":%.1f}\n",
+					dir?dir:"synthetic",encoders[e].name,corpus.width,corpus.height,
+					r.frames,r.rects,mbps,perFrame,ratio,r.p50*1e6,r.p99*1e6);
+		else
+			printf("%-10s %9.1f %12.0f %8.2f %10.1f %10.1f\n",
+					encoders[e].name,mbps,perFrame,ratio,r.p50*1e6,r.p99*1e6);
+	}
+
+	rfbCloseClient(cl);
+	rfbClientConnectionGone(cl);
+	free(screen->frameBuffer);
+	rfbScreenCleanup(screen);
+	closeCorpus(&corpus);
+	return 0;
+}
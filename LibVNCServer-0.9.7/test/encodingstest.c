@@ -39,6 +39,8 @@ static encoding_t testEncodings[]={
 /* Here come the variables/functions to handle the test output */
 
 static const int width=400,height=300;
+/* each encoding must have been checked at least this often */
+#define MIN_CHECKED_UPDATES 10
 static struct { int x1,y1,x2,y2; } lastUpdateRect;
 static unsigned int statistics[2][NUMBER_OF_ENCODINGS_TO_TEST];
 static unsigned int totalFailed,totalCount;
@@ -124,6 +126,16 @@ static rfbBool resize(rfbClient* cl) {
 	return TRUE;
 }
 
+/* The server sends the damaged 16x16 tiles (see damage.c), so the last
+ * rectangle of an update ends at the corner of the last damaged tile,
+ * or at the edge of the screen. */
+#define DAMAGE_TILE 16
+
+static int roundUpToTile(int x,int max) {
+	x=(x+DAMAGE_TILE-1)/DAMAGE_TILE*DAMAGE_TILE;
+	return x<max?x:max;
+}
+
 typedef struct clientData {
 	int encodingIndex;
 	rfbScreenInfo* server;
@@ -132,7 +144,7 @@ typedef struct clientData {
 
 static void update(rfbClient* client,int x,int y,int w,int h) {
 	clientData* cd=(clientData*)client->clientData;
-	int maxDelta=0;
+	int maxDelta=0,x2,y2;
 	
 #ifndef VERY_VERBOSE
 	static const char* progress="|/-\\";
@@ -147,10 +159,11 @@ static void update(rfbClient* client,int x,int y,int w,int h) {
 #endif
 
 	/* only check if this was the last update */
-	if(x+w!=lastUpdateRect.x2 || y+h!=lastUpdateRect.y2) {
+	x2=roundUpToTile(lastUpdateRect.x2,cd->server->width);
+	y2=roundUpToTile(lastUpdateRect.y2,cd->server->height);
+	if(x+w!=x2 || y+h!=y2) {
 #ifdef VERY_VERBOSE
-		rfbClientLog("Waiting (%d!=%d or %d!=%d)\n",
-				x+w,lastUpdateRect.x2,y+h,lastUpdateRect.y2);
+		rfbClientLog("Waiting (%d!=%d or %d!=%d)\n",x+w,x2,y+h,y2);
 #endif
 		return;
 	}
@@ -340,9 +353,15 @@ int main(int argc,char** argv)
 	rfbScreenCleanup(server);
 
 	rfbLog("Statistics:\n");
-	for(i=0;i<NUMBER_OF_ENCODINGS_TO_TEST;i++)
+	for(i=0;i<NUMBER_OF_ENCODINGS_TO_TEST;i++) {
 		rfbLog("%s encoding: %d failed, %d received\n",
 				testEncodings[i].str,statistics[1][i],statistics[0][i]);
+		if(statistics[0][i]<MIN_CHECKED_UPDATES) {
+			rfbLog("%s encoding: fewer than %d updates checked\n",
+					testEncodings[i].str,MIN_CHECKED_UPDATES);
+			totalFailed++;
+		}
+	}
 	if(totalFailed)
 		return 1;
 	return(0);
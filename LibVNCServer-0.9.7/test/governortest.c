@@ -0,0 +1,120 @@
+/*
+ * governortest: a CPU budget for encoding.
+ *
+ * A libvncclient client asks for Tight, but also lists Hextile.  While
+ * the whole screen changes all the time, encoding it takes far more than
+ * the server's CPU budget: the server must move the client to Hextile.
+ * Once there is a budget to spare, it must go back to Tight.
+ */
+
+#include <time.h>
+#include <sys/time.h>
+#include <unistd.h>
+#include <rfb/rfb.h>
+#include <rfb/rfbclient.h>
+
+#ifndef LIBVNCSERVER_HAVE_LIBPTHREAD
+#error This test needs pthread support (the server runs in the background)
+#endif
+
+static const int width=320,height=240,bpp=4;
+
+static double now(void)
+{
+	struct timeval tv;
+	gettimeofday(&tv,NULL);
+	return tv.tv_sec+tv.tv_usec/1e6;
+}
+
+/* change the screen, everywhere or a bit, until cl uses encoding */
+static int run(rfbScreenInfoPtr server,rfbClient* client,rfbClientPtr cl,
+		rfbBool everywhere,int encoding)
+{
+	double start=now(),t=start;
+	int frame=0;
+
+	while(cl->preferredEncoding!=encoding && now()-start<8) {
+		if(now()-t>0.02) {
+			if(everywhere) {
+				int n;
+				for(n=0;n<width*height*bpp;n++)
+					server->frameBuffer[n]=rand();
+				rfbMarkRectAsModified(server,0,0,width,height);
+			} else {
+				int x=(frame*16)%width,y=(frame*16/width*16)%height,n;
+				for(n=0;n<16;n++)
+					memset(server->frameBuffer+((y+n)*width+x)*bpp,frame,16*bpp);
+				rfbMarkRectAsModified(server,x,y,x+16,y+16);
+			}
+			frame++;
+			t=now();
+		}
+		if(WaitForMessage(client,10000)>0 && !HandleRFBServerMessage(client)) {
+			rfbErr("client was disconnected\n");
+			exit(1);
+		}
+	}
+	return cl->preferredEncoding==encoding;
+}
+
+int main(int argc,char** argv)
+{
+	rfbScreenInfoPtr server;
+	rfbClient* client;
+	rfbClientPtr cl;
+	char* fb;
+	int failed=0;
+	double start;
+
+	server=rfbGetScreen(&argc,argv,width,height,8,3,bpp);
+	server->frameBuffer=malloc(width*height*bpp);
+	memset(server->frameBuffer,0,width*height*bpp);
+	server->cursor=NULL;
+	server->cpuBudget=1;
+	rfbInitServer(server);
+	rfbRunEventLoop(server,-1,TRUE);
+
+	client=rfbGetClient(8,3,bpp);
+	client->serverHost=strdup("127.0.0.1");
+	client->serverPort=server->port;
+	client->appData.encodingsString="tight hextile";
+	client->appData.qualityLevel=8;
+	if(!rfbInitClient(client,NULL,NULL)) {
+		rfbErr("could not connect\n");
+		return 1;
+	}
+	cl=server->clientHead;
+
+	if(!run(server,client,cl,TRUE,rfbEncodingHextile)) {
+		rfbErr("the client was not moved to a cheaper encoding\n");
+		failed++;
+	}
+	rfbLog("over the budget: CPU level %d, Tight took %d us, Hextile %d us\n",
+			rfbAdaptGetCpuLevel(server),
+			rfbStatGetEncodingTime(cl,rfbEncodingTight),
+			rfbStatGetEncodingTime(cl,rfbEncodingHextile));
+	if(rfbStatGetEncodingTime(cl,rfbEncodingTight)<=0) {
+		rfbErr("encoding was not timed\n");
+		failed++;
+	}
+
+	server->cpuBudget=1000;
+	if(!run(server,client,cl,FALSE,rfbEncodingTight)) {
+		rfbErr("the client did not go back to its own encoding\n");
+		failed++;
+	}
+	rfbLog("within the budget: CPU level %d\n",rfbAdaptGetCpuLevel(server));
+
+	close(client->sock);
+	rfbClientCleanup(client);
+	start=now();
+	while(server->clientHead && now()-start<5)
+		usleep(10000);
+
+	rfbShutdownServer(server,TRUE);
+	fb=server->frameBuffer;
+	rfbScreenCleanup(server);
+	free(fb);
+	rfbLog("CPU governor: %d failed\n",failed);
+	return failed?1:0;
+}
@@ -0,0 +1,378 @@
+/*
+ * loadtest: many clients on a server running in the background.
+ *
+ * 200 clients connect to a server started with rfbRunEventLoop(...,TRUE)
+ * and keep asking for updates while a small part of the screen changes all
+ * the time.  Every client must keep getting updates, and the number of
+ * threads must not grow with the number of clients.
+ *
+ * Then a few more clients ask for the whole screen in ZRLE again and
+ * again, which is large enough to be split between ZRLE's helper threads.
+ * Those may be started once, but the number of threads must not grow
+ * with the number of updates either.
+ */
+
+#include <time.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <rfb/rfb.h>
+
+#define CLIENTS 200
+#define ZRLE_CLIENTS 8
+#define ZRLE_HELPERS 3		/* ZRLE_MAX_THREADS-1, in zrle.c */
+
+/* 8x2 ZRLE tiles */
+static const int width=512,height=128,bpp=4;
+
+typedef struct {
+	int sock;
+	rfbBool zrle;		/* asks for the whole screen every time */
+	/* where we are in the stream of framebuffer updates */
+	enum { UPDATE_HEADER, RECT_HEADER, RECT_LENGTH, RECT_DATA } state;
+	char header[sz_rfbFramebufferUpdateRectHeader];
+	int have,rects;
+	long left;
+	int updates;
+} Client;
+
+static Client clients[CLIENTS+ZRLE_CLIENTS];
+static struct pollfd fds[CLIENTS+ZRLE_CLIENTS];
+static int frame=0;
+
+static double now(void)
+{
+	struct timeval tv;
+	gettimeofday(&tv,NULL);
+	return tv.tv_sec+tv.tv_usec/1e6;
+}
+
+static int countThreads(void)
+{
+	FILE* f=fopen("/proc/self/status","r");
+	char line[256];
+	int count=-1;
+
+	if(!f)
+		return -1;
+	while(fgets(line,sizeof(line),f))
+		if(sscanf(line,"Threads: %d",&count)==1)
+			break;
+	fclose(f);
+	return count;
+}
+
+static void* noop(void* arg)
+{
+	return arg;
+}
+
+/* the threads of the process before the server starts any; one is
+   started and joined first, so that those a runtime starts along with
+   the first, like a sanitizer's, are counted too */
+static int countThreadsBefore(void)
+{
+	pthread_t thread;
+
+	if(pthread_create(&thread,NULL,noop,NULL)==0)
+		pthread_join(thread,NULL);
+	return countThreads();
+}
+
+/* the clients the server still serves; the iterator takes the list's
+   mutex, which rfbClientConnectionGone() holds to unlink one */
+static int countClients(rfbScreenInfoPtr server)
+{
+	rfbClientIteratorPtr i=rfbGetClientIterator(server);
+	int count=0;
+
+	while(rfbClientIteratorNext(i))
+		count++;
+	rfbReleaseClientIterator(i);
+	return count;
+}
+
+static void readFully(int sock,char* buf,int len)
+{
+	int n;
+
+	while(len>0) {
+		n=recv(sock,buf,len,0);
+		if(n<=0) {
+			rfbErr("handshake failed\n");
+			exit(1);
+		}
+		buf+=n;
+		len-=n;
+	}
+}
+
+/* RFB 3.3 handshake without authentication */
+static int newClient(rfbScreenInfoPtr server)
+{
+	struct sockaddr_in addr;
+	struct timeval timeout;
+	int sock=socket(AF_INET,SOCK_STREAM,0);
+	char buf[sz_rfbProtocolVersionMsg];
+	rfbServerInitMsg si;
+	uint32_t nameLength;
+
+	timeout.tv_sec=5;
+	timeout.tv_usec=0;
+	setsockopt(sock,SOL_SOCKET,SO_RCVTIMEO,(char*)&timeout,sizeof(timeout));
+	memset(&addr,0,sizeof(addr));
+	addr.sin_family=AF_INET;
+	addr.sin_port=htons(server->port);
+	addr.sin_addr.s_addr=inet_addr("127.0.0.1");
+	if(connect(sock,(struct sockaddr*)&addr,sizeof(addr))<0) {
+		rfbLogPerror("connect");
+		exit(1);
+	}
+
+	readFully(sock,buf,sz_rfbProtocolVersionMsg);
+	write(sock,"RFB 003.003\n",sz_rfbProtocolVersionMsg);
+	readFully(sock,buf,4);
+	write(sock,"\1",1);
+	readFully(sock,(char*)&si,sz_rfbServerInitMsg);
+	nameLength=Swap32IfLE(si.nameLength);
+	while(nameLength>0) {
+		int n=nameLength>sizeof(buf)?sizeof(buf):nameLength;
+		readFully(sock,buf,n);
+		nameLength-=n;
+	}
+	return sock;
+}
+
+static void requestUpdate(int sock,int incremental)
+{
+	rfbFramebufferUpdateRequestMsg fur;
+
+	fur.type=rfbFramebufferUpdateRequest;
+	fur.incremental=incremental;
+	fur.x=fur.y=0;
+	fur.w=Swap16IfLE(width);
+	fur.h=Swap16IfLE(height);
+	send(sock,(char*)&fur,sz_rfbFramebufferUpdateRequestMsg,0);
+}
+
+static void setEncodingZRLE(int sock)
+{
+	char buf[sz_rfbSetEncodingsMsg+4];
+	rfbSetEncodingsMsg* se=(rfbSetEncodingsMsg*)buf;
+	uint32_t enc=Swap32IfLE(rfbEncodingZRLE);
+
+	se->type=rfbSetEncodings;
+	se->pad=0;
+	se->nEncodings=Swap16IfLE(1);
+	memcpy(buf+sz_rfbSetEncodingsMsg,&enc,4);
+	send(sock,buf,sizeof(buf),0);
+}
+
+/* follow the raw or ZRLE encoded updates, and ask for the next one after
+   each */
+static void parse(Client* c,char* buf,int len)
+{
+	while(len>0) {
+		if(c->state==RECT_DATA) {
+			int n=c->left<len?c->left:len;
+			buf+=n;
+			len-=n;
+			if((c->left-=n)>0)
+				break;
+			c->state=RECT_HEADER;
+		} else {
+			int need=c->state==UPDATE_HEADER?sz_rfbFramebufferUpdateMsg
+				:c->state==RECT_LENGTH?4:sz_rfbFramebufferUpdateRectHeader;
+			int n=need-c->have<len?need-c->have:len;
+			memcpy(c->header+c->have,buf,n);
+			buf+=n;
+			len-=n;
+			if((c->have+=n)<need)
+				break;
+			c->have=0;
+			if(c->state==UPDATE_HEADER) {
+				rfbFramebufferUpdateMsg* fu=(rfbFramebufferUpdateMsg*)c->header;
+				if(fu->type!=rfbFramebufferUpdate) {
+					rfbErr("unexpected message %d\n",fu->type);
+					exit(1);
+				}
+				c->rects=Swap16IfLE(fu->nRects);
+			} else if(c->state==RECT_LENGTH) {
+				uint32_t length;
+				memcpy(&length,c->header,4);
+				c->left=Swap32IfLE(length);
+				c->state=RECT_DATA;
+				if(c->left>0)
+					continue;
+			} else {
+				rfbFramebufferUpdateRectHeader* rect=
+					(rfbFramebufferUpdateRectHeader*)c->header;
+				c->rects--;
+				if(Swap32IfLE(rect->encoding)==rfbEncodingZRLE) {
+					c->state=RECT_LENGTH;
+					continue;
+				}
+				c->left=(long)Swap16IfLE(rect->r.w)*Swap16IfLE(rect->r.h)*bpp;
+				c->state=RECT_DATA;
+				if(c->left>0)
+					continue;
+			}
+		}
+		if(c->rects>0) {
+			c->state=RECT_HEADER;
+		} else {
+			c->state=UPDATE_HEADER;
+			c->updates++;
+			requestUpdate(c->sock,!c->zrle);
+		}
+	}
+}
+
+/* reads from the first count clients for a while, changing the screen;
+   the most threads seen are kept in maxThreads */
+static void run(rfbScreenInfoPtr server,int count,double seconds,int* maxThreads)
+{
+	char buf[65536];
+	double start,t;
+	int i,n;
+
+	start=t=now();
+	while(now()-start<seconds) {
+		/* a moving 16x16 square */
+		if(now()-t>0.02) {
+			int x=(frame*16)%width,y=(frame*16/width*16)%height;
+			for(n=0;n<16;n++)
+				memset(server->frameBuffer+((y+n)*width+x)*bpp,frame,16*bpp);
+			rfbMarkRectAsModified(server,x,y,x+16,y+16);
+			frame++;
+			t=now();
+		}
+
+		if(poll(fds,count,20)<0 && errno!=EINTR) {
+			rfbLogPerror("poll");
+			exit(1);
+		}
+		for(i=0;i<count;i++)
+			if(fds[i].revents) {
+				n=recv(clients[i].sock,buf,sizeof(buf),MSG_DONTWAIT);
+				if(n==0 || (n<0 && errno!=EAGAIN && errno!=EWOULDBLOCK)) {
+					rfbErr("client %d was disconnected\n",i);
+					exit(1);
+				}
+				if(n>0)
+					parse(clients+i,buf,n);
+			}
+
+		n=countThreads();
+		if(n>*maxThreads)
+			*maxThreads=n;
+	}
+}
+
+int main(int argc,char** argv)
+{
+	rfbScreenInfoPtr server;
+	char* fb;
+	int i,n,failed=0,before,threads,maxThreads,zrleThreads,fewest=-1;
+	long updates=0;
+	double start;
+
+	before=countThreadsBefore();
+	server=rfbGetScreen(&argc,argv,width,height,8,3,bpp);
+	server->frameBuffer=malloc(width*height*bpp);
+	memset(server->frameBuffer,0,width*height*bpp);
+	server->cursor=NULL;
+	rfbInitServer(server);
+	rfbRunEventLoop(server,-1,TRUE);
+	threads=maxThreads=countThreads();
+
+	start=now();
+	for(i=0;i<CLIENTS;i++) {
+		clients[i].sock=newClient(server);
+		requestUpdate(clients[i].sock,0);
+		fds[i].fd=clients[i].sock;
+		fds[i].events=POLLIN;
+		n=countThreads();
+		if(n>maxThreads)
+			maxThreads=n;
+	}
+	rfbLog("%d clients connected in %.1f s\n",CLIENTS,now()-start);
+
+	run(server,CLIENTS,5,&maxThreads);
+
+	for(i=0;i<CLIENTS;i++) {
+		updates+=clients[i].updates;
+		if(fewest<0 || clients[i].updates<fewest)
+			fewest=clients[i].updates;
+	}
+	rfbLog("%d screen changes, %ld updates, every client got at least %d\n",
+			frame,updates,fewest);
+	rfbLog("%d threads with no client, at most %d with %d clients\n",
+			threads,maxThreads,CLIENTS);
+	if(fewest<10) {
+		rfbErr("a client got too few updates\n");
+		failed++;
+	}
+	if(maxThreads!=threads) {
+		rfbErr("the number of threads grew with the clients\n");
+		failed++;
+	}
+
+	/* the helpers are started by the first update split between them */
+	for(i=CLIENTS;i<CLIENTS+ZRLE_CLIENTS;i++) {
+		clients[i].sock=newClient(server);
+		clients[i].zrle=TRUE;
+		setEncodingZRLE(clients[i].sock);
+		requestUpdate(clients[i].sock,0);
+		fds[i].fd=clients[i].sock;
+		fds[i].events=POLLIN;
+	}
+	zrleThreads=0;
+	run(server,CLIENTS+ZRLE_CLIENTS,1,&zrleThreads);
+	maxThreads=zrleThreads=countThreads();
+	for(i=CLIENTS;i<CLIENTS+ZRLE_CLIENTS;i++)
+		clients[i].updates=0;
+	run(server,CLIENTS+ZRLE_CLIENTS,3,&maxThreads);
+	fewest=-1;
+	for(i=CLIENTS;i<CLIENTS+ZRLE_CLIENTS;i++)
+		if(fewest<0 || clients[i].updates<fewest)
+			fewest=clients[i].updates;
+	rfbLog("%d threads after the first ZRLE updates, at most %d after more, "
+			"every ZRLE client got at least %d\n",zrleThreads,maxThreads,fewest);
+	if(fewest<10) {
+		rfbErr("a ZRLE client got too few updates\n");
+		failed++;
+	}
+	if(zrleThreads>threads+ZRLE_HELPERS || maxThreads!=zrleThreads) {
+		rfbErr("the number of threads grew with the ZRLE updates\n");
+		failed++;
+	}
+
+	/* the server notices them going, and cleans up */
+	for(i=0;i<CLIENTS+ZRLE_CLIENTS;i++)
+		close(clients[i].sock);
+	start=now();
+	while(countClients(server)>0 && now()-start<5)
+		usleep(10000);
+	if(countClients(server)>0) {
+		rfbErr("clients which have gone are still there\n");
+		failed++;
+	}
+
+	rfbShutdownServer(server,TRUE);
+	fb=server->frameBuffer;
+	rfbScreenCleanup(server);
+	free(fb);
+	/* the workers and the ZRLE helpers are stopped with the screen */
+	n=countThreads();
+	if(n!=before) {
+		rfbErr("%d threads left after the screen was cleaned up, %d before\n",n,before);
+		failed++;
+	}
+	rfbLog("load: %d failed\n",failed);
+	return failed?1:0;
+}
@@ -0,0 +1,198 @@
+/*
+ * logtest: logging does not wait for a slow stderr.
+ *
+ * stderr is made a pipe which nobody reads at first, and several threads
+ * log as fast as they can with the log written asynchronously.  No call
+ * may block; what does not fit is dropped and reported, and everything
+ * else must come out whole and in order.  Then a client's fields must be
+ * put in front of its messages, and a message repeated too often must be
+ * held back and counted.
+ */
+
+#include <time.h>
+#include <fcntl.h>
+#include <sys/time.h>
+#include <rfb/rfb.h>
+
+#ifndef LIBVNCSERVER_HAVE_LIBPTHREAD
+#error This test needs pthread support
+#endif
+
+#define THREADS 4
+#define MESSAGES 5000
+#define REPEATS 100
+
+static int errors=0;
+static int logPipe[2];
+static char* logged=NULL;
+static size_t loggedLen=0,loggedSize=0;
+
+typedef struct { int id; double maxMs; } logger_t;
+
+static void* readLoop(void* data)
+{
+	ssize_t n;
+	while(1) {
+		if(loggedLen+4096+1>loggedSize) {
+			loggedSize=(loggedSize+4096+1)*2;
+			logged=(char*)realloc(logged,loggedSize);
+		}
+		if((n=read(logPipe[0],logged+loggedLen,4096))<=0)
+			break;
+		loggedLen+=n;
+	}
+	logged[loggedLen]='\0';
+	return NULL;
+}
+
+static void* logLoop(void* data)
+{
+	logger_t* l=(logger_t*)data;
+	struct timeval start,end;
+	double ms;
+	int i;
+
+	l->maxMs=0;
+	for(i=0;i<MESSAGES;i++) {
+		gettimeofday(&start,NULL);
+		rfbLog("thread %d message %d, with a little more text to fill the pipe\n",l->id,i);
+		gettimeofday(&end,NULL);
+		ms=(end.tv_sec-start.tv_sec)*1e3+(end.tv_usec-start.tv_usec)/1e3;
+		if(ms>l->maxMs)
+			l->maxMs=ms;
+	}
+	return NULL;
+}
+
+/* fills the pipe, so that the next write to stderr blocks */
+static void fillPipe(void)
+{
+	static const char filler[]="00/00/0000 00:00:00 filler\n";
+	int flags=fcntl(logPipe[1],F_GETFL);
+
+	fcntl(logPipe[1],F_SETFL,flags|O_NONBLOCK);
+	while(write(logPipe[1],filler,sizeof(filler)-1)>0);
+	fcntl(logPipe[1],F_SETFL,flags);
+}
+
+static void waitForNextSecond(void)
+{
+	time_t t=time(NULL);
+	while(time(NULL)==t)
+		usleep(1000);
+}
+
+int main(int argc,char** argv)
+{
+	pthread_t threads[THREADS],reader;
+	logger_t loggers[THREADS];
+	rfbClientRec cl;
+	char line[128];
+	const char* p;
+	int savedStderr,n,last[THREADS],seen=0,dropped=0;
+	double maxMs=0;
+
+	if(pipe(logPipe)<0)
+		return 1;
+	savedStderr=dup(2);
+	fillPipe();
+	dup2(logPipe[1],2);
+	close(logPipe[1]);
+
+	if(!rfbLogStartAsync()) {
+		dup2(savedStderr,2);
+		rfbErr("cannot log asynchronously here\n");
+		return 1;
+	}
+
+	/* nobody reads the full pipe yet */
+	rfbLogSetRateLimit(0);
+	for(n=0;n<THREADS;n++) {
+		loggers[n].id=n;
+		pthread_create(&threads[n],NULL,logLoop,&loggers[n]);
+	}
+	for(n=0;n<THREADS;n++) {
+		pthread_join(threads[n],NULL);
+		if(loggers[n].maxMs>maxMs)
+			maxMs=loggers[n].maxMs;
+	}
+	pthread_create(&reader,NULL,readLoop,NULL);
+	rfbLogFlush();
+
+	memset(&cl,0,sizeof(cl));
+	cl.host="10.0.0.1";
+	cl.sock=5;
+	cl.preferredEncoding=rfbEncodingHextile;
+	rfbLogClient(&cl,"a message about the client\n");
+
+	rfbLogSetRateLimit(20);
+	waitForNextSecond();
+	for(n=0;n<REPEATS;n++)
+		rfbLog("repeated %d\n",n);
+	waitForNextSecond();
+	rfbLog("repeated %d\n",n);
+
+	rfbLogFlush();
+	rfbLogStopAsync();
+	dup2(savedStderr,2);
+	pthread_join(reader,NULL);
+
+	if(maxMs>100) {
+		rfbErr("a call to rfbLog() took %.1f ms\n",maxMs);
+		errors++;
+	}
+
+	/* every line is whole, and each thread's are in order */
+	for(n=0;n<THREADS;n++)
+		last[n]=-1;
+	for(p=logged;*p;p=strchr(p,'\n')+1) {
+		int thread,message,k;
+		const char* text=strchr(p,' ')?strchr(strchr(p,' ')+1,' '):NULL;
+		if(!strchr(p,'\n') || !text) {
+			rfbErr("a line is cut: %s\n",p);
+			errors++;
+			break;
+		}
+		text++;
+		if(sscanf(text,"thread %d message %d,",&thread,&message)==2) {
+			if(thread<0 || thread>=THREADS || message<=last[thread]) {
+				rfbErr("out of order: %.*s\n",(int)(strchr(p,'\n')-p),p);
+				errors++;
+			}
+			last[thread]=message;
+			seen++;
+		} else if(sscanf(text,"(%d log messages dropped",&k)==1
+				&& strncmp(strchr(text,' ')," log messages dropped",21)==0)
+			dropped+=k;
+	}
+	rfbLog("%d messages written, %d dropped, %.2f ms the longest call\n",seen,dropped,maxMs);
+	if(seen+dropped!=THREADS*MESSAGES || dropped==0) {
+		rfbErr("%d messages logged, %d written and %d dropped\n",
+				THREADS*MESSAGES,seen,dropped);
+		errors++;
+	}
+
+	if(!strstr(logged,"client=10.0.0.1 sock=5 encoding=hextile: a message about the client\n")) {
+		rfbErr("no client fields\n");
+		errors++;
+	}
+	snprintf(line,sizeof(line),"repeated %d\n",19);
+	if(!strstr(logged,line)) {
+		rfbErr("the first repeats are missing\n");
+		errors++;
+	}
+	snprintf(line,sizeof(line),"repeated %d\n",20);
+	if(strstr(logged,line)) {
+		rfbErr("the repeats were not held back\n");
+		errors++;
+	}
+	snprintf(line,sizeof(line),"(%d more messages like \"repeated %%d\" left out)\n",REPEATS-20);
+	if(!strstr(logged,line) || !strstr(logged,"repeated 100\n")) {
+		rfbErr("the repeats left out were not reported\n");
+		errors++;
+	}
+
+	free(logged);
+	rfbLog("log: %d errors\n",errors);
+	return errors?1:0;
+}
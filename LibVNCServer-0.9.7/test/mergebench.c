@@ -0,0 +1,286 @@
+/*
+ * mergebench: what merging the rectangles of an update saves, on the
+ * kind of damage a phone screen sees.
+ *
+ * Each damage pattern is sent as whole framebuffer updates, once with
+ * screen->mergeRects off and once with it on, for a few encodings.  The
+ * bytes and rectangles sent per update and the time taken to encode one
+ * are printed for both.
+ *
+ * As in tilebench, the client's end of the connection is drained by a
+ * separate thread.
+ */
+
+#ifdef __STRICT_ANSI__
+#define _BSD_SOURCE
+#endif
+#include <time.h>
+#include <sys/time.h>
+#include <rfb/rfb.h>
+#include <rfb/rfbregion.h>
+
+#ifndef LIBVNCSERVER_HAVE_LIBPTHREAD
+#error This benchmark needs pthread support (to drain the client socket)
+#endif
+
+static const int width=480,height=800;
+
+typedef struct { char* name; int (*damage)(int n,sraRect* r); } pattern_t;
+
+static int setRect(sraRect* r,int x,int y,int w,int h)
+{
+	r->x1=x; r->y1=y; r->x2=x+w; r->y2=y+h;
+	return 1;
+}
+
+/* the digits of the status bar clock */
+static int damageClock(int n,sraRect* r)
+{
+	static const int x[]={ 420,429,441,450 };
+	if(n>=4)
+		return 0;
+	return setRect(r,x[n],6,7,12);
+}
+
+/* signal, battery and notification icons */
+static int damageStatusIcons(int n,sraRect* r)
+{
+	if(n>=8)
+		return 0;
+	if(n<5)
+		return setRect(r,8+n*22,5,16,16);
+	return setRect(r,340+(n-5)*22,5,16,16);
+}
+
+/* a list scrolled by redrawing its rows: icon, title and summary */
+static int damageListRows(int n,sraRect* r)
+{
+	int y=80+(n/3)*72;
+	if(n>=8*3)
+		return 0;
+	switch(n%3) {
+	case 0: return setRect(r,16,y+16,40,40);
+	case 1: return setRect(r,72,y+14,180,16);
+	default: return setRect(r,72,y+40,260,12);
+	}
+}
+
+/* typing: a pressed key and its preview, the caret and the suggestions */
+static int damageKeyboard(int n,sraRect* r)
+{
+	switch(n) {
+	case 0: return setRect(r,146,640,44,52);
+	case 1: return setRect(r,138,570,60,66);
+	case 2: return setRect(r,212,402,2,20);
+	case 3: return setRect(r,200,404,10,16);
+	case 4: return setRect(r,20,536,120,24);
+	case 5: return setRect(r,180,536,120,24);
+	case 6: return setRect(r,340,536,120,24);
+	default: return 0;
+	}
+}
+
+/* small changes all over the screen */
+static int damageScattered(int n,sraRect* r)
+{
+	static unsigned int seed;
+	if(n==0)
+		seed=1;
+	if(n>=40)
+		return 0;
+	return setRect(r,rand_r(&seed)%(width-24),rand_r(&seed)%(height-24),
+			4+rand_r(&seed)%20,4+rand_r(&seed)%20);
+}
+
+static pattern_t patterns[]={
+	{ "clock", damageClock },
+	{ "status", damageStatusIcons },
+	{ "listrows", damageListRows },
+	{ "keyboard", damageKeyboard },
+	{ "scattered", damageScattered },
+	{ NULL, NULL }
+};
+
+typedef struct { char* name; int encoding; int quality; } encoding_t;
+
+static encoding_t encodings[]={
+	{ "raw", rfbEncodingRaw, -1 },
+	{ "hextile", rfbEncodingHextile, -1 },
+#ifdef LIBVNCSERVER_HAVE_LIBZ
+	{ "zrle", rfbEncodingZRLE, -1 },
+#ifdef LIBVNCSERVER_HAVE_LIBJPEG
+	{ "tight", rfbEncodingTight, -1 },
+	{ "tight-jpeg", rfbEncodingTight, 6 },
+#endif
+#endif
+	{ NULL, 0, 0 }
+};
+
+static void putPixel(rfbScreenInfoPtr s,int x,int y,int r,int g,int b)
+{
+	rfbPixelFormat* f=&s->serverFormat;
+	uint32_t pix=((r*f->redMax/255)<<f->redShift)
+		|((g*f->greenMax/255)<<f->greenShift)
+		|((b*f->blueMax/255)<<f->blueShift);
+	*(uint32_t*)(s->frameBuffer+y*s->paddedWidthInBytes+x*4)=pix;
+}
+
+/* a plain background with a dark status bar, and detail in the changes */
+static void fillScreen(rfbScreenInfoPtr s,pattern_t* p,int frame)
+{
+	sraRect r;
+	int x,y,n;
+
+	for(y=0;y<height;y++)
+		for(x=0;x<width;x++) {
+			if(y<25)
+				putPixel(s,x,y,20,20,20);
+			else if(y%72==79%72)
+				putPixel(s,x,y,210,210,210);
+			else
+				putPixel(s,x,y,250,250,250);
+		}
+	for(n=0;p->damage(n,&r);n++)
+		for(y=r.y1;y<r.y2;y++)
+			for(x=r.x1;x<r.x2;x++) {
+				int ink=((x*31+y*17+frame*7)%5)<2;
+				putPixel(s,x,y,ink?40:200,ink?90:220,ink?160:240);
+			}
+}
+
+static void* drainLoop(void* data)
+{
+	int sock=*(int*)data;
+	char buf[65536];
+	while(read(sock,buf,sizeof(buf))>0);
+	return NULL;
+}
+
+/* Connect a client to the screen over loopback; the other end of the
+ * connection is drained by a thread. */
+static rfbClientPtr newBenchClient(rfbScreenInfoPtr screen,int* peer)
+{
+	struct sockaddr_in addr;
+	socklen_t len=sizeof(addr);
+	int listenSock,sock;
+	pthread_t drainThread;
+	rfbClientPtr cl;
+
+	memset(&addr,0,sizeof(addr));
+	addr.sin_family=AF_INET;
+	addr.sin_addr.s_addr=htonl(INADDR_LOOPBACK);
+	listenSock=socket(AF_INET,SOCK_STREAM,0);
+	if(listenSock<0 || bind(listenSock,(struct sockaddr*)&addr,sizeof(addr))<0
+			|| listen(listenSock,1)<0
+			|| getsockname(listenSock,(struct sockaddr*)&addr,&len)<0)
+		return NULL;
+	*peer=socket(AF_INET,SOCK_STREAM,0);
+	if(connect(*peer,(struct sockaddr*)&addr,sizeof(addr))<0)
+		return NULL;
+	sock=accept(listenSock,NULL,NULL);
+	close(listenSock);
+	if(sock<0)
+		return NULL;
+
+	pthread_create(&drainThread,NULL,drainLoop,(void*)peer);
+	pthread_detach(drainThread);
+
+	cl=rfbNewClient(screen,sock);
+	if(!cl)
+		return NULL;
+	cl->state=RFB_NORMAL;
+	cl->enableLastRectEncoding=TRUE;
+	return cl;
+}
+
+static double now(void)
+{
+	struct timeval tv;
+	gettimeofday(&tv,NULL);
+	return tv.tv_sec+tv.tv_usec/1000000.0;
+}
+
+typedef struct { double bytes, rects, us; } result_t;
+
+/* sends the pattern's damage loops times */
+static void runBench(rfbClientPtr cl,pattern_t* p,encoding_t* e,rfbBool merge,
+		int loops,result_t* res)
+{
+	rfbScreenInfoPtr screen=cl->screen;
+	int i,bytes,rects,updates;
+	double t=0;
+	sraRect r;
+
+	screen->mergeRects=merge;
+	cl->preferredEncoding=e->encoding;
+	cl->tightQualityLevel=e->quality;
+	cl->tightCompressLevel=1;
+	bytes=rfbStatGetSentBytes(cl);
+	rects=rfbStatGetEncodingCountSent(cl,e->encoding);
+	for(i=0;i<loops;i++) {
+		sraRegionPtr damage=sraRgnCreate();
+		int n;
+
+		fillScreen(screen,p,i);
+		for(n=0;p->damage(n,&r);n++) {
+			sraRegionPtr rect=sraRgnCreateRect(r.x1,r.y1,r.x2,r.y2);
+			sraRgnOr(damage,rect);
+			sraRgnDestroy(rect);
+		}
+		/* an update is not sent while the last one is still queued */
+		updates=rfbStatGetMessageCountSent(cl,rfbFramebufferUpdate);
+		while(rfbStatGetMessageCountSent(cl,rfbFramebufferUpdate)==updates) {
+			double start;
+			while(rfbStatGetQueueDepth(cl)>0)
+				rfbProcessEvents(screen,1000);
+			sraRgnOr(cl->modifiedRegion,damage);
+			sraRgnDestroy(cl->requestedRegion);
+			cl->requestedRegion=sraRgnCreateRect(0,0,width,height);
+			start=now();
+			rfbSendFramebufferUpdate(cl,damage);
+			t+=now()-start;
+		}
+		sraRgnDestroy(damage);
+	}
+	res->bytes=(double)(rfbStatGetSentBytes(cl)-bytes)/loops;
+	res->rects=(double)(rfbStatGetEncodingCountSent(cl,e->encoding)-rects)/loops;
+	res->us=t*1e6/loops;
+}
+
+int main(int argc,char** argv)
+{
+	rfbScreenInfoPtr screen;
+	rfbClientPtr cl;
+	int loops,peer,p,e;
+
+	rfbLogEnable(0);
+	screen=rfbGetScreen(&argc,argv,width,height,8,3,4);
+	loops=argc>1?atoi(argv[1]):200;
+	screen->frameBuffer=(char*)malloc(screen->paddedWidthInBytes*height);
+	screen->autoPort=FALSE;
+	screen->port=0;
+	screen->httpPort=0;
+	rfbInitServer(screen);
+
+	cl=newBenchClient(screen,&peer);
+	if(!cl) {
+		rfbErr("could not connect a client\n");
+		return 1;
+	}
+
+	for(p=0;patterns[p].name;p++)
+		for(e=0;encodings[e].name;e++) {
+			result_t off,on;
+			runBench(cl,&patterns[p],&encodings[e],FALSE,loops,&off);
+			runBench(cl,&patterns[p],&encodings[e],TRUE,loops,&on);
+			printf("%-10s %-10s  %4.0f -> %4.0f rects  %7.0f -> %7.0f bytes  %6.0f -> %6.0f us\n",
+					patterns[p].name,encodings[e].name,off.rects,on.rects,
+					off.bytes,on.bytes,off.us,on.us);
+		}
+
+	rfbCloseClient(cl);
+	rfbClientConnectionGone(cl);
+	free(screen->frameBuffer);
+	rfbScreenCleanup(screen);
+	return 0;
+}
@@ -0,0 +1,181 @@
+/*
+ * metricstest: the statistics can be fetched over http.
+ *
+ * A screen with -httpmetrics and no http directory gets a client and a
+ * few reported screen scans.  /metrics must then give them in the
+ * Prometheus text format, /status as JSON, and anything else must not be
+ * found.  The requests are made by a thread while the main one runs the
+ * event loop.
+ */
+
+#include <rfb/rfb.h>
+
+#ifndef LIBVNCSERVER_HAVE_LIBPTHREAD
+#error This test needs pthread support
+#endif
+
+#define WIDTH 64
+#define HEIGHT 48
+#define SCANS 25
+
+static int errors=0;
+static int httpPort;
+
+typedef struct {
+	const char* path;
+	char answer[65536];
+	volatile int done;
+} request_t;
+
+/* Connect a client over loopback; nothing is ever read from it. */
+static rfbClientPtr newTestClient(rfbScreenInfoPtr screen)
+{
+	struct sockaddr_in addr;
+	socklen_t len=sizeof(addr);
+	int listenSock,sock,peer;
+	rfbClientPtr cl;
+
+	memset(&addr,0,sizeof(addr));
+	addr.sin_family=AF_INET;
+	addr.sin_addr.s_addr=htonl(INADDR_LOOPBACK);
+	listenSock=socket(AF_INET,SOCK_STREAM,0);
+	if(listenSock<0 || bind(listenSock,(struct sockaddr*)&addr,sizeof(addr))<0
+			|| listen(listenSock,1)<0
+			|| getsockname(listenSock,(struct sockaddr*)&addr,&len)<0)
+		return NULL;
+	peer=socket(AF_INET,SOCK_STREAM,0);
+	if(connect(peer,(struct sockaddr*)&addr,sizeof(addr))<0)
+		return NULL;
+	sock=accept(listenSock,NULL,NULL);
+	close(listenSock);
+	if(sock<0)
+		return NULL;
+
+	cl=rfbNewClient(screen,sock);
+	if(!cl)
+		return NULL;
+	cl->state=RFB_NORMAL;
+	return cl;
+}
+
+/* a port nobody listens on */
+static int freePort(void)
+{
+	struct sockaddr_in addr;
+	socklen_t len=sizeof(addr);
+	int sock=socket(AF_INET,SOCK_STREAM,0);
+
+	memset(&addr,0,sizeof(addr));
+	addr.sin_family=AF_INET;
+	addr.sin_addr.s_addr=htonl(INADDR_LOOPBACK);
+	if(sock<0 || bind(sock,(struct sockaddr*)&addr,sizeof(addr))<0
+			|| getsockname(sock,(struct sockaddr*)&addr,&len)<0)
+		return -1;
+	close(sock);
+	return ntohs(addr.sin_port);
+}
+
+static void* requestThread(void* data)
+{
+	request_t* r=(request_t*)data;
+	struct sockaddr_in addr;
+	char get[256];
+	size_t got=0;
+	ssize_t n;
+	int sock=socket(AF_INET,SOCK_STREAM,0);
+
+	memset(&addr,0,sizeof(addr));
+	addr.sin_family=AF_INET;
+	addr.sin_addr.s_addr=htonl(INADDR_LOOPBACK);
+	addr.sin_port=htons(httpPort);
+	if(connect(sock,(struct sockaddr*)&addr,sizeof(addr))==0) {
+		snprintf(get,sizeof(get),"GET %s HTTP/1.0\r\n\r\n",r->path);
+		if(write(sock,get,strlen(get))==(ssize_t)strlen(get))
+			while(got<sizeof(r->answer)-1
+					&& (n=read(sock,r->answer+got,sizeof(r->answer)-1-got))>0)
+				got+=n;
+	}
+	r->answer[got]='\0';
+	close(sock);
+	r->done=1;
+	return NULL;
+}
+
+/* what the server answers to a GET of path */
+static void fetch(rfbScreenInfoPtr screen,request_t* r,const char* path)
+{
+	pthread_t thread;
+
+	r->path=path;
+	r->done=0;
+	pthread_create(&thread,NULL,requestThread,r);
+	while(!r->done)
+		rfbProcessEvents(screen,10000);
+	pthread_join(thread,NULL);
+}
+
+static void expect(const char* path,const char* answer,const char* what)
+{
+	if(!strstr(answer,what)) {
+		rfbErr("%s: \"%s\" not in the answer:\n%s\n",path,what,answer);
+		errors++;
+	}
+}
+
+int main(int argc,char** argv)
+{
+	rfbScreenInfoPtr screen;
+	rfbClientPtr cl;
+	static request_t r;
+	char line[64];
+	int n;
+
+	screen=rfbGetScreen(&argc,argv,WIDTH,HEIGHT,8,3,4);
+	screen->frameBuffer=(char*)calloc(WIDTH*4,HEIGHT);
+	screen->autoPort=FALSE;
+	screen->port=0;
+	screen->httpMetrics=TRUE;
+	screen->httpPort=httpPort=freePort();
+	rfbInitServer(screen);
+
+	cl=newTestClient(screen);
+	if(!cl || httpPort<0) {
+		rfbErr("could not connect a client\n");
+		return 1;
+	}
+	for(n=0;n<SCANS;n++)
+		rfbStatRecordCapture(screen,1000+n,n%5==0);
+
+	fetch(screen,&r,"/metrics");
+	expect("/metrics",r.answer,"HTTP/1.0 200 OK");
+	expect("/metrics",r.answer,"# TYPE rfb_capture_scan_seconds histogram");
+	snprintf(line,sizeof(line),"rfb_capture_scans_total %d\n",SCANS);
+	expect("/metrics",r.answer,line);
+	snprintf(line,sizeof(line),"rfb_capture_frames_total %d\n",SCANS/5);
+	expect("/metrics",r.answer,line);
+	snprintf(line,sizeof(line),"rfb_capture_scan_seconds_count %d\n",SCANS);
+	expect("/metrics",r.answer,line);
+	expect("/metrics",r.answer,"rfb_clients 1\n");
+	expect("/metrics",r.answer,"rfb_client_info{client=\"127.0.0.1\"");
+	expect("/metrics",r.answer,"rfb_client_sent_bytes_total{client=\"127.0.0.1\"");
+	expect("/metrics",r.answer,"rfb_client_update_latency_seconds_count{client=\"127.0.0.1\"");
+
+	fetch(screen,&r,"/status");
+	expect("/status",r.answer,"Content-Type: application/json");
+	expect("/status",r.answer,"\r\n\r\n{\"width\":64,\"height\":48,");
+	snprintf(line,sizeof(line),"\"capture\":{\"scans\":%d,",SCANS);
+	expect("/status",r.answer,line);
+	expect("/status",r.answer,"\"clients\":[{\"host\":\"127.0.0.1\"");
+	expect("/status",r.answer,"]}\n");
+
+	fetch(screen,&r,"/index.html");
+	expect("/index.html",r.answer,"404");
+
+	rfbCloseClient(cl);
+	rfbClientConnectionGone(cl);
+	free(screen->frameBuffer);
+	rfbScreenCleanup(screen);
+
+	rfbLog("metrics over http: %d errors\n",errors);
+	return errors?1:0;
+}
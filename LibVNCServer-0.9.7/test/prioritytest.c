@@ -0,0 +1,122 @@
+/*
+ * prioritytest: the client being used comes before those which watch.
+ *
+ * One libvncclient client moves the pointer now and then, while OBSERVERS
+ * view-only clients watch the same screen, which changes everywhere all
+ * the time so that encoding keeps the server's workers busy.  The updates
+ * of the interactive client must not wait longer than those of the
+ * observers.
+ */
+
+#include <time.h>
+#include <sys/time.h>
+#include <unistd.h>
+#include <rfb/rfb.h>
+#include <rfb/rfbclient.h>
+
+#ifndef LIBVNCSERVER_HAVE_LIBPTHREAD
+#error This test needs pthread support (the server runs in the background)
+#endif
+
+#define OBSERVERS 8
+
+static const int width=320,height=240,bpp=4;
+static int connected;
+
+static double now(void)
+{
+	struct timeval tv;
+	gettimeofday(&tv,NULL);
+	return tv.tv_sec+tv.tv_usec/1e6;
+}
+
+/* all but the first client only watch */
+static enum rfbNewClientAction newClient(rfbClientPtr cl)
+{
+	if(connected++>0)
+		cl->viewOnly=TRUE;
+	return RFB_CLIENT_ACCEPT;
+}
+
+static rfbClient* newViewer(rfbScreenInfoPtr server)
+{
+	rfbClient* client=rfbGetClient(8,3,bpp);
+
+	client->serverHost=strdup("127.0.0.1");
+	client->serverPort=server->port;
+	client->appData.encodingsString="tight";
+	if(!rfbInitClient(client,NULL,NULL)) {
+		rfbErr("could not connect\n");
+		exit(1);
+	}
+	return client;
+}
+
+int main(int argc,char** argv)
+{
+	rfbScreenInfoPtr server;
+	rfbClient* clients[OBSERVERS+1];
+	char* fb;
+	int i,n,frame=0,failed=0,interactive,viewOnly;
+	double start,t,moved=0;
+
+	server=rfbGetScreen(&argc,argv,width,height,8,3,bpp);
+	server->frameBuffer=malloc(width*height*bpp);
+	memset(server->frameBuffer,0,width*height*bpp);
+	server->cursor=NULL;
+	server->newClientHook=newClient;
+	server->workerThreads=2;
+	rfbInitServer(server);
+	rfbRunEventLoop(server,-1,TRUE);
+
+	for(i=0;i<=OBSERVERS;i++)
+		clients[i]=newViewer(server);
+
+	start=t=now();
+	while(now()-start<4) {
+		if(now()-t>0.02) {
+			for(n=0;n<width*height*bpp;n++)
+				server->frameBuffer[n]=rand();
+			rfbMarkRectAsModified(server,0,0,width,height);
+			frame++;
+			t=now();
+		}
+		if(now()-moved>0.1) {
+			SendPointerEvent(clients[0],frame%width,frame%height,0);
+			moved=now();
+		}
+		for(i=0;i<=OBSERVERS;i++)
+			while(WaitForMessage(clients[i],0)>0)
+				if(!HandleRFBServerMessage(clients[i])) {
+					rfbErr("client %d was disconnected\n",i);
+					return 1;
+				}
+		usleep(1000);
+	}
+
+	interactive=rfbStatGetClassLatency(server,RFB_CLASS_INTERACTIVE);
+	viewOnly=rfbStatGetClassLatency(server,RFB_CLASS_VIEWONLY);
+	if(rfbStatGetClassUpdates(server,RFB_CLASS_INTERACTIVE)==0
+			|| rfbStatGetClassUpdates(server,RFB_CLASS_VIEWONLY)==0) {
+		rfbErr("the latencies were not measured\n");
+		failed++;
+	} else if(interactive>viewOnly) {
+		rfbErr("the interactive client waited longer than the observers\n");
+		failed++;
+	}
+
+	for(i=0;i<=OBSERVERS;i++) {
+		close(clients[i]->sock);
+		rfbClientCleanup(clients[i]);
+	}
+	start=now();
+	while(server->clientHead && now()-start<5)
+		usleep(10000);
+
+	rfbShutdownServer(server,TRUE);
+	fb=server->frameBuffer;
+	rfbScreenCleanup(server);
+	free(fb);
+	rfbLog("priorities: %d failed\n",failed);
+	return failed?1:0;
+}
@@ -0,0 +1,143 @@
+/*
+ * ratelimittest: caps on the updates and bytes sent to a client.
+ *
+ * A libvncclient client, made view-only by the server, gets at most the
+ * screen's view-only update rate while a small part of the screen changes
+ * all the time.  Then it also gets a byte rate of its own, while the
+ * whole screen changes.  Either way it must not get more than its cap,
+ * and the changes in between must be merged into the updates it gets.
+ */
+
+#include <time.h>
+#include <sys/time.h>
+#include <unistd.h>
+#include <rfb/rfb.h>
+#include <rfb/rfbclient.h>
+
+#ifndef LIBVNCSERVER_HAVE_LIBPTHREAD
+#error This test needs pthread support (the server runs in the background)
+#endif
+
+#define FPS 5
+#define RATE 40000
+
+static const int width=64,height=64,bpp=4;
+
+static double now(void)
+{
+	struct timeval tv;
+	gettimeofday(&tv,NULL);
+	return tv.tv_sec+tv.tv_usec/1e6;
+}
+
+static enum rfbNewClientAction newClient(rfbClientPtr cl)
+{
+	cl->viewOnly=TRUE;
+	return RFB_CLIENT_ACCEPT;
+}
+
+/* change the screen every 10 ms for a while, returns how many changes */
+static int run(rfbScreenInfoPtr server,rfbClient* client,rfbBool everywhere,double seconds)
+{
+	double start=now(),t=start;
+	int frame=0;
+
+	while(now()-start<seconds) {
+		if(now()-t>0.01) {
+			if(everywhere) {
+				int n;
+				for(n=0;n<width*height*bpp;n++)
+					server->frameBuffer[n]=rand();
+				rfbMarkRectAsModified(server,0,0,width,height);
+			} else {
+				int x=(frame*8)%width,y=(frame*8/width*8)%height,n;
+				for(n=0;n<8;n++)
+					memset(server->frameBuffer+((y+n)*width+x)*bpp,frame,8*bpp);
+				rfbMarkRectAsModified(server,x,y,x+8,y+8);
+			}
+			frame++;
+			t=now();
+		}
+		if(WaitForMessage(client,10000)>0 && !HandleRFBServerMessage(client)) {
+			rfbErr("client was disconnected\n");
+			exit(1);
+		}
+	}
+	return frame;
+}
+
+int main(int argc,char** argv)
+{
+	rfbScreenInfoPtr server;
+	rfbClient* client;
+	rfbClientPtr cl;
+	char* fb;
+	int frames,failed=0,updates,sent;
+	double start;
+
+	server=rfbGetScreen(&argc,argv,width,height,8,3,bpp);
+	server->frameBuffer=malloc(width*height*bpp);
+	memset(server->frameBuffer,0,width*height*bpp);
+	server->cursor=NULL;
+	server->newClientHook=newClient;
+	server->viewOnlyMaxUpdatesPerSecond=FPS;
+	rfbInitServer(server);
+	rfbRunEventLoop(server,-1,TRUE);
+
+	client=rfbGetClient(8,3,bpp);
+	client->serverHost=strdup("127.0.0.1");
+	client->serverPort=server->port;
+	client->appData.encodingsString="raw";
+	if(!rfbInitClient(client,NULL,NULL)) {
+		rfbErr("could not connect\n");
+		return 1;
+	}
+	cl=server->clientHead;
+
+	/* let the first, full update through */
+	run(server,client,FALSE,0.5);
+	updates=rfbStatGetMessageCountSent(cl,rfbFramebufferUpdate);
+	frames=run(server,client,FALSE,2);
+	updates=rfbStatGetMessageCountSent(cl,rfbFramebufferUpdate)-updates;
+	rfbLog("%d changes, %d updates at most %d per second\n",frames,updates,FPS);
+	if(updates>2*FPS+1) {
+		rfbErr("too many updates\n");
+		failed++;
+	}
+	if(updates<FPS) {
+		rfbErr("too few updates\n");
+		failed++;
+	}
+
+	cl->maxBytesPerSecond=RATE;
+	run(server,client,TRUE,0.5);
+	sent=rfbStatGetSentBytes(cl);
+	frames=run(server,client,TRUE,3);
+	sent=rfbStatGetSentBytes(cl)-sent;
+	rfbLog("%d changes, %d bytes sent at most %d per second\n",frames,sent,RATE);
+	if(sent>3*RATE+width*height*bpp+RATE/4) {
+		rfbErr("too much was sent\n");
+		failed++;
+	}
+	if(sent<RATE) {
+		rfbErr("too little was sent\n");
+		failed++;
+	}
+	if(rfbStatGetFramesSkipped(cl)==0) {
+		rfbErr("no changes were merged\n");
+		failed++;
+	}
+
+	close(client->sock);
+	rfbClientCleanup(client);
+	start=now();
+	while(server->clientHead && now()-start<5)
+		usleep(10000);
+
+	rfbShutdownServer(server,TRUE);
+	fb=server->frameBuffer;
+	rfbScreenCleanup(server);
+	free(fb);
+	rfbLog("rate limits: %d failed\n",failed);
+	return failed?1:0;
+}
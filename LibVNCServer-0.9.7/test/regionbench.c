@@ -0,0 +1,167 @@
+/*
+ * regionbench: time span list regions against banded ones on the damage
+ * a server sees.
+ *
+ * Each frame, damage is merged rectangle by rectangle the way
+ * rfbMarkRectAsModified does it, then for each of a few clients it is
+ * clipped to the requested region, walked rectangle by rectangle, and
+ * taken away again, as rfbSendFramebufferUpdate does.
+ */
+
+#include <time.h>
+#include <sys/time.h>
+#include <rfb/rfb.h>
+#define SRA_LIST_REGIONS
+#include <rfb/rfbregion.h>
+
+static const int width=1280,height=1024;
+
+#define CLIENTS 4
+
+typedef struct {
+	const char* name;
+	sraRegion* (*create)(void);
+	sraRegion* (*createRect)(int x1,int y1,int x2,int y2);
+	sraRegion* (*createRgn)(const sraRegion* src);
+	void (*destroy)(sraRegion* rgn);
+	rfbBool (*and)(sraRegion* dst,const sraRegion* src);
+	void (*or)(sraRegion* dst,const sraRegion* src);
+	rfbBool (*subtract)(sraRegion* dst,const sraRegion* src);
+	sraRectangleIterator* (*getIterator)(sraRegion* s);
+	rfbBool (*iteratorNext)(sraRectangleIterator* i,sraRect* r);
+	void (*releaseIterator)(sraRectangleIterator* i);
+} backend_t;
+
+static backend_t backends[]={
+	{"lists",sraRgnCreate,sraRgnCreateRect,sraRgnCreateRgn,sraRgnDestroy,
+		sraRgnAnd,sraRgnOr,sraRgnSubtract,
+		sraRgnGetIterator,sraRgnIteratorNext,sraRgnReleaseIterator},
+	{"bands",sraBandRgnCreate,sraBandRgnCreateRect,sraBandRgnCreateRgn,sraBandRgnDestroy,
+		sraBandRgnAnd,sraBandRgnOr,sraBandRgnSubtract,
+		sraBandRgnGetIterator,sraBandRgnIteratorNext,sraBandRgnReleaseIterator}
+};
+
+typedef struct { char* name; int (*damage)(int frame,int n,sraRect* r); } pattern_t;
+
+/* a line of text being typed, glyph by glyph */
+static int damageTyping(int frame,int n,sraRect* r)
+{
+	int x=((frame*8+n)%150)*8,y=((frame*8+n)/150%60)*16;
+	if(n>=8)
+		return 0;
+	r->x1=x; r->y1=y; r->x2=x+8; r->y2=y+16;
+	return 1;
+}
+
+/* a window being dragged: its old and new place, and what was under it */
+static int damageWindow(int frame,int n,sraRect* r)
+{
+	int x=(frame*13)%(width-400),y=(frame*7)%(height-300);
+	if(n>=3)
+		return 0;
+	r->x1=x+n*5; r->y1=y+n*3; r->x2=r->x1+400; r->y2=r->y1+300;
+	return 1;
+}
+
+/* a third of all 16x16 tiles change, as with video or a busy web page */
+static int damageTiles(int frame,int n,sraRect* r)
+{
+	int tiles=(width/16)*(height/16),t;
+	if(n>=tiles/3)
+		return 0;
+	t=(n*3+(n*7919+frame*104729)%3)%tiles;
+	r->x1=(t%(width/16))*16; r->y1=(t/(width/16))*16;
+	r->x2=r->x1+16; r->y2=r->y1+16;
+	return 1;
+}
+
+/* every other tile, the worst case for both */
+static int damageCheckerboard(int frame,int n,sraRect* r)
+{
+	int cols=width/32,rows=height/16,x,y;
+	if(n>=cols*rows)
+		return 0;
+	x=n%cols; y=n/cols;
+	r->x1=x*32+(y+frame)%2*16; r->y1=y*16;
+	r->x2=r->x1+16; r->y2=r->y1+16;
+	return 1;
+}
+
+static pattern_t patterns[]={
+	{ "typing", damageTyping },
+	{ "window", damageWindow },
+	{ "tiles", damageTiles },
+	{ "checkerboard", damageCheckerboard },
+	{ NULL, NULL }
+};
+
+static double now(void)
+{
+	struct timeval tv;
+	gettimeofday(&tv,NULL);
+	return tv.tv_sec+tv.tv_usec/1000000.0;
+}
+
+/* returns the seconds taken; rects is set to the rectangles sent */
+static double runBench(backend_t* b,pattern_t* p,int frames,unsigned long* rects)
+{
+	sraRegion* requested[CLIENTS];
+	sraRegion* modified[CLIENTS];
+	sraRegion* damage;
+	sraRect r;
+	double t;
+	int frame,n,c;
+
+	for(c=0;c<CLIENTS;c++) {
+		requested[c]=b->createRect(0,0,width,height);
+		modified[c]=b->create();
+	}
+	*rects=0;
+	t=now();
+	for(frame=0;frame<frames;frame++) {
+		damage=b->create();
+		for(n=0;p->damage(frame,n,&r);n++) {
+			sraRegion* rect=b->createRect(r.x1,r.y1,r.x2,r.y2);
+			b->or(damage,rect);
+			b->destroy(rect);
+		}
+		for(c=0;c<CLIENTS;c++) {
+			sraRegion* update;
+			sraRectangleIterator* i;
+
+			b->or(modified[c],damage);
+			update=b->createRgn(modified[c]);
+			b->and(update,requested[c]);
+			i=b->getIterator(update);
+			while(b->iteratorNext(i,&r))
+				(*rects)++;
+			b->releaseIterator(i);
+			b->subtract(modified[c],update);
+			b->destroy(update);
+		}
+		b->destroy(damage);
+	}
+	t=now()-t;
+	for(c=0;c<CLIENTS;c++) {
+		b->destroy(requested[c]);
+		b->destroy(modified[c]);
+	}
+	return t;
+}
+
+int main(int argc,char** argv)
+{
+	int frames=argc>1?atoi(argv[1]):50;
+	int p;
+
+	for(p=0;patterns[p].name;p++) {
+		unsigned long listRects,bandRects;
+		double list=runBench(&backends[0],&patterns[p],frames,&listRects);
+		double band=runBench(&backends[1],&patterns[p],frames,&bandRects);
+
+		printf("%-12s  lists %8.3f ms/frame %6lu rects   bands %8.3f ms/frame %6lu rects\n",
+				patterns[p].name,list*1000/frames,listRects/frames/CLIENTS,
+				band*1000/frames,bandRects/frames/CLIENTS);
+	}
+	return 0;
+}
@@ -0,0 +1,152 @@
+/*
+ * regiontest: regions built from many small rectangles, by several
+ * threads at once.
+ *
+ * Each thread adds, takes away and clips to random rectangles, the way
+ * damage is merged and sent, and checks the region against a plain
+ * bitmap.  Half of the threads use span lists, the others banded
+ * regions.  Freed spans, span lists and iterators must be taken again
+ * from the free lists, so that hardly any of them need malloc().
+ */
+
+#include <pthread.h>
+#include <rfb/rfb.h>
+#define SRA_LIST_REGIONS
+#include <rfb/rfbregion.h>
+
+#define THREADS 4
+#define ROUNDS 2000
+#define SIZE 64
+
+typedef struct {
+	const char* name;
+	sraRegion* (*create)(void);
+	sraRegion* (*createRect)(int x1,int y1,int x2,int y2);
+	void (*destroy)(sraRegion* rgn);
+	void (*makeEmpty)(sraRegion* rgn);
+	rfbBool (*and)(sraRegion* dst,const sraRegion* src);
+	void (*or)(sraRegion* dst,const sraRegion* src);
+	rfbBool (*subtract)(sraRegion* dst,const sraRegion* src);
+	unsigned long (*countRects)(const sraRegion* rgn);
+	sraRectangleIterator* (*getIterator)(sraRegion* s);
+	rfbBool (*iteratorNext)(sraRectangleIterator* i,sraRect* r);
+	void (*releaseIterator)(sraRectangleIterator* i);
+} backend_t;
+
+static backend_t backends[]={
+	{"span lists",sraRgnCreate,sraRgnCreateRect,sraRgnDestroy,sraRgnMakeEmpty,
+		sraRgnAnd,sraRgnOr,sraRgnSubtract,sraRgnCountRects,
+		sraRgnGetIterator,sraRgnIteratorNext,sraRgnReleaseIterator},
+	{"banded",sraBandRgnCreate,sraBandRgnCreateRect,sraBandRgnDestroy,sraBandRgnMakeEmpty,
+		sraBandRgnAnd,sraBandRgnOr,sraBandRgnSubtract,sraBandRgnCountRects,
+		sraBandRgnGetIterator,sraBandRgnIteratorNext,sraBandRgnReleaseIterator}
+};
+
+static int check(backend_t* b,sraRegion* region,const char* bitmap)
+{
+	char seen[SIZE*SIZE];
+	sraRectangleIterator* i;
+	sraRect rect;
+	unsigned long rects=0;
+	int x,y,ok=1;
+
+	memset(seen,0,sizeof(seen));
+	i=b->getIterator(region);
+	while(b->iteratorNext(i,&rect)) {
+		for(y=rect.y1;y<rect.y2;y++)
+			for(x=rect.x1;x<rect.x2;x++)
+				seen[y*SIZE+x]++;
+		rects++;
+	}
+	b->releaseIterator(i);
+	for(x=0;x<SIZE*SIZE;x++)
+		if(seen[x]!=bitmap[x])
+			ok=0;
+	return ok && rects==b->countRects(region);
+}
+
+static void* run(void* arg)
+{
+	unsigned int seed=(unsigned int)(size_t)arg;
+	backend_t* b=&backends[seed%2];
+	char bitmap[SIZE*SIZE];
+	sraRegion* region=b->create();
+	int n,x,y,errors=0;
+
+	memset(bitmap,0,sizeof(bitmap));
+	for(n=0;n<ROUNDS;n++) {
+		int x1=rand_r(&seed)%SIZE,y1=rand_r(&seed)%SIZE;
+		int x2=x1+1+rand_r(&seed)%8,y2=y1+1+rand_r(&seed)%8;
+		int op=n%10==9?2:n%4==3?1:0;
+		sraRegion* rect;
+
+		if(op==2) {
+			/* clip to a big rectangle */
+			x1/=2; y1/=2;
+			x2=x1+SIZE/2; y2=y1+SIZE/2;
+		}
+		if(x2>SIZE) x2=SIZE;
+		if(y2>SIZE) y2=SIZE;
+		rect=b->createRect(x1,y1,x2,y2);
+		if(op==0)
+			b->or(region,rect);
+		else if(op==1)
+			b->subtract(region,rect);
+		else
+			b->and(region,rect);
+		b->destroy(rect);
+		for(y=0;y<SIZE;y++)
+			for(x=0;x<SIZE;x++)
+				if(x>=x1 && x<x2 && y>=y1 && y<y2) {
+					if(op!=2)
+						bitmap[y*SIZE+x]=(op==0);
+				} else if(op==2)
+					bitmap[y*SIZE+x]=0;
+		if(!check(b,region,bitmap))
+			errors++;
+		if(n%100==99) {
+			b->makeEmpty(region);
+			memset(bitmap,0,sizeof(bitmap));
+		}
+	}
+	b->destroy(region);
+	return (void*)(size_t)errors;
+}
+
+int main(int argc,char** argv)
+{
+	pthread_t threads[THREADS];
+	sraAllocStats stats;
+	void* errors;
+	int i,failed=0;
+
+	for(i=0;i<THREADS;i++)
+		pthread_create(&threads[i],NULL,run,(void*)(size_t)(i+1));
+	for(i=0;i<THREADS;i++) {
+		pthread_join(threads[i],&errors);
+		if(errors) {
+			rfbErr("thread %d (%s): %d regions were wrong\n",
+					i,backends[(i+1)%2].name,(int)(size_t)errors);
+			failed++;
+		}
+	}
+
+	sraGetAllocStats(&stats);
+	rfbLog("%lu allocations, %lu from malloc(), %lu freed, %lu pooled\n",
+			stats.allocs,stats.mallocs,stats.frees,stats.pooled);
+	if(stats.frees!=stats.allocs) {
+		rfbErr("not everything was freed\n");
+		failed++;
+	}
+	if(stats.pooled!=0) {
+		rfbErr("the free lists of finished threads were kept\n");
+		failed++;
+	}
+	if(stats.mallocs*10>stats.allocs) {
+		rfbErr("too few allocations came from the free lists\n");
+		failed++;
+	}
+
+	rfbLog("region allocation: %d failed\n",failed);
+	return failed?1:0;
+}
@@ -0,0 +1,209 @@
+/*
+ * slowclienttest: a client which stops reading must not hold up the others.
+ *
+ * Two clients connect to a server run with rfbProcessEvents(); the screen
+ * changes all the time and both keep asking for updates, but only one of
+ * them reads.  The reader must keep getting data, no call of
+ * rfbProcessEvents() may block, and the other client must be disconnected
+ * once it has not read anything for rfbMaxClientWait ms.  The reader does not
+ * keep up with the changes either, so some of them must be merged into
+ * later updates instead of queueing up.
+ */
+
+#include <time.h>
+#include <errno.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <rfb/rfb.h>
+
+static const int width=800,height=600;
+
+static double now(void)
+{
+	struct timeval tv;
+	gettimeofday(&tv,NULL);
+	return tv.tv_sec+tv.tv_usec/1e6;
+}
+
+static int connectToServer(rfbScreenInfoPtr server,int rcvbuf)
+{
+	struct sockaddr_in addr;
+	int sock=socket(AF_INET,SOCK_STREAM,0);
+
+	if(rcvbuf)
+		setsockopt(sock,SOL_SOCKET,SO_RCVBUF,(char*)&rcvbuf,sizeof(rcvbuf));
+	memset(&addr,0,sizeof(addr));
+	addr.sin_family=AF_INET;
+	addr.sin_port=htons(server->port);
+	addr.sin_addr.s_addr=inet_addr("127.0.0.1");
+	if(connect(sock,(struct sockaddr*)&addr,sizeof(addr))<0) {
+		rfbLogPerror("connect");
+		exit(1);
+	}
+	return sock;
+}
+
+/* read len bytes, running the server meanwhile */
+static void readFully(rfbScreenInfoPtr server,int sock,char* buf,int len)
+{
+	double start=now();
+	int n;
+
+	while(len>0) {
+		rfbProcessEvents(server,1000);
+		n=recv(sock,buf,len,MSG_DONTWAIT);
+		if(n>0) {
+			buf+=n;
+			len-=n;
+		} else if(n==0 || (errno!=EAGAIN && errno!=EWOULDBLOCK) || now()-start>5) {
+			rfbErr("handshake failed\n");
+			exit(1);
+		}
+	}
+}
+
+/* RFB 3.3 handshake without authentication */
+static int newClient(rfbScreenInfoPtr server,int rcvbuf)
+{
+	int sock=connectToServer(server,rcvbuf);
+	char buf[sz_rfbServerInitMsg];
+	rfbServerInitMsg si;
+	uint32_t nameLength;
+
+	readFully(server,sock,buf,sz_rfbProtocolVersionMsg);
+	write(sock,"RFB 003.003\n",sz_rfbProtocolVersionMsg);
+	readFully(server,sock,buf,4);
+	write(sock,"\1",1);
+	readFully(server,sock,(char*)&si,sz_rfbServerInitMsg);
+	nameLength=Swap32IfLE(si.nameLength);
+	while(nameLength>0) {
+		int n=nameLength>sizeof(buf)?sizeof(buf):nameLength;
+		readFully(server,sock,buf,n);
+		nameLength-=n;
+	}
+	return sock;
+}
+
+static void requestUpdate(int sock,int incremental)
+{
+	rfbFramebufferUpdateRequestMsg fur;
+
+	fur.type=rfbFramebufferUpdateRequest;
+	fur.incremental=incremental;
+	fur.x=fur.y=0;
+	fur.w=Swap16IfLE(width);
+	fur.h=Swap16IfLE(height);
+	send(sock,(char*)&fur,sz_rfbFramebufferUpdateRequestMsg,MSG_DONTWAIT);
+}
+
+static rfbClientPtr connectedClient(rfbScreenInfoPtr server)
+{
+	rfbClientIteratorPtr i=rfbGetClientIterator(server);
+	rfbClientPtr cl,result=NULL;
+
+	while((cl=rfbClientIteratorNext(i)))
+		if(cl->sock>=0)
+			result=cl;
+	rfbReleaseClientIterator(i);
+	return result;
+}
+
+static int countClients(rfbScreenInfoPtr server)
+{
+	rfbClientIteratorPtr i=rfbGetClientIterator(server);
+	rfbClientPtr cl;
+	int count=0;
+
+	while((cl=rfbClientIteratorNext(i)))
+		if(cl->sock>=0)
+			count++;
+	rfbReleaseClientIterator(i);
+	return count;
+}
+
+int main(int argc,char** argv)
+{
+	rfbScreenInfoPtr server;
+	rfbClientPtr cl;
+	int fast,slow,n,frame=0,failed=0,slowGone=0;
+	double start,t,longest=0,gone=0;
+	long received=0;
+	char buf[65536],*fb;
+
+	rfbMaxClientWait=2000;
+
+	server=rfbGetScreen(&argc,argv,width,height,8,3,4);
+	server->frameBuffer=malloc(width*height*4);
+	server->cursor=NULL;
+	rfbInitServer(server);
+
+	fast=newClient(server,0);
+	slow=newClient(server,4096);
+	requestUpdate(fast,0);
+	requestUpdate(slow,0);
+
+	start=now();
+	while((t=now())-start<6) {
+		/* new pixels everywhere, raw encoding makes them expensive */
+		memset(server->frameBuffer,frame++,width*height*4);
+		rfbMarkRectAsModified(server,0,0,width,height);
+
+		rfbProcessEvents(server,1000);
+		if(now()-t>longest)
+			longest=now()-t;
+
+		/* a bit at a time, so that it falls behind */
+		if((n=recv(fast,buf,sizeof(buf),MSG_DONTWAIT))>0)
+			received+=n;
+		requestUpdate(fast,1);
+		requestUpdate(slow,1);
+
+		if(!slowGone && countClients(server)<2) {
+			slowGone=1;
+			gone=now()-start;
+		}
+	}
+
+	rfbLog("longest rfbProcessEvents() call: %.3f s\n",longest);
+	rfbLog("reading client received %ld bytes (%.1f frames)\n",
+			received,received/(width*height*4.0));
+	if(longest>1) {
+		rfbErr("rfbProcessEvents() blocked\n");
+		failed++;
+	}
+	if(received<10*width*height*4) {
+		rfbErr("reading client got too little data\n");
+		failed++;
+	}
+	if(!slowGone) {
+		rfbErr("client which does not read was not disconnected\n");
+		failed++;
+	} else {
+		rfbLog("client which does not read was disconnected after %.1f s\n",gone);
+		if(countClients(server)!=1) {
+			rfbErr("reading client was disconnected too\n");
+			failed++;
+		}
+	}
+
+	cl=connectedClient(server);
+	if(cl) {
+		rfbLog("reading client: %d of %d changes skipped, queue depth at most %d bytes\n",
+				rfbStatGetFramesSkipped(cl),frame,rfbStatGetMaxQueueDepth(cl));
+		if(rfbStatGetFramesSkipped(cl)==0) {
+			rfbErr("no changes were merged for the reading client\n");
+			failed++;
+		}
+	}
+
+	close(fast);
+	close(slow);
+	fb=server->frameBuffer;
+	rfbScreenCleanup(server);
+	free(fb);
+	rfbLog("slow client: %d failed\n",failed);
+	return failed?1:0;
+}
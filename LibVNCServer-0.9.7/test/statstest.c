@@ -0,0 +1,250 @@
+/*
+ * statstest: the statistics of a client can be read while it is being
+ * served, and add up.
+ *
+ * Updates are sent to a client over loopback, the client's end drained by
+ * a thread, while another thread takes snapshots.  The counters and the
+ * histograms in the last snapshot must agree with each other and with
+ * what was sent.  Then several threads count messages for one client at
+ * once, and none of them may be lost.
+ */
+
+#ifdef __STRICT_ANSI__
+#define _BSD_SOURCE
+#endif
+#include <time.h>
+#include <sys/time.h>
+#include <rfb/rfb.h>
+#include <rfb/rfbregion.h>
+
+#ifndef LIBVNCSERVER_HAVE_LIBPTHREAD
+#error This test needs pthread support
+#endif
+
+#define WIDTH 320
+#define HEIGHT 240
+#define UPDATES 200
+#define THREADS 4
+#define RECORDS 200000
+
+static int errors=0;
+static volatile int sending=1;
+
+static void* drainLoop(void* data)
+{
+	int sock=*(int*)data;
+	char buf[65536];
+	while(read(sock,buf,sizeof(buf))>0);
+	return NULL;
+}
+
+/* Connect a client over loopback; what is sent to it is drained by a
+ * thread. */
+static rfbClientPtr newTestClient(rfbScreenInfoPtr screen,int* peer)
+{
+	struct sockaddr_in addr;
+	socklen_t len=sizeof(addr);
+	int listenSock,sock;
+	pthread_t drainThread;
+	rfbClientPtr cl;
+
+	memset(&addr,0,sizeof(addr));
+	addr.sin_family=AF_INET;
+	addr.sin_addr.s_addr=htonl(INADDR_LOOPBACK);
+	listenSock=socket(AF_INET,SOCK_STREAM,0);
+	if(listenSock<0 || bind(listenSock,(struct sockaddr*)&addr,sizeof(addr))<0
+			|| listen(listenSock,1)<0
+			|| getsockname(listenSock,(struct sockaddr*)&addr,&len)<0)
+		return NULL;
+	*peer=socket(AF_INET,SOCK_STREAM,0);
+	if(connect(*peer,(struct sockaddr*)&addr,sizeof(addr))<0)
+		return NULL;
+	sock=accept(listenSock,NULL,NULL);
+	close(listenSock);
+	if(sock<0)
+		return NULL;
+
+	pthread_create(&drainThread,NULL,drainLoop,(void*)peer);
+	pthread_detach(drainThread);
+
+	cl=rfbNewClient(screen,sock);
+	if(!cl)
+		return NULL;
+	cl->state=RFB_NORMAL;
+	return cl;
+}
+
+static uint32_t bucketTotal(const rfbStatHistogram* h)
+{
+	uint32_t total=0;
+	int i;
+	for(i=0;i<RFB_STAT_BUCKETS;i++)
+		total+=h->buckets[i];
+	return total;
+}
+
+static void checkHistogram(const char* name,const rfbStatHistogram* h,uint32_t count)
+{
+	if(h->count!=count || bucketTotal(h)!=count) {
+		rfbErr("%s: %u values, %u in buckets, expected %u\n",
+				name,h->count,bucketTotal(h),count);
+		errors++;
+	}
+	if(count>0 && (rfbStatHistogramPercentile(h,50)>rfbStatHistogramPercentile(h,90)
+			|| (uint32_t)rfbStatHistogramPercentile(h,100)>h->max)) {
+		rfbErr("%s: percentiles out of order\n",name);
+		errors++;
+	}
+}
+
+/* takes snapshots as fast as it can while the updates are sent */
+static void* snapshotLoop(void* data)
+{
+	rfbClientPtr cl=(rfbClientPtr)data;
+	rfbStatSnapshot s;
+	uint32_t last=0;
+	int n=0;
+
+	while(sending) {
+		rfbStatGetSnapshot(cl,&s);
+		if(s.updatesSent<last) {
+			rfbErr("snapshot: updates went from %u down to %u\n",last,s.updatesSent);
+			errors++;
+		}
+		last=s.updatesSent;
+		n++;
+	}
+	rfbLog("%d snapshots taken while sending\n",n);
+	return NULL;
+}
+
+typedef struct { rfbClientPtr cl; double ns; } recorder_t;
+
+static void* recordLoop(void* data)
+{
+	recorder_t* r=(recorder_t*)data;
+	struct timeval start,end;
+	int i;
+
+	gettimeofday(&start,NULL);
+	for(i=0;i<RECORDS;i++) {
+		rfbStatRecordMessageRcvd(r->cl,rfbKeyEvent,sz_rfbKeyEventMsg,sz_rfbKeyEventMsg);
+		rfbStatRecordEncodingSent(r->cl,rfbEncodingHextile,100,400);
+	}
+	gettimeofday(&end,NULL);
+	r->ns=((end.tv_sec-start.tv_sec)*1e9+(end.tv_usec-start.tv_usec)*1e3)/RECORDS/2;
+	return NULL;
+}
+
+int main(int argc,char** argv)
+{
+	rfbScreenInfoPtr screen;
+	rfbClientPtr cl;
+	rfbStatSnapshot s;
+	pthread_t snapshotThread,threads[THREADS];
+	recorder_t recorders[THREADS];
+	int peer,n,bytes,rects,keys,hextileBytes;
+	double ns=0;
+
+	screen=rfbGetScreen(&argc,argv,WIDTH,HEIGHT,8,3,4);
+	screen->frameBuffer=(char*)calloc(WIDTH*4,HEIGHT);
+	screen->autoPort=FALSE;
+	screen->port=0;
+	screen->httpPort=0;
+	rfbInitServer(screen);
+
+	cl=newTestClient(screen,&peer);
+	if(!cl) {
+		rfbErr("could not connect a client\n");
+		return 1;
+	}
+	cl->preferredEncoding=rfbEncodingHextile;
+	bytes=rfbStatGetSentBytes(cl);
+
+	pthread_create(&snapshotThread,NULL,snapshotLoop,cl);
+	for(n=0;n<UPDATES;n++) {
+		sraRegionPtr damage;
+		int x=(n*37)%(WIDTH-32),y=(n*23)%(HEIGHT-32);
+
+		memset(screen->frameBuffer+(y*WIDTH+x)*4,n,32*4);
+		while(rfbStatGetQueueDepth(cl)>0)
+			rfbProcessEvents(screen,1000);
+		damage=sraRgnCreateRect(x,y,x+32,y+32);
+		sraRgnOr(cl->modifiedRegion,damage);
+		sraRgnDestroy(cl->requestedRegion);
+		cl->requestedRegion=sraRgnCreateRect(0,0,WIDTH,HEIGHT);
+		rfbSendFramebufferUpdate(cl,damage);
+		sraRgnDestroy(damage);
+	}
+	sending=0;
+	pthread_join(snapshotThread,NULL);
+
+	rfbStatGetSnapshot(cl,&s);
+	rects=rfbStatGetEncodingCountSent(cl,rfbEncodingHextile);
+	if(s.updatesSent!=(uint32_t)rfbStatGetMessageCountSent(cl,rfbFramebufferUpdate)
+			|| s.updatesSent<UPDATES) {
+		rfbErr("%u updates in the snapshot, %d counted, %d sent\n",s.updatesSent,
+				rfbStatGetMessageCountSent(cl,rfbFramebufferUpdate),UPDATES);
+		errors++;
+	}
+	if(s.bytesSent!=(uint32_t)rfbStatGetSentBytes(cl)) {
+		rfbErr("%u bytes in the snapshot, %d counted\n",s.bytesSent,rfbStatGetSentBytes(cl));
+		errors++;
+	}
+	/* every update was sent by rfbSendFramebufferUpdate(), and so is in
+	   the bytes per update */
+	if(s.updateBytes.sum!=s.bytesSent-(uint32_t)bytes) {
+		rfbErr("%u bytes in updates, %u sent\n",s.updateBytes.sum,s.bytesSent-bytes);
+		errors++;
+	}
+	checkHistogram("bytes per update",&s.updateBytes,s.updatesSent);
+	/* the first update is of damage put straight into modifiedRegion,
+	   with no time to it */
+	checkHistogram("update latency",&s.updateLatency,s.updatesSent-1);
+	checkHistogram("encode time",&s.encodeTime,rects);
+	if(s.fps.count>0 && s.fps.sum>s.updatesSent) {
+		rfbErr("%u updates in the seconds counted, %u sent\n",s.fps.sum,s.updatesSent);
+		errors++;
+	}
+
+	/* types far apart have counters of their own */
+	rfbStatRecordEncodingRcvd(cl,rfbEncodingFence,0,0);
+	rfbStatRecordEncodingRcvd(cl,rfbEncodingQualityLevel5,0,0);
+	rfbStatRecordEncodingRcvd(cl,0x12345678,0,0);
+	if(rfbStatGetEncodingCountRcvd(cl,rfbEncodingFence)!=1
+			|| rfbStatGetEncodingCountRcvd(cl,rfbEncodingQualityLevel5)!=1
+			|| rfbStatGetEncodingCountRcvd(cl,rfbEncodingQualityLevel6)!=0
+			|| rfbStatGetEncodingCountRcvd(cl,0x12345679)!=0) {
+		rfbErr("encoding counters mixed up\n");
+		errors++;
+	}
+
+	/* counting from several threads at once */
+	keys=rfbStatGetMessageCountRcvd(cl,rfbKeyEvent);
+	rects=rfbStatGetEncodingCountSent(cl,rfbEncodingHextile);
+	hextileBytes=rfbStatLookupEncoding(cl,rfbEncodingHextile)->bytesSent;
+	for(n=0;n<THREADS;n++) {
+		recorders[n].cl=cl;
+		pthread_create(&threads[n],NULL,recordLoop,&recorders[n]);
+	}
+	for(n=0;n<THREADS;n++) {
+		pthread_join(threads[n],NULL);
+		ns+=recorders[n].ns/THREADS;
+	}
+	if(rfbStatGetMessageCountRcvd(cl,rfbKeyEvent)-keys!=THREADS*RECORDS
+			|| rfbStatGetEncodingCountSent(cl,rfbEncodingHextile)-rects!=THREADS*RECORDS
+			|| (int)rfbStatLookupEncoding(cl,rfbEncodingHextile)->bytesSent-hextileBytes
+				!=THREADS*RECORDS*100) {
+		rfbErr("counts lost between threads\n");
+		errors++;
+	}
+	rfbLog("%.0f ns to count a message or rectangle, %d threads at once\n",ns,THREADS);
+
+	rfbCloseClient(cl);
+	rfbClientConnectionGone(cl);
+	free(screen->frameBuffer);
+	rfbScreenCleanup(screen);
+
+	rfbLog("statistics: %d errors\n",errors);
+	return errors?1:0;
+}
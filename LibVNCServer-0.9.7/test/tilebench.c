@@ -0,0 +1,217 @@
+/*
+ * tilebench: time the pixel analysis of the Hextile and Tight encoders
+ * (solid tile, two colour and small palette detection) on synthetic
+ * screen contents, at 16 and 32 bits per pixel.
+ *
+ * The encoded data is written to a loopback connection which is drained
+ * by a separate thread, so the numbers include the encoders' own
+ * buffering but not the network.
+ */
+
+#ifdef __STRICT_ANSI__
+#define _BSD_SOURCE
+#endif
+#include <time.h>
+#include <sys/time.h>
+#include <rfb/rfb.h>
+
+#ifndef LIBVNCSERVER_HAVE_LIBPTHREAD
+#error This benchmark needs pthread support (to drain the client socket)
+#endif
+
+static const int width=640,height=480;
+
+typedef struct { char* name; void (*fill)(rfbScreenInfoPtr s); } content_t;
+
+static void putPixel(rfbScreenInfoPtr s,int x,int y,int r,int g,int b)
+{
+	rfbPixelFormat* f=&s->serverFormat;
+	uint32_t pix=((r*f->redMax/255)<<f->redShift)
+		|((g*f->greenMax/255)<<f->greenShift)
+		|((b*f->blueMax/255)<<f->blueShift);
+	char* p=s->frameBuffer+y*s->paddedWidthInBytes+x*(f->bitsPerPixel/8);
+
+	if(f->bitsPerPixel==16)
+		*(uint16_t*)p=(uint16_t)pix;
+	else
+		*(uint32_t*)p=pix;
+}
+
+static void fillSolid(rfbScreenInfoPtr s)
+{
+	int x,y;
+	for(y=0;y<height;y++)
+		for(x=0;x<width;x++)
+			putPixel(s,x,y,0xe0,0xe0,0xe0);
+}
+
+/* black glyph-like strokes on white */
+static void fillText(rfbScreenInfoPtr s)
+{
+	int x,y;
+	for(y=0;y<height;y++)
+		for(x=0;x<width;x++) {
+			int ink=(y%14)<10 && (x%7)<5 && ((x*31+y*17+(x/7)*(y/14))%5)<2;
+			putPixel(s,x,y,ink?0:255,ink?0:255,ink?0:255);
+		}
+}
+
+/* flat widgets with borders: a handful of colours per tile */
+static void fillWidgets(rfbScreenInfoPtr s)
+{
+	static const int colours[6][3]={
+		{240,240,240},{200,200,200},{60,90,160},{255,255,255},{30,30,30},{220,120,40}
+	};
+	int x,y;
+	for(y=0;y<height;y++)
+		for(x=0;x<width;x++) {
+			int c=((x/40)+(y/24))%4;
+			if(x%40==0 || y%24==0)
+				c=4;
+			else if((x%40)>8 && (x%40)<12 && (y%24)>8 && (y%24)<14)
+				c=5;
+			putPixel(s,x,y,colours[c][0],colours[c][1],colours[c][2]);
+		}
+}
+
+/* smooth gradient with a little noise, like a photo */
+static void fillPhoto(rfbScreenInfoPtr s)
+{
+	int x,y;
+	srand(1);
+	for(y=0;y<height;y++)
+		for(x=0;x<width;x++)
+			putPixel(s,x,y,(x*255/width+rand()%8)&0xff,
+					(y*255/height+rand()%8)&0xff,((x+y)/5)&0xff);
+}
+
+static content_t contents[]={
+	{ "solid", fillSolid },
+	{ "text", fillText },
+	{ "widgets", fillWidgets },
+	{ "photo", fillPhoto },
+	{ NULL, NULL }
+};
+
+static void* drainLoop(void* data)
+{
+	int sock=*(int*)data;
+	char buf[65536];
+	while(read(sock,buf,sizeof(buf))>0);
+	return NULL;
+}
+
+/* Connect a client to the screen over loopback; the other end of the
+ * connection is drained by a thread. */
+static rfbClientPtr newBenchClient(rfbScreenInfoPtr screen,int* peer)
+{
+	struct sockaddr_in addr;
+	socklen_t len=sizeof(addr);
+	int listenSock,sock;
+	pthread_t drainThread;
+	rfbClientPtr cl;
+
+	memset(&addr,0,sizeof(addr));
+	addr.sin_family=AF_INET;
+	addr.sin_addr.s_addr=htonl(INADDR_LOOPBACK);
+	listenSock=socket(AF_INET,SOCK_STREAM,0);
+	if(listenSock<0 || bind(listenSock,(struct sockaddr*)&addr,sizeof(addr))<0
+			|| listen(listenSock,1)<0
+			|| getsockname(listenSock,(struct sockaddr*)&addr,&len)<0)
+		return NULL;
+	*peer=socket(AF_INET,SOCK_STREAM,0);
+	if(connect(*peer,(struct sockaddr*)&addr,sizeof(addr))<0)
+		return NULL;
+	sock=accept(listenSock,NULL,NULL);
+	close(listenSock);
+	if(sock<0)
+		return NULL;
+
+	pthread_create(&drainThread,NULL,drainLoop,(void*)peer);
+	pthread_detach(drainThread);
+
+	cl=rfbNewClient(screen,sock);
+	if(!cl)
+		return NULL;
+	cl->state=RFB_NORMAL;
+	cl->enableLastRectEncoding=TRUE;
+	return cl;
+}
+
+static double now(void)
+{
+	struct timeval tv;
+	gettimeofday(&tv,NULL);
+	return tv.tv_sec+tv.tv_usec/1000000.0;
+}
+
+static void runBench(int bpp,int loops)
+{
+	rfbScreenInfoPtr screen;
+	rfbClientPtr cl;
+	int argc=1,peer,i,c;
+	char* argv[]={"tilebench",NULL};
+
+	if(bpp==16)
+		screen=rfbGetScreen(&argc,argv,width,height,5,3,2);
+	else
+		screen=rfbGetScreen(&argc,argv,width,height,8,3,4);
+	screen->frameBuffer=(char*)malloc(screen->paddedWidthInBytes*height);
+	screen->autoPort=FALSE;
+	screen->port=0;
+	screen->httpPort=0;
+	rfbInitServer(screen);
+
+	cl=newBenchClient(screen,&peer);
+	if(!cl) {
+		rfbErr("could not connect a client\n");
+		exit(1);
+	}
+
+	for(c=0;contents[c].name;c++) {
+		double t,hextile,tight;
+
+		contents[c].fill(screen);
+
+		cl->ublen=0;
+		t=now();
+		for(i=0;i<loops;i++) {
+			rfbSendRectEncodingHextile(cl,0,0,width,height);
+			rfbSendUpdateBuf(cl);
+		}
+		hextile=now()-t;
+
+#ifdef LIBVNCSERVER_HAVE_LIBJPEG
+		cl->tightCompressLevel=1;
+		cl->tightQualityLevel=-1;
+		t=now();
+		for(i=0;i<loops;i++) {
+			rfbSendRectEncodingTight(cl,0,0,width,height);
+			rfbSendUpdateBuf(cl);
+		}
+		tight=now()-t;
+#else
+		tight=0;
+#endif
+
+		printf("%2d bpp %-8s  hextile %8.1f Mpixel/s   tight %8.1f Mpixel/s\n",
+				bpp,contents[c].name,
+				hextile>0?(double)width*height*loops/hextile/1e6:0,
+				tight>0?(double)width*height*loops/tight/1e6:0);
+	}
+
+	rfbCloseClient(cl);
+	rfbClientConnectionGone(cl);
+	free(screen->frameBuffer);
+	rfbScreenCleanup(screen);
+}
+
+int main(int argc,char** argv)
+{
+	int loops=argc>1?atoi(argv[1]):50;
+
+	rfbLogEnable(0);
+	runBench(16,loops);
+	runBench(32,loops);
+	return 0;
+}
@@ -0,0 +1,166 @@
+/*
+ * tracetest: the trace can be dumped while it is being recorded.
+ *
+ * Several threads record nested trace points as fast as they can while
+ * the main thread dumps the trace again and again.  Every dump must be a
+ * complete Chrome trace: in the events of each thread, the time never
+ * goes back, and no more ends are found than begins.  Then SIGUSR2 must
+ * make rfbProcessEvents() write the trace to the screen's traceFile.
+ *
+ * Built without LIBVNCSERVER_WITH_TRACE, only the empty trace is checked.
+ */
+
+#include <signal.h>
+#include <rfb/rfb.h>
+
+#ifndef LIBVNCSERVER_HAVE_LIBPTHREAD
+#error This test needs pthread support
+#endif
+
+#define THREADS 4
+#define DUMPS 20
+#define MAX_TID 256
+
+static int errors=0;
+static volatile int recording=1;
+
+typedef struct {
+	char* text;
+	size_t len, size;
+} trace_t;
+
+static void appendTrace(void* data,const char* text,size_t len)
+{
+	trace_t* t=(trace_t*)data;
+	if(t->len+len+1>t->size) {
+		t->size=(t->len+len+1)*2;
+		t->text=(char*)realloc(t->text,t->size);
+	}
+	memcpy(t->text+t->len,text,len);
+	t->len+=len;
+	t->text[t->len]='\0';
+}
+
+static void* recordLoop(void* data)
+{
+	int n=0;
+	while(recording) {
+		RFB_TRACE_BEGIN("outer",n);
+		RFB_TRACE_BEGIN("inner",n);
+		RFB_TRACE_INSTANT("tick",n);
+		RFB_TRACE_END();
+		RFB_TRACE_END();
+		n++;
+	}
+	return NULL;
+}
+
+/* returns how many events there are in a dump, or -1 if it is broken */
+static int checkTrace(const char* text)
+{
+	double last[MAX_TID];
+	int depth[MAX_TID],events=0,tid,i;
+	const char* p;
+
+	if(strncmp(text,"{\"traceEvents\":[",16)!=0 || !strstr(text,"]"))
+		return -1;
+	for(i=0;i<MAX_TID;i++) {
+		last[i]=-1;
+		depth[i]=0;
+	}
+	for(p=strchr(text,'\n');p;p=strchr(p+1,'\n')) {
+		const char *ph=strstr(p,"\"ph\":\""),*ts=strstr(p,"\"ts\":"),*t=strstr(p,"\"tid\":");
+		double time;
+		if(p[1]!='{')
+			continue;
+		if(!ph || !ts || !t)
+			return -1;
+		time=atof(ts+5);
+		tid=atoi(t+6);
+		if(tid<0 || tid>=MAX_TID || time<last[tid])
+			return -1;
+		last[tid]=time;
+		/* the oldest events of a ring may have been overwritten, so a
+		   thread may start inside a BEGIN; it may not end more than that */
+		if(ph[6]=='B')
+			depth[tid]++;
+		else if(ph[6]=='E' && --depth[tid]<-2)
+			return -1;
+		events++;
+	}
+	return events;
+}
+
+int main(int argc,char** argv)
+{
+	rfbScreenInfoPtr screen;
+	pthread_t threads[THREADS];
+	trace_t t={NULL,0,0};
+	char file[64];
+	FILE* f;
+	int n,events=0;
+
+#ifndef LIBVNCSERVER_WITH_TRACE
+	rfbTraceWrite(appendTrace,&t);
+	if(checkTrace(t.text)!=0) {
+		rfbErr("not the empty trace:\n%s\n",t.text);
+		errors++;
+	}
+	free(t.text);
+	rfbLog("trace (not built in): %d errors\n",errors);
+	return errors?1:0;
+#endif
+
+	for(n=0;n<THREADS;n++)
+		pthread_create(&threads[n],NULL,recordLoop,NULL);
+	for(n=0;n<DUMPS;n++) {
+		t.len=0;
+		rfbTraceWrite(appendTrace,&t);
+		if((events=checkTrace(t.text))<0) {
+			rfbErr("dump %d is broken\n",n);
+			errors++;
+		}
+	}
+	recording=0;
+	for(n=0;n<THREADS;n++)
+		pthread_join(threads[n],NULL);
+	rfbLog("%d events in the last dump\n",events);
+	if(events<THREADS*5) {
+		rfbErr("too few events\n");
+		errors++;
+	}
+
+	/* the dump on a signal */
+	snprintf(file,sizeof(file),"/tmp/tracetest-%d.json",(int)getpid());
+	screen=rfbGetScreen(&argc,argv,64,48,8,3,4);
+	screen->frameBuffer=(char*)calloc(64*4,48);
+	screen->autoPort=FALSE;
+	screen->port=0;
+	screen->httpPort=0;
+	screen->traceFile=file;
+	rfbInitServer(screen);
+	raise(SIGUSR2);
+	rfbProcessEvents(screen,1000);
+	if((f=fopen(file,"r"))==NULL) {
+		rfbErr("SIGUSR2 did not write %s\n",file);
+		errors++;
+	} else {
+		char buf[4096];
+		size_t got;
+		t.len=0;
+		while((got=fread(buf,1,sizeof(buf),f))>0)
+			appendTrace(&t,buf,got);
+		fclose(f);
+		unlink(file);
+		if(checkTrace(t.text)<THREADS*5) {
+			rfbErr("the trace written on SIGUSR2 is broken\n");
+			errors++;
+		}
+	}
+	free(t.text);
+	free(screen->frameBuffer);
+	rfbScreenCleanup(screen);
+
+	rfbLog("trace: %d errors\n",errors);
+	return errors?1:0;
+}
@@ -0,0 +1,201 @@
+/*
+ * zywrletest: check the ZYWRLE wavelet code.
+ *
+ * The encoder and decoder are built here a second time from
+ * zywrletemplate.c, under other names, so that they can be run both with
+ * and without the SSE2/NEON code; the two must give exactly the same
+ * coefficients and pixels. The coefficients are also compared with
+ * libvncserver's encoder, decoded with libvncclient's decoder, and the
+ * result compared with the original pixels.
+ */
+
+#include <rfb/rfb.h>
+
+/* the copies in libvncserver and libvncclient */
+extern uint16_t* zywrleAnalyze16LE(uint16_t* dst, uint16_t* src, int w, int h, int scanline, int level, int* pBuf);
+extern uint32_t* zywrleAnalyze32LE(uint32_t* dst, uint32_t* src, int w, int h, int scanline, int level, int* pBuf);
+extern uint16_t* zywrleSynthesize16LE(uint16_t* dst, uint16_t* src, int w, int h, int scanline, int level, int* pBuf);
+extern uint32_t* zywrleSynthesize32LE(uint32_t* dst, uint32_t* src, int w, int h, int scanline, int level, int* pBuf);
+
+#define zywrleAnalyze16LE testAnalyze16
+#define zywrleAnalyze32LE testAnalyze32
+#define zywrleSynthesize16LE testSynthesize16
+#define zywrleSynthesize32LE testSynthesize32
+
+#define __RFB_CONCAT2(a,b) a##b
+#define __RFB_CONCAT2E(a,b) __RFB_CONCAT2(a,b)
+#define __RFB_CONCAT3(a,b,c) a##b##c
+#define __RFB_CONCAT3E(a,b,c) __RFB_CONCAT3(a,b,c)
+#define ENDIAN_LITTLE 0
+#define ENDIAN_BIG 1
+#define ZYWRLE_ENDIAN ENDIAN_LITTLE
+#define END_FIX LE
+#define ZYWRLE_ENCODE 1
+#define ZYWRLE_DECODE 1
+#define BPP 16
+#define PIXEL_T uint16_t
+#include "../libvncserver/zywrletemplate.c"
+#undef BPP
+#undef PIXEL_T
+#define BPP 32
+#define PIXEL_T uint32_t
+#include "../libvncserver/zywrletemplate.c"
+#undef BPP
+#undef PIXEL_T
+
+#define MAX_SIZE 64
+#define SCANLINE (MAX_SIZE+3)
+
+typedef struct { char* name; int smooth; } content_t;
+static content_t contents[]={
+	{ "gradient", 1 },
+	{ "noise", 0 },
+	{ "text", 0 },
+	{ NULL, 0 }
+};
+
+static int failed,count;
+
+static void setSimd(int on)
+{
+#ifdef ZYWRLE_SIMD
+	zywrleUseSimd=on;
+#endif
+}
+
+static void fill(uint32_t* src,int content,int bpp)
+{
+	int x,y,r,g,b;
+
+	for(y=0;y<MAX_SIZE;y++)
+		for(x=0;x<SCANLINE;x++) {
+			switch(content) {
+			case 0:
+				r=x*4; g=y*4; b=(x+y)*2;
+				break;
+			case 1:
+				r=rand()&0xff; g=rand()&0xff; b=rand()&0xff;
+				break;
+			default:
+				r=g=b=((y%12)<9 && (x%6)<4 && ((x*7+y*3)%5)<2)?0:255;
+				break;
+			}
+			if(bpp==16)
+				((uint16_t*)src)[y*SCANLINE+x]=((r>>3)<<11)|((g>>2)<<5)|(b>>3);
+			else
+				src[y*SCANLINE+x]=(r<<16)|(g<<8)|b;
+		}
+}
+
+/* average difference per colour channel, scaled to 8 bits */
+static double difference(uint32_t* a,uint32_t* b,int w,int h,int bpp)
+{
+	int x,y,i;
+	double diff=0;
+
+	for(y=0;y<h;y++)
+		for(x=0;x<w;x++) {
+			uint32_t p=bpp==16?((uint16_t*)a)[y*SCANLINE+x]:a[y*SCANLINE+x];
+			uint32_t q=bpp==16?((uint16_t*)b)[y*SCANLINE+x]:b[y*SCANLINE+x];
+			if(bpp==16) {
+				diff+=abs((int)((p>>11)&0x1f)-(int)((q>>11)&0x1f))*8;
+				diff+=abs((int)((p>>5)&0x3f)-(int)((q>>5)&0x3f))*4;
+				diff+=abs((int)(p&0x1f)-(int)(q&0x1f))*8;
+			} else
+				for(i=0;i<24;i+=8)
+					diff+=abs((int)((p>>i)&0xff)-(int)((q>>i)&0xff));
+		}
+	return diff/(w*h*3);
+}
+
+/* copy a w x h tile between a SCANLINE wide frame and a packed buffer */
+static void copyTile(void* dst,int dstScan,void* src,int srcScan,int w,int h,int bpp)
+{
+	int y,bytes=bpp/8;
+
+	for(y=0;y<h;y++)
+		memcpy((char*)dst+y*dstScan*bytes,(char*)src+y*srcScan*bytes,w*bytes);
+}
+
+/*
+ * The encoder works in place on a packed tile, which is sent as is; the
+ * decoder works in place on the tile in the client's frame buffer.
+ */
+static void check(int bpp,int content,int w,int h,int level)
+{
+	static uint32_t src[SCANLINE*MAX_SIZE],frame[SCANLINE*MAX_SIZE],ref[SCANLINE*MAX_SIZE];
+	static uint32_t coeff[MAX_SIZE*MAX_SIZE],plain[MAX_SIZE*MAX_SIZE],lib[MAX_SIZE*MAX_SIZE];
+	static int buf[MAX_SIZE*MAX_SIZE];
+	int ok=1;
+
+	fill(src,content,bpp);
+
+	/* encode: vector code, plain code and libvncserver */
+	copyTile(coeff,w,src,SCANLINE,w,h,bpp);
+	copyTile(plain,w,src,SCANLINE,w,h,bpp);
+	copyTile(lib,w,src,SCANLINE,w,h,bpp);
+	setSimd(1);
+	if(bpp==16) {
+		testAnalyze16((uint16_t*)coeff,(uint16_t*)coeff,w,h,w,level,buf);
+		setSimd(0);
+		testAnalyze16((uint16_t*)plain,(uint16_t*)plain,w,h,w,level,buf);
+		zywrleAnalyze16LE((uint16_t*)lib,(uint16_t*)lib,w,h,w,level,buf);
+	} else {
+		testAnalyze32(coeff,coeff,w,h,w,level,buf);
+		setSimd(0);
+		testAnalyze32(plain,plain,w,h,w,level,buf);
+		zywrleAnalyze32LE(lib,lib,w,h,w,level,buf);
+	}
+	if(memcmp(coeff,plain,w*h*bpp/8) || memcmp(coeff,lib,w*h*bpp/8)) {
+		rfbErr("%d bpp %s %dx%d level %d: coefficients differ\n",
+				bpp,contents[content].name,w,h,level);
+		ok=0;
+	}
+
+	/* decode: libvncclient and plain code */
+	memset(frame,0,sizeof(frame));
+	copyTile(frame,SCANLINE,coeff,w,w,h,bpp);
+	memcpy(ref,frame,sizeof(frame));
+	if(bpp==16) {
+		zywrleSynthesize16LE((uint16_t*)frame,(uint16_t*)frame,w,h,SCANLINE,level,buf);
+		testSynthesize16((uint16_t*)ref,(uint16_t*)ref,w,h,SCANLINE,level,buf);
+	} else {
+		zywrleSynthesize32LE(frame,frame,w,h,SCANLINE,level,buf);
+		testSynthesize32(ref,ref,w,h,SCANLINE,level,buf);
+	}
+	if(memcmp(frame,ref,sizeof(frame))) {
+		rfbErr("%d bpp %s %dx%d level %d: decoded pixels differ\n",
+				bpp,contents[content].name,w,h,level);
+		ok=0;
+	}
+
+	/* the filter is lossy, more so at higher levels, but smooth content
+	 * must survive it */
+	if(contents[content].smooth && difference(src,frame,w,h,bpp)>=(4<<level)) {
+		rfbErr("%d bpp %s %dx%d level %d: average difference %.1f\n",
+				bpp,contents[content].name,w,h,level,difference(src,frame,w,h,bpp));
+		ok=0;
+	}
+
+	count++;
+	if(!ok)
+		failed++;
+}
+
+int main(int argc,char** argv)
+{
+	static const int sizes[][2]={
+		{ 64, 64 }, { 16, 16 }, { 63, 17 }, { 8, 64 }, { 5, 3 }, { 1, 1 }, { 36, 52 }
+	};
+	int bpp,content,size,level;
+
+	srand(1);
+	for(bpp=16;bpp<=32;bpp+=16)
+		for(content=0;contents[content].name;content++)
+			for(size=0;size<sizeof(sizes)/sizeof(sizes[0]);size++)
+				for(level=1;level<=3;level++)
+					check(bpp,content,sizes[size][0],sizes[size][1],level);
+
+	rfbLog("zywrle: %d failed, %d tested\n",failed,count);
+	return failed?1:0;
+}
@@ -130,9 +130,10 @@ static struct varblock_t {
 static void keyevent(rfbBool down, rfbKeySym key, rfbClientPtr cl);
 static void ptrevent(int buttonMask, int x, int y, rfbClientPtr cl);
 
+/* through the library's log, which a thread writes out, see main() */
 #ifdef DEBUG
 # define pr_debug(fmt, ...) \
-	 fprintf(stderr, fmt, ## __VA_ARGS__)
+	 rfbLog(fmt, ## __VA_ARGS__)
 #else
 # define pr_debug(fmt, ...) do { } while(0)
 #endif
@@ -145,10 +146,10 @@ static void ptrevent(int buttonMask, int x, int y, rfbClientPtr cl);
 #endif
 
 #define pr_info(fmt, ...) \
-	fprintf(stdout, fmt, ## __VA_ARGS__)
+	rfbLog(fmt, ## __VA_ARGS__)
 
 #define pr_err(fmt, ...) \
-	fprintf(stderr, fmt, ## __VA_ARGS__)
+	rfbErr(fmt, ## __VA_ARGS__)
 
 static void init_fb(void)
 {
@@ -300,6 +301,7 @@ static void init_fb_server(int argc, char **argv)
 void injectKeyEvent(uint16_t code, uint16_t value)
 {
     struct input_event ev;
+    RFB_TRACE_BEGIN("inject key", code);
     memset(&ev, 0, sizeof(ev));
     gettimeofday(&ev.time,0);
     ev.type = EV_KEY;
@@ -309,6 +311,7 @@ void injectKeyEvent(uint16_t code, uint16_t value)
     {
         pr_err("write event failed, %s\n", strerror(errno));
     }
+    RFB_TRACE_END();
 
     pr_vdebug("injectKey (%d, %d)\n", code , value);
 }
@@ -391,6 +394,8 @@ void injectTouchEvent(int down, int x, int y)
 {
     struct input_event ev;
 
+    RFB_TRACE_BEGIN("inject touch", down);
+
     // Re-calculate the final x and y if xmax/ymax are specified
     if (xmax) x = xmin + (x * (xmax - xmin)) / (scrinfo.xres);
     if (ymax) y = ymin + (y * (ymax - ymin)) / (scrinfo.yres);
@@ -437,6 +442,7 @@ void injectTouchEvent(int down, int x, int y)
         pr_err("write event failed, %s\n", strerror(errno));
     }
 
+    RFB_TRACE_END();
     pr_vdebug("injectTouchEvent (x=%d, y=%d, down=%d)\n", x , y, down);
 }
 
@@ -478,6 +484,10 @@ static void update_screen(void)
 {
 	unsigned int *f, *c, *r;
 	int x, y, y_virtual;
+	struct timeval start, end;
+
+	gettimeofday(&start, NULL);
+	RFB_TRACE_BEGIN("scan", 0);
 
 	/* get virtual screen info */
 	y_virtual = get_framebuffer_yoffset();
@@ -532,6 +542,12 @@ static void update_screen(void)
 		}
 	}
 
+	/* for the statistics */
+	RFB_TRACE_END();
+	gettimeofday(&end, NULL);
+	rfbStatRecordCapture(vncscr, (end.tv_sec - start.tv_sec) * 1000000
+			+ (end.tv_usec - start.tv_usec), varblock.min_x < INT_MAX);
+
 	if (varblock.min_x < INT_MAX) {
 		if (varblock.max_x < 0)
 			varblock.max_x = varblock.min_x;
@@ -564,7 +580,7 @@ void blank_framebuffer()
 
 void print_usage(char **argv)
 {
-	pr_info("%s [-k device] [-t device] [-h]\n"
+	printf("%s [-k device] [-t device] [-h]\n"
 		"-k device: keyboard device node, default is %s\n"
 		"-t device: touch device node, default is %s\n"
 		"-h : print this help\n",
@@ -656,6 +672,9 @@ void sigint_handler(int arg)
 
 int main(int argc, char **argv)
 {
+	/* a slow console must not hold up the updates */
+	rfbLogStartAsync();
+
 	/* attempts to auto-determine input devices first */
 	input_search();
 
@@ -669,6 +688,9 @@ int main(int argc, char **argv)
 				switch(*(argv[i] + 1))
 				{
 				case 'h':
+					/* not -httpport and the like, for libvncserver */
+					if (argv[i][2])
+						break;
 					print_usage(argv);
 					exit(0);
 					break;